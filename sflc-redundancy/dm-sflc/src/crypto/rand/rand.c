@@ -27,6 +27,9 @@
 
 #include <crypto/rng.h>
 #include <linux/random.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/string.h>
 
 #include "rand.h"
 #include "log/log.h"
@@ -37,19 +40,52 @@
 
 #define SFLC_RAND_RNG_NAME "drbg_nopr_sha256"
 
+/* Size of the per-CPU buffer of random bytes: the IVs of a whole slice */
+#define SFLC_RAND_PCPU_BUF_SIZE 4096
+/* Reseed a per-CPU RNG from the global one after it produced this many bytes */
+#define SFLC_RAND_PCPU_RESEED_INTERVAL (16 * 1024 * 1024)
+/* Largest seed fed to a per-CPU RNG (it's drawn on the stack, on the write path) */
+#define SFLC_RAND_PCPU_SEED_SIZE 64
+
+/*****************************************************
+ *                       TYPES                       *
+ *****************************************************/
+
+/* A per-CPU RNG, with a pre-filled buffer of random bytes */
+struct sflc_rand_pcpu_s
+{
+	/* Might sleep in the RNG, so we can't rely on disabling preemption */
+	struct mutex		lock;
+	struct crypto_rng     * tfm;
+
+	/* Buffer and how many bytes are still unused (at its end) */
+	u8		      * buf;
+	unsigned		avail;
+
+	/* Bytes produced since the last reseed */
+	unsigned long		produced;
+};
+
 /*****************************************************
  *                 PRIVATE VARIABLES                 *
  *****************************************************/
 
+/* The global RNG only seeds the per-CPU ones */
 static struct mutex sflc_rand_tfm_lock;
 static struct crypto_rng * sflc_rand_tfm = NULL;
 
+static struct sflc_rand_pcpu_s __percpu * sflc_rand_pcpu = NULL;
+
 /*****************************************************
  *           PRIVATE FUNCTIONS PROTOTYPES            *
  *****************************************************/
 
 /* Flexible to accommodate for both required and non-required reseeding */
 static int sflc_rand_reseed(void);
+/* Reseed a per-CPU RNG with bytes from the global one */
+static int sflc_rand_reseedPcpu(struct sflc_rand_pcpu_s * pcpu);
+/* Get bytes straight from a per-CPU RNG, reseeding it if due */
+static int sflc_rand_pcpuGenerate(struct sflc_rand_pcpu_s * pcpu, u8 * buf, unsigned count);
 
 /*****************************************************
  *           PUBLIC FUNCTIONS DEFINITIONS            *
@@ -59,6 +95,7 @@ static int sflc_rand_reseed(void);
 int sflc_rand_init(void)
 {
 	int err;
+	int cpu;
 
 	/* Init the lock governing the SFLC RNG */
 	mutex_init(&sflc_rand_tfm_lock);
@@ -80,28 +117,90 @@ int sflc_rand_init(void)
 		return err;
 	}
 
+	/* Allocate the per-CPU RNGs */
+	sflc_rand_pcpu = alloc_percpu(struct sflc_rand_pcpu_s);
+	if (!sflc_rand_pcpu) {
+		pr_err("Could not allocate per-CPU RNGs\n");
+		sflc_rand_exit();
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu) {
+		struct sflc_rand_pcpu_s * pcpu = per_cpu_ptr(sflc_rand_pcpu, cpu);
+
+		mutex_init(&pcpu->lock);
+		pcpu->avail = 0;
+		pcpu->produced = 0;
+
+		pcpu->buf = kmalloc(SFLC_RAND_PCPU_BUF_SIZE, GFP_KERNEL);
+		if (!pcpu->buf) {
+			pr_err("Could not allocate buffer of per-CPU RNG\n");
+			sflc_rand_exit();
+			return -ENOMEM;
+		}
+
+		pcpu->tfm = crypto_alloc_rng(SFLC_RAND_RNG_NAME, CRYPTO_ALG_TYPE_RNG, 0);
+		if (IS_ERR(pcpu->tfm)) {
+			err = PTR_ERR(pcpu->tfm);
+			pcpu->tfm = NULL;
+			pr_err("Could not allocate per-CPU RNG %s; error %d\n", SFLC_RAND_RNG_NAME, err);
+			sflc_rand_exit();
+			return err;
+		}
+
+		err = sflc_rand_reseedPcpu(pcpu);
+		if (err) {
+			pr_err("Could not seed per-CPU RNG; error %d\n", err);
+			sflc_rand_exit();
+			return err;
+		}
+	}
+
 	return 0;
 }
 
-/* Get random bytes. Might sleep for re-seeding (not implemented yet), or for contention (mutex). */
+/* Get random bytes. Might sleep for re-seeding, or for contention (mutex) if we got preempted
+   and another thread is using the same CPU's RNG. */
 int sflc_rand_getBytes(u8 * buf, unsigned count)
 {
-	int ret;
+	struct sflc_rand_pcpu_s * pcpu;
+	int err = 0;
+
+	/* Use the current CPU's RNG (no big deal if we migrate afterwards) */
+	pcpu = raw_cpu_ptr(sflc_rand_pcpu);
 
 	/* Acquire lock */
-	if (mutex_lock_interruptible(&sflc_rand_tfm_lock)) {
+	if (mutex_lock_interruptible(&pcpu->lock)) {
 		pr_err("Got error while waiting for SFLC RNG\n");
 		return -EINTR;
 	}
 
-	ret = crypto_rng_get_bytes(sflc_rand_tfm, buf, count);
+	/* Big requests bypass the buffer */
+	if (count > SFLC_RAND_PCPU_BUF_SIZE) {
+		err = sflc_rand_pcpuGenerate(pcpu, buf, count);
+		goto out;
+	}
 
+	/* Refill the buffer if needed */
+	if (count > pcpu->avail) {
+		err = sflc_rand_pcpuGenerate(pcpu, pcpu->buf, SFLC_RAND_PCPU_BUF_SIZE);
+		if (err) {
+			pcpu->avail = 0;
+			goto out;
+		}
+		pcpu->avail = SFLC_RAND_PCPU_BUF_SIZE;
+	}
+
+	/* Hand out bytes from the end of the buffer, and wipe them */
+	pcpu->avail -= count;
+	memcpy(buf, pcpu->buf + pcpu->avail, count);
+	memzero_explicit(pcpu->buf + pcpu->avail, count);
+
+out:
 	/* End of critical region */
-	mutex_unlock(&sflc_rand_tfm_lock);
+	mutex_unlock(&pcpu->lock);
 
-	return ret;
+	return err;
 }
-
 /* Get a random s32 from 0 (inclusive) to max (exclusive). Returns < 0 if error. */
 s32 sflc_rand_uniform(s32 max)
 {
@@ -131,6 +230,21 @@ s32 sflc_rand_uniform(s32 max)
 /* Tear down the submodule */
 void sflc_rand_exit(void)
 {
+	int cpu;
+
+	if (sflc_rand_pcpu) {
+		for_each_possible_cpu(cpu) {
+			struct sflc_rand_pcpu_s * pcpu = per_cpu_ptr(sflc_rand_pcpu, cpu);
+
+			if (pcpu->tfm) {
+				crypto_free_rng(pcpu->tfm);
+			}
+			kfree_sensitive(pcpu->buf);
+		}
+		free_percpu(sflc_rand_pcpu);
+		sflc_rand_pcpu = NULL;
+	}
+
 	if (sflc_rand_tfm) {
 		crypto_free_rng(sflc_rand_tfm);
 		sflc_rand_tfm = NULL;
@@ -157,3 +271,68 @@ static int sflc_rand_reseed(void)
 
 	return 0;
 }
+
+/* Reseed a per-CPU RNG with bytes from the global one */
+static int sflc_rand_reseedPcpu(struct sflc_rand_pcpu_s * pcpu)
+{
+	unsigned seedsize = crypto_rng_seedsize(pcpu->tfm);
+	u8 seed[SFLC_RAND_PCPU_SEED_SIZE];
+	int err;
+
+	/* The drbg has no fixed seed size (it draws kernel entropy on its own, and
+	   mixes ours in as personalisation string): give it a full-strength seed */
+	if (seedsize == 0) {
+		seedsize = SFLC_RAND_PCPU_SEED_SIZE;
+	}
+	if (seedsize > SFLC_RAND_PCPU_SEED_SIZE) {
+		pr_err("Seed size %u of the per-CPU RNG too large\n", seedsize);
+		return -EINVAL;
+	}
+
+	/* Draw the seed from the global RNG */
+	if (mutex_lock_interruptible(&sflc_rand_tfm_lock)) {
+		pr_err("Got error while waiting for SFLC RNG\n");
+		err = -EINTR;
+		goto out;
+	}
+	err = crypto_rng_get_bytes(sflc_rand_tfm, seed, seedsize);
+	mutex_unlock(&sflc_rand_tfm_lock);
+	if (err) {
+		pr_err("Could not draw seed from the global RNG; error %d\n", err);
+		goto out;
+	}
+
+	/* Feed it to the per-CPU RNG */
+	err = crypto_rng_reset(pcpu->tfm, seed, seedsize);
+	if (err) {
+		pr_err("Could not feed seed to the per-CPU RNG; error %d\n", err);
+		goto out;
+	}
+	pcpu->produced = 0;
+
+out:
+	memzero_explicit(seed, sizeof(seed));
+	return err;
+}
+
+/* Get bytes straight from a per-CPU RNG, reseeding it if due. Caller holds the per-CPU lock. */
+static int sflc_rand_pcpuGenerate(struct sflc_rand_pcpu_s * pcpu, u8 * buf, unsigned count)
+{
+	int err;
+
+	if (pcpu->produced >= SFLC_RAND_PCPU_RESEED_INTERVAL) {
+		err = sflc_rand_reseedPcpu(pcpu);
+		if (err) {
+			/* Not fatal: the drbg is still good for a long while */
+			pr_warn("Could not reseed per-CPU RNG; error %d\n", err);
+		}
+	}
+
+	err = crypto_rng_get_bytes(pcpu->tfm, buf, count);
+	if (err) {
+		return err;
+	}
+	pcpu->produced += count;
+
+	return 0;
+}
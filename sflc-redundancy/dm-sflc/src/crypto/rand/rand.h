@@ -23,8 +23,9 @@
  
 /*
  * A module-wide source of randomness.
- * Private to Shufflecake (no randomness sharing via /dev/urandom), but
- * no need to make it more fine grained.
+ * Private to Shufflecake (no randomness sharing via /dev/urandom).
+ * Bytes are handed out by per-CPU RNGs, periodically reseeded from a
+ * global one, so that concurrent writers don't contend on a single lock.
  */
 
 #ifndef _SFLC_CRYPTO_RAND_RAND_H_
@@ -46,7 +47,7 @@ int sflc_rand_selftest(void);
 /* Init the submodule */
 int sflc_rand_init(void);
 
-/* Get random bytes. Might sleep for re-seeding (not implemented yet), or for contention (mutex). */
+/* Get random bytes from the current CPU's RNG. Might sleep for re-seeding, or for contention (mutex). */
 int sflc_rand_getBytes(u8 * buf, unsigned count);
 
 /* Get a random s32 from 0 (inclusive) to max (exclusive). Returns < 0 if error. */
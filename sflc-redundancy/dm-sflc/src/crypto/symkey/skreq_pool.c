@@ -36,11 +36,17 @@
  *           PRIVATE FUNCTIONS PROTOTYPES            *
  *****************************************************/
 
-/* A mempool_alloc_t using skcipher_request_alloc as backend */
+/* A mempool_alloc_t, allocating like skcipher_request_alloc (plus the room for the async stuff) */
 static void * sflc_sk_allocRequest(gfp_t gfp_mask, void * pool_data);
 /* A mempool_free_t using skcipher_request_free as backend */
 static void sflc_sk_freeRequest(void * element, void * pool_data);
 
+/* Where the async stuff starts, after the request and the tfm's context */
+static inline size_t sflc_sk_asyncOffset(sflc_sk_Context * ctx)
+{
+	return ALIGN(sizeof(struct skcipher_request) + crypto_skcipher_reqsize(ctx->tfm), __alignof__(sflc_sk_Async));
+}
+
 /*****************************************************
  *           PUBLIC FUNCTIONS DEFINITIONS            *
  *****************************************************/
@@ -50,21 +56,28 @@ mempool_t * sflc_sk_createReqPool(int min_nr, sflc_sk_Context * ctx)
 	return mempool_create(min_nr, sflc_sk_allocRequest, sflc_sk_freeRequest, (void *) ctx);
 }
 
+/* The room for the asynchronous stuff, after the request */
+sflc_sk_Async * sflc_sk_reqAsync(sflc_sk_Context * ctx, struct skcipher_request * skreq)
+{
+	return (sflc_sk_Async *) ((u8 *) skreq + sflc_sk_asyncOffset(ctx));
+}
+
 /*****************************************************
  *           PRIVATE FUNCTIONS DEFINITIONS           *
  *****************************************************/
 
-/* A mempool_alloc_t using skcipher_request_alloc as backend */
+/* A mempool_alloc_t, allocating like skcipher_request_alloc (plus the room for the async stuff) */
 static void * sflc_sk_allocRequest(gfp_t gfp_mask, void * pool_data)
 {
 	sflc_sk_Context * ctx = pool_data;
 	struct skcipher_request * skreq;
 
-	skreq = skcipher_request_alloc(ctx->tfm, gfp_mask);
+	skreq = kmalloc(sflc_sk_asyncOffset(ctx) + sizeof(sflc_sk_Async), gfp_mask);
 	if (!skreq) {
 		pr_err("Could not allocate skcipher_request");
 		return NULL;
 	}
+	skcipher_request_set_tfm(skreq, ctx->tfm);
 
 	return (void *) skreq;
 }
@@ -23,7 +23,8 @@
 
 /*
  * Adapter of the scipher_request_alloc and skcipher_request_free
- * functions to the mempool interface.
+ * functions to the mempool interface. Every request has room after it
+ * for what an asynchronous request carries along.
  */
 
 #ifndef _SFLC_CRYPTO_SYMKEY_SKREQ_POOL_H_
@@ -34,6 +35,7 @@
  *****************************************************/
 
 #include <linux/mempool.h>
+#include <linux/scatterlist.h>
 
 #include "symkey.h"
 
@@ -45,11 +47,25 @@
  *                       TYPES                       *
  *****************************************************/
 
+/* What an asynchronous request carries along: it outlives the submitter's stack */
+typedef struct sflc_sk_async_s
+{
+	struct skcipher_request	      * skreq;
+	sflc_sk_Context		      * ctx;
+	sflc_sk_Batch		      * batch;
+	struct scatterlist		src;
+	struct scatterlist		dst;
+	/* The cipher updates it in place */
+	u8				iv[SFLC_SK_IV_LEN];
+} sflc_sk_Async;
+
 /*****************************************************
  *            PUBLIC FUNCTIONS PROTOTYPES            *
  *****************************************************/
 
 mempool_t * sflc_sk_createReqPool(int min_nr, sflc_sk_Context * ctx);
+/* The room for the asynchronous stuff, after the request */
+sflc_sk_Async * sflc_sk_reqAsync(sflc_sk_Context * ctx, struct skcipher_request * skreq);
 
 
 #endif /* _SFLC_CRYPTO_SYMKEY_SKREQ_POOL_H_ */
@@ -45,6 +45,10 @@
  *****************************************************/
 
 static int sflc_sk_encdec(sflc_sk_Context * ctx, u8 * src, u8 * dst, unsigned int len, u8 * iv, int op);
+static int sflc_sk_queueEncdec(sflc_sk_Context * ctx, sflc_sk_Batch * batch, struct page * src, unsigned int src_off,
+		struct page * dst, unsigned int dst_off, unsigned int len, const u8 * iv, int op);
+static void sflc_sk_asyncDone(struct crypto_async_request * areq, int err);
+static void sflc_sk_finishAsync(sflc_sk_Async * async, int err);
 
 /*****************************************************
  *           PUBLIC FUNCTIONS DEFINITIONS            *
@@ -63,8 +67,8 @@ sflc_sk_Context * sflc_sk_createContext(u8 * key)
 		return ERR_PTR(-ENOMEM);
 	}
 
-	/* Allocate crypto transform */
-	ctx->tfm = crypto_alloc_skcipher(SFLC_SK_CIPHER_NAME, CRYPTO_ALG_ASYNC, 0);
+	/* Allocate crypto transform (asynchronous implementations welcome) */
+	ctx->tfm = crypto_alloc_skcipher(SFLC_SK_CIPHER_NAME, 0, 0);
 	if (IS_ERR(ctx->tfm)) {
 		err = PTR_ERR(ctx->tfm);
 		ctx->tfm = NULL;
@@ -126,6 +130,42 @@ int sflc_sk_decrypt(sflc_sk_Context * ctx, u8 * src, u8 * dst, unsigned int len,
 	return sflc_sk_encdec(ctx, src, dst, len, iv, SFLC_SK_DECRYPT);
 }
 
+/* Start a batch (holding the submitter's reference) */
+void sflc_sk_initBatch(sflc_sk_Batch * batch, sflc_sk_BatchDoneFn done, void * private)
+{
+	atomic_set(&batch->pending, 1);
+	batch->err = 0;
+	batch->done = done;
+	batch->private = private;
+}
+
+/* Queue an asynchronous encryption to the batch. Returns < 0 if error. */
+int sflc_sk_queueEncrypt(sflc_sk_Context * ctx, sflc_sk_Batch * batch, struct page * src, unsigned int src_off,
+		struct page * dst, unsigned int dst_off, unsigned int len, const u8 * iv)
+{
+	return sflc_sk_queueEncdec(ctx, batch, src, src_off, dst, dst_off, len, iv, SFLC_SK_ENCRYPT);
+}
+
+int sflc_sk_queueDecrypt(sflc_sk_Context * ctx, sflc_sk_Batch * batch, struct page * src, unsigned int src_off,
+		struct page * dst, unsigned int dst_off, unsigned int len, const u8 * iv)
+{
+	return sflc_sk_queueEncdec(ctx, batch, src, src_off, dst, dst_off, len, iv, SFLC_SK_DECRYPT);
+}
+
+/* Record an error of the submitter's own in the batch (the first one sticks) */
+void sflc_sk_failBatch(sflc_sk_Batch * batch, int err)
+{
+	cmpxchg(&batch->err, 0, err);
+}
+
+/* Drop a reference to the batch: the last one runs the callback */
+void sflc_sk_closeBatch(sflc_sk_Batch * batch)
+{
+	if (atomic_dec_and_test(&batch->pending)) {
+		batch->done(batch, READ_ONCE(batch->err));
+	}
+}
+
 /*****************************************************
  *           PRIVATE FUNCTIONS DEFINITIONS           *
  *****************************************************/
@@ -176,3 +216,81 @@ static int sflc_sk_encdec(sflc_sk_Context * ctx, u8 * src, u8 * dst, unsigned in
 
 	return ret;
 }
+
+static int sflc_sk_queueEncdec(sflc_sk_Context * ctx, sflc_sk_Batch * batch, struct page * src, unsigned int src_off,
+		struct page * dst, unsigned int dst_off, unsigned int len, const u8 * iv, int op)
+{
+	struct skcipher_request * skreq;
+	sflc_sk_Async * async;
+	bool in_place = (dst == src && dst_off == src_off);
+	int ret;
+
+	/* Allocate request (will already have the ctx's tfm into it) */
+	skreq = mempool_alloc(ctx->sk_req_pool, GFP_NOIO);
+	if (!skreq) {
+		pr_err("Could not allocate skcipher_request\n");
+		sflc_sk_failBatch(batch, -ENOMEM);
+		return -ENOMEM;
+	}
+	async = sflc_sk_reqAsync(ctx, skreq);
+	async->skreq = skreq;
+	async->ctx = ctx;
+	async->batch = batch;
+	memcpy(async->iv, iv, SFLC_SK_IV_LEN);
+
+	/* Set src and dst scatterlist (just one if in place) */
+	sg_init_table(&async->src, 1);
+	sg_set_page(&async->src, src, len, src_off);
+	if (!in_place) {
+		sg_init_table(&async->dst, 1);
+		sg_set_page(&async->dst, dst, len, dst_off);
+	}
+
+	/* Chuck all into the skreq, with the callback */
+	skcipher_request_set_crypt(skreq, &async->src, in_place ? &async->src : &async->dst, len, async->iv);
+	skcipher_request_set_callback(skreq, CRYPTO_TFM_REQ_MAY_SLEEP | CRYPTO_TFM_REQ_MAY_BACKLOG,
+					sflc_sk_asyncDone, async);
+
+	/* One more in flight */
+	atomic_inc(&batch->pending);
+
+	/* Do it */
+	if (op == SFLC_SK_ENCRYPT) {
+		ret = crypto_skcipher_encrypt(skreq);
+	} else {
+		ret = crypto_skcipher_decrypt(skreq);
+	}
+
+	/* Queued (or backlogged): the callback will finish it */
+	if (ret == -EINPROGRESS || ret == -EBUSY) {
+		return 0;
+	}
+	/* Done already (synchronous implementation, or error) */
+	sflc_sk_finishAsync(async, ret);
+
+	return ret;
+}
+
+/* Completion callback of the asynchronous requests */
+static void sflc_sk_asyncDone(struct crypto_async_request * areq, int err)
+{
+	/* A backlogged request just got going */
+	if (err == -EINPROGRESS) {
+		return;
+	}
+
+	sflc_sk_finishAsync(areq->data, err);
+}
+
+/* Frees the request, and drops its reference to the batch */
+static void sflc_sk_finishAsync(sflc_sk_Async * async, int err)
+{
+	sflc_sk_Batch * batch = async->batch;
+
+	mempool_free(async->skreq, async->ctx->sk_req_pool);
+
+	if (err) {
+		sflc_sk_failBatch(batch, err);
+	}
+	sflc_sk_closeBatch(batch);
+}
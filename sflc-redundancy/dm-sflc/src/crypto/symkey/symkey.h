@@ -22,7 +22,8 @@
  */
  
 /*
- * A thin wrapper around the kernel's synchronous block cipher API.
+ * A thin wrapper around the kernel's block cipher API: synchronous calls,
+ * and batches of asynchronous requests completing through a callback.
  */
 
 #ifndef _SFLC_CRYPTO_SYMKEY_SYMKEY_H_
@@ -47,6 +48,28 @@
  *                       TYPES                       *
  *****************************************************/
 
+typedef struct sflc_sk_batch_s sflc_sk_Batch;
+
+/* Called once all the requests of a batch have completed, with the first error (if any).
+   Might run in softirq context, or in the submitter's own context. */
+typedef void (*sflc_sk_BatchDoneFn)(sflc_sk_Batch * batch, int err);
+
+/**
+ * A set of asynchronous requests, completed as a whole.
+ * The submitter holds a reference until it closes the batch, so the
+ * callback can't run before all the requests are submitted.
+ */
+struct sflc_sk_batch_s
+{
+	/* Requests in flight, plus the submitter's reference */
+	atomic_t			pending;
+	/* First error */
+	int				err;
+
+	sflc_sk_BatchDoneFn		done;
+	void			      * private;
+};
+
 /**
  * There is one of these Context's for each volume.
  * No need for locking, methods can be called in parallel.
@@ -80,5 +103,18 @@ void sflc_sk_destroyContext(sflc_sk_Context * ctx);
 int sflc_sk_encrypt(sflc_sk_Context * ctx, u8 * src, u8 * dst, unsigned int len, u8 * iv);
 int sflc_sk_decrypt(sflc_sk_Context * ctx, u8 * src, u8 * dst, unsigned int len, u8 * iv);
 
+/* Start a batch (holding the submitter's reference) */
+void sflc_sk_initBatch(sflc_sk_Batch * batch, sflc_sk_BatchDoneFn done, void * private);
+/* Queue an asynchronous encryption/decryption to the batch (the IV is copied, the pages must
+   stay around until the batch completes). Returns < 0 if error, which the batch records too. */
+int sflc_sk_queueEncrypt(sflc_sk_Context * ctx, sflc_sk_Batch * batch, struct page * src, unsigned int src_off,
+		struct page * dst, unsigned int dst_off, unsigned int len, const u8 * iv);
+int sflc_sk_queueDecrypt(sflc_sk_Context * ctx, sflc_sk_Batch * batch, struct page * src, unsigned int src_off,
+		struct page * dst, unsigned int dst_off, unsigned int len, const u8 * iv);
+/* Record an error of the submitter's own in the batch */
+void sflc_sk_failBatch(sflc_sk_Batch * batch, int err);
+/* Drop the submitter's reference: the callback runs once the requests in flight are done */
+void sflc_sk_closeBatch(sflc_sk_Batch * batch);
+
 
 #endif /* _SFLC_CRYPTO_SYMKEY_SYMKEY_H_ */
@@ -0,0 +1,166 @@
+/*
+ *  Copyright The Shufflecake Project Authors (2022)
+ *  Copyright The Shufflecake Project Contributors (2022)
+ *  Copyright Contributors to the The Shufflecake Project.
+ *
+ *  See the AUTHORS file at the top-level directory of this distribution and at
+ *  <https://www.shufflecake.net/permalinks/shufflecake-userland/AUTHORS>
+ *
+ *  This file is part of the program dm-sflc, which is part of the Shufflecake
+ *  Project. Shufflecake is a plausible deniability (hidden storage) layer for
+ *  Linux. See <https://www.shufflecake.net>.
+ *
+ *  This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version. This program is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ *  Public License for more details. You should have received a copy of the
+ *  GNU General Public License along with this program.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file only implements the decryption queues.
+ * A read is decrypted on the CPU it was submitted from, where its pages are
+ * likely still cache-hot: its completion goes in a per-CPU list, and a
+ * per-CPU work item drains the list in one go, so that a burst of
+ * completions costs one wakeup. The work items run on a per-device
+ * workqueue, bound to the CPUs by default; its flags can be changed through
+ * sysfs (an unbound queue runs them on the NUMA node of the CPU instead).
+ */
+
+/*****************************************************
+ *                  INCLUDE SECTION                  *
+ *****************************************************/
+
+#include <linux/cpumask.h>
+#include <linux/llist.h>
+#include <linux/rcupdate.h>
+
+#include "device.h"
+#include "log/log.h"
+
+/*****************************************************
+ *           PRIVATE FUNCTIONS PROTOTYPES            *
+ *****************************************************/
+
+static void sflc_dev_readDoneWorkFn(struct work_struct * work);
+
+/*****************************************************
+ *           PUBLIC FUNCTIONS DEFINITIONS            *
+ *****************************************************/
+
+/* Sets up the per-CPU lists and the workqueue. Returns < 0 if error. */
+int sflc_dev_startDecryptQueues(sflc_Device * dev)
+{
+	int cpu;
+	int err;
+
+	dev->read_done = alloc_percpu(sflc_dev_ReadDone);
+	if (!dev->read_done) {
+		pr_err("Could not allocate per-CPU read completions\n");
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu) {
+		sflc_dev_ReadDone * done = per_cpu_ptr(dev->read_done, cpu);
+
+		init_llist_head(&done->list);
+		INIT_WORK(&done->work, sflc_dev_readDoneWorkFn);
+	}
+
+	mutex_init(&dev->decrypt_queue_lock);
+	RCU_INIT_POINTER(dev->decrypt_queue, NULL);
+	err = sflc_dev_setDecryptQueueFlags(dev, 0);
+	if (err) {
+		pr_err("Could not create decrypt workqueue; error %d\n", err);
+		free_percpu(dev->read_done);
+		return err;
+	}
+
+	return 0;
+}
+
+/* Tears them down (no read can be in flight by then) */
+void sflc_dev_stopDecryptQueues(sflc_Device * dev)
+{
+	destroy_workqueue(rcu_dereference_protected(dev->decrypt_queue, true));
+	free_percpu(dev->read_done);
+
+	return;
+}
+
+/* Replaces the workqueue with one with the given flags (among SFLC_DEV_DECRYPT_QUEUE_FLAGS).
+   The old one is destroyed once the completions queued to it are drained. Returns < 0 if error. */
+int sflc_dev_setDecryptQueueFlags(sflc_Device * dev, unsigned int flags)
+{
+	struct workqueue_struct * queue;
+	struct workqueue_struct * old_queue;
+
+	if (flags & ~SFLC_DEV_DECRYPT_QUEUE_FLAGS) {
+		return -EINVAL;
+	}
+
+	/* It serves the I/O path */
+	queue = alloc_workqueue("sflc_decrypt/%s", flags | WQ_MEM_RECLAIM, 0, dev->real_dev->name);
+	if (!queue) {
+		return -ENOMEM;
+	}
+
+	mutex_lock(&dev->decrypt_queue_lock);
+	old_queue = rcu_replace_pointer(dev->decrypt_queue, queue, lockdep_is_held(&dev->decrypt_queue_lock));
+	dev->decrypt_queue_flags = flags;
+	mutex_unlock(&dev->decrypt_queue_lock);
+
+	/* Nobody is about to queue to the old one anymore: drain it */
+	if (old_queue) {
+		synchronize_rcu();
+		destroy_workqueue(old_queue);
+	}
+
+	return 0;
+}
+
+/* Hands a completed read over to its submitting CPU (called from the bio endio) */
+void sflc_dev_queueReadDone(sflc_Device * dev, sflc_vol_DecryptWork * dec_work)
+{
+	sflc_dev_ReadDone * done = per_cpu_ptr(dev->read_done, dec_work->cpu);
+
+	/* Whatever comes in before the work item runs goes in the same batch */
+	if (!llist_add(&dec_work->done_node, &done->list)) {
+		return;
+	}
+
+	/* The submitting CPU may have gone offline since: then any CPU will do (the work item
+	   only stands for that CPU's list) */
+	rcu_read_lock();
+	if (likely(cpu_online(dec_work->cpu))) {
+		queue_work_on(dec_work->cpu, rcu_dereference(dev->decrypt_queue), &done->work);
+	} else {
+		queue_work(rcu_dereference(dev->decrypt_queue), &done->work);
+	}
+	rcu_read_unlock();
+
+	return;
+}
+
+/*****************************************************
+ *          PRIVATE FUNCTIONS DEFINITIONS            *
+ *****************************************************/
+
+/* Decrypts all the reads completed for the CPU so far, in completion order */
+static void sflc_dev_readDoneWorkFn(struct work_struct * work)
+{
+	sflc_dev_ReadDone * done = container_of(work, sflc_dev_ReadDone, work);
+	struct llist_node * batch = llist_reverse_order(llist_del_all(&done->list));
+	sflc_vol_DecryptWork * dec_work;
+	sflc_vol_DecryptWork * tmp;
+
+	llist_for_each_entry_safe(dec_work, tmp, batch, done_node) {
+		sflc_vol_readDone(dec_work);
+		cond_resched();
+	}
+
+	return;
+}
@@ -102,22 +102,81 @@ sflc_Device * sflc_dev_getDevice(struct dm_target * ti, char * real_dev_path, u3
 	/* Initialise it */
 	memset(dev->rmap, SFLC_DEV_RMAP_INVALID_VOL, dev->tot_slices * sizeof(u8));
 	dev->free_slices = dev->tot_slices;
+	/* Allocate the free list */
+	dev->free_psis = vmalloc(dev->tot_slices * sizeof(u32));
+	dev->free_pos = vmalloc(dev->tot_slices * sizeof(u32));
+	if (!dev->free_psis || !dev->free_pos) {
+		pr_err("Could not allocate free slices list\n");
+		err = -ENOMEM;
+		goto err_alloc_free_list;
+	}
+	/* Initialise it: all PSIs are free */
+	for (i = 0; i < dev->tot_slices; i++) {
+		dev->free_psis[i] = i;
+		dev->free_pos[i] = i;
+	}
 
-	/* Init IV cache lock */
-	mutex_init(&dev->iv_cache_lock);
-	/* Init IV cache waitqueue */
-	init_waitqueue_head(&dev->iv_cache_waitqueue);
-	/* Allocate IV cache */
-	dev->iv_cache = kzalloc(dev->tot_slices * sizeof(sflc_dev_IvCacheEntry *), GFP_KERNEL);
+	/* Allocate IV cache (one pointer per slice: can be big) */
+	dev->iv_cache = kvzalloc(dev->tot_slices * sizeof(sflc_dev_IvCacheEntry *), GFP_KERNEL);
 	if (!dev->iv_cache) {
 		pr_err("Could not allocate IV cache\n");
 		err = -ENOMEM;
 		goto err_alloc_iv_cache;
 	}
-	/* Set it empty */
-	dev->iv_cache_nr_entries = 0;
-	/* Init list head */
-	INIT_LIST_HEAD(&dev->iv_lru_list);
+	/* Init the shards, all empty */
+	for (i = 0; i < SFLC_DEV_IV_CACHE_SHARDS; i++) {
+		sflc_dev_IvCacheShard * shard = &dev->iv_cache_shards[i];
+
+		mutex_init(&shard->lock);
+		init_waitqueue_head(&shard->waitqueue);
+		shard->nr_entries = 0;
+		shard->nr_idle = 0;
+		atomic_set(&shard->events, 0);
+		INIT_LIST_HEAD(&shard->clock_list);
+	}
+	/* Set default capacity */
+	dev->iv_cache_capacity = SFLC_DEV_IV_CACHE_DEFAULT_CAPACITY;
+	/* Init the writeback engine */
+	INIT_WORK(&dev->iv_wb_work, sflc_dev_ivWritebackWorkFn);
+	atomic_set(&dev->iv_wb_inflight, 0);
+	init_waitqueue_head(&dev->iv_wb_waitqueue);
+	/* Nothing read ahead */
+	xa_init(&dev->iv_prefetch);
+	atomic_set(&dev->iv_prefetch_nr, 0);
+	dev->iv_prefetch_cursor = 0;
+
+	/* No reads in flight */
+	for (i = 0; i < SFLC_DEV_READ_REGIONS; i++) {
+		atomic_set(&dev->read_inflight[i], 0);
+	}
+
+	/* Init the repair daemon (started later, when there is something to repair) */
+	spin_lock_init(&dev->repair_lock);
+	INIT_LIST_HEAD(&dev->repair_queue);
+	xa_init(&dev->repair_jobs);
+	dev->repair_current = NULL;
+	dev->repair_thread = NULL;
+	init_waitqueue_head(&dev->repair_waitqueue);
+	dev->repair_held = 0;
+	dev->repair_pending = 0;
+	dev->repair_done = 0;
+	dev->repair_failed = 0;
+	dev->repair_max_kbps = SFLC_DEV_REPAIR_DEFAULT_KBPS;
+	INIT_DELAYED_WORK(&dev->repair_kick_work, sflc_dev_repairKickWorkFn);
+
+	/* Set up the decryption of the reads */
+	err = sflc_dev_startDecryptQueues(dev);
+	if (err) {
+		pr_err("Could not set up decryption queues; error %d\n", err);
+		goto err_decrypt_queues;
+	}
+
+	/* Start the write engine */
+	err = sflc_dev_startWriteEngine(dev);
+	if (err) {
+		pr_err("Could not start write engine; error %d\n", err);
+		goto err_write_engine;
+	}
 
 	/* Create kobject */
 	dev->kobj = sflc_sysfs_devKobjCreateAndAdd(dev);
@@ -134,8 +193,15 @@ sflc_Device * sflc_dev_getDevice(struct dm_target * ti, char * real_dev_path, u3
 
 
 err_sysfs:
-	kfree(dev->iv_cache);
+	sflc_dev_stopWriteEngine(dev);
+err_write_engine:
+	sflc_dev_stopDecryptQueues(dev);
+err_decrypt_queues:
+	kvfree(dev->iv_cache);
 err_alloc_iv_cache:
+err_alloc_free_list:
+	vfree(dev->free_pos);
+	vfree(dev->free_psis);
 	vfree(dev->rmap);
 err_alloc_rmap:
 	kfree(dev->real_dev_path);
@@ -174,6 +240,12 @@ bool sflc_dev_putDevice(struct dm_target * ti, sflc_Device * dev)
 		return false;
 	}
 
+	/* Stop the repair daemon and the write engine (they use the IV cache) */
+	sflc_dev_stopRepair(dev);
+	sflc_dev_stopWriteEngine(dev);
+	/* No read in flight either */
+	sflc_dev_stopDecryptQueues(dev);
+
 	/* Flush all IVs */
 	sflc_dev_flushIvs(dev);
 
@@ -184,9 +256,13 @@ bool sflc_dev_putDevice(struct dm_target * ti, sflc_Device * dev)
 	sflc_sysfs_putDevKobj(dev->kobj);
 
 	/* IV cache */
-	kfree(dev->iv_cache);
+	xa_destroy(&dev->iv_prefetch);
+	kvfree(dev->iv_cache);
 
-	/* Reverse slice map */
+	/* Reverse slice map, free list, and conflicts */
+	sflc_dev_clearConflicts(dev);
+	vfree(dev->free_pos);
+	vfree(dev->free_psis);
 	vfree(dev->rmap);
 
 	/* Backing device */
@@ -41,12 +41,19 @@
 
 typedef struct sflc_device_s sflc_Device;
 typedef struct sflc_dev_iv_cache_entry_s sflc_dev_IvCacheEntry;
+typedef struct sflc_dev_iv_cache_shard_s sflc_dev_IvCacheShard;
+typedef struct sflc_dev_slice_conflict_s sflc_dev_SliceConflict;
+typedef struct sflc_dev_repair_job_s sflc_dev_RepairJob;
+typedef struct sflc_dev_read_done_s sflc_dev_ReadDone;
+typedef struct sflc_dev_write_queue_s sflc_dev_WriteQueue;
 
 /*****************************************************
  *                  INCLUDE SECTION                  *
  *****************************************************/
 
 #include <linux/device-mapper.h>
+#include <linux/llist.h>
+#include <linux/xarray.h>
 
 #include "volume/volume.h"
 #include "crypto/symkey/symkey.h"
@@ -76,13 +83,41 @@ typedef struct sflc_dev_iv_cache_entry_s sflc_dev_IvCacheEntry;
 /* Value marking a PSI as unassigned */
 #define SFLC_DEV_RMAP_INVALID_VOL 0xFFU
 
+/* The IV cache is split into shards (by PSI hash), each with its own lock */
+#define SFLC_DEV_IV_CACHE_SHARD_BITS 4
+#define SFLC_DEV_IV_CACHE_SHARDS (1U << SFLC_DEV_IV_CACHE_SHARD_BITS)
+/* Default capacity of the IV cache (can be changed through sysfs) */
+#define SFLC_DEV_IV_CACHE_DEFAULT_CAPACITY 1024
+
+/* Bits in the flags of an IV cache entry */
+#define SFLC_DEV_IV_WRITEBACK 0		/* A writeback is in flight */
+#define SFLC_DEV_IV_WB_ERROR 1		/* The last writeback failed: still dirty */
+
+/* Max number of IV blocks read ahead and not yet adopted by the cache (beyond that, one gets dropped) */
+#define SFLC_DEV_IV_PREFETCH_MAX 64
+
+/* Reads in flight are counted per physical region (a range of PSIs), to balance them among replicas */
+#define SFLC_DEV_READ_REGIONS 64
+
+/* The repair daemon copies this many blocks per bio (256 kB) */
+#define SFLC_DEV_REPAIR_BATCH 64
+/* Default bandwidth cap of the repair daemon, in kB/s (can be changed through sysfs, 0 = no cap) */
+#define SFLC_DEV_REPAIR_DEFAULT_KBPS (64 * 1024)
+
+/* The write engine submits at most this many queued writes (of a CPU) under one plug */
+#define SFLC_DEV_WRITE_BATCH 128
+
+/* The flags of the decrypt workqueue that can be set through sysfs (none: bound to the CPUs) */
+#define SFLC_DEV_DECRYPT_QUEUE_FLAGS (WQ_UNBOUND | WQ_HIGHPRI | WQ_CPU_INTENSIVE)
+
 /*****************************************************
  *                       TYPES                       *
  *****************************************************/
 
 struct sflc_dev_iv_cache_entry_s
 {
-	/* The PSI it refers to */
+	/* The device and PSI it refers to */
+	sflc_Device	      * dev;
 	u32			psi;
 	/* The actual data, containing the 4-kB IV block */
 	struct page	      * iv_page;
@@ -91,9 +126,86 @@ struct sflc_dev_iv_cache_entry_s
 	u16			refcnt;
 	/* How many changes have been performed since the last flush */
 	u16			dirtyness;
+	/* Set on every access, cleared by the CLOCK hand (second chance) */
+	bool			referenced;
+	/* Writeback state, touched from the bio completion (atomic bitops) */
+	unsigned long		flags;
+
+	/* Position in the shard's CLOCK list */
+	struct list_head	clock_node;
+	/* Freed after a grace period: the reads of read-only volumes look entries up locklessly */
+	struct rcu_head		rcu;
+};
+
+struct sflc_dev_iv_cache_shard_s
+{
+	/* Protects everything in the shard, and the iv_cache slots of its PSIs */
+	struct mutex		lock;
+	/* Where to wait when the shard is full and every entry is reffed */
+	wait_queue_head_t	waitqueue;
+
+	/* Number of cached entries, and how many of them have refcnt == 0 */
+	u32			nr_entries;
+	u32			nr_idle;
+	/* Bumped whenever an entry might have become evictable (released, or cleaned) */
+	atomic_t		events;
+
+	/* CLOCK list: the hand sits at the tail, new entries go to the head */
+	struct list_head	clock_list;
+};
 
-	/* Position in the LRU list */
-	struct list_head	lru_node;
+/* A PSI found mapped by a volume while already owned by another one */
+struct sflc_dev_slice_conflict_s
+{
+	u32			psi;
+	/* The volume owning it in the rmap (loaded first), and the one also mapping it */
+	u8			owner_vol;
+	u8			claimant_vol;
+	/* The LSI the claimant maps onto it */
+	u32			claimant_lsi;
+};
+
+/* A slice to be rebuilt by the repair daemon, by copying it from its replica */
+struct sflc_dev_repair_job_s
+{
+	/* Where to copy from, and where to */
+	u8			donor_vol;
+	u8			receiver_vol;
+	u32			donor_lsi;
+	u32			receiver_lsi;
+	/* A stale lazy replica (the receiver keeps its PSI), rather than a corrupted slice */
+	bool			resync;
+	/* A slice of a parity volume, rebuilt from its stripe (the donor is the receiver itself) */
+	bool			rebuild;
+
+	/* I/O to the receiver slice, held back until it is rebuilt: read bios, and write works
+	   (a mirrored write is held back as a whole) */
+	struct bio_list		reads;
+	struct list_head	writes;
+	u32			nr_held;
+
+	/* Position in the repair queue */
+	struct list_head	queue_node;
+};
+
+/* The writes queued from a CPU, waiting for the engine to encrypt and submit them there */
+struct sflc_dev_write_queue_s
+{
+	sflc_Device	      * dev;
+	int			cpu;
+	/* The queued writes, under lock */
+	spinlock_t		lock;
+	struct list_head	queue;
+	/* Drains the queue, in batches */
+	struct work_struct	work;
+};
+
+/* The reads completed for a CPU, waiting to be decrypted there */
+struct sflc_dev_read_done_s
+{
+	struct llist_head	list;
+	/* Drains the list */
+	struct work_struct	work;
 };
 
 struct sflc_device_s
@@ -111,13 +223,64 @@ struct sflc_device_s
 	u8			      	* rmap;
 	u32				tot_slices;
 	u32				free_slices;
-
-	/* LRU cache of IV blocks */
-	struct mutex			iv_cache_lock;
-	wait_queue_head_t		iv_cache_waitqueue;
-	sflc_dev_IvCacheEntry	     ** iv_cache;
-	u32				iv_cache_nr_entries;
-	struct list_head		iv_lru_list;
+	/* The free PSIs are kept in the first free_slices cells of free_psis
+	   (in no order), free_pos gives the position of a free PSI in there */
+	u32			      * free_psis;
+	u32			      * free_pos;
+	/* Conflicts found while loading the fmaps (under rmap_lock) */
+	sflc_dev_SliceConflict	      * conflicts;
+	u32				nr_conflicts;
+	u32				conflicts_cap;
+
+	/* Sharded CLOCK cache of IV blocks, indexed by PSI */
+	sflc_dev_IvCacheEntry __rcu  ** iv_cache;
+	sflc_dev_IvCacheShard		iv_cache_shards[SFLC_DEV_IV_CACHE_SHARDS];
+	/* Max number of cached IV blocks (over the whole device) */
+	u32				iv_cache_capacity;
+	/* Background cleaning of dirty IV blocks near the CLOCK hand */
+	struct work_struct		iv_wb_work;
+	atomic_t			iv_wb_inflight;
+	wait_queue_head_t		iv_wb_waitqueue;
+	/* IV blocks being read ahead, indexed by PSI (inserted under the shard lock) */
+	struct xarray			iv_prefetch;
+	atomic_t			iv_prefetch_nr;
+	/* Where to look for one to drop, when there are too many (those never adopted) */
+	unsigned long			iv_prefetch_cursor;
+
+	/* Background repair of the corrupted slices. The queue, the current job, and
+	   the bios held back are protected by repair_lock */
+	spinlock_t			repair_lock;
+	struct list_head		repair_queue;
+	/* Pending jobs, indexed by receiver volume and LSI */
+	struct xarray			repair_jobs;
+	sflc_dev_RepairJob	      * repair_current;
+	struct task_struct	      * repair_thread;
+	wait_queue_head_t		repair_waitqueue;
+	/* The daemon's copy buffer */
+	struct page		      * repair_pages[SFLC_DEV_REPAIR_BATCH];
+	/* I/Os held back, over all jobs (no throttling while there are any) */
+	u32				repair_held;
+	/* Progress */
+	u32				repair_pending;
+	u32				repair_done;
+	u32				repair_failed;
+	/* Bandwidth cap, in kB/s (0 = no cap) */
+	u32				repair_max_kbps;
+	/* Starts the daemon for the jobs queued from the I/O path (which can't take the device lock) */
+	struct delayed_work		repair_kick_work;
+
+	/* Reads in flight, per physical region */
+	atomic_t			read_inflight[SFLC_DEV_READ_REGIONS];
+
+	/* The write engine: data writes queued by the volumes, per submitting CPU, drained in batches */
+	sflc_dev_WriteQueue __percpu  * write_queues;
+
+	/* Decryption of the completed reads, per submitting CPU. The workqueue is replaced (under
+	   decrypt_queue_lock) when its flags change, and used under RCU */
+	sflc_dev_ReadDone __percpu    * read_done;
+	struct workqueue_struct __rcu * decrypt_queue;
+	unsigned int			decrypt_queue_flags;
+	struct mutex			decrypt_queue_lock;
 
 	/* Sysfs stuff */
 	sflc_sysfs_DeviceKobject	      * kobj;
@@ -180,13 +343,19 @@ void sflc_dev_unsetRmap(sflc_Device * dev, u32 psi);
 /* Returns a random free physical slice, or < 0 if error */
 s32 sflc_dev_getRandomFreePsi(sflc_Device * dev);
 
+/* Records that the volume maps the LSI onto an already-owned PSI. Returns < 0 if error. */
+int sflc_dev_addConflict(sflc_Device * dev, u32 psi, u8 vol_idx, u32 lsi);
+
+/* Forgets all the recorded conflicts */
+void sflc_dev_clearConflicts(sflc_Device * dev);
+
 
 /* These functions provide concurrent-safe access to the entries of the IV cache.
-   The lock iv_cache_lock is acquired by these functions: it must not be held by the caller.
+   The lock of the PSI's shard is acquired by these functions: it must not be held by the caller.
    The individual entries (IV blocks) are not concurrent-safe because they don't need to:
    concurrent consumers of the same block are concerned with different IVs contained in the
    block, because we exclued concurrent I/O to the same logical data block (BIG QUESTION MARK HERE).
-   When the refcount reaches 0, the IV block is flushed. */
+   Dirty IV blocks are written back asynchronously; only clean ones are evicted. */
 
 /* Get a pointer to the specified IV block. Increases the refcount and possibly the dirtyness (if WRITE). */
 u8 * sflc_dev_getIvBlockRef(sflc_Device * dev, u32 psi, int rw);
@@ -197,5 +366,80 @@ int sflc_dev_putIvBlockRef(sflc_Device * dev, u32 psi);
 /* Flush all dirty IV blocks */
 void sflc_dev_flushIvs(sflc_Device * dev);
 
+/* Copy the IVs of nr blocks of the slice, from the first one, out of the cached IV block without
+   taking the shard lock. Only for IV blocks that can't change (read-only volumes).
+   Returns -ENOENT if the IV block is not cached. */
+int sflc_dev_copyIvsLockless(sflc_Device * dev, u32 psi, u32 first, u32 nr, u8 * ivs);
+
+/* Drop the cached IV block of a PSI that was just freed, without writing it back */
+void sflc_dev_dropIvBlock(sflc_Device * dev, u32 psi);
+
+/* Start reading the IV block of the PSI, if it's not cached (never sleeps on the shard lock).
+   The cache entry created next for the PSI adopts it, instead of reading it again. */
+void sflc_dev_prefetchIvBlock(sflc_Device * dev, u32 psi);
+/* Forget the IV block read ahead for the PSI, if any */
+void sflc_dev_dropIvPrefetch(sflc_Device * dev, u32 psi);
+
+/* Change the capacity of the IV cache. Shrinking is applied lazily, as entries are released. */
+int sflc_dev_setIvCacheCapacity(sflc_Device * dev, u32 capacity);
+
+/* Work function of the IV writeback engine: cleans the dirty entries nearest to the CLOCK hand */
+void sflc_dev_ivWritebackWorkFn(struct work_struct * work);
+
+
+/* The repair daemon rebuilds corrupted slices in the background, once the volumes are live.
+   I/O to a slice still waiting for repair is held back, and the slice is repaired first. */
+
+/* Queues the copy of the donor slice onto the receiver slice. Returns < 0 if error. */
+int sflc_dev_queueRepair(sflc_Device * dev, u8 donor_vol, u32 donor_lsi, u8 receiver_vol, u32 receiver_lsi);
+/* Same, to bring a stale lazy replica up to date. Returns < 0 if error. */
+int sflc_dev_queueResync(sflc_Device * dev, u8 donor_vol, u32 donor_lsi, u8 receiver_vol, u32 receiver_lsi);
+/* Same, to rebuild the slice of a parity volume from the rest of its stripe. Returns < 0 if error. */
+int sflc_dev_queueRebuild(sflc_Device * dev, u8 vol_idx, u32 lsi);
+
+/* Starts the repair daemon, if there is anything to repair. Returns < 0 if error. */
+int sflc_dev_startRepair(sflc_Device * dev);
+
+/* Stops the repair daemon, and drops the jobs left. */
+void sflc_dev_stopRepair(sflc_Device * dev);
+/* Starts the repair daemon in the background (it needs the device lock). */
+void sflc_dev_kickRepair(sflc_Device * dev);
+void sflc_dev_repairKickWorkFn(struct work_struct * work);
+
+/* Drops the jobs involving the volume, and waits for the one in progress (if it does). */
+void sflc_dev_cancelRepairs(sflc_Device * dev, u8 vol_idx);
+
+/* Return true if the slice is waiting for repair: the bio is then resubmitted (the write
+   work requeued) once it's done */
+bool sflc_dev_deferReadToRepair(sflc_Device * dev, u8 vol_idx, u32 lsi, struct bio * bio);
+bool sflc_dev_deferWriteToRepair(sflc_Device * dev, u8 vol_idx, u32 lsi, sflc_vol_WriteWork * write_work);
+
+/* Returns true if the slice is waiting for repair, or being repaired */
+bool sflc_dev_repairIsQueued(sflc_Device * dev, u8 vol_idx, u32 lsi);
+/* Sleeps off what's left of the batch's time budget, unless some I/O is held back (repair daemon only) */
+void sflc_dev_throttleRepair(sflc_Device * dev, unsigned long batch_start);
+
+
+/* The write engine drains the data writes of all the volumes in per-CPU batches, submitted under one plug */
+
+/* Starts the write engine. Returns < 0 if error. */
+int sflc_dev_startWriteEngine(sflc_Device * dev);
+/* Stops the write engine (nothing can be queued by then) */
+void sflc_dev_stopWriteEngine(sflc_Device * dev);
+/* Queues the write work to the engine */
+void sflc_dev_queueWrite(sflc_Device * dev, sflc_vol_WriteWork * write_work);
+
+
+/* Completed reads are decrypted on the CPU that submitted them, in batches */
+
+/* Sets up the decryption queues. Returns < 0 if error. */
+int sflc_dev_startDecryptQueues(sflc_Device * dev);
+/* Tears them down (no read can be in flight by then) */
+void sflc_dev_stopDecryptQueues(sflc_Device * dev);
+/* Replaces the decrypt workqueue with one with the given flags. Returns < 0 if error. */
+int sflc_dev_setDecryptQueueFlags(sflc_Device * dev, unsigned int flags);
+/* Hands a completed read over to its submitting CPU (callable from endio) */
+void sflc_dev_queueReadDone(sflc_Device * dev, sflc_vol_DecryptWork * dec_work);
+
 
 #endif /* _SFLC_DEVICE_DEVICE_H_ */
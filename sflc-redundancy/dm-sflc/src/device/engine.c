@@ -0,0 +1,168 @@
+/*
+ *  Copyright The Shufflecake Project Authors (2022)
+ *  Copyright The Shufflecake Project Contributors (2022)
+ *  Copyright Contributors to the The Shufflecake Project.
+ *
+ *  See the AUTHORS file at the top-level directory of this distribution and at
+ *  <https://www.shufflecake.net/permalinks/shufflecake-userland/AUTHORS>
+ *
+ *  This file is part of the program dm-sflc, which is part of the Shufflecake
+ *  Project. Shufflecake is a plausible deniability (hidden storage) layer for
+ *  Linux. See <https://www.shufflecake.net>.
+ *
+ *  This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version. This program is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ *  Public License for more details. You should have received a copy of the
+ *  GNU General Public License along with this program.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file only implements the write engine.
+ * Instead of one work item per write, the data writes of all the volumes
+ * on the device are queued on the CPU they were submitted from, and each
+ * CPU's queue is drained by a per-CPU work item (on the write workqueue)
+ * in batches: each batch is encrypted in slice order and submitted under
+ * a single plug, so that the block layer can merge adjacent writes (see
+ * sflc_vol_writeBatch()). The encryption is thus spread over the CPUs
+ * doing the writes, like it was with one work item per write.
+ * Flushes, discards, parity writes and the writes resubmitted by the repair
+ * daemon still go through the write workqueue as work items of their own.
+ */
+
+/*****************************************************
+ *                  INCLUDE SECTION                  *
+ *****************************************************/
+
+#include <linux/cpumask.h>
+#include <linux/percpu.h>
+
+#include "device.h"
+#include "utils/workqueues.h"
+#include "log/log.h"
+
+/*****************************************************
+ *           PRIVATE FUNCTIONS PROTOTYPES            *
+ *****************************************************/
+
+static void sflc_dev_writeQueueWorkFn(struct work_struct * work);
+static void sflc_dev_kickWriteQueue(sflc_dev_WriteQueue * wq);
+
+/*****************************************************
+ *           PUBLIC FUNCTIONS DEFINITIONS            *
+ *****************************************************/
+
+/* Starts the write engine. Returns < 0 if error. */
+int sflc_dev_startWriteEngine(sflc_Device * dev)
+{
+	int cpu;
+
+	dev->write_queues = alloc_percpu(sflc_dev_WriteQueue);
+	if (!dev->write_queues) {
+		pr_err("Could not allocate per-CPU write queues\n");
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu) {
+		sflc_dev_WriteQueue * wq = per_cpu_ptr(dev->write_queues, cpu);
+
+		wq->dev = dev;
+		wq->cpu = cpu;
+		spin_lock_init(&wq->lock);
+		INIT_LIST_HEAD(&wq->queue);
+		INIT_WORK(&wq->work, sflc_dev_writeQueueWorkFn);
+	}
+
+	return 0;
+}
+
+/* Stops the write engine (nothing can be queued by then: DM waits for all the bios of a target
+   before destroying it, and writes only complete once submitted) */
+void sflc_dev_stopWriteEngine(sflc_Device * dev)
+{
+	int cpu;
+
+	if (!dev->write_queues) {
+		return;
+	}
+	for_each_possible_cpu(cpu) {
+		sflc_dev_WriteQueue * wq = per_cpu_ptr(dev->write_queues, cpu);
+
+		flush_work(&wq->work);
+		if (!list_empty(&wq->queue)) {
+			pr_err("Write engine stopped with writes still queued on CPU %d\n", cpu);
+		}
+	}
+	free_percpu(dev->write_queues);
+	dev->write_queues = NULL;
+
+	return;
+}
+
+/* Queues the write work to the engine, on the current CPU */
+void sflc_dev_queueWrite(sflc_Device * dev, sflc_vol_WriteWork * write_work)
+{
+	sflc_dev_WriteQueue * wq = per_cpu_ptr(dev->write_queues, raw_smp_processor_id());
+	bool was_empty;
+
+	spin_lock(&wq->lock);
+	was_empty = list_empty(&wq->queue);
+	list_add_tail(&write_work->queue_node, &wq->queue);
+	spin_unlock(&wq->lock);
+
+	/* Whatever comes in while the work item is busy goes in its next batch */
+	if (was_empty) {
+		sflc_dev_kickWriteQueue(wq);
+	}
+
+	return;
+}
+
+/*****************************************************
+ *          PRIVATE FUNCTIONS DEFINITIONS            *
+ *****************************************************/
+
+/* Takes up to a batch of writes off the CPU's queue, and writes them. Requeues itself if more are left. */
+static void sflc_dev_writeQueueWorkFn(struct work_struct * work)
+{
+	sflc_dev_WriteQueue * wq = container_of(work, sflc_dev_WriteQueue, work);
+	sflc_vol_WriteWork * write_work;
+	sflc_vol_WriteWork * tmp;
+	LIST_HEAD(batch);
+	bool more;
+	u32 nr = 0;
+
+	spin_lock(&wq->lock);
+	list_for_each_entry_safe(write_work, tmp, &wq->queue, queue_node) {
+		if (nr == SFLC_DEV_WRITE_BATCH) {
+			break;
+		}
+		list_move_tail(&write_work->queue_node, &batch);
+		nr += 1;
+	}
+	more = !list_empty(&wq->queue);
+	spin_unlock(&wq->lock);
+
+	if (nr) {
+		sflc_vol_writeBatch(&batch);
+	}
+	/* Let the other work items of the CPU go in between batches */
+	if (more) {
+		sflc_dev_kickWriteQueue(wq);
+	}
+
+	return;
+}
+
+/* Schedules the work item of the queue on its CPU (any CPU if it went offline) */
+static void sflc_dev_kickWriteQueue(sflc_dev_WriteQueue * wq)
+{
+	if (likely(cpu_online(wq->cpu))) {
+		queue_work_on(wq->cpu, sflc_queues_writeQueue, &wq->work);
+	} else {
+		queue_work(sflc_queues_writeQueue, &wq->work);
+	}
+}
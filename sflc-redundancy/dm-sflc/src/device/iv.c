@@ -25,16 +25,37 @@
  *                  INCLUDE SECTION                  *
  *****************************************************/
 
+#include <linux/hash.h>
+#include <linux/rcupdate.h>
+
+#include <linux/blkdev.h>
+
 #include "device.h"
 #include "utils/pools.h"
+#include "utils/workqueues.h"
 #include "log/log.h"
 
 /*****************************************************
  *                     CONSTANTS                     *
  *****************************************************/
 
-/* Capacity of IV cache */
-#define SFLC_DEV_IV_CACHE_CAPACITY 1024
+/* Max number of entries the writeback engine looks at, from the CLOCK hand, in each shard */
+#define SFLC_DEV_IV_WB_BATCH 32
+
+/*****************************************************
+ *                       TYPES                       *
+ *****************************************************/
+
+/* An IV block read ahead of its cache entry, along with a data read. It is adopted by the next
+   entry created for the PSI (so it can't go stale: no entry, no writeback of that IV block). */
+typedef struct sflc_dev_iv_prefetch_s
+{
+        struct page * page;
+        blk_status_t status;
+        struct completion done;
+        /* One for the prefetch table, one for the bio */
+        atomic_t refs;
+} sflc_dev_IvPrefetch;
 
 /*****************************************************
  *                      MACROS                       *
@@ -42,12 +63,30 @@
 
 #define sflc_dev_psiToIvBlockSector(psi) (SFLC_DEV_HEADER_SIZE + (sector_t)(psi) * SFLC_DEV_PHYS_SLICE_SIZE)
 
+/* The shard a PSI belongs to */
+#define sflc_dev_ivShard(dev, psi) (&(dev)->iv_cache_shards[hash_32((psi), SFLC_DEV_IV_CACHE_SHARD_BITS)])
+/* The cache slot of the PSI, read under the lock of its shard */
+#define sflc_dev_ivSlot(dev, psi, shard) rcu_dereference_protected((dev)->iv_cache[psi], lockdep_is_held(&(shard)->lock))
+
+/* The writeback engine kicks in when a shard is 3/4 full */
+#define sflc_dev_ivShardWatermark(dev) (sflc_dev_ivShardCapacity(dev) * 3 / 4)
+
 /*****************************************************
  *           PRIVATE FUNCTIONS PROTOTYPES            *
  *****************************************************/
 
+static u32 sflc_dev_ivShardCapacity(sflc_Device * dev);
+static int sflc_dev_evictIvCacheEntry(sflc_Device * dev, sflc_dev_IvCacheShard * shard);
+static bool sflc_dev_ivEntryIsClean(sflc_dev_IvCacheEntry * entry);
+static int sflc_dev_startIvWriteback(sflc_dev_IvCacheEntry * entry);
+static void sflc_dev_ivWritebackEndIo(struct bio * bio);
+static void sflc_dev_ivPrefetchEndIo(struct bio * bio);
+static sflc_dev_IvPrefetch * sflc_dev_takeIvPrefetch(sflc_Device * dev, u32 psi);
+static void sflc_dev_putIvPrefetch(sflc_dev_IvPrefetch * pf);
+static void sflc_dev_recycleIvPrefetch(sflc_Device * dev);
 static sflc_dev_IvCacheEntry * sflc_dev_newIvCacheEntry(sflc_Device * dev, u32 psi);
 static int sflc_dev_destroyIvCacheEntry(sflc_Device * dev, sflc_dev_IvCacheEntry * entry);
+static void sflc_dev_freeIvCacheEntryRcu(struct rcu_head * rcu);
 
 /*****************************************************
  *           PUBLIC FUNCTIONS DEFINITIONS            *
@@ -57,45 +96,59 @@ static int sflc_dev_destroyIvCacheEntry(sflc_Device * dev, sflc_dev_IvCacheEntry
    Returns an ERR_PTR() if error. */
 u8 * sflc_dev_getIvBlockRef(sflc_Device * dev, u32 psi, int rw)
 {
+        sflc_dev_IvCacheShard * shard = sflc_dev_ivShard(dev, psi);
         sflc_dev_IvCacheEntry * entry;
         int err;
 
-        /* Lock + waitqueue pattern */
+        /* Lock + waitqueue pattern, on the PSI's shard only */
 
         /* Acquire the lock */
-        if (mutex_lock_interruptible(&dev->iv_cache_lock)) {
-                pr_err("Interrupted while waiting to lock IV cache\n");
+        if (mutex_lock_interruptible(&shard->lock)) {
+                pr_err("Interrupted while waiting to lock IV cache shard\n");
                 err = -EINTR;
                 goto err_lock_cache;
         }
 
-        /* Check for either of two conditions in order to go through */
-        while (dev->iv_cache[psi] == NULL && dev->iv_cache_nr_entries >= SFLC_DEV_IV_CACHE_CAPACITY) {
-                /* We can't go through, yield the lock */
-                mutex_unlock(&dev->iv_cache_lock);
+        /* Go through once the entry is cached, or there is room in the shard to create it */
+        while (sflc_dev_ivSlot(dev, psi, shard) == NULL && shard->nr_entries >= sflc_dev_ivShardCapacity(dev)) {
+                /* Sample the events before looking for a victim, so we can't miss a wakeup */
+                int seen = atomic_read(&shard->events);
+
+                /* Make room ourselves if some entry is unreffed and clean */
+                err = sflc_dev_evictIvCacheEntry(dev, shard);
+                if (!err) {
+                        continue;
+                }
+                if (err != -EAGAIN) {
+                        pr_err("Could not evict an IV cache entry; error %d\n", err);
+                        goto err_evict;
+                }
+
+                /* All entries are reffed or being written back: we can't go through, yield the lock */
+                mutex_unlock(&shard->lock);
 
-                /* Sleep in the waitqueue (same conditions) */
-                if (wait_event_interruptible(dev->iv_cache_waitqueue, dev->iv_cache[psi] != NULL || 
-                                                dev->iv_cache_nr_entries < SFLC_DEV_IV_CACHE_CAPACITY)) {
+                /* Sleep in the waitqueue until an entry is released or cleaned */
+                if (wait_event_interruptible(shard->waitqueue, rcu_access_pointer(dev->iv_cache[psi]) != NULL ||
+                                                atomic_read(&shard->events) != seen ||
+                                                shard->nr_entries < sflc_dev_ivShardCapacity(dev))) {
                         err = -EINTR;
                         pr_err("Interrupted while waiting in waitqueue\n");
                         goto err_wait_queue;
                 }
 
-                /* Re-acquire the lock, hoping that either condition will be true at the next iteration */
-                if (mutex_lock_interruptible(&dev->iv_cache_lock)) {
-                        pr_err("Interrupted while waiting to re-lock IV cache\n");
+                /* Re-acquire the lock, and check again */
+                if (mutex_lock_interruptible(&shard->lock)) {
+                        pr_err("Interrupted while waiting to re-lock IV cache shard\n");
                         err = -EINTR;
                         goto err_relock_cache;
                 }
         }
 
-        /* Phew, we're out! At this point, we hold the lock, and one of two conditions is true (or both):
-           either our desired cache entry is already in cache (in which case we can just grab a new reference),
-           or there is enough space in the cache for us to create it. */
+        /* At this point, we hold the lock, and either our desired cache entry is already in cache
+           (in which case we can just grab a new reference), or there is room for us to create it. */
 
         /* Let's see which one it is */
-        entry = dev->iv_cache[psi];
+        entry = sflc_dev_ivSlot(dev, psi, shard);
         if (!entry) {
                 /* Create it */
                 entry = sflc_dev_newIvCacheEntry(dev, psi);
@@ -105,32 +158,34 @@ u8 * sflc_dev_getIvBlockRef(sflc_Device * dev, u32 psi, int rw)
                         goto err_create_entry;
                 }
 
-                /* Insert it into the cache */
-                dev->iv_cache[psi] = entry;
-                /* Update cache size */
-                dev->iv_cache_nr_entries += 1;
+                /* Insert it into the cache (published to the lockless readers) */
+                rcu_assign_pointer(dev->iv_cache[psi], entry);
+                /* Update shard size */
+                shard->nr_entries += 1;
 
-                /* Insert it anywhere in the LRU list (won't be evicted anyway as long as it's reffed) */
-                list_add(&entry->lru_node, &dev->iv_lru_list);
-
-                /* We just altered the condition someone might be sleeping for: tell the waitqueue */
-                wake_up_interruptible(&dev->iv_cache_waitqueue);
+                /* Insert it at the head of the CLOCK list, farthest from the hand */
+                list_add(&entry->clock_node, &shard->clock_list);
+        } else if (entry->refcnt == 0) {
+                /* It is no longer an eviction candidate */
+                shard->nr_idle -= 1;
         }
 
-        /* Increase refcount, and possibly dirtyness */
+        /* Increase refcount, and possibly dirtyness. Mark as recently used. */
         entry->refcnt += 1;
+        entry->referenced = true;
         if (rw == WRITE) {
                 entry->dirtyness += 1;
         }
 
         /* Finally yield the lock */
-        mutex_unlock(&dev->iv_cache_lock);
+        mutex_unlock(&shard->lock);
 
         return page_address(entry->iv_page);
 
 
 err_create_entry:
-        mutex_unlock(&dev->iv_cache_lock);
+err_evict:
+        mutex_unlock(&shard->lock);
 err_relock_cache:
 err_wait_queue:
 err_lock_cache:
@@ -140,106 +195,548 @@ err_lock_cache:
 /* Signal end of usage of an IV block. Decreases the refcount. */
 int sflc_dev_putIvBlockRef(sflc_Device * dev, u32 psi)
 {
+        sflc_dev_IvCacheShard * shard = sflc_dev_ivShard(dev, psi);
         sflc_dev_IvCacheEntry * entry;
-        int err;
+        int err = 0;
 
         /* No condition needed besides mutual exclusion: just grab the lock (no waitqueue) */
-        if (mutex_lock_interruptible(&dev->iv_cache_lock)) {
-                pr_err("Interrupted while waiting to lock IV cache\n");
-                err = -EINTR;
-                goto err_lock_cache;
+        if (mutex_lock_interruptible(&shard->lock)) {
+                pr_err("Interrupted while waiting to lock IV cache shard\n");
+                return -EINTR;
         }
 
         /* Retrieve entry */
-        entry = dev->iv_cache[psi];
+        entry = sflc_dev_ivSlot(dev, psi, shard);
 
-        /* Decrease refcount */
+        /* Decrease refcount. No list movement: the referenced bit set on get does the job. */
         entry->refcnt -= 1;
+        if (entry->refcnt > 0) {
+                goto out;
+        }
+
+        /* It can now be evicted */
+        shard->nr_idle += 1;
+        atomic_inc(&shard->events);
+
+        /* If the shard is filling up, have the dirty entries cleaned in the background */
+        if (entry->dirtyness && shard->nr_entries >= sflc_dev_ivShardWatermark(dev)) {
+                queue_work(sflc_queues_ivWritebackQueue, &dev->iv_wb_work);
+        }
+
+        /* If the capacity was lowered, shrink the shard (if there is nothing clean, it will be later) */
+        if (shard->nr_entries > sflc_dev_ivShardCapacity(dev)) {
+                err = sflc_dev_evictIvCacheEntry(dev, shard);
+                if (err == -EAGAIN) {
+                        err = 0;
+                }
+                if (err) {
+                        pr_err("Could not evict an IV cache entry; error %d\n", err);
+                }
+        }
+
+        /* We just altered the condition someone might be sleeping for: tell the waitqueue */
+        wake_up_interruptible(&shard->waitqueue);
+
+out:
+        /* Yield the lock */
+        mutex_unlock(&shard->lock);
+
+        return err;
+}
+
+/* Flush all dirty IV blocks */
+void sflc_dev_flushIvs(sflc_Device * dev)
+{
+	sflc_dev_IvCacheEntry * entry, * _next;
+        sflc_dev_IvPrefetch * pf;
+        unsigned long index;
+        int err;
+        int i;
+
+        /* Stop the writeback engine, and wait for the writebacks in flight. The last endio
+           might still be waking us up: it's done with the device once it drops the lock */
+        cancel_work_sync(&dev->iv_wb_work);
+        wait_event(dev->iv_wb_waitqueue, atomic_read(&dev->iv_wb_inflight) == 0);
+        spin_lock_irq(&dev->iv_wb_waitqueue.lock);
+        spin_unlock_irq(&dev->iv_wb_waitqueue.lock);
+
+        /* Drop the IV blocks read ahead for nothing, once their reads are over */
+        xa_for_each(&dev->iv_prefetch, index, pf) {
+                pf = sflc_dev_takeIvPrefetch(dev, index);
+                if (pf) {
+                        wait_for_completion(&pf->done);
+                        sflc_dev_putIvPrefetch(pf);
+                }
+        }
+
+        /* Iterate over all entries of all shards */
+        for (i = 0; i < SFLC_DEV_IV_CACHE_SHARDS; i++) {
+                sflc_dev_IvCacheShard * shard = &dev->iv_cache_shards[i];
+
+                list_for_each_entry_safe(entry, _next, &shard->clock_list, clock_node) {
+                        /* Pop it from the list */
+                        __list_del_entry(&entry->clock_node);
+
+                        /* Destroy it */
+                        err = sflc_dev_destroyIvCacheEntry(dev, entry);
+                        if (err) {
+                                pr_err("Could not destroy IV cache entry for PSI %u; error %d\n", entry->psi, err);
+                        }
+                }
+                shard->nr_entries = 0;
+                shard->nr_idle = 0;
+        }
+
+        /* Wait for the entries to be actually freed */
+        rcu_barrier();
+}
 
-        /* Pull it to the the head of the LRU list */
-        __list_del_entry(&entry->lru_node);
-        list_add(&entry->lru_node, &dev->iv_lru_list);
+/* Copy the IVs of nr blocks of the slice, from the first one, out of the cached IV block without
+   taking the shard lock. Only for IV blocks that can't change (read-only volumes): the entry is
+   only guaranteed to stay around, not to be left alone. Returns -ENOENT if it's not cached. */
+int sflc_dev_copyIvsLockless(sflc_Device * dev, u32 psi, u32 first, u32 nr, u8 * ivs)
+{
+        sflc_dev_IvCacheEntry * entry;
+
+        rcu_read_lock();
+
+        entry = rcu_dereference(dev->iv_cache[psi]);
+        if (!entry) {
+                rcu_read_unlock();
+                return -ENOENT;
+        }
+        /* IV pages are never highmem: no kmap needed */
+        memcpy(ivs, page_address(entry->iv_page) + (first * SFLC_SK_IV_LEN), nr * SFLC_SK_IV_LEN);
+        /* Recently used, for the CLOCK hand (a lost update only costs it a second chance) */
+        WRITE_ONCE(entry->referenced, true);
+
+        rcu_read_unlock();
+
+        return 0;
+}
+
+/* Drop the cached IV block of a PSI that was just freed, without writing it back. An entry
+   that is still reffed, or under writeback, is left to the CLOCK hand. */
+void sflc_dev_dropIvBlock(sflc_Device * dev, u32 psi)
+{
+        sflc_dev_IvCacheShard * shard = sflc_dev_ivShard(dev, psi);
+        sflc_dev_IvCacheEntry * entry;
+        int err;
+
+        mutex_lock(&shard->lock);
+
+        /* Not worth adopting either */
+        sflc_dev_dropIvPrefetch(dev, psi);
+
+        entry = sflc_dev_ivSlot(dev, psi, shard);
+        if (!entry || entry->refcnt > 0 || test_bit(SFLC_DEV_IV_WRITEBACK, &entry->flags)) {
+                goto out;
+        }
+
+        /* Take it out of the cache (lockless readers may still see it, until a grace period) */
+        RCU_INIT_POINTER(dev->iv_cache[psi], NULL);
+        shard->nr_entries -= 1;
+        shard->nr_idle -= 1;
+        __list_del_entry(&entry->clock_node);
+
+        /* Nothing worth writing in it */
+        entry->dirtyness = 0;
+        clear_bit(SFLC_DEV_IV_WB_ERROR, &entry->flags);
+        err = sflc_dev_destroyIvCacheEntry(dev, entry);
+        if (err) {
+                pr_err("Could not drop cache entry for PSI %u; error %d\n", psi, err);
+        }
+
+        /* Room was made in the shard */
+        atomic_inc(&shard->events);
+        wake_up_interruptible(&shard->waitqueue);
 
-        /* If cache is not full, we can return now */
-        if (dev->iv_cache_nr_entries < SFLC_DEV_IV_CACHE_CAPACITY) {
+out:
+        mutex_unlock(&shard->lock);
+}
+
+/* Start reading the IV block of the PSI if it's not cached, so that it is at hand (or on its way)
+   by the time the data read completes. Never waits for the shard lock: gives up if it's taken. */
+void sflc_dev_prefetchIvBlock(sflc_Device * dev, u32 psi)
+{
+        sflc_dev_IvCacheShard * shard = sflc_dev_ivShard(dev, psi);
+        sflc_dev_IvPrefetch * pf;
+        struct bio * bio;
+
+        /* Cheap (racy) check first */
+        if (rcu_access_pointer(dev->iv_cache[psi])) {
+                return;
+        }
+        if (!mutex_trylock(&shard->lock)) {
+                return;
+        }
+        /* Under the lock, no entry can be created (or adopt anything) behind our back */
+        if (sflc_dev_ivSlot(dev, psi, shard) || xa_load(&dev->iv_prefetch, psi)) {
                 goto out;
         }
 
-        /* Otherwise, let's look for the least recent unreffed entry, and evict it */
+        /* Too many of them: some were read for nothing (streams that stopped, failed reads...) */
+        if (atomic_read(&dev->iv_prefetch_nr) >= SFLC_DEV_IV_PREFETCH_MAX) {
+                sflc_dev_recycleIvPrefetch(dev);
+        }
+
+        /* Allocate the prefetch, its page, and the bio */
+        pf = kmalloc(sizeof(*pf), GFP_NOIO);
+        if (!pf) {
+                goto out;
+        }
+        pf->page = mempool_alloc(sflc_pools_ivPagePool, GFP_NOIO);
+        if (!pf->page) {
+                goto err_alloc_page;
+        }
+        bio = bio_alloc_bioset(GFP_NOIO, 1, &sflc_pools_bioset);
+        if (!bio) {
+                goto err_alloc_bio;
+        }
+        pf->status = BLK_STS_OK;
+        init_completion(&pf->done);
+        atomic_set(&pf->refs, 2);
+
+        /* Publish it */
+        if (xa_insert(&dev->iv_prefetch, psi, pf, GFP_NOIO)) {
+                goto err_insert;
+        }
+        atomic_inc(&dev->iv_prefetch_nr);
+
+        /* Set real backing device */
+        bio_set_dev(bio, dev->real_dev->bdev);
+        /* Set sector */
+        bio->bi_iter.bi_sector = sflc_dev_psiToIvBlockSector(psi) * SFLC_DEV_SECTOR_SCALE;
+        /* Set flags */
+        bio->bi_opf = REQ_OP_READ;
+        /* Add page (can't fail on a fresh bio) */
+        bio_add_page(bio, pf->page, SFLC_DEV_SECTOR_SIZE, 0);
+        /* Set completion */
+        bio->bi_private = pf;
+        bio->bi_end_io = sflc_dev_ivPrefetchEndIo;
+
+        /* Submit */
+        submit_bio(bio);
+        goto out;
+
+
+err_insert:
+        bio_put(bio);
+err_alloc_bio:
+        mempool_free(pf->page, sflc_pools_ivPagePool);
+err_alloc_page:
+        kfree(pf);
+out:
+        mutex_unlock(&shard->lock);
+}
+
+/* Forget the IV block read ahead for the PSI, if any: the read it came with went elsewhere */
+void sflc_dev_dropIvPrefetch(sflc_Device * dev, u32 psi)
+{
+        sflc_dev_IvPrefetch * pf = sflc_dev_takeIvPrefetch(dev, psi);
+
+        /* Freed by the bio completion, if it's still in flight */
+        if (pf) {
+                sflc_dev_putIvPrefetch(pf);
+        }
+}
+
+/* Change the capacity of the IV cache. Shrinking is applied lazily, as entries are released. */
+int sflc_dev_setIvCacheCapacity(sflc_Device * dev, u32 capacity)
+{
+        int i;
+
+        /* Need at least one entry per shard */
+        if (capacity < SFLC_DEV_IV_CACHE_SHARDS) {
+                return -EINVAL;
+        }
+
+        WRITE_ONCE(dev->iv_cache_capacity, capacity);
+
+        /* Growing the cache might let some waiters through */
+        for (i = 0; i < SFLC_DEV_IV_CACHE_SHARDS; i++) {
+                wake_up_interruptible(&dev->iv_cache_shards[i].waitqueue);
+        }
+
+        return 0;
+}
+
+/* Work function of the IV writeback engine: cleans the dirty entries nearest to the CLOCK hand */
+void sflc_dev_ivWritebackWorkFn(struct work_struct * work)
+{
+        sflc_Device * dev = container_of(work, sflc_Device, iv_wb_work);
+        sflc_dev_IvCacheEntry * entry;
+        struct blk_plug plug;
+        int err;
+        int i;
+
+        /* Submit all the writebacks in one go */
+        blk_start_plug(&plug);
+
+        for (i = 0; i < SFLC_DEV_IV_CACHE_SHARDS; i++) {
+                sflc_dev_IvCacheShard * shard = &dev->iv_cache_shards[i];
+                int scanned = 0;
+
+                mutex_lock(&shard->lock);
+
+                /* Only bother with shards that are filling up */
+                if (shard->nr_entries < sflc_dev_ivShardWatermark(dev)) {
+                        mutex_unlock(&shard->lock);
+                        continue;
+                }
+
+                /* Walk from the hand: these are the next eviction candidates */
+                list_for_each_entry_reverse(entry, &shard->clock_list, clock_node) {
+                        if (scanned++ >= SFLC_DEV_IV_WB_BATCH) {
+                                break;
+                        }
+                        if (entry->refcnt > 0 || sflc_dev_ivEntryIsClean(entry) ||
+                                        test_bit(SFLC_DEV_IV_WRITEBACK, &entry->flags)) {
+                                continue;
+                        }
+
+                        err = sflc_dev_startIvWriteback(entry);
+                        if (err) {
+                                pr_err("Could not start writeback of IV block for PSI %u; error %d\n", entry->psi, err);
+                        }
+                }
+
+                mutex_unlock(&shard->lock);
+        }
+
+        blk_finish_plug(&plug);
+}
+
+/*****************************************************
+ *           PRIVATE FUNCTIONS DEFINITIONS           *
+ *****************************************************/
+
+/* Each shard gets an equal part of the total capacity */
+static u32 sflc_dev_ivShardCapacity(sflc_Device * dev)
+{
+        return DIV_ROUND_UP(READ_ONCE(dev->iv_cache_capacity), SFLC_DEV_IV_CACHE_SHARDS);
+}
+
+/* Evict one unreffed, clean entry from the shard, chosen by the CLOCK hand. Dirty entries
+   met by the hand are written back asynchronously, and skipped for now.
+   The caller holds the shard lock. Returns -EAGAIN if no entry can be evicted right now. */
+static int sflc_dev_evictIvCacheEntry(sflc_Device * dev, sflc_dev_IvCacheShard * shard)
+{
         sflc_dev_IvCacheEntry * evicted;
-        bool found = false;
-        list_for_each_entry_reverse(evicted, &dev->iv_lru_list, lru_node) {
-                if (evicted->refcnt == 0) {
-                        found = true;
-                        break;
+        struct blk_plug plug;
+        u32 scanned;
+        int err;
+
+        /* Nothing is evictable if everything is reffed */
+        if (shard->nr_idle == 0) {
+                return -EAGAIN;
+        }
+
+        /* Advance the hand: reffed, recently used, or dirty entries get moved back to the head
+           (clearing their referenced bit). Two rounds are enough to see every entry unreferenced. */
+        blk_start_plug(&plug);
+        for (scanned = 0; scanned < 2 * shard->nr_entries; scanned++) {
+                evicted = list_last_entry(&shard->clock_list, sflc_dev_IvCacheEntry, clock_node);
+                if (evicted->refcnt == 0 && !evicted->referenced) {
+                        if (sflc_dev_ivEntryIsClean(evicted)) {
+                                break;
+                        }
+                        /* Clean it for the next round */
+                        if (!test_bit(SFLC_DEV_IV_WRITEBACK, &evicted->flags)) {
+                                err = sflc_dev_startIvWriteback(evicted);
+                                if (err) {
+                                        pr_err("Could not start writeback of IV block for PSI %u; error %d\n", evicted->psi, err);
+                                }
+                        }
                 }
+                evicted->referenced = false;
+                list_move(&evicted->clock_node, &shard->clock_list);
         }
+        blk_finish_plug(&plug);
 
-        /* If we didn't find one (all entries are reffed), no luck, return now */
-        if (!found) {
-                goto out;
+        /* Went around twice without finding a clean victim */
+        if (scanned == 2 * shard->nr_entries) {
+                return -EAGAIN;
         }
 
-        /* Take it out of the cache */
-        dev->iv_cache[evicted->psi] = NULL;
-        dev->iv_cache_nr_entries -= 1;
-        
-        /* Pull it out of the LRU list */
-        __list_del_entry(&evicted->lru_node);
-        /* Destroy it (free and flush to disk) */
+        /* Take it out of the cache (lockless readers may still see it, until a grace period) */
+        RCU_INIT_POINTER(dev->iv_cache[evicted->psi], NULL);
+        shard->nr_entries -= 1;
+        shard->nr_idle -= 1;
+        /* Pull it out of the CLOCK list */
+        __list_del_entry(&evicted->clock_node);
+
+        /* Destroy it (just a free, since it's clean) */
         err = sflc_dev_destroyIvCacheEntry(dev, evicted);
         if (err) {
                 pr_err("Could not evict cache entry for PSI %u; error %d\n", evicted->psi, err);
                 goto err_destroy_entry;
         }
-        /* We just altered the condition someone might be sleeping for: tell the waitqueue */
-        wake_up_interruptible(&dev->iv_cache_waitqueue);
-
-out:
-        /* Yield the lock */
-        mutex_unlock(&dev->iv_cache_lock);
 
         return 0;
 
 
 err_destroy_entry:
         /* Add it back to the list */
-        list_add(&evicted->lru_node, &dev->iv_lru_list);
+        list_add(&evicted->clock_node, &shard->clock_list);
         /* Add it back to the cache */
-        dev->iv_cache[evicted->psi] = evicted;
-        dev->iv_cache_nr_entries+= 1;
-        
-        mutex_unlock(&dev->iv_cache_lock);
-err_lock_cache:
+        rcu_assign_pointer(dev->iv_cache[evicted->psi], evicted);
+        shard->nr_entries += 1;
+        shard->nr_idle += 1;
+
         return err;
 }
 
-/* Flush all dirty IV blocks */
-void sflc_dev_flushIvs(sflc_Device * dev)
+/* True if the entry can be dropped without writing it. Caller holds the shard lock. */
+static bool sflc_dev_ivEntryIsClean(sflc_dev_IvCacheEntry * entry)
 {
-	sflc_dev_IvCacheEntry * entry, * _next;
-        int err;
+        if (test_bit(SFLC_DEV_IV_WRITEBACK, &entry->flags)) {
+                return false;
+        }
+        /* A failed writeback leaves the entry dirty */
+        if (test_and_clear_bit(SFLC_DEV_IV_WB_ERROR, &entry->flags)) {
+                entry->dirtyness += 1;
+        }
 
-        /* Iterate over all entries */
-        list_for_each_entry_safe(entry, _next, &dev->iv_lru_list, lru_node) {
-                /* Pop it from the list */
-                __list_del_entry(&entry->lru_node);
+        return entry->dirtyness == 0;
+}
 
-                /* Destroy it */
-                err = sflc_dev_destroyIvCacheEntry(dev, entry);
-                if (err) {
-                        pr_err("Could not destroy IV cache entry for PSI %u; error %d\n", entry->psi, err);
-                }
+/* Snapshot the IV block into a bounce page and submit it for writing. The entry counts as clean
+   as soon as the write completes, unless it's dirtied again in the meantime.
+   Caller holds the shard lock, and the entry must not be under writeback already. */
+static int sflc_dev_startIvWriteback(sflc_dev_IvCacheEntry * entry)
+{
+        sflc_Device * dev = entry->dev;
+        struct page * bounce_page;
+        struct bio * bio;
+
+        /* Allocate bounce page */
+        bounce_page = mempool_alloc(sflc_pools_ivPagePool, GFP_NOIO);
+        if (!bounce_page) {
+                pr_err("Could not allocate bounce page\n");
+                return -ENOMEM;
+        }
+        /* Allocate bio */
+        bio = bio_alloc_bioset(GFP_NOIO, 1, &sflc_pools_bioset);
+        if (!bio) {
+                pr_err("Could not allocate bio\n");
+                mempool_free(bounce_page, sflc_pools_ivPagePool);
+                return -ENOMEM;
         }
+
+        /* Snapshot the IVs */
+        memcpy(page_address(bounce_page), page_address(entry->iv_page), SFLC_DEV_SECTOR_SIZE);
+        entry->dirtyness = 0;
+        set_bit(SFLC_DEV_IV_WRITEBACK, &entry->flags);
+        atomic_inc(&dev->iv_wb_inflight);
+
+        /* Set real backing device */
+        bio_set_dev(bio, dev->real_dev->bdev);
+        /* Set sector */
+        bio->bi_iter.bi_sector = sflc_dev_psiToIvBlockSector(entry->psi) * SFLC_DEV_SECTOR_SCALE;
+        /* Set flags */
+        bio->bi_opf = REQ_OP_WRITE;
+        /* Add page (can't fail on a fresh bio) */
+        bio_add_page(bio, bounce_page, SFLC_DEV_SECTOR_SIZE, 0);
+        /* Set completion */
+        bio->bi_private = entry;
+        bio->bi_end_io = sflc_dev_ivWritebackEndIo;
+
+        /* Submit */
+        submit_bio(bio);
+
+        return 0;
 }
 
-/*****************************************************
- *           PRIVATE FUNCTIONS PROTOTYPES            *
- *****************************************************/
+/* Completion of an IV block writeback. Runs in interrupt context: only atomic bitops on the entry */
+static void sflc_dev_ivWritebackEndIo(struct bio * bio)
+{
+        sflc_dev_IvCacheEntry * entry = bio->bi_private;
+        sflc_Device * dev = entry->dev;
+        sflc_dev_IvCacheShard * shard = sflc_dev_ivShard(dev, entry->psi);
+        unsigned long flags;
+
+        /* Remember the failure, the entry will be considered dirty again */
+        if (bio->bi_status) {
+                pr_err("Could not write back IV block for PSI %u; error %d\n", entry->psi, blk_status_to_errno(bio->bi_status));
+                set_bit(SFLC_DEV_IV_WB_ERROR, &entry->flags);
+        }
+
+        /* Free the bounce page and the bio */
+        mempool_free(bio_first_page_all(bio), sflc_pools_ivPagePool);
+        bio_put(bio);
+
+        /* The entry is evictable again */
+        smp_mb__before_atomic();
+        clear_bit(SFLC_DEV_IV_WRITEBACK, &entry->flags);
+        atomic_inc(&shard->events);
+        wake_up_interruptible(&shard->waitqueue);
+
+        /* Tell the flush if we were the last one (under the waitqueue lock: the device can
+           go away as soon as the flush sees the count drop, see sflc_dev_flushIvs()) */
+        spin_lock_irqsave(&dev->iv_wb_waitqueue.lock, flags);
+        if (atomic_dec_and_test(&dev->iv_wb_inflight)) {
+                wake_up_locked(&dev->iv_wb_waitqueue);
+        }
+        spin_unlock_irqrestore(&dev->iv_wb_waitqueue.lock, flags);
+}
+
+/* Completion of an IV block read ahead. Runs in interrupt context. */
+static void sflc_dev_ivPrefetchEndIo(struct bio * bio)
+{
+        sflc_dev_IvPrefetch * pf = bio->bi_private;
+
+        pf->status = bio->bi_status;
+        bio_put(bio);
+
+        /* Wake up the entry waiting to adopt it, if any */
+        complete(&pf->done);
+        sflc_dev_putIvPrefetch(pf);
+}
+
+/* Take the prefetch of the PSI out of the table (the caller gets its reference). NULL if none. */
+static sflc_dev_IvPrefetch * sflc_dev_takeIvPrefetch(sflc_Device * dev, u32 psi)
+{
+        sflc_dev_IvPrefetch * pf = xa_erase(&dev->iv_prefetch, psi);
+
+        if (pf) {
+                atomic_dec(&dev->iv_prefetch_nr);
+        }
+
+        return pf;
+}
+
+/* Drop a reference to the prefetch: the last one frees it */
+static void sflc_dev_putIvPrefetch(sflc_dev_IvPrefetch * pf)
+{
+        if (atomic_dec_and_test(&pf->refs)) {
+                mempool_free(pf->page, sflc_pools_ivPagePool);
+                kfree(pf);
+        }
+}
+
+/* Drop the next prefetch after the cursor (wrapping around): adopted ones leave the table, so those
+   left behind the cursor for a whole round are likely never to be */
+static void sflc_dev_recycleIvPrefetch(sflc_Device * dev)
+{
+        unsigned long index = READ_ONCE(dev->iv_prefetch_cursor);
+
+        if (!xa_find(&dev->iv_prefetch, &index, ULONG_MAX, XA_PRESENT)) {
+                index = 0;
+                if (!xa_find(&dev->iv_prefetch, &index, ULONG_MAX, XA_PRESENT)) {
+                        return;
+                }
+        }
+        WRITE_ONCE(dev->iv_prefetch_cursor, index + 1);
+
+        sflc_dev_dropIvPrefetch(dev, index);
+}
 
 static sflc_dev_IvCacheEntry * sflc_dev_newIvCacheEntry(sflc_Device * dev, u32 psi)
 {
         sflc_dev_IvCacheEntry * entry;
+        sflc_dev_IvPrefetch * pf;
+        bool prefetched = false;
         int err;
         sector_t sector;
 
@@ -253,27 +750,43 @@ static sflc_dev_IvCacheEntry * sflc_dev_newIvCacheEntry(sflc_Device * dev, u32 p
                 goto err_alloc_entry;
         }
 
-        /* Set PSI */
+        /* Set device and PSI */
+        entry->dev = dev;
         entry->psi = psi;
         /* Allocate page */
-        entry->iv_page = mempool_alloc(sflc_pools_pagePool, GFP_NOIO);
+        entry->iv_page = mempool_alloc(sflc_pools_ivPagePool, GFP_NOIO);
         if (!entry->iv_page) {
                 pr_err("Could not allocate IV page\n");
                 err = -ENOMEM;
                 goto err_alloc_page;
         }
+        /* Swap it with the IV block read ahead, if there is one (waiting for the read to finish) */
+        pf = sflc_dev_takeIvPrefetch(dev, psi);
+        if (pf) {
+                wait_for_completion(&pf->done);
+                if (!pf->status) {
+                        swap(entry->iv_page, pf->page);
+                        prefetched = true;
+                }
+                sflc_dev_putIvPrefetch(pf);
+        }
         /* Kmap it */
         kmap(entry->iv_page);
 
-        /* Clear refcount and dirtyness */
+        /* Clear refcount, dirtyness, and referenced bit */
         entry->refcnt = 0;
         entry->dirtyness = 0;
+        entry->referenced = false;
+        entry->flags = 0;
 
         /* Init list node */
-        INIT_LIST_HEAD(&entry->lru_node);
+        INIT_LIST_HEAD(&entry->clock_node);
 
 
-        /* Read from disk */
+        /* Read from disk (unless it already was) */
+        if (prefetched) {
+                return entry;
+        }
 
         /* Position on disk */
         sector = sflc_dev_psiToIvBlockSector(psi);
@@ -290,7 +803,7 @@ static sflc_dev_IvCacheEntry * sflc_dev_newIvCacheEntry(sflc_Device * dev, u32 p
 
 err_read:
         kunmap(entry->iv_page);
-        mempool_free(entry->iv_page, sflc_pools_pagePool);
+        mempool_free(entry->iv_page, sflc_pools_ivPagePool);
 err_alloc_page:
         kmem_cache_free(sflc_pools_ivSlab, entry);
 err_alloc_entry:
@@ -307,8 +820,8 @@ static int sflc_dev_destroyIvCacheEntry(sflc_Device * dev, sflc_dev_IvCacheEntry
         /* Position on disk */
         sector = sflc_dev_psiToIvBlockSector(entry->psi);
 
-        /* Write (if necessary) */
-        if (entry->dirtyness) {
+        /* Write (if necessary, also if the last writeback failed) */
+        if (entry->dirtyness || test_bit(SFLC_DEV_IV_WB_ERROR, &entry->flags)) {
                 err = sflc_dev_rwSector(dev, entry->iv_page, sector, WRITE);
                 if (err) {
                         pr_err("Could not write IV block to disk; error %d\n", err);
@@ -321,11 +834,16 @@ static int sflc_dev_destroyIvCacheEntry(sflc_Device * dev, sflc_dev_IvCacheEntry
 
         /* Kunmap page */
         kunmap(entry->iv_page);
-        /* Free it */
-        mempool_free(entry->iv_page, sflc_pools_pagePool);
-
-        /* Free structure */
-        kmem_cache_free(sflc_pools_ivSlab, entry);
+        /* Free it, and the structure, once no lockless reader can be looking */
+        call_rcu(&entry->rcu, sflc_dev_freeIvCacheEntryRcu);
 
         return 0;
 }
+
+static void sflc_dev_freeIvCacheEntryRcu(struct rcu_head * rcu)
+{
+        sflc_dev_IvCacheEntry * entry = container_of(rcu, sflc_dev_IvCacheEntry, rcu);
+
+        mempool_free(entry->iv_page, sflc_pools_ivPagePool);
+        kmem_cache_free(sflc_pools_ivSlab, entry);
+}
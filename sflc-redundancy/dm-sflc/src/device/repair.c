@@ -0,0 +1,674 @@
+/*
+ *  Copyright The Shufflecake Project Authors (2022)
+ *  Copyright The Shufflecake Project Contributors (2022)
+ *  Copyright Contributors to the The Shufflecake Project.
+ *
+ *  See the AUTHORS file at the top-level directory of this distribution and at
+ *  <https://www.shufflecake.net/permalinks/shufflecake-userland/AUTHORS>
+ *
+ *  This file is part of the program dm-sflc, which is part of the Shufflecake
+ *  Project. Shufflecake is a plausible deniability (hidden storage) layer for
+ *  Linux. See <https://www.shufflecake.net>.
+ *
+ *  This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version. This program is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ *  Public License for more details. You should have received a copy of the
+ *  GNU General Public License along with this program.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file only implements the slice repair daemon.
+ * The corrupted slices found when opening the volumes are queued here,
+ * and rebuilt by a per-device kernel thread once the volumes are live:
+ * the donor slice is read in large batches, re-encrypted under the
+ * receiver's key (with fresh IVs), and written onto the receiver slice.
+ * I/O to a receiver slice is held back until it is rebuilt, and the
+ * slice jumps to the head of the queue.
+ * The stale lazy replicas are brought up to date the same way, and the
+ * slices of parity volumes are rebuilt from the rest of their stripe.
+ */
+
+/*****************************************************
+ *                  INCLUDE SECTION                  *
+ *****************************************************/
+
+#include <linux/kthread.h>
+
+#include "device.h"
+#include "crypto/rand/rand.h"
+#include "utils/pools.h"
+#include "utils/workqueues.h"
+#include "log/log.h"
+
+/*****************************************************
+ *                     CONSTANTS                     *
+ *****************************************************/
+
+#define SFLC_DEV_REPAIR_THREAD_NAME "sflc_repair"
+
+/* How long a kick waits for the device lock to be free, before trying again */
+#define SFLC_DEV_REPAIR_KICK_RETRY_MS 100
+
+/*****************************************************
+ *           PRIVATE FUNCTIONS PROTOTYPES            *
+ *****************************************************/
+
+static int sflc_dev_queueJob(sflc_Device * dev, u8 donor_vol, u32 donor_lsi, u8 receiver_vol, u32 receiver_lsi, bool resync, bool rebuild);
+static int sflc_dev_repairThreadFn(void * data);
+static sflc_dev_RepairJob * sflc_dev_nextRepairJob(sflc_Device * dev);
+static void sflc_dev_finishRepairJob(sflc_Device * dev, sflc_dev_RepairJob * job, int err);
+static int sflc_dev_repairSlice(sflc_Device * dev, sflc_dev_RepairJob * job);
+static int sflc_dev_rwRepairBatch(sflc_Device * dev, u32 psi, u32 off_in_slice, int rw);
+static bool sflc_dev_holdForRepair(sflc_Device * dev, u8 vol_idx, u32 lsi, struct bio * bio, sflc_vol_WriteWork * write_work);
+static void sflc_dev_resubmitHeld(sflc_Device * dev, sflc_dev_RepairJob * job);
+static bool sflc_dev_repairInvolves(sflc_Device * dev, u8 vol_idx);
+static void sflc_dev_freeRepairPages(sflc_Device * dev);
+
+/* Jobs are indexed by receiver volume and LSI */
+static inline unsigned long sflc_dev_repairKey(u8 vol_idx, u32 lsi)
+{
+	return (unsigned long) vol_idx * SFLC_DEV_MAX_SLICES + lsi;
+}
+
+/*****************************************************
+ *           PUBLIC FUNCTIONS DEFINITIONS            *
+ *****************************************************/
+
+/* Queues the copy of the donor slice onto the receiver slice. Returns < 0 if error. */
+int sflc_dev_queueRepair(sflc_Device * dev, u8 donor_vol, u32 donor_lsi, u8 receiver_vol, u32 receiver_lsi)
+{
+	return sflc_dev_queueJob(dev, donor_vol, donor_lsi, receiver_vol, receiver_lsi, false, false);
+}
+
+/* Same, to bring a stale lazy replica up to date. Returns < 0 if error. */
+int sflc_dev_queueResync(sflc_Device * dev, u8 donor_vol, u32 donor_lsi, u8 receiver_vol, u32 receiver_lsi)
+{
+	return sflc_dev_queueJob(dev, donor_vol, donor_lsi, receiver_vol, receiver_lsi, true, false);
+}
+
+/* Same, to rebuild the slice of a parity volume from the rest of its stripe. Returns < 0 if error. */
+int sflc_dev_queueRebuild(sflc_Device * dev, u8 vol_idx, u32 lsi)
+{
+	return sflc_dev_queueJob(dev, vol_idx, lsi, vol_idx, lsi, false, true);
+}
+
+/* Starts the repair daemon, if there is anything to repair. Returns < 0 if error. */
+int sflc_dev_startRepair(sflc_Device * dev)
+{
+	struct task_struct * thread;
+	int err;
+	int i;
+
+	/* Already running: just poke it */
+	if (dev->repair_thread) {
+		wake_up_all(&dev->repair_waitqueue);
+		return 0;
+	}
+	/* Nothing to do */
+	if (READ_ONCE(dev->repair_pending) == 0) {
+		return 0;
+	}
+
+	/* Allocate the copy buffer */
+	for (i = 0; i < SFLC_DEV_REPAIR_BATCH; i++) {
+		dev->repair_pages[i] = alloc_page(GFP_KERNEL);
+		if (!dev->repair_pages[i]) {
+			pr_err("Could not allocate repair buffer\n");
+			err = -ENOMEM;
+			goto err_alloc_pages;
+		}
+	}
+
+	/* Create the thread */
+	thread = kthread_run(sflc_dev_repairThreadFn, dev, SFLC_DEV_REPAIR_THREAD_NAME);
+	if (IS_ERR(thread)) {
+		err = PTR_ERR(thread);
+		pr_err("Could not start repair thread; error %d\n", err);
+		goto err_kthread;
+	}
+	dev->repair_thread = thread;
+
+	pr_info("Started repairing %u slices in the background\n", READ_ONCE(dev->repair_pending));
+
+	return 0;
+
+
+err_kthread:
+err_alloc_pages:
+	sflc_dev_freeRepairPages(dev);
+	return err;
+}
+
+/* Stops the repair daemon, and drops the jobs left. */
+void sflc_dev_stopRepair(sflc_Device * dev)
+{
+	sflc_dev_RepairJob * job;
+	sflc_dev_RepairJob * tmp;
+	LIST_HEAD(dropped);
+
+	/* No more kicks: nothing can queue jobs anymore */
+	cancel_delayed_work_sync(&dev->repair_kick_work);
+
+	/* Stop the thread (it finishes the slice it's on) */
+	if (dev->repair_thread) {
+		kthread_stop(dev->repair_thread);
+		dev->repair_thread = NULL;
+	}
+	sflc_dev_freeRepairPages(dev);
+
+	/* Take the jobs left out of the queue, like sflc_dev_cancelRepairs() (no volume should be
+	   left to queue or hold back I/O, but this doesn't rely on it) */
+	spin_lock(&dev->repair_lock);
+	list_for_each_entry_safe(job, tmp, &dev->repair_queue, queue_node) {
+		list_move_tail(&job->queue_node, &dropped);
+		xa_erase(&dev->repair_jobs, sflc_dev_repairKey(job->receiver_vol, job->receiver_lsi));
+		dev->repair_pending -= 1;
+		dev->repair_held -= job->nr_held;
+	}
+	spin_unlock(&dev->repair_lock);
+
+	/* And drop them, letting their I/O through */
+	list_for_each_entry_safe(job, tmp, &dropped, queue_node) {
+		list_del(&job->queue_node);
+		sflc_dev_resubmitHeld(dev, job);
+		kfree(job);
+	}
+	xa_destroy(&dev->repair_jobs);
+
+	return;
+}
+
+/* Starts the repair daemon in the background (it needs the device lock). */
+void sflc_dev_kickRepair(sflc_Device * dev)
+{
+	queue_delayed_work(sflc_queues_writeQueue, &dev->repair_kick_work, 0);
+}
+
+/* The device lock is taken while a volume comes or goes (which may wait on this very workqueue):
+   if it's taken, try again later */
+void sflc_dev_repairKickWorkFn(struct work_struct * work)
+{
+	sflc_Device * dev = container_of(to_delayed_work(work), sflc_Device, repair_kick_work);
+	int err;
+
+	if (down_trylock(&sflc_dev_mutex)) {
+		queue_delayed_work(sflc_queues_writeQueue, &dev->repair_kick_work, msecs_to_jiffies(SFLC_DEV_REPAIR_KICK_RETRY_MS));
+		return;
+	}
+	err = sflc_dev_startRepair(dev);
+	up(&sflc_dev_mutex);
+	if (err) {
+		pr_err("Could not start the repair daemon; error %d\n", err);
+	}
+}
+
+/* Drops the jobs involving the volume, and waits for the one in progress (if it does). */
+void sflc_dev_cancelRepairs(sflc_Device * dev, u8 vol_idx)
+{
+	sflc_dev_RepairJob * job;
+	sflc_dev_RepairJob * tmp;
+	LIST_HEAD(dropped);
+
+	/* Take the jobs out of the queue */
+	spin_lock(&dev->repair_lock);
+	list_for_each_entry_safe(job, tmp, &dev->repair_queue, queue_node) {
+		if (job->donor_vol != vol_idx && job->receiver_vol != vol_idx) {
+			continue;
+		}
+		list_move_tail(&job->queue_node, &dropped);
+		xa_erase(&dev->repair_jobs, sflc_dev_repairKey(job->receiver_vol, job->receiver_lsi));
+		dev->repair_pending -= 1;
+		dev->repair_failed += 1;
+		dev->repair_held -= job->nr_held;
+	}
+	spin_unlock(&dev->repair_lock);
+
+	/* Let their I/O through (the receiver is still live only if the donor is going away) */
+	list_for_each_entry_safe(job, tmp, &dropped, queue_node) {
+		pr_warn("Volume %d going away: slice %u of volume %d won't be repaired\n",
+				vol_idx + 1, job->receiver_lsi, job->receiver_vol + 1);
+		list_del(&job->queue_node);
+		sflc_dev_resubmitHeld(dev, job);
+		kfree(job);
+	}
+
+	/* Wait for the slice in progress */
+	wait_event(dev->repair_waitqueue, !sflc_dev_repairInvolves(dev, vol_idx));
+
+	return;
+}
+
+/* Return true if the slice is waiting for repair: the bio is then resubmitted (the write
+   work requeued) once it's done */
+bool sflc_dev_deferReadToRepair(sflc_Device * dev, u8 vol_idx, u32 lsi, struct bio * bio)
+{
+	return sflc_dev_holdForRepair(dev, vol_idx, lsi, bio, NULL);
+}
+
+bool sflc_dev_deferWriteToRepair(sflc_Device * dev, u8 vol_idx, u32 lsi, sflc_vol_WriteWork * write_work)
+{
+	return sflc_dev_holdForRepair(dev, vol_idx, lsi, NULL, write_work);
+}
+
+/* Returns true if the slice is waiting for repair, or being repaired */
+bool sflc_dev_repairIsQueued(sflc_Device * dev, u8 vol_idx, u32 lsi)
+{
+	bool ret;
+
+	spin_lock(&dev->repair_lock);
+	ret = (xa_load(&dev->repair_jobs, sflc_dev_repairKey(vol_idx, lsi)) != NULL);
+	spin_unlock(&dev->repair_lock);
+
+	return ret;
+}
+
+/* Sleeps off what's left of the batch's time budget, unless some I/O is held back */
+void sflc_dev_throttleRepair(sflc_Device * dev, unsigned long batch_start)
+{
+	u32 max_kbps = READ_ONCE(dev->repair_max_kbps);
+	unsigned long budget;
+	unsigned long elapsed;
+
+	/* No cap */
+	if (max_kbps == 0) {
+		return;
+	}
+	/* Somebody is waiting */
+	if (READ_ONCE(dev->repair_held)) {
+		return;
+	}
+
+	budget = msecs_to_jiffies(DIV_ROUND_UP(SFLC_DEV_REPAIR_BATCH * (SFLC_DEV_SECTOR_SIZE / 1024) * 1000, max_kbps));
+	elapsed = jiffies - batch_start;
+	if (elapsed >= budget) {
+		return;
+	}
+
+	/* Woken up early by held I/O */
+	wait_event_interruptible_timeout(dev->repair_waitqueue,
+			kthread_should_stop() || READ_ONCE(dev->repair_held), budget - elapsed);
+
+	return;
+}
+
+/*****************************************************
+ *          PRIVATE FUNCTIONS DEFINITIONS            *
+ *****************************************************/
+
+/* Allocates, indexes, and enqueues a job. Returns < 0 if error. */
+static int sflc_dev_queueJob(sflc_Device * dev, u8 donor_vol, u32 donor_lsi, u8 receiver_vol, u32 receiver_lsi, bool resync, bool rebuild)
+{
+	sflc_dev_RepairJob * job;
+	int err;
+
+	/* Also reached from the write path: don't recurse into the I/O we're doing */
+	job = kzalloc(sizeof(sflc_dev_RepairJob), GFP_NOIO);
+	if (!job) {
+		pr_err("Could not allocate repair job\n");
+		return -ENOMEM;
+	}
+	job->donor_vol = donor_vol;
+	job->receiver_vol = receiver_vol;
+	job->donor_lsi = donor_lsi;
+	job->receiver_lsi = receiver_lsi;
+	job->resync = resync;
+	job->rebuild = rebuild;
+	bio_list_init(&job->reads);
+	INIT_LIST_HEAD(&job->writes);
+	job->nr_held = 0;
+	INIT_LIST_HEAD(&job->queue_node);
+
+	/* Index it (a slice is only repaired once) */
+	err = xa_insert(&dev->repair_jobs, sflc_dev_repairKey(receiver_vol, receiver_lsi), job, GFP_NOIO);
+	if (err == -EBUSY) {
+		pr_debug("Slice %u of volume %d already queued for repair\n", receiver_lsi, receiver_vol + 1);
+		kfree(job);
+		return 0;
+	}
+	if (err) {
+		pr_err("Could not index repair job; error %d\n", err);
+		kfree(job);
+		return err;
+	}
+
+	/* Enqueue it */
+	spin_lock(&dev->repair_lock);
+	list_add_tail(&job->queue_node, &dev->repair_queue);
+	dev->repair_pending += 1;
+	spin_unlock(&dev->repair_lock);
+
+	return 0;
+}
+
+/* Main loop of the repair daemon */
+static int sflc_dev_repairThreadFn(void * data)
+{
+	sflc_Device * dev = data;
+	sflc_dev_RepairJob * job;
+	int err;
+
+	while (!kthread_should_stop()) {
+		sflc_Volume * donor;
+		bool resync;
+
+		job = sflc_dev_nextRepairJob(dev);
+		if (!job) {
+			continue;
+		}
+
+		/* Writes to the primary landing from now on will be copied by the next resync */
+		donor = dev->vol[job->donor_vol];
+		if (job->resync && donor) {
+			sflc_vol_beginResync(donor, job->donor_lsi);
+		}
+
+		err = sflc_dev_repairSlice(dev, job);
+		if (err) {
+			pr_err("Could not repair slice %u of volume %d from slice %u of volume %d; error %d\n",
+					job->receiver_lsi, job->receiver_vol + 1, job->donor_lsi, job->donor_vol + 1, err);
+		}
+
+		resync = job->resync;
+		if (resync && donor) {
+			sflc_vol_endResync(donor, job->donor_lsi, err);
+		}
+		sflc_dev_finishRepairJob(dev, job, err);
+
+		/* Resyncs come and go all the time, only the repairs are worth a line */
+		if (READ_ONCE(dev->repair_pending) == 0 && !resync) {
+			pr_info("Background repair finished: %u slices repaired, %u failed\n",
+					READ_ONCE(dev->repair_done), READ_ONCE(dev->repair_failed));
+		}
+	}
+
+	return 0;
+}
+
+/* Waits for a job and makes it the current one. Returns NULL if the thread has to stop. */
+static sflc_dev_RepairJob * sflc_dev_nextRepairJob(sflc_Device * dev)
+{
+	sflc_dev_RepairJob * job;
+
+	wait_event_interruptible(dev->repair_waitqueue,
+			kthread_should_stop() || !list_empty_careful(&dev->repair_queue));
+	if (kthread_should_stop()) {
+		return NULL;
+	}
+
+	spin_lock(&dev->repair_lock);
+	job = list_first_entry_or_null(&dev->repair_queue, sflc_dev_RepairJob, queue_node);
+	if (job) {
+		list_del_init(&job->queue_node);
+		dev->repair_current = job;
+	}
+	spin_unlock(&dev->repair_lock);
+
+	return job;
+}
+
+/* Retires the current job, and lets its held I/O through */
+static void sflc_dev_finishRepairJob(sflc_Device * dev, sflc_dev_RepairJob * job, int err)
+{
+	spin_lock(&dev->repair_lock);
+	xa_erase(&dev->repair_jobs, sflc_dev_repairKey(job->receiver_vol, job->receiver_lsi));
+	dev->repair_current = NULL;
+	dev->repair_pending -= 1;
+	if (err) {
+		dev->repair_failed += 1;
+	} else {
+		dev->repair_done += 1;
+	}
+	dev->repair_held -= job->nr_held;
+	spin_unlock(&dev->repair_lock);
+
+	/* Nobody can add I/O anymore. It keeps the receiver from being suspended, so it's still there */
+	sflc_dev_resubmitHeld(dev, job);
+	kfree(job);
+
+	/* For those waiting to cancel */
+	wake_up_all(&dev->repair_waitqueue);
+
+	return;
+}
+
+/* Copies the donor slice onto the receiver slice, re-encrypting it. Returns < 0 if error. */
+static int sflc_dev_repairSlice(sflc_Device * dev, sflc_dev_RepairJob * job)
+{
+	/* Volumes can't go away while their job is the current one */
+	sflc_Volume * donor = dev->vol[job->donor_vol];
+	sflc_Volume * receiver = dev->vol[job->receiver_vol];
+	u32 donor_psi;
+	u32 receiver_psi;
+	u8 * donor_ivs;
+	u8 * receiver_ivs;
+	u8 iv[SFLC_SK_IV_LEN];
+	unsigned long batch_start;
+	u32 off_in_slice;
+	int err;
+	int i;
+
+	if (!donor || !receiver) {
+		return -ENODEV;
+	}
+
+	/* Parity volumes have no replica to copy from */
+	if (job->rebuild) {
+		return sflc_vol_rebuildFromParity(receiver, job->receiver_lsi);
+	}
+
+	/* Both slices are mapped (the receiver was given a fresh PSI when queued) */
+	donor_psi = READ_ONCE(donor->fmap[job->donor_lsi]);
+	receiver_psi = READ_ONCE(receiver->fmap[job->receiver_lsi]);
+	if (donor_psi == SFLC_VOL_FMAP_INVALID_PSI || receiver_psi == SFLC_VOL_FMAP_INVALID_PSI) {
+		return -ENXIO;
+	}
+
+	/* The IV blocks go through the cache, which may hold newer IVs than the disk */
+	donor_ivs = sflc_dev_getIvBlockRef(dev, donor_psi, READ);
+	if (IS_ERR(donor_ivs)) {
+		err = PTR_ERR(donor_ivs);
+		pr_err("Could not acquire reference to donor IV block; error %d\n", err);
+		goto err_donor_ivs;
+	}
+	receiver_ivs = sflc_dev_getIvBlockRef(dev, receiver_psi, WRITE);
+	if (IS_ERR(receiver_ivs)) {
+		err = PTR_ERR(receiver_ivs);
+		pr_err("Could not acquire reference to receiver IV block; error %d\n", err);
+		goto err_receiver_ivs;
+	}
+
+	/* The whole receiver slice is rewritten: fresh IVs for all of it */
+	err = sflc_rand_getBytes(receiver_ivs, SFLC_DEV_SECTOR_SIZE);
+	if (err) {
+		pr_err("Could not sample IVs; error %d\n", err);
+		goto err_sample_ivs;
+	}
+
+	for (off_in_slice = 0; off_in_slice < SFLC_VOL_LOG_SLICE_SIZE; off_in_slice += SFLC_DEV_REPAIR_BATCH) {
+		batch_start = jiffies;
+
+		/* Read a batch of donor blocks */
+		err = sflc_dev_rwRepairBatch(dev, donor_psi, off_in_slice, READ);
+		if (err) {
+			pr_err("Could not read donor blocks at offset %u; error %d\n", off_in_slice, err);
+			goto err_batch;
+		}
+
+		/* Re-encrypt them in place, under the receiver's key */
+		for (i = 0; i < SFLC_DEV_REPAIR_BATCH; i++) {
+			u8 * block = kmap(dev->repair_pages[i]);
+
+			/* The crypto API updates the IV in place, so work on a copy */
+			memcpy(iv, donor_ivs + ((off_in_slice + i) * SFLC_SK_IV_LEN), SFLC_SK_IV_LEN);
+			err = sflc_sk_decrypt(donor->skctx, block, block, SFLC_DEV_SECTOR_SIZE, iv);
+			if (!err) {
+				memcpy(iv, receiver_ivs + ((off_in_slice + i) * SFLC_SK_IV_LEN), SFLC_SK_IV_LEN);
+				err = sflc_sk_encrypt(receiver->skctx, block, block, SFLC_DEV_SECTOR_SIZE, iv);
+			}
+			kunmap(dev->repair_pages[i]);
+			if (err) {
+				pr_err("Could not re-encrypt block at offset %u; error %d\n", off_in_slice + i, err);
+				goto err_batch;
+			}
+		}
+
+		/* Write them to the receiver */
+		err = sflc_dev_rwRepairBatch(dev, receiver_psi, off_in_slice, WRITE);
+		if (err) {
+			pr_err("Could not write receiver blocks at offset %u; error %d\n", off_in_slice, err);
+			goto err_batch;
+		}
+
+		sflc_dev_throttleRepair(dev, batch_start);
+	}
+
+	/* The receiver has the same blocks written as the donor */
+	sflc_vol_copyWritten(donor, job->donor_lsi, receiver, job->receiver_lsi);
+
+	/* No error if we made it here */
+	err = 0;
+
+err_batch:
+err_sample_ivs:
+	sflc_dev_putIvBlockRef(dev, receiver_psi);
+err_receiver_ivs:
+	sflc_dev_putIvBlockRef(dev, donor_psi);
+err_donor_ivs:
+	return err;
+}
+
+/* Synchronously reads/writes a batch of data blocks of a physical slice from/to the copy buffer */
+static int sflc_dev_rwRepairBatch(sflc_Device * dev, u32 psi, u32 off_in_slice, int rw)
+{
+	struct bio * bio;
+	sector_t sector;
+	int err;
+	int i;
+
+	/* Allocate bio */
+	bio = bio_alloc_bioset(GFP_NOIO, SFLC_DEV_REPAIR_BATCH, &sflc_pools_bioset);
+	if (!bio) {
+		pr_err("Could not allocate bio\n");
+		return -ENOMEM;
+	}
+
+	/* Skip the header, the previous slices, and the IV block */
+	sector = SFLC_DEV_HEADER_SIZE + ((sector_t) psi * SFLC_DEV_PHYS_SLICE_SIZE) + 1 + off_in_slice;
+
+	/* Set real backing device */
+	bio_set_dev(bio, dev->real_dev->bdev);
+	/* Set sector */
+	bio->bi_iter.bi_sector = sector * SFLC_DEV_SECTOR_SCALE;
+	/* Set flags */
+	bio->bi_opf = ((rw == READ) ? REQ_OP_READ : REQ_OP_WRITE);
+	/* Add pages */
+	for (i = 0; i < SFLC_DEV_REPAIR_BATCH; i++) {
+		if (!bio_add_page(bio, dev->repair_pages[i], SFLC_DEV_SECTOR_SIZE, 0)) {
+			pr_err("Catastrophe: could not add page to bio! WTF?\n");
+			err = -EINVAL;
+			goto out;
+		}
+	}
+
+	/* Submit */
+	err = submit_bio_wait(bio);
+
+out:
+	bio_put(bio);
+	return err;
+}
+
+/* Holds back a read bio or a write work, if the slice is waiting for repair */
+static bool sflc_dev_holdForRepair(sflc_Device * dev, u8 vol_idx, u32 lsi, struct bio * bio, sflc_vol_WriteWork * write_work)
+{
+	sflc_dev_RepairJob * job;
+
+	/* Fast path: nothing to repair */
+	if (likely(READ_ONCE(dev->repair_pending) == 0)) {
+		return false;
+	}
+
+	spin_lock(&dev->repair_lock);
+	job = xa_load(&dev->repair_jobs, sflc_dev_repairKey(vol_idx, lsi));
+	if (!job) {
+		spin_unlock(&dev->repair_lock);
+		return false;
+	}
+	/* Hold the I/O back */
+	if (write_work) {
+		list_add_tail(&write_work->held_node, &job->writes);
+	} else {
+		bio_list_add(&job->reads, bio);
+	}
+	job->nr_held += 1;
+	dev->repair_held += 1;
+	/* And have the slice jump the queue */
+	if (job != dev->repair_current) {
+		list_move(&job->queue_node, &dev->repair_queue);
+	}
+	spin_unlock(&dev->repair_lock);
+
+	/* Wake the daemon up, also from its throttling */
+	wake_up_all(&dev->repair_waitqueue);
+
+	return true;
+}
+
+/* Passes the I/O held back by a retired job on: reads to the receiver volume, writes to the write queue */
+static void sflc_dev_resubmitHeld(sflc_Device * dev, sflc_dev_RepairJob * job)
+{
+	sflc_Volume * vol = dev->vol[job->receiver_vol];
+	sflc_vol_WriteWork * write_work;
+	sflc_vol_WriteWork * tmp;
+	struct bio * bio;
+
+	while ((bio = bio_list_pop(&job->reads))) {
+		if (vol) {
+			sflc_vol_doRead(vol, bio);
+		} else {
+			bio_io_error(bio);
+		}
+	}
+
+	/* The write works still know their volumes (and mirror) */
+	list_for_each_entry_safe(write_work, tmp, &job->writes, held_node) {
+		list_del(&write_work->held_node);
+		queue_work(sflc_queues_writeQueue, &write_work->work);
+	}
+
+	return;
+}
+
+/* Returns true if the job in progress involves the volume */
+static bool sflc_dev_repairInvolves(sflc_Device * dev, u8 vol_idx)
+{
+	sflc_dev_RepairJob * job;
+	bool ret;
+
+	spin_lock(&dev->repair_lock);
+	job = dev->repair_current;
+	ret = job && (job->donor_vol == vol_idx || job->receiver_vol == vol_idx);
+	spin_unlock(&dev->repair_lock);
+
+	return ret;
+}
+
+/* Frees the copy buffer */
+static void sflc_dev_freeRepairPages(sflc_Device * dev)
+{
+	int i;
+
+	for (i = 0; i < SFLC_DEV_REPAIR_BATCH; i++) {
+		if (dev->repair_pages[i]) {
+			__free_page(dev->repair_pages[i]);
+			dev->repair_pages[i] = NULL;
+		}
+	}
+
+	return;
+}
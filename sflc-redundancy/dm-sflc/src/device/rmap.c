@@ -45,6 +45,8 @@
 int sflc_dev_setRmap(sflc_Device * dev, u32 psi, u8 vol_idx)
 {
 	u8 prev_vol_idx;
+	u32 pos;
+	u32 last_psi;
 
 	/* Bounds check */
 	if (psi >= dev->tot_slices) {
@@ -59,8 +61,14 @@ int sflc_dev_setRmap(sflc_Device * dev, u32 psi, u8 vol_idx)
 		return -EINVAL;
 	}
 
-	/* Just set it */
+	/* Set it */
 	dev->rmap[psi] = vol_idx;
+
+	/* Remove it from the free list, by moving the last free PSI in its place */
+	pos = dev->free_pos[psi];
+	last_psi = dev->free_psis[dev->free_slices - 1];
+	dev->free_psis[pos] = last_psi;
+	dev->free_pos[last_psi] = pos;
 	dev->free_slices -= 1;
 
 	return 0;
@@ -72,19 +80,68 @@ void sflc_dev_unsetRmap(sflc_Device * dev, u32 psi)
 	/* Bounds check */
 	if (psi >= dev->tot_slices) {
 		pr_err("Requested to unset ownership for invalid PSI\n");
+		return;
+	}
+	/* Nothing to do if already free */
+	if (dev->rmap[psi] == SFLC_DEV_RMAP_INVALID_VOL) {
+		return;
 	}
 
-	/* Just unset it */
+	/* Unset it */
 	dev->rmap[psi] = SFLC_DEV_RMAP_INVALID_VOL;
+
+	/* Append it to the free list */
+	dev->free_psis[dev->free_slices] = psi;
+	dev->free_pos[psi] = dev->free_slices;
 	dev->free_slices += 1;
 
 	return;
 }
 
+/* Records that the volume maps the LSI onto an already-owned PSI. Returns < 0 if error. */
+int sflc_dev_addConflict(sflc_Device * dev, u32 psi, u8 vol_idx, u32 lsi)
+{
+	sflc_dev_SliceConflict * conflict;
+
+	/* Grow the list if needed (doubling) */
+	if (dev->nr_conflicts == dev->conflicts_cap) {
+		u32 new_cap = dev->conflicts_cap ? 2 * dev->conflicts_cap : 64;
+		sflc_dev_SliceConflict * new_conflicts;
+
+		new_conflicts = kvrealloc(dev->conflicts, dev->conflicts_cap * sizeof(sflc_dev_SliceConflict),
+						new_cap * sizeof(sflc_dev_SliceConflict), GFP_KERNEL);
+		if (!new_conflicts) {
+			pr_err("Could not grow the slice conflicts list\n");
+			return -ENOMEM;
+		}
+		dev->conflicts = new_conflicts;
+		dev->conflicts_cap = new_cap;
+	}
+
+	/* Append */
+	conflict = &dev->conflicts[dev->nr_conflicts];
+	conflict->psi = psi;
+	conflict->owner_vol = dev->rmap[psi];
+	conflict->claimant_vol = vol_idx;
+	conflict->claimant_lsi = lsi;
+	dev->nr_conflicts += 1;
+
+	return 0;
+}
+
+/* Forgets all the recorded conflicts */
+void sflc_dev_clearConflicts(sflc_Device * dev)
+{
+	kvfree(dev->conflicts);
+	dev->conflicts = NULL;
+	dev->nr_conflicts = 0;
+	dev->conflicts_cap = 0;
+}
+
 /* Returns a random free physical slice, or < 0 if error */
 s32 sflc_dev_getRandomFreePsi(sflc_Device * dev)
 {
-	s32 psi;
+	s32 idx;
 
 	/* Check that there are free slices */
 	if (!dev->free_slices) {
@@ -92,14 +149,12 @@ s32 sflc_dev_getRandomFreePsi(sflc_Device * dev)
 		return -ENOSPC;
 	}
 
-	/* Repeatedly sample until you find a free one */
-	do {
-		psi = sflc_rand_uniform(dev->tot_slices);
-		if (psi < 0) {
-			pr_err("Could not sample random PSI\n");
-			return -EINVAL;
-		}
-	} while (dev->rmap[psi] != SFLC_DEV_RMAP_INVALID_VOL);
+	/* Sample uniformly among the free ones: a single draw, however full the device */
+	idx = sflc_rand_uniform(dev->free_slices);
+	if (idx < 0) {
+		pr_err("Could not sample random PSI\n");
+		return -EINVAL;
+	}
 
-	return psi;
+	return dev->free_psis[idx];
 }
@@ -36,6 +36,12 @@
 #define SFLC_SYSFS_DEV_VOLUMES_ATTR_NAME "volumes"
 #define SFLC_SYSFS_DEV_TOT_SLICES_ATTR_NAME "tot_slices"
 #define SFLC_SYSFS_DEV_FREE_SLICES_ATTR_NAME "free_slices"
+#define SFLC_SYSFS_DEV_IV_CACHE_CAPACITY_ATTR_NAME "iv_cache_capacity"
+#define SFLC_SYSFS_DEV_REPAIR_PENDING_ATTR_NAME "repair_pending"
+#define SFLC_SYSFS_DEV_REPAIR_DONE_ATTR_NAME "repair_done"
+#define SFLC_SYSFS_DEV_REPAIR_FAILED_ATTR_NAME "repair_failed"
+#define SFLC_SYSFS_DEV_REPAIR_MAX_KBPS_ATTR_NAME "repair_max_kbps"
+#define SFLC_SYSFS_DEV_DECRYPT_QUEUE_ATTR_NAME "decrypt_queue"
 
 /*****************************************************
  *           PRIVATE FUNCTIONS PROTOTYPES            *
@@ -49,6 +55,14 @@ static ssize_t sflc_sysfs_devStore(struct kobject * kobj, struct attribute * att
 static ssize_t sflc_sysfs_showDeviceVolumes(struct kobject * kobj, struct attribute * attr, char * buf);
 static ssize_t sflc_sysfs_showDeviceTotSlices(struct kobject * kobj, struct attribute * attr, char * buf);
 static ssize_t sflc_sysfs_showDeviceFreeSlices(struct kobject * kobj, struct attribute * attr, char * buf);
+static ssize_t sflc_sysfs_showDeviceIvCacheCapacity(struct kobject * kobj, struct attribute * attr, char * buf);
+static ssize_t sflc_sysfs_showDeviceRepair(struct kobject * kobj, struct attribute * attr, char * buf);
+static ssize_t sflc_sysfs_showDeviceDecryptQueue(struct kobject * kobj, struct attribute * attr, char * buf);
+
+/* Concrete file storers */
+static ssize_t sflc_sysfs_storeDeviceIvCacheCapacity(struct kobject * kobj, struct attribute * attr, const char * buf, size_t len);
+static ssize_t sflc_sysfs_storeDeviceRepairMaxKbps(struct kobject * kobj, struct attribute * attr, const char * buf, size_t len);
+static ssize_t sflc_sysfs_storeDeviceDecryptQueue(struct kobject * kobj, struct attribute * attr, const char * buf, size_t len);
 
 /* Release function for the DeviceKobject */
 static void sflc_sysfs_releaseDevKobj(struct kobject * kobj);
@@ -75,6 +89,48 @@ static const struct attribute sflc_sysfs_devFreeSlicesAttr = {
 	.mode = 0444
 };
 
+/* The attribute representing the iv_cache_capacity file */
+static const struct attribute sflc_sysfs_devIvCacheCapacityAttr = {
+	.name = SFLC_SYSFS_DEV_IV_CACHE_CAPACITY_ATTR_NAME,
+	.mode = 0644
+};
+
+/* The attributes representing the progress of the repair daemon */
+static const struct attribute sflc_sysfs_devRepairPendingAttr = {
+	.name = SFLC_SYSFS_DEV_REPAIR_PENDING_ATTR_NAME,
+	.mode = 0444
+};
+static const struct attribute sflc_sysfs_devRepairDoneAttr = {
+	.name = SFLC_SYSFS_DEV_REPAIR_DONE_ATTR_NAME,
+	.mode = 0444
+};
+static const struct attribute sflc_sysfs_devRepairFailedAttr = {
+	.name = SFLC_SYSFS_DEV_REPAIR_FAILED_ATTR_NAME,
+	.mode = 0444
+};
+
+/* The attribute representing the repair_max_kbps file */
+static const struct attribute sflc_sysfs_devRepairMaxKbpsAttr = {
+	.name = SFLC_SYSFS_DEV_REPAIR_MAX_KBPS_ATTR_NAME,
+	.mode = 0644
+};
+
+/* The attribute representing the decrypt_queue file */
+static const struct attribute sflc_sysfs_devDecryptQueueAttr = {
+	.name = SFLC_SYSFS_DEV_DECRYPT_QUEUE_ATTR_NAME,
+	.mode = 0644
+};
+
+/* The flags of the decrypt workqueue, as written in the decrypt_queue file */
+static const struct {
+	const char * name;
+	unsigned int flag;
+} sflc_sysfs_decryptQueueFlags[] = {
+	{ "unbound", WQ_UNBOUND },
+	{ "highpri", WQ_HIGHPRI },
+	{ "cpu_intensive", WQ_CPU_INTENSIVE },
+};
+
 /* The sysfs_ops struct encapsulating the access methods */
 static const struct sysfs_ops sflc_sysfs_devKobjSysfsOps = {
 	.show = sflc_sysfs_devShow,
@@ -146,10 +202,40 @@ sflc_sysfs_DeviceKobject * sflc_sysfs_devKobjCreateAndAdd(sflc_Device * dev)
 		pr_err("Could not add free_slices file; error %d\n", err);
 		goto err_free_slices_file;
 	}
+	/* Create the iv_cache_capacity file */
+	err = sysfs_create_file(&dev_kobj->kobj, &sflc_sysfs_devIvCacheCapacityAttr);
+	if (err) {
+		pr_err("Could not add iv_cache_capacity file; error %d\n", err);
+		goto err_iv_cache_capacity_file;
+	}
+	/* Create the repair files */
+	err = sysfs_create_file(&dev_kobj->kobj, &sflc_sysfs_devRepairPendingAttr);
+	if (!err) {
+		err = sysfs_create_file(&dev_kobj->kobj, &sflc_sysfs_devRepairDoneAttr);
+	}
+	if (!err) {
+		err = sysfs_create_file(&dev_kobj->kobj, &sflc_sysfs_devRepairFailedAttr);
+	}
+	if (!err) {
+		err = sysfs_create_file(&dev_kobj->kobj, &sflc_sysfs_devRepairMaxKbpsAttr);
+	}
+	if (err) {
+		pr_err("Could not add repair files; error %d\n", err);
+		goto err_repair_files;
+	}
+	/* Create the decrypt_queue file */
+	err = sysfs_create_file(&dev_kobj->kobj, &sflc_sysfs_devDecryptQueueAttr);
+	if (err) {
+		pr_err("Could not add decrypt_queue file; error %d\n", err);
+		goto err_decrypt_queue_file;
+	}
 
 	return dev_kobj;
 
 
+err_decrypt_queue_file:
+err_repair_files:
+err_iv_cache_capacity_file:
 err_free_slices_file:
 err_tot_slices_file:
 err_vol_file:
@@ -197,15 +283,36 @@ static ssize_t sflc_sysfs_devShow(struct kobject * kobj, struct attribute * attr
 	if (strcmp(attr->name, SFLC_SYSFS_DEV_FREE_SLICES_ATTR_NAME) == 0) {
 		return sflc_sysfs_showDeviceFreeSlices(kobj, attr, buf);
 	}
+	if (strcmp(attr->name, SFLC_SYSFS_DEV_IV_CACHE_CAPACITY_ATTR_NAME) == 0) {
+		return sflc_sysfs_showDeviceIvCacheCapacity(kobj, attr, buf);
+	}
+	if (strncmp(attr->name, "repair_", strlen("repair_")) == 0) {
+		return sflc_sysfs_showDeviceRepair(kobj, attr, buf);
+	}
+	if (strcmp(attr->name, SFLC_SYSFS_DEV_DECRYPT_QUEUE_ATTR_NAME) == 0) {
+		return sflc_sysfs_showDeviceDecryptQueue(kobj, attr, buf);
+	}
 	
 	/* Else, error */
 	pr_err("Error, unknown attribute %s\n", attr->name);
 	return -EIO;
 }
 
-/* Do nothing */
+/* Dispatch to the right storer */
 static ssize_t sflc_sysfs_devStore(struct kobject * kobj, struct attribute * attr, const char * buf, size_t len)
 {
+	/* Dispatch based on name */
+	if (strcmp(attr->name, SFLC_SYSFS_DEV_IV_CACHE_CAPACITY_ATTR_NAME) == 0) {
+		return sflc_sysfs_storeDeviceIvCacheCapacity(kobj, attr, buf, len);
+	}
+	if (strcmp(attr->name, SFLC_SYSFS_DEV_REPAIR_MAX_KBPS_ATTR_NAME) == 0) {
+		return sflc_sysfs_storeDeviceRepairMaxKbps(kobj, attr, buf, len);
+	}
+	if (strcmp(attr->name, SFLC_SYSFS_DEV_DECRYPT_QUEUE_ATTR_NAME) == 0) {
+		return sflc_sysfs_storeDeviceDecryptQueue(kobj, attr, buf, len);
+	}
+
+	/* Else, read-only file */
 	return -EIO;
 }
 
@@ -279,6 +386,192 @@ static ssize_t sflc_sysfs_showDeviceFreeSlices(struct kobject * kobj, struct att
 	return ret;
 }
 
+/* Show the capacity of the IV cache */
+static ssize_t sflc_sysfs_showDeviceIvCacheCapacity(struct kobject * kobj, struct attribute * attr, char * buf)
+{
+	sflc_sysfs_DeviceKobject * dev_kobj;
+	sflc_Device * dev;
+	ssize_t ret;
+
+	/* Cast to a DeviceKobject */
+	dev_kobj = container_of(kobj, sflc_sysfs_DeviceKobject, kobj);
+	/* Get the device */
+	dev = dev_kobj->dev;
+
+	/* Write the iv_cache_capacity */
+	ret = sprintf(buf, "%u\n", READ_ONCE(dev->iv_cache_capacity));
+
+	return ret;
+}
+
+/* Set the capacity of the IV cache */
+static ssize_t sflc_sysfs_storeDeviceIvCacheCapacity(struct kobject * kobj, struct attribute * attr, const char * buf, size_t len)
+{
+	sflc_sysfs_DeviceKobject * dev_kobj;
+	sflc_Device * dev;
+	u32 capacity;
+	int err;
+
+	/* Cast to a DeviceKobject */
+	dev_kobj = container_of(kobj, sflc_sysfs_DeviceKobject, kobj);
+	/* Get the device */
+	dev = dev_kobj->dev;
+
+	/* Parse the new capacity */
+	err = kstrtou32(buf, 10, &capacity);
+	if (err) {
+		return err;
+	}
+
+	/* Set it */
+	err = sflc_dev_setIvCacheCapacity(dev, capacity);
+	if (err) {
+		pr_err("Invalid IV cache capacity %u\n", capacity);
+		return err;
+	}
+
+	return len;
+}
+
+/* Show the progress of the repair daemon, or its bandwidth cap */
+static ssize_t sflc_sysfs_showDeviceRepair(struct kobject * kobj, struct attribute * attr, char * buf)
+{
+	sflc_sysfs_DeviceKobject * dev_kobj;
+	sflc_Device * dev;
+	u32 value;
+
+	/* Cast to a DeviceKobject */
+	dev_kobj = container_of(kobj, sflc_sysfs_DeviceKobject, kobj);
+	/* Get the device */
+	dev = dev_kobj->dev;
+
+	/* Pick the counter */
+	if (strcmp(attr->name, SFLC_SYSFS_DEV_REPAIR_PENDING_ATTR_NAME) == 0) {
+		value = READ_ONCE(dev->repair_pending);
+	} else if (strcmp(attr->name, SFLC_SYSFS_DEV_REPAIR_DONE_ATTR_NAME) == 0) {
+		value = READ_ONCE(dev->repair_done);
+	} else if (strcmp(attr->name, SFLC_SYSFS_DEV_REPAIR_FAILED_ATTR_NAME) == 0) {
+		value = READ_ONCE(dev->repair_failed);
+	} else if (strcmp(attr->name, SFLC_SYSFS_DEV_REPAIR_MAX_KBPS_ATTR_NAME) == 0) {
+		value = READ_ONCE(dev->repair_max_kbps);
+	} else {
+		pr_err("Error, unknown attribute %s\n", attr->name);
+		return -EIO;
+	}
+
+	return sprintf(buf, "%u\n", value);
+}
+
+/* Set the bandwidth cap of the repair daemon (0 = no cap) */
+static ssize_t sflc_sysfs_storeDeviceRepairMaxKbps(struct kobject * kobj, struct attribute * attr, const char * buf, size_t len)
+{
+	sflc_sysfs_DeviceKobject * dev_kobj;
+	sflc_Device * dev;
+	u32 max_kbps;
+	int err;
+
+	/* Cast to a DeviceKobject */
+	dev_kobj = container_of(kobj, sflc_sysfs_DeviceKobject, kobj);
+	/* Get the device */
+	dev = dev_kobj->dev;
+
+	/* Parse the new cap */
+	err = kstrtou32(buf, 10, &max_kbps);
+	if (err) {
+		return err;
+	}
+
+	/* Set it, and cut short the current throttling */
+	WRITE_ONCE(dev->repair_max_kbps, max_kbps);
+	wake_up_all(&dev->repair_waitqueue);
+
+	return len;
+}
+
+/* Show the flags of the decrypt workqueue ("percpu" if none) */
+static ssize_t sflc_sysfs_showDeviceDecryptQueue(struct kobject * kobj, struct attribute * attr, char * buf)
+{
+	sflc_sysfs_DeviceKobject * dev_kobj;
+	sflc_Device * dev;
+	unsigned int flags;
+	ssize_t ret;
+	int i;
+
+	/* Cast to a DeviceKobject */
+	dev_kobj = container_of(kobj, sflc_sysfs_DeviceKobject, kobj);
+	/* Get the device */
+	dev = dev_kobj->dev;
+
+	flags = READ_ONCE(dev->decrypt_queue_flags);
+	if (!flags) {
+		return sprintf(buf, "percpu\n");
+	}
+
+	/* Space-separated names */
+	ret = 0;
+	for (i = 0; i < ARRAY_SIZE(sflc_sysfs_decryptQueueFlags); i++) {
+		if (flags & sflc_sysfs_decryptQueueFlags[i].flag) {
+			ret += sprintf(buf + ret, "%s%s", ret ? " " : "", sflc_sysfs_decryptQueueFlags[i].name);
+		}
+	}
+	ret += sprintf(buf + ret, "\n");
+
+	return ret;
+}
+
+/* Recreate the decrypt workqueue with the given flags ("percpu", or any of "unbound", "highpri",
+   "cpu_intensive", space-separated) */
+static ssize_t sflc_sysfs_storeDeviceDecryptQueue(struct kobject * kobj, struct attribute * attr, const char * buf, size_t len)
+{
+	sflc_sysfs_DeviceKobject * dev_kobj;
+	sflc_Device * dev;
+	unsigned int flags = 0;
+	char * str, * cur, * word;
+	int err = 0;
+	int i;
+
+	/* Cast to a DeviceKobject */
+	dev_kobj = container_of(kobj, sflc_sysfs_DeviceKobject, kobj);
+	/* Get the device */
+	dev = dev_kobj->dev;
+
+	/* Parse the flags */
+	str = kstrndup(buf, len, GFP_KERNEL);
+	if (!str) {
+		return -ENOMEM;
+	}
+	cur = strim(str);
+	while ((word = strsep(&cur, " ")) != NULL) {
+		if (!*word || strcmp(word, "percpu") == 0) {
+			continue;
+		}
+		for (i = 0; i < ARRAY_SIZE(sflc_sysfs_decryptQueueFlags); i++) {
+			if (strcmp(word, sflc_sysfs_decryptQueueFlags[i].name) == 0) {
+				flags |= sflc_sysfs_decryptQueueFlags[i].flag;
+				break;
+			}
+		}
+		if (i == ARRAY_SIZE(sflc_sysfs_decryptQueueFlags)) {
+			pr_err("Unknown decrypt workqueue flag %s\n", word);
+			err = -EINVAL;
+			break;
+		}
+	}
+	kfree(str);
+	if (err) {
+		return err;
+	}
+
+	/* Swap the workqueue */
+	err = sflc_dev_setDecryptQueueFlags(dev, flags);
+	if (err) {
+		pr_err("Could not recreate decrypt workqueue; error %d\n", err);
+		return err;
+	}
+
+	return len;
+}
+
 /* Release function for the DeviceKobject */
 static void sflc_sysfs_releaseDevKobj(struct kobject * kobj)
 {
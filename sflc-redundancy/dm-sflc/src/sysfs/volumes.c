@@ -34,6 +34,8 @@
  *****************************************************/
 
 #define SFLC_SYSFS_VOL_NR_SLICES_ATTR_NAME mapped_slices
+#define SFLC_SYSFS_VOL_CHECKPOINT_ATTR_NAME checkpoint_on_flush
+#define SFLC_SYSFS_VOL_LAZY_REPLICAS_ATTR_NAME lazy_replicas
 
 /*****************************************************
  *           PRIVATE FUNCTIONS PROTOTYPES            *
@@ -41,6 +43,10 @@
 
 static void sflc_sysfs_volDevRelease(struct device * dev);
 static ssize_t sflc_sysfs_showVolNrSlices(struct device * dev, struct device_attribute * attr, char * buf);
+static ssize_t sflc_sysfs_showVolCheckpoint(struct device * dev, struct device_attribute * attr, char * buf);
+static ssize_t sflc_sysfs_storeVolCheckpoint(struct device * dev, struct device_attribute * attr, const char * buf, size_t len);
+static ssize_t sflc_sysfs_showVolLazyReplicas(struct device * dev, struct device_attribute * attr, char * buf);
+static ssize_t sflc_sysfs_storeVolLazyReplicas(struct device * dev, struct device_attribute * attr, const char * buf, size_t len);
 
 /*****************************************************
  *           PRIVATE VARIABLES DEFINITIONS           *
@@ -54,6 +60,22 @@ static const struct device_attribute sflc_sysfs_volNrSlicesAttr = __ATTR(
 	NULL
 );
 
+/* Attribute enabling the position map checkpoints on flush */
+static const struct device_attribute sflc_sysfs_volCheckpointAttr = __ATTR(
+	SFLC_SYSFS_VOL_CHECKPOINT_ATTR_NAME,
+	0644,
+	sflc_sysfs_showVolCheckpoint,
+	sflc_sysfs_storeVolCheckpoint
+);
+
+/* Attribute enabling the lazy (background) writes of the replicas */
+static const struct device_attribute sflc_sysfs_volLazyReplicasAttr = __ATTR(
+	SFLC_SYSFS_VOL_LAZY_REPLICAS_ATTR_NAME,
+	0644,
+	sflc_sysfs_showVolLazyReplicas,
+	sflc_sysfs_storeVolLazyReplicas
+);
+
 /*****************************************************
  *           PUBLIC FUNCTIONS DEFINITIONS            *
  *****************************************************/
@@ -100,6 +122,18 @@ sflc_sysfs_VolumeDevice * sflc_sysfs_volDevCreateAndAdd(sflc_Volume * vol)
 		pr_err("Could not create mapped_slices device file; error %d\n", err);
 		goto err_dev_create_file;
 	}
+	/* Add checkpoint_on_flush attribute */
+	err = device_create_file(&kdev->dev, &sflc_sysfs_volCheckpointAttr);
+	if (err) {
+		pr_err("Could not create checkpoint_on_flush device file; error %d\n", err);
+		goto err_dev_create_file;
+	}
+	/* Add lazy_replicas attribute */
+	err = device_create_file(&kdev->dev, &sflc_sysfs_volLazyReplicasAttr);
+	if (err) {
+		pr_err("Could not create lazy_replicas device file; error %d\n", err);
+		goto err_dev_create_file;
+	}
 
 	return kdev;
 
@@ -132,6 +166,58 @@ static ssize_t sflc_sysfs_showVolNrSlices(struct device * dev, struct device_att
 	return sprintf(buf, "%u\n", vol->mapped_slices);
 }
 
+static ssize_t sflc_sysfs_showVolCheckpoint(struct device * dev, struct device_attribute * attr, char * buf)
+{
+	sflc_sysfs_VolumeDevice * kdev = container_of(dev, sflc_sysfs_VolumeDevice, dev);
+	sflc_Volume * vol = kdev->vol;
+
+	return sprintf(buf, "%d\n", READ_ONCE(vol->checkpoint_on_flush));
+}
+
+static ssize_t sflc_sysfs_storeVolCheckpoint(struct device * dev, struct device_attribute * attr, const char * buf, size_t len)
+{
+	sflc_sysfs_VolumeDevice * kdev = container_of(dev, sflc_sysfs_VolumeDevice, dev);
+	sflc_Volume * vol = kdev->vol;
+	bool enable;
+	int err;
+
+	err = kstrtobool(buf, &enable);
+	if (err) {
+		return err;
+	}
+	WRITE_ONCE(vol->checkpoint_on_flush, enable);
+
+	return len;
+}
+
+static ssize_t sflc_sysfs_showVolLazyReplicas(struct device * dev, struct device_attribute * attr, char * buf)
+{
+	sflc_sysfs_VolumeDevice * kdev = container_of(dev, sflc_sysfs_VolumeDevice, dev);
+	sflc_Volume * vol = kdev->vol;
+
+	return sprintf(buf, "%d\n", READ_ONCE(vol->lazy_replicas));
+}
+
+static ssize_t sflc_sysfs_storeVolLazyReplicas(struct device * dev, struct device_attribute * attr, const char * buf, size_t len)
+{
+	sflc_sysfs_VolumeDevice * kdev = container_of(dev, sflc_sysfs_VolumeDevice, dev);
+	sflc_Volume * vol = kdev->vol;
+	bool enable;
+	int err;
+
+	err = kstrtobool(buf, &enable);
+	if (err) {
+		return err;
+	}
+	/* Fails if there's no room for the dirty-replica log */
+	err = sflc_vol_setLazyReplicas(vol, enable);
+	if (err) {
+		return err;
+	}
+
+	return len;
+}
+
 static void sflc_sysfs_volDevRelease(struct device * dev)
 {
 	sflc_sysfs_VolumeDevice * kdev;
@@ -29,6 +29,9 @@
  *                  INCLUDE SECTION                  *
  *****************************************************/
 
+#include <linux/sort.h>
+#include <linux/bsearch.h>
+
 #include "target.h"
 #include "device/device.h"
 #include "volume/volume.h"
@@ -63,12 +66,16 @@ typedef struct sflc_slice_corr_s sflc_Slice_Corr;
 static int sflc_tgt_ctr(struct dm_target *ti, unsigned int argc, char **argv);
 static void sflc_tgt_dtr(struct dm_target *ti);
 static int sflc_tgt_map(struct dm_target *ti, struct bio *bio);
+static void sflc_tgt_resume(struct dm_target *ti);
 static void sflc_tgt_ioHints(struct dm_target *ti, struct queue_limits *limits);
 static int sflc_tgt_iterateDevices(struct dm_target *ti, iterate_devices_callout_fn fn,
 								   void *data);
 
 // sflc-raid START
-int slice_transfusion(sflc_Device *dev, sflc_Volume *donor_volume, sflc_Volume *receiver_volume, u32 donoe_slice, u32 receiver_slice);
+static int collect_slice_corr(sflc_Device *dev, sflc_Slice_Corr **slice_corr, int *corr_index);
+static int add_slice_corr(sflc_Slice_Corr **slice_corr, int *corr_index, sflc_Volume *receiver_volume, u32 receiver_slice);
+static bool is_slice_corr(sflc_Slice_Corr *slice_corr, int corr_index, sflc_Volume *volume, u32 slice);
+static int cmp_conflict_psi(const void *a, const void *b);
 // sflc-raid END
 
 /*****************************************************
@@ -83,6 +90,7 @@ struct target_type sflc_target = {
 	.dtr = sflc_tgt_dtr,
 	.map = sflc_tgt_map,
 	.status = NULL,
+	.resume = sflc_tgt_resume,
 	.io_hints = sflc_tgt_ioHints,
 	.iterate_devices = sflc_tgt_iterateDevices,
 };
@@ -103,6 +111,7 @@ static int sflc_tgt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	char *vol_name;
 	int vol_idx;
 	bool vol_creation;
+	bool vol_read_only;
 	char *enckey_hex;
 	u8 enckey[SFLC_SK_KEY_LEN];
 	u32 tot_slices;
@@ -113,6 +122,11 @@ static int sflc_tgt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	// sflc-raid START
 	bool redundant_among;
 	bool redundant_within;
+	bool redundant_parity;
+	u32 parity_data = 0;
+	u32 parity_nr = 0;
+	u32 replicas = 0;
+	sflc_vol_MirrorPolicy mirror_policy;
 
 	/*
 	 * Parse arguments.
@@ -120,13 +134,15 @@ static int sflc_tgt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	 * argv[0]: real device path
 	 * argv[1]: Shufflecake-unique volume name
 	 * argv[2]: volume index within the device
-	 * argv[3]: 'c' for volume creation, 'o' for volume opening
+	 * argv[3]: 'c' for volume creation, 'o' for volume opening, 'r' for opening read-only
 	 * argv[4]: number of 1 MB slices in the underlying device
 	 * argv[5]: 32-byte encryption key (hex-encoded)
-	 * argv[6]: redundancy implementation
+	 * argv[6]: redundancy implementation ('n', 'a', 'w' for even/odd pairs, 'w<R>' for R copies spread
+	 *          across the volume, or 'p<K>+<M>' for K data slices and M parity slices per stripe)
+	 * argv[7]: (optional) what gets mirrored: "all" (default), "meta", or "ranges:<start>-<end>,..."
 	 */
 
-	if (argc != 7)
+	if (argc != 7 && argc != 8)
 	{
 		ti->error = "Invalid argument count";
 		return -EINVAL;
@@ -135,10 +151,35 @@ static int sflc_tgt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	vol_name = argv[1];
 	sscanf(argv[2], "%d", &vol_idx);
 	vol_creation = (argv[3][0] == 'c');
+	vol_read_only = (argv[3][0] == 'r');
 	sscanf(argv[4], "%u", &tot_slices);
 	enckey_hex = argv[5];
 	redundant_among = (argv[6][0] == 'a');
 	redundant_within = (argv[6][0] == 'w');
+	redundant_parity = (argv[6][0] == 'p');
+	if (redundant_within && argv[6][1] != '\0')
+	{
+		if (kstrtou32(argv[6] + 1, 10, &replicas) || replicas < 1 || replicas > SFLC_VOL_MAX_REPLICAS)
+		{
+			ti->error = "Invalid replication factor";
+			return -EINVAL;
+		}
+	}
+	if (redundant_parity)
+	{
+		err = sflc_vol_parseParity(argv[6] + 1, &parity_data, &parity_nr);
+		if (err)
+		{
+			ti->error = "Invalid parity layout";
+			return err;
+		}
+	}
+	err = sflc_vol_parseMirrorPolicy((argc == 8) ? argv[7] : "all", &mirror_policy);
+	if (err)
+	{
+		ti->error = "Invalid mirror policy";
+		return err;
+	}
 
 	/* Decode the encryption key */
 	if (strlen(enckey_hex) != 2 * SFLC_SK_KEY_LEN)
@@ -154,6 +195,14 @@ static int sflc_tgt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		return err;
 	}
 
+	/* Even/odd pairs need an even count (spread copies just leave the remainder unused): the last
+	   slice is left out before the device's free-slice list is built */
+	if (redundant_within && !replicas && tot_slices % 2 != 0)
+	{
+		tot_slices -= 1;
+		pr_info("Reduced total number of slices to %u to be even\n", tot_slices);
+	}
+
 	/* Acquire the big device lock */
 	if (down_interruptible(&sflc_dev_mutex))
 	{
@@ -188,6 +237,13 @@ static int sflc_tgt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		up(&sflc_dev_mutex);
 		return PTR_ERR(dev);
 	}
+	/* The volumes of a device all see the same slices */
+	if (dev->tot_slices != tot_slices)
+	{
+		ti->error = "Device already open with a different number of slices";
+		up(&sflc_dev_mutex);
+		return -EINVAL;
+	}
 
 	/* Check that the provided volume name is actually unique across Shufflecake */
 	vol = sflc_dev_lookupVolumeByName(vol_name);
@@ -198,6 +254,38 @@ static int sflc_tgt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		return -EINVAL;
 	}
 
+	// sflc-raid START
+	/* A pair of volumes mirroring each other write into each other: both or neither are read-only */
+	if (redundant_among && vol_idx > 0 && vol_idx < SFLC_DEV_MAX_VOLUMES)
+	{
+		int pair_idx = (vol_idx % 2 == 0) ? vol_idx - 1 : vol_idx + 1;
+
+		if (pair_idx < SFLC_DEV_MAX_VOLUMES && volume_links[pair_idx] && volume_links[pair_idx]->read_only != vol_read_only)
+		{
+			ti->error = "Can't pair a read-only volume with a writable one";
+			up(&sflc_dev_mutex);
+			return -EINVAL;
+		}
+	}
+	// sflc-raid END
+
+	/* Spread copies and parity stripes leave less room than the device: don't expose more */
+	if (replicas && vol_idx != 0 &&
+	    ti->len > (sector_t)(dev->tot_slices / replicas) * SFLC_VOL_LOG_SLICE_SIZE * SFLC_DEV_SECTOR_SCALE)
+	{
+		ti->error = "Volume larger than the slices of one replica";
+		up(&sflc_dev_mutex);
+		return -EINVAL;
+	}
+	if (redundant_parity && vol_idx != 0 &&
+	    ti->len > (sector_t)(dev->tot_slices / (parity_data + parity_nr) * parity_data) *
+			SFLC_VOL_LOG_SLICE_SIZE * SFLC_DEV_SECTOR_SCALE)
+	{
+		ti->error = "Volume larger than the data slices of its parity stripes";
+		up(&sflc_dev_mutex);
+		return -EINVAL;
+	}
+
 	/* Create the volume (also adds it to the device) */
 	vol = sflc_vol_getVolume(ti, vol_name, dev, vol_idx, enckey, vol_creation);
 	if (IS_ERR(vol))
@@ -208,20 +296,37 @@ static int sflc_tgt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	}
 	pr_debug("Now %d volumes are linked to device %s\n", dev->vol_cnt, real_dev_path);
 
+	/* Set before any I/O comes in (the first volume is never redundant) */
+	vol->read_only = vol_read_only;
+	vol->mirror_policy = mirror_policy;
+	if (redundant_parity && vol->vol_idx != 0)
+	{
+		vol->parity_data = parity_data;
+		vol->parity_nr = parity_nr;
+	}
+	if (replicas && vol->vol_idx != 0)
+	{
+		vol->replica_factor = replicas;
+		vol->replica_stride = dev->tot_slices / replicas;
+	}
+
 	/* Release the big device lock */
 	up(&sflc_dev_mutex);
 
-	/* Tell DM we want one SFLC sector at a time */
-	ti->max_io_len = SFLC_DEV_SECTOR_SCALE;
+	/* Tell DM to split bios at logical slice boundaries (a slice is contiguous on disk) */
+	ti->max_io_len = SFLC_VOL_LOG_SLICE_SIZE * SFLC_DEV_SECTOR_SCALE;
 	/* Enable REQ_OP_FLUSH bios */
 	ti->num_flush_bios = 1;
-	/* Disable REQ_OP_WRITE_ZEROES and REQ_OP_SECURE_ERASE (can't be passed through as
-	   they would break deniability, and they would be too complicated to handle individually) */
+	/* Disable REQ_OP_SECURE_ERASE (can't be passed through as it would break deniability,
+	   and it would be too complicated to handle individually). REQ_OP_WRITE_ZEROES never reach
+	   the device either, they only clear bits of the written-block map (when there is one, and
+	   not with parity, which would go stale) */
 	ti->num_secure_erase_bios = 0;
-	ti->num_write_zeroes_bios = 0;
-	/* Momentarily disable REQ_OP_DISCARD_BIOS
-	   TODO: will need to support them to release slice mappings */
-	ti->num_discard_bios = 0;
+	ti->num_write_zeroes_bios = (vol->written && parity_data == 0 && !vol_read_only) ? 1 : 0;
+	/* Enable REQ_OP_DISCARD, to release the slices they empty. They are never passed down
+	   (that would tell which slices are in use), so the underlying device needn't support them */
+	ti->num_discard_bios = vol_read_only ? 0 : 1;
+	ti->discards_supported = !vol_read_only;
 	/* When we receive a ->map call, we won't need to take the device lock anymore */
 	ti->private = vol;
 
@@ -244,12 +349,10 @@ static int sflc_tgt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	else if (redundant_within)
 	{
 		redundancy = 'w';
-
-		if (dev->tot_slices % 2 != 0)
-		{
-			dev->tot_slices -= 1;
-			pr_info("Reduced total number of slices to %d to be even\n", dev->tot_slices);
-		}
+	}
+	else if (redundant_parity)
+	{
+		redundancy = 'p';
 	}
 	else
 	{
@@ -263,6 +366,34 @@ static int sflc_tgt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	// Remembering volume
 	volume_links[vol->vol_idx] = vol;
 
+	// Pairing it with the volume holding its replicas, for the resync of the lazy ones
+	if (vol->vol_idx != 0 && redundancy != 'p')
+	{
+		sflc_Volume *pair = NULL;
+
+		if (redundancy == 'w')
+		{
+			pair = vol;
+		}
+		else if (vol->vol_idx % 2 == 0)
+		{
+			pair = volume_links[vol->vol_idx - 1];
+		}
+		else if (vol->vol_idx + 1 < SFLC_DEV_MAX_VOLUMES)
+		{
+			pair = volume_links[vol->vol_idx + 1];
+		}
+
+		if (pair)
+		{
+			WRITE_ONCE(vol->mirror_vol, pair);
+			WRITE_ONCE(pair->mirror_vol, vol);
+			/* Replicas left stale by the last session */
+			sflc_vol_scheduleResync(vol, 0);
+			sflc_vol_scheduleResync(pair, 0);
+		}
+	}
+
 	// When last volume was added, check for corruption
 	if (!vol_creation && vol->vol_idx == 0)
 	{
@@ -270,75 +401,16 @@ static int sflc_tgt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		sflc_Slice_Corr *slice_corr = NULL;
 
 		pr_info("Checking for corrupted slices\n");
-		int low_idx;
-		int high_idx;
-		u32 i;
-		u32 j;
-		for (low_idx = 0; low_idx < SFLC_DEV_MAX_VOLUMES; low_idx++)
+		err = collect_slice_corr(dev, &slice_corr, &corr_index);
+		if (err)
 		{
-			if (volume_links[low_idx] != NULL)
-			{
-				for (high_idx = low_idx + 1; high_idx < SFLC_DEV_MAX_VOLUMES; high_idx++)
-				{
-					if (volume_links[high_idx] != NULL)
-					{
-						for (i = 0; i < dev->tot_slices; i++)
-						{
-							if (volume_links[low_idx]->fmap[i] != SFLC_VOL_FMAP_INVALID_PSI)
-							{
-								for (j = 0; j < dev->tot_slices; j++)
-								{
-									if (volume_links[high_idx]->fmap[j] != SFLC_VOL_FMAP_INVALID_PSI)
-									{
-										if (volume_links[low_idx]->fmap[i] == volume_links[high_idx]->fmap[j])
-										{
-											pr_info("Slice conflict, volume %d : %u -> %u and volume %d : %u -> %u\n", low_idx + 1, i, volume_links[low_idx]->fmap[i], high_idx + 1, j, volume_links[high_idx]->fmap[j]);
-
-											sflc_Volume *donor_volume;
-											sflc_Volume *receiver_volume = volume_links[high_idx];
-
-											if (redundancy == 'a')
-											{
-												if (receiver_volume->vol_idx % 2 == 0)
-												{
-													donor_volume = volume_links[high_idx - 1];
-												}
-												else
-												{
-													donor_volume = volume_links[high_idx + 1];
-												}
-											}
-											else if (redundancy == 'w')
-											{
-												donor_volume = receiver_volume;
-											}
-											else
-											{
-												pr_warn("Unrecognizable redundancy, not supposed to be here, what happened ?\n");
-												continue;
-											}
-
-											if (donor_volume == NULL)
-											{
-												pr_warn("Something is wrong, the donor volume is missing, cancelling this transfusion\n");
-												continue;
-											}
-
-											corr_index += 1;
-											slice_corr = krealloc(slice_corr, corr_index * sizeof(sflc_Slice_Corr), GFP_KERNEL);
-											slice_corr[corr_index - 1] = (sflc_Slice_Corr){donor_volume, receiver_volume, j};
-										}
-									}
-								}
-							}
-						}
-					}
-				}
-			}
+			pr_err("Could not collect slice conflicts; error %d\n", err);
+			kfree(slice_corr);
+			return err;
 		}
 		pr_info("Detected %d slice inconsistencies\n", corr_index);
 
-		int fixed_slices = 0;
+		int queued_slices = 0;
 
 		int k;
 		for (k = 0; k < corr_index; k++)
@@ -355,43 +427,53 @@ static int sflc_tgt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 			}
 			else if (redundancy == 'w')
 			{
-				if (receiver_slice % 2 == 0)
-				{
-					donor_slice = receiver_slice + 1;
-				}
-				else
+				u32 copies[SFLC_VOL_MAX_REPLICAS - 1];
+				u32 nr_copies = sflc_vol_replicaLsis(receiver_volume, receiver_slice, copies);
+				u32 c;
+
+				// Any copy that is not corrupted itself will do (the last one otherwise)
+				donor_slice = dev->tot_slices;
+				for (c = 0; c < nr_copies; c++)
 				{
-					donor_slice = receiver_slice - 1;
+					donor_slice = copies[c];
+					if (!is_slice_corr(slice_corr, corr_index, donor_volume, donor_slice))
+					{
+						break;
+					}
 				}
 			}
+			else if (redundancy == 'p')
+			{
+				// Rebuilt from the rest of its stripe instead
+				donor_slice = receiver_slice;
+			}
 			else
 			{
 				pr_warn("Unrecognizable redundancy, not supposed to be here, what happened ?\n");
 				continue;
 			}
 
-			if (donor_slice < 0 || donor_slice > dev->tot_slices)
+			if (donor_slice >= dev->tot_slices)
 			{
 				pr_warn("Something is wrong, the donor slice %d in %d is unreachable, cancelling this transfusion\n", receiver_slice, donor_volume->vol_idx + 1);
 				continue;
 			}
 
-			bool double_corr = false;
+			bool double_corr = (redundancy != 'p') && is_slice_corr(slice_corr, corr_index, donor_volume, donor_slice);
 
-			int l;
-			for (l = 0; l < corr_index; l++)
+			// A read-only volume is left as it is on disk
+			if (receiver_volume->read_only)
 			{
-				if (donor_slice == slice_corr[l].slice_index && donor_volume->vol_idx == slice_corr[l].receiver_volume->vol_idx)
-				{
-					double_corr = true;
-					break;
-				}
+				pr_warn("Volume %d is read-only, not repairing its slice %d\n", receiver_volume->vol_idx + 1, receiver_slice);
+				continue;
 			}
 
-			// Discard slice for receiver volume
-			receiver_volume->fmap[receiver_slice] = SFLC_VOL_FMAP_INVALID_PSI;
-			// Allocate new slice
-			sflc_vol_mapSlice(receiver_volume, receiver_slice, WRITE); // WRITE to force allocation
+			// Discard slice for receiver volume, and allocate a new one
+			if (sflc_vol_reallocSlice(receiver_volume, receiver_slice) < 0)
+			{
+				pr_warn("Could not allocate a new slice for volume %d slice %d, cancelling this transfusion\n", receiver_volume->vol_idx + 1, receiver_slice);
+				continue;
+			}
 
 			if (double_corr)
 			{
@@ -399,17 +481,26 @@ static int sflc_tgt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 				continue;
 			}
 
-			err = slice_transfusion(dev, donor_volume, receiver_volume, donor_slice, receiver_slice);
+			// The copy itself is left to the repair daemon, once the volumes are live
+			if (redundancy == 'p')
+			{
+				err = sflc_dev_queueRebuild(dev, receiver_volume->vol_idx, receiver_slice);
+			}
+			else
+			{
+				err = sflc_dev_queueRepair(dev, donor_volume->vol_idx, donor_slice, receiver_volume->vol_idx, receiver_slice);
+			}
 			if (err)
 			{
-				pr_err("Slice transfusion failed from volume %d to %d from slice %d to %d\n", donor_volume->vol_idx + 1, receiver_volume->vol_idx + 1, donor_slice, receiver_slice);
+				pr_err("Could not queue transfusion from volume %d to %d from slice %d to %d\n", donor_volume->vol_idx + 1, receiver_volume->vol_idx + 1, donor_slice, receiver_slice);
+				kfree(slice_corr);
 				return err;
 			}
 
-			fixed_slices += 1;
+			queued_slices += 1;
 		}
 
-		pr_info("Redundancy repair finished, fixed %d of %d corrupted slices\n", fixed_slices, corr_index);
+		pr_info("Queued %d of %d corrupted slices for repair\n", queued_slices, corr_index);
 
 		if (slice_corr != NULL)
 		{
@@ -425,144 +516,202 @@ static int sflc_tgt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 }
 
 // sflc-raid START
-int slice_transfusion(sflc_Device *dev, sflc_Volume *donor_volume, sflc_Volume *receiver_volume, u32 donor_slice, u32 receiver_slice)
+/* Turns the conflicts recorded by the device while loading the fmaps into the list of slices to repair.
+   Every pair of volumes mapping the same PSI yields one corrupted slice, in the higher-index volume */
+static int collect_slice_corr(sflc_Device *dev, sflc_Slice_Corr **slice_corr, int *corr_index)
 {
-	sector_t data_start_sector;
-	sector_t donor_sector;
-	sector_t receiver_sector;
-	struct page *iv_donor_page;
-	struct page *iv_receiver_page;
-	u8 *iv_donor_ptr;
-	u8 *iv_receiver_ptr;
-	struct page *data_page;
-	u8 *data_ptr;
-	int err;
+	sflc_dev_SliceConflict *conflicts = dev->conflicts;
+	u32 nr_conflicts = dev->nr_conflicts;
+	u32 *owner_lsi;
+	int vol_idx;
+	u32 lsi;
+	u32 first;
+	u32 last;
+	int err = 0;
 
-	/* Allocate pages */
-	iv_donor_page = mempool_alloc(sflc_pools_pagePool, GFP_NOIO);
-	if (!iv_donor_page)
+	if (nr_conflicts == 0)
 	{
-		pr_err("Could not allocate IV donor page\n");
-		return -ENOMEM;
+		return 0;
 	}
-	iv_receiver_page = mempool_alloc(sflc_pools_pagePool, GFP_NOIO);
-	if (!iv_receiver_page)
+
+	/* Group the conflicts by PSI */
+	sort(conflicts, nr_conflicts, sizeof(sflc_dev_SliceConflict), cmp_conflict_psi, NULL);
+
+	/* Find which LSI each owner maps onto the conflicting PSIs: one pass over each owner's fmap */
+	owner_lsi = kvmalloc_array(nr_conflicts, sizeof(u32), GFP_KERNEL);
+	if (!owner_lsi)
 	{
-		pr_err("Could not allocate IV receiver page\n");
+		pr_err("Could not allocate owner LSIs\n");
 		return -ENOMEM;
 	}
-	data_page = mempool_alloc(sflc_pools_pagePool, GFP_NOIO);
-	if (!data_page)
+	memset(owner_lsi, 0xFF, nr_conflicts * sizeof(u32));
+	for (vol_idx = 0; vol_idx < SFLC_DEV_MAX_VOLUMES; vol_idx++)
 	{
-		pr_err("Could not allocate data page\n");
-		return -ENOMEM;
+		sflc_Volume *vol = volume_links[vol_idx];
+
+		if (vol == NULL)
+		{
+			continue;
+		}
+		for (lsi = 0; lsi < dev->tot_slices; lsi++)
+		{
+			u32 psi = vol->fmap[lsi];
+			sflc_dev_SliceConflict *conflict;
+
+			if (psi == SFLC_VOL_FMAP_INVALID_PSI)
+			{
+				continue;
+			}
+			conflict = bsearch(&psi, conflicts, nr_conflicts, sizeof(sflc_dev_SliceConflict), cmp_conflict_psi);
+			if (conflict == NULL || conflict->owner_vol != vol_idx)
+			{
+				continue;
+			}
+			/* All the conflicts on this PSI have the same owner */
+			for (first = conflict - conflicts; first > 0 && conflicts[first - 1].psi == psi; first--);
+			for (last = first; last < nr_conflicts && conflicts[last].psi == psi; last++)
+			{
+				owner_lsi[last] = lsi;
+			}
+		}
 	}
-	/* Kmap them */
-	iv_donor_ptr = kmap(iv_donor_page);
-	iv_receiver_ptr = kmap(iv_receiver_page);
-	data_ptr = kmap(data_page);
 
-	/* Lock both the forward and the reverse position maps */
-	if (mutex_lock_interruptible(&donor_volume->fmap_lock))
+	/* Within each group, the owner and the claimants all conflict pairwise */
+	for (first = 0; first < nr_conflicts; first = last)
 	{
-		pr_err("Interrupted while waiting to lock fmap\n");
-		return -EINTR;
+		u32 i;
+		u32 j;
+
+		for (last = first; last < nr_conflicts && conflicts[last].psi == conflicts[first].psi; last++);
+
+		if (owner_lsi[first] == SFLC_VOL_FMAP_INVALID_PSI || volume_links[conflicts[first].owner_vol] == NULL)
+		{
+			pr_warn("Something is wrong, the owner of PSI %u is missing, skipping it\n", conflicts[first].psi);
+			continue;
+		}
+
+		for (i = first; i < last; i++)
+		{
+			sflc_dev_SliceConflict *c = &conflicts[i];
+
+			pr_info("Slice conflict, volume %d : %u -> %u and volume %d : %u -> %u\n", c->claimant_vol + 1, c->claimant_lsi, c->psi, c->owner_vol + 1, owner_lsi[i], c->psi);
+
+			/* Against the owner */
+			if (c->owner_vol > c->claimant_vol)
+			{
+				err = add_slice_corr(slice_corr, corr_index, volume_links[c->owner_vol], owner_lsi[i]);
+			}
+			else
+			{
+				err = add_slice_corr(slice_corr, corr_index, volume_links[c->claimant_vol], c->claimant_lsi);
+			}
+			if (err)
+			{
+				goto out;
+			}
+
+			/* Against the other claimants (each pair once) */
+			for (j = i + 1; j < last; j++)
+			{
+				sflc_dev_SliceConflict *d = &conflicts[j];
+
+				if (d->claimant_vol > c->claimant_vol)
+				{
+					err = add_slice_corr(slice_corr, corr_index, volume_links[d->claimant_vol], d->claimant_lsi);
+				}
+				else
+				{
+					err = add_slice_corr(slice_corr, corr_index, volume_links[c->claimant_vol], c->claimant_lsi);
+				}
+				if (err)
+				{
+					goto out;
+				}
+			}
+		}
 	}
-	if (mutex_lock_interruptible(&receiver_volume->fmap_lock))
+
+out:
+	kvfree(owner_lsi);
+	/* They have been dealt with */
+	sflc_dev_clearConflicts(dev);
+
+	return err;
+}
+
+/* Appends a corrupted slice of the receiver volume, along with the volume to copy it from */
+static int add_slice_corr(sflc_Slice_Corr **slice_corr, int *corr_index, sflc_Volume *receiver_volume, u32 receiver_slice)
+{
+	sflc_Volume *donor_volume;
+	sflc_Slice_Corr *new_slice_corr;
+
+	if (redundancy == 'a')
 	{
-		mutex_unlock(&donor_volume->fmap_lock);
-		pr_err("Interrupted while waiting to lock fmap\n");
-		return -EINTR;
+		if (receiver_volume->vol_idx % 2 == 0)
+		{
+			donor_volume = volume_links[receiver_volume->vol_idx - 1];
+		}
+		else
+		{
+			donor_volume = volume_links[receiver_volume->vol_idx + 1];
+		}
 	}
-	if (mutex_lock_interruptible(&dev->rmap_lock))
+	else if (redundancy == 'w' || redundancy == 'p')
 	{
-		pr_err("Interrupted while waiting to lock rmap\n");
-		mutex_unlock(&donor_volume->fmap_lock);
-		mutex_unlock(&receiver_volume->fmap_lock);
-		return -EINTR;
+		donor_volume = receiver_volume;
 	}
-
-	/* Starting sector of data section */
-	data_start_sector = SFLC_DEV_HEADER_SIZE;
-
-	/* Starting sector of the physical slices */
-	donor_sector = data_start_sector + (donor_volume->fmap[donor_slice] * SFLC_DEV_PHYS_SLICE_SIZE);
-	receiver_sector = data_start_sector + (receiver_volume->fmap[receiver_slice] * SFLC_DEV_PHYS_SLICE_SIZE);
-
-	/* Read IV-data of donor slice */
-	err = sflc_dev_rwSector(dev, iv_donor_page, donor_sector, READ);
-	if (err)
+	else
 	{
-		pr_err("Could not read IV donor block %d at sector %llu; error %d\n", donor_volume->vol_idx + 1, donor_sector, err);
-		goto out;
+		pr_warn("Unrecognizable redundancy, not supposed to be here, what happened ?\n");
+		return 0;
 	}
-	donor_sector += 1;
 
-	/* Read IV-data of receiver slice */
-	err = sflc_dev_rwSector(dev, iv_receiver_page, receiver_sector, READ);
-	if (err)
+	if (donor_volume == NULL)
 	{
-		pr_err("Could not read IV receiver block %d at sector %llu; error %d\n", receiver_volume->vol_idx + 1, receiver_sector, err);
-		goto out;
+		pr_warn("Something is wrong, the donor volume is missing, cancelling this transfusion\n");
+		return 0;
 	}
-	receiver_sector += 1;
 
-	int k;
-	for (k = 0; k < SFLC_DEV_SECTOR_TO_IV_RATIO; k++)
+	new_slice_corr = krealloc(*slice_corr, (*corr_index + 1) * sizeof(sflc_Slice_Corr), GFP_KERNEL);
+	if (!new_slice_corr)
 	{
-		/* Load the data block from donor */
-		err = sflc_dev_rwSector(dev, data_page, donor_sector, READ);
-		if (err)
-		{
-			pr_err("Could not read data block from donor %d at sector %llu; error %d\n", donor_volume->vol_idx + 1, donor_sector, err);
-			goto out;
-		}
-		donor_sector += 1;
+		pr_err("Could not grow the list of corrupted slices\n");
+		return -ENOMEM;
+	}
+	*slice_corr = new_slice_corr;
+	(*slice_corr)[*corr_index] = (sflc_Slice_Corr){donor_volume, receiver_volume, receiver_slice};
+	*corr_index += 1;
 
-		/* Decrypt it in place with donor crypto */
-		err = sflc_sk_decrypt(donor_volume->skctx, data_ptr, data_ptr, SFLC_DEV_SECTOR_SIZE, (iv_donor_ptr + donor_slice * SFLC_SK_IV_LEN));
-		if (err)
-		{
-			pr_err("Could not decrypt data block from donor %d at sector %llu; error %d\n", donor_volume->vol_idx + 1, donor_sector, err);
-			goto out;
-		}
+	return 0;
+}
 
-		/* Encrypt it in place with receiver crypto */
-		err = sflc_sk_encrypt(receiver_volume->skctx, data_ptr, data_ptr, SFLC_DEV_SECTOR_SIZE, (iv_receiver_ptr + receiver_slice * SFLC_SK_IV_LEN));
-		if (err)
-		{
-			pr_err("Could not encrypt data block to receiver %d at sector %llu; error %d\n", receiver_volume->vol_idx + 1, receiver_sector, err);
-			goto out;
-		}
+/* Whether the slice of the volume is itself in the list of corrupted ones */
+static bool is_slice_corr(sflc_Slice_Corr *slice_corr, int corr_index, sflc_Volume *volume, u32 slice)
+{
+	int l;
 
-		/* Store the data block to receiver */
-		err = sflc_dev_rwSector(dev, data_page, receiver_sector, WRITE);
-		if (err)
+	for (l = 0; l < corr_index; l++)
+	{
+		if (slice == slice_corr[l].slice_index && volume->vol_idx == slice_corr[l].receiver_volume->vol_idx)
 		{
-			pr_err("Could not write data block to receiver %d at sector %llu; error %d\n", receiver_volume->vol_idx + 1, receiver_sector, err);
-			goto out;
+			return true;
 		}
-		receiver_sector += 1;
 	}
 
-	/* No error if we made it here */
-	err = 0;
+	return false;
+}
 
-out:
-	/* Unlock all maps */
-	mutex_unlock(&dev->rmap_lock);
-	mutex_unlock(&receiver_volume->fmap_lock);
-	mutex_unlock(&donor_volume->fmap_lock);
-	/* Kunmap pages */
-	kunmap(iv_donor_page);
-	kunmap(iv_receiver_page);
-	kunmap(data_page);
-	/* Free them */
-	mempool_free(iv_donor_page, sflc_pools_pagePool);
-	mempool_free(iv_receiver_page, sflc_pools_pagePool);
-	mempool_free(data_page, sflc_pools_pagePool);
+/* Orders conflicts by PSI (also used to look up a PSI) */
+static int cmp_conflict_psi(const void *a, const void *b)
+{
+	u32 psi_a = ((const sflc_dev_SliceConflict *)a)->psi;
+	u32 psi_b = ((const sflc_dev_SliceConflict *)b)->psi;
 
-	return err;
+	if (psi_a < psi_b)
+	{
+		return -1;
+	}
+	return psi_a > psi_b;
 }
 // sflc-raid END
 
@@ -581,6 +730,18 @@ static void sflc_tgt_dtr(struct dm_target *ti)
 		return;
 	}
 
+	// sflc-raid START
+	/* No more resyncs from it, or onto it */
+	cancel_delayed_work_sync(&vol->resync_work);
+	if (vol->mirror_vol && vol->mirror_vol != vol)
+	{
+		WRITE_ONCE(vol->mirror_vol->mirror_vol, NULL);
+		cancel_delayed_work_sync(&vol->mirror_vol->resync_work);
+	}
+	/* The repair daemon must let go of the volume */
+	sflc_dev_cancelRepairs(dev, vol->vol_idx);
+	// sflc-raid END
+
 	/* Destroy volume (also decreases refcount in device) */
 	sflc_vol_putVolume(ti, vol);
 
@@ -610,6 +771,33 @@ static int sflc_tgt_map(struct dm_target *ti, struct bio *bio)
 {
 	int err;
 	sflc_Volume *vol = ti->private;
+	sector_t slice_left;
+
+	/* Nothing gets written to a read-only volume (empty flushes go through, there is nothing to flush) */
+	if (unlikely(vol->read_only && op_is_write(bio_op(bio)) && bio_sectors(bio)))
+	{
+		return DM_MAPIO_KILL;
+	}
+
+	/* Flushes can be used as checkpoints for the position map. They always store the dirty header
+	   of a volume with a written-block map: flushed data would read back as zeros without it */
+	if (unlikely(op_is_flush(bio->bi_opf) && !bio_has_data(bio) && (READ_ONCE(vol->checkpoint_on_flush) || vol->written)))
+	{
+		err = sflc_vol_processFlush(vol, bio);
+		if (err)
+		{
+			pr_err("Could not enqueue flush; error %d\n", err);
+			return DM_MAPIO_KILL;
+		}
+
+		return DM_MAPIO_SUBMITTED;
+	}
+
+	/* Discards (and write-zeroes) may span several slices: the volume deals with each of them */
+	if (bio_op(bio) == REQ_OP_DISCARD || bio_op(bio) == REQ_OP_WRITE_ZEROES)
+	{
+		goto process;
+	}
 
 	/* If no data, just quickly remap the sector and the block device (no crypto) */
 	/* TODO: this is dangerous for deniability, will need more filtering */
@@ -636,19 +824,17 @@ static int sflc_tgt_map(struct dm_target *ti, struct bio *bio)
 		pr_err("Unaligned bio!\n");
 		return DM_MAPIO_KILL;
 	}
-	/* If it contains more than one SFLC sector, complain with the DM layer and continue */
-	if (unlikely(bio->bi_iter.bi_size > SFLC_DEV_SECTOR_SIZE))
-	{
-		pr_notice("Large bio of size %u\n", bio->bi_iter.bi_size);
-		dm_accept_partial_bio(bio, SFLC_DEV_SECTOR_SCALE);
-	}
-	/* Check that it contains exactly one SFLC sector */
-	if (unlikely(bio->bi_iter.bi_size != SFLC_DEV_SECTOR_SIZE))
+	/* If it crosses a logical slice boundary, complain with the DM layer and continue
+	   (should not happen, since max_io_len is one slice) */
+	slice_left = SFLC_VOL_LOG_SLICE_SIZE * SFLC_DEV_SECTOR_SCALE -
+			(bio->bi_iter.bi_sector % (SFLC_VOL_LOG_SLICE_SIZE * SFLC_DEV_SECTOR_SCALE));
+	if (unlikely(bio_sectors(bio) > slice_left))
 	{
-		pr_err("Wrong length (%u) of bio\n", bio->bi_iter.bi_size);
-		return DM_MAPIO_KILL;
+		pr_notice("Bio of size %u crossing a slice boundary\n", bio->bi_iter.bi_size);
+		dm_accept_partial_bio(bio, slice_left);
 	}
 
+process:
 	// sflc-raid START
 	if (redundancy != 'n' && vol->vol_idx != 0)
 	{
@@ -682,6 +868,15 @@ static int sflc_tgt_map(struct dm_target *ti, struct bio *bio)
 				return DM_MAPIO_KILL;
 			}
 		}
+		else if (redundancy == 'p')
+		{
+			err = sflc_vol_processBioWithParity(vol, bio);
+			if (err)
+			{
+				pr_err("Could not enqueue bio\n");
+				return DM_MAPIO_KILL;
+			}
+		}
 		else
 		{
 			pr_warn("Unrecognizable redundancy, not supposed to be here, what happened ?\n");
@@ -703,7 +898,30 @@ static int sflc_tgt_map(struct dm_target *ti, struct bio *bio)
 	return DM_MAPIO_SUBMITTED;
 }
 
-/* Callback executed to inform the DM about our 4096-byte sector size */
+// sflc-raid START
+/* Called when the volume goes live: slices found corrupted when opening it can now be repaired */
+static void sflc_tgt_resume(struct dm_target *ti)
+{
+	sflc_Volume *vol = ti->private;
+	int err;
+
+	if (down_interruptible(&sflc_dev_mutex))
+	{
+		pr_warn("Interrupted while waiting to start the repair of volume \"%s\"\n", vol->vol_name);
+		return;
+	}
+	err = sflc_dev_startRepair(vol->dev);
+	up(&sflc_dev_mutex);
+	if (err)
+	{
+		pr_err("Could not start the repair daemon; error %d\n", err);
+	}
+
+	return;
+}
+// sflc-raid END
+
+/* Callback executed to inform the DM about our 4096-byte sector size, and our 1 MB slices */
 static void sflc_tgt_ioHints(struct dm_target *ti, struct queue_limits *limits)
 {
 	sflc_Volume *vol = ti->private;
@@ -713,8 +931,16 @@ static void sflc_tgt_ioHints(struct dm_target *ti, struct queue_limits *limits)
 	limits->logical_block_size = SFLC_DEV_SECTOR_SIZE;
 	limits->physical_block_size = SFLC_DEV_SECTOR_SIZE;
 
+	/* A whole logical slice is the largest bio we process in one go */
 	limits->io_min = SFLC_DEV_SECTOR_SIZE;
-	limits->io_opt = SFLC_DEV_SECTOR_SIZE;
+	limits->io_opt = SFLC_VOL_LOG_SLICE_SIZE * SFLC_DEV_SECTOR_SIZE;
+	limits->max_sectors = min_t(unsigned int, limits->max_sectors,
+				    SFLC_VOL_LOG_SLICE_SIZE * SFLC_DEV_SECTOR_SCALE);
+
+	/* Only whole blocks can be discarded */
+	limits->discard_granularity = SFLC_DEV_SECTOR_SIZE;
+	limits->max_discard_sectors = SFLC_VOL_LOG_SLICE_SIZE * SFLC_DEV_SECTOR_SCALE;
+	limits->max_write_zeroes_sectors = SFLC_VOL_LOG_SLICE_SIZE * SFLC_DEV_SECTOR_SCALE;
 
 	return;
 }
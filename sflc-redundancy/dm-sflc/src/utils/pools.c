@@ -29,6 +29,11 @@
  *                  INCLUDE SECTION                  *
  *****************************************************/
 
+#include <linux/gfp.h>
+#include <linux/local_lock.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+
 #include "pools.h"
 #include "log/log.h"
 
@@ -38,7 +43,14 @@
 
 /* Pool sizes */
 #define SFLC_POOLS_BIOSET_POOL_SIZE 1024
-#define SFLC_POOLS_PAGE_POOL_SIZE 1024
+/* The bounce reserve covers the largest write (a whole slice) with all its copies: the one writer
+   waiting on it at a time eventually gets all it needs */
+#define SFLC_POOLS_BOUNCE_PAGE_POOL_SIZE (SFLC_VOL_MAX_REPLICAS * SFLC_VOL_LOG_SLICE_SIZE)
+#define SFLC_POOLS_IV_PAGE_POOL_SIZE 256
+/* The metadata reserve covers one header chunk (an IV block and its data blocks): the one load or store
+   waiting on it at a time goes chunk by chunk */
+#define SFLC_POOLS_META_PAGE_POOL_SIZE (1 + SFLC_DEV_SECTOR_TO_IV_RATIO)
+#define SFLC_POOLS_PARITY_BUF_POOL_SIZE 2
 #define SFLC_POOLS_WRITE_WORK_POOL_SIZE 1024
 #define SFLC_POOLS_DECRYPT_WORK_POOL_SIZE 1024
 
@@ -47,12 +59,31 @@
 #define SFLC_POOLS_DECRYPT_WORK_SLAB_NAME "sflc_decrypt_work_slab"
 #define SFLC_POOLS_IV_SLAB_NAME "sflc_iv_slab"
 
+/* Per-CPU bounce page magazines: capacity, and pages moved at a time when empty or full */
+#define SFLC_POOLS_MAGAZINE_SIZE 64
+#define SFLC_POOLS_MAGAZINE_BATCH 32
+
+/*****************************************************
+ *                       TYPES                       *
+ *****************************************************/
+
+/* A CPU's stash of free bounce pages. Slots [0, nr) are full, the others NULL */
+typedef struct sflc_pools_page_magazine_s
+{
+	local_lock_t lock;
+	unsigned nr;
+	struct page * pages[SFLC_POOLS_MAGAZINE_SIZE];
+} sflc_pools_PageMagazine;
+
 /*****************************************************
  *           PUBLIC VARIABLES DEFINITIONS            *
  *****************************************************/
 
 struct bio_set sflc_pools_bioset;
-mempool_t * sflc_pools_pagePool;
+mempool_t * sflc_pools_bouncePagePool;
+mempool_t * sflc_pools_ivPagePool;
+mempool_t * sflc_pools_metaPagePool;
+mempool_t * sflc_pools_parityBufPool;
 mempool_t * sflc_pools_writeWorkPool;
 mempool_t * sflc_pools_decryptWorkPool;
 struct kmem_cache * sflc_pools_ivSlab;
@@ -63,6 +94,14 @@ struct kmem_cache * sflc_pools_ivSlab;
 
 static struct kmem_cache * sflc_pools_writeWorkSlab;
 static struct kmem_cache * sflc_pools_decryptWorkSlab;
+static sflc_pools_PageMagazine __percpu * sflc_pools_bounceMagazines;
+
+/*****************************************************
+ *           PRIVATE FUNCTIONS PROTOTYPES            *
+ *****************************************************/
+
+static void * sflc_pools_allocParityBuf(gfp_t gfp, void * pool_data);
+static void sflc_pools_freeParityBuf(void * element, void * pool_data);
 
 /*****************************************************
  *           PUBLIC FUNCTIONS DEFINITIONS            *
@@ -70,6 +109,7 @@ static struct kmem_cache * sflc_pools_decryptWorkSlab;
 
 int sflc_pools_init(void)
 {
+	int cpu;
 	int err;
 
 	/* Memory pools: bioset */
@@ -79,12 +119,41 @@ int sflc_pools_init(void)
 		goto err_bioset;
 	}
 
-	/* Memory pools: page_pool */
-	sflc_pools_pagePool = mempool_create_page_pool(SFLC_POOLS_PAGE_POOL_SIZE, 0);
-	if (!sflc_pools_pagePool) {
-		pr_err("Could not create page pool\n");
+	/* Memory pools: page pools */
+	sflc_pools_bouncePagePool = mempool_create_page_pool(SFLC_POOLS_BOUNCE_PAGE_POOL_SIZE, 0);
+	if (!sflc_pools_bouncePagePool) {
+		pr_err("Could not create bounce page pool\n");
+		err = -ENOMEM;
+		goto err_bounce_pagepool;
+	}
+	sflc_pools_ivPagePool = mempool_create_page_pool(SFLC_POOLS_IV_PAGE_POOL_SIZE, 0);
+	if (!sflc_pools_ivPagePool) {
+		pr_err("Could not create IV page pool\n");
+		err = -ENOMEM;
+		goto err_iv_pagepool;
+	}
+	sflc_pools_metaPagePool = mempool_create_page_pool(SFLC_POOLS_META_PAGE_POOL_SIZE, 0);
+	if (!sflc_pools_metaPagePool) {
+		pr_err("Could not create metadata page pool\n");
 		err = -ENOMEM;
-                goto err_pagepool;
+		goto err_meta_pagepool;
+	}
+	sflc_pools_parityBufPool = mempool_create(SFLC_POOLS_PARITY_BUF_POOL_SIZE, sflc_pools_allocParityBuf, sflc_pools_freeParityBuf, NULL);
+	if (!sflc_pools_parityBufPool) {
+		pr_err("Could not create parity buffer pool\n");
+		err = -ENOMEM;
+		goto err_parity_bufpool;
+	}
+
+	/* Bounce page magazines (start empty) */
+	sflc_pools_bounceMagazines = alloc_percpu(sflc_pools_PageMagazine);
+	if (!sflc_pools_bounceMagazines) {
+		pr_err("Could not allocate bounce page magazines\n");
+		err = -ENOMEM;
+		goto err_magazines;
+	}
+	for_each_possible_cpu(cpu) {
+		local_lock_init(&per_cpu_ptr(sflc_pools_bounceMagazines, cpu)->lock);
 	}
 
         /* Memory pools: writeWork slab cache */
@@ -139,8 +208,16 @@ err_create_decrypt_work_slab:
 err_write_work_pool:
         kmem_cache_destroy(sflc_pools_writeWorkSlab);
 err_create_write_work_slab:
-        mempool_destroy(sflc_pools_pagePool);
-err_pagepool:
+        free_percpu(sflc_pools_bounceMagazines);
+err_magazines:
+        mempool_destroy(sflc_pools_parityBufPool);
+err_parity_bufpool:
+        mempool_destroy(sflc_pools_metaPagePool);
+err_meta_pagepool:
+        mempool_destroy(sflc_pools_ivPagePool);
+err_iv_pagepool:
+        mempool_destroy(sflc_pools_bouncePagePool);
+err_bounce_pagepool:
         bioset_exit(&sflc_pools_bioset);
 err_bioset:
 	return err;
@@ -148,11 +225,122 @@ err_bioset:
 
 void sflc_pools_exit(void)
 {
+	int cpu;
+
         kmem_cache_destroy(sflc_pools_ivSlab);
         mempool_destroy(sflc_pools_decryptWorkPool);
         kmem_cache_destroy(sflc_pools_decryptWorkSlab);
         mempool_destroy(sflc_pools_writeWorkPool);
         kmem_cache_destroy(sflc_pools_writeWorkSlab);
-        mempool_destroy(sflc_pools_pagePool);
+
+	/* No I/O is left: empty the magazines (offline CPUs' too) */
+	for_each_possible_cpu(cpu) {
+		sflc_pools_PageMagazine * mag = per_cpu_ptr(sflc_pools_bounceMagazines, cpu);
+
+		while (mag->nr) {
+			__free_page(mag->pages[--mag->nr]);
+		}
+	}
+	free_percpu(sflc_pools_bounceMagazines);
+
+        mempool_destroy(sflc_pools_parityBufPool);
+        mempool_destroy(sflc_pools_metaPagePool);
+        mempool_destroy(sflc_pools_ivPagePool);
+        mempool_destroy(sflc_pools_bouncePagePool);
         bioset_exit(&sflc_pools_bioset);
 }
+
+/* Takes a bounce page from this CPU's magazine. When it's empty, it's refilled with a batch
+   from the page allocator in one go, without waiting; only when that fails too does it fall
+   back on the reserve, with the given flags. Callers holding pages must not let it sleep
+   (see sflc_vol_allocWritePages()) */
+struct page * sflc_pools_allocBouncePage(gfp_t gfp)
+{
+	sflc_pools_PageMagazine * mag;
+	struct page * page = NULL;
+	unsigned long flags;
+
+	local_lock_irqsave(&sflc_pools_bounceMagazines->lock, flags);
+	mag = this_cpu_ptr(sflc_pools_bounceMagazines);
+	if (!mag->nr) {
+		mag->nr = alloc_pages_bulk_array(GFP_NOWAIT | __GFP_NOWARN, SFLC_POOLS_MAGAZINE_BATCH, mag->pages);
+	}
+	if (mag->nr) {
+		mag->nr -= 1;
+		page = mag->pages[mag->nr];
+		mag->pages[mag->nr] = NULL;
+	}
+	local_unlock_irqrestore(&sflc_pools_bounceMagazines->lock, flags);
+
+	if (unlikely(!page)) {
+		page = mempool_alloc(sflc_pools_bouncePagePool, gfp);
+	}
+
+	return page;
+}
+
+/* Gives a bounce page back to this CPU's magazine. When it's full, a batch goes back to the
+   reserve first (which keeps what it lacks, and frees the rest) */
+void sflc_pools_freeBouncePage(struct page * page)
+{
+	sflc_pools_PageMagazine * mag;
+	unsigned long flags;
+
+	/* A depleted reserve gets it first: a writer may be sleeping on it, and the pages
+	   in the magazines would never wake it up */
+	if (unlikely(READ_ONCE(sflc_pools_bouncePagePool->curr_nr) < sflc_pools_bouncePagePool->min_nr)) {
+		mempool_free(page, sflc_pools_bouncePagePool);
+		return;
+	}
+
+	local_lock_irqsave(&sflc_pools_bounceMagazines->lock, flags);
+	mag = this_cpu_ptr(sflc_pools_bounceMagazines);
+	if (unlikely(mag->nr == SFLC_POOLS_MAGAZINE_SIZE)) {
+		while (mag->nr > SFLC_POOLS_MAGAZINE_SIZE - SFLC_POOLS_MAGAZINE_BATCH) {
+			mag->nr -= 1;
+			mempool_free(mag->pages[mag->nr], sflc_pools_bouncePagePool);
+			mag->pages[mag->nr] = NULL;
+		}
+	}
+	mag->pages[mag->nr] = page;
+	mag->nr += 1;
+	local_unlock_irqrestore(&sflc_pools_bounceMagazines->lock, flags);
+}
+
+/*****************************************************
+ *          PRIVATE FUNCTIONS DEFINITIONS            *
+ *****************************************************/
+
+/* A parity buffer is an array of low-memory pages (used through page_address()) */
+static void * sflc_pools_allocParityBuf(gfp_t gfp, void * pool_data)
+{
+	struct page ** pages;
+	u32 i;
+
+	pages = kcalloc(SFLC_POOLS_PARITY_BUF_PAGES, sizeof(struct page *), gfp);
+	if (!pages) {
+		return NULL;
+	}
+	for (i = 0; i < SFLC_POOLS_PARITY_BUF_PAGES; i++) {
+		pages[i] = alloc_page(gfp);
+		if (!pages[i]) {
+			sflc_pools_freeParityBuf(pages, pool_data);
+			return NULL;
+		}
+	}
+
+	return pages;
+}
+
+static void sflc_pools_freeParityBuf(void * element, void * pool_data)
+{
+	struct page ** pages = element;
+	u32 i;
+
+	for (i = 0; i < SFLC_POOLS_PARITY_BUF_PAGES; i++) {
+		if (pages[i]) {
+			__free_page(pages[i]);
+		}
+	}
+	kfree(pages);
+}
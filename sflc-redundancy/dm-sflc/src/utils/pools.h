@@ -34,12 +34,23 @@
 
 #include "device/device.h"
 
+/*****************************************************
+ *                     CONSTANTS                     *
+ *****************************************************/
+
+/* Pages in a parity buffer: enough for a batch of old data, new data, and each parity slice */
+#define SFLC_POOLS_PARITY_BUF_PAGES ((2 + SFLC_VOL_PARITY_MAX_PARITY) * SFLC_VOL_PARITY_BATCH)
+
 /*****************************************************
  *           PUBLIC VARIABLES DECLARATIONS           *
  *****************************************************/
 
 extern struct bio_set sflc_pools_bioset;
-extern mempool_t * sflc_pools_pagePool;
+/* Separate page reserves, so that one kind of I/O can't starve the others */
+extern mempool_t * sflc_pools_bouncePagePool;	/* Encrypted copies of data writes (go through the magazines) */
+extern mempool_t * sflc_pools_ivPagePool;	/* IV cache, IV block prefetches and writes */
+extern mempool_t * sflc_pools_metaPagePool;	/* Position map load/store */
+extern mempool_t * sflc_pools_parityBufPool;	/* Parity updates and rebuilds (arrays of SFLC_POOLS_PARITY_BUF_PAGES pages) */
 extern  mempool_t * sflc_pools_writeWorkPool;
 extern  mempool_t * sflc_pools_decryptWorkPool;
 extern struct kmem_cache * sflc_pools_ivSlab;
@@ -51,5 +62,9 @@ extern struct kmem_cache * sflc_pools_ivSlab;
 int sflc_pools_init(void);
 void sflc_pools_exit(void);
 
+/* Bounce pages for data writes, from the per-CPU magazines (callable from endio) */
+struct page * sflc_pools_allocBouncePage(gfp_t gfp);
+void sflc_pools_freeBouncePage(struct page * page);
+
 
 #endif /* _SFLC_UTILS_POOLS_H_ */
@@ -37,6 +37,7 @@
 
 #define SFLC_QUEUES_WRITE_WQ_NAME "sflc_write_workqueue"
 #define SFLC_QUEUES_DECRYPT_WQ_NAME "sflc_decrypt_workqueue"
+#define SFLC_QUEUES_IV_WRITEBACK_WQ_NAME "sflc_iv_writeback_workqueue"
 
 /*****************************************************
  *           PUBLIC VARIABLES DEFINITIONS            *
@@ -44,6 +45,7 @@
 
 struct workqueue_struct * sflc_queues_writeQueue;
 struct workqueue_struct * sflc_queues_decryptQueue;
+struct workqueue_struct * sflc_queues_ivWritebackQueue;
 
 /*****************************************************
  *           PUBLIC FUNCTIONS DEFINITIONS            *
@@ -69,9 +71,19 @@ int sflc_queues_init(void)
                 goto err_decrypt_queue;
         }
 
+        /* IV writeback workqueue */
+        sflc_queues_ivWritebackQueue = create_workqueue(SFLC_QUEUES_IV_WRITEBACK_WQ_NAME);
+        if (!sflc_queues_ivWritebackQueue) {
+                pr_err("Could not create IV writeback workqueue\n");
+                err = -ENOMEM;
+                goto err_iv_writeback_queue;
+        }
+
         return 0;
 
 
+err_iv_writeback_queue:
+        destroy_workqueue(sflc_queues_decryptQueue);
 err_decrypt_queue:
         destroy_workqueue(sflc_queues_writeQueue);
 err_write_queue:
@@ -80,6 +92,7 @@ err_write_queue:
 
 void sflc_queues_exit(void)
 {
+        destroy_workqueue(sflc_queues_ivWritebackQueue);
         destroy_workqueue(sflc_queues_decryptQueue);
         destroy_workqueue(sflc_queues_writeQueue);
 }
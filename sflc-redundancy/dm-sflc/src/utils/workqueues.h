@@ -40,6 +40,7 @@
 
 extern struct workqueue_struct * sflc_queues_writeQueue;
 extern struct workqueue_struct * sflc_queues_decryptQueue;
+extern struct workqueue_struct * sflc_queues_ivWritebackQueue;
 
 /*****************************************************
  *            PUBLIC FUNCTIONS PROTOTYPES            *
@@ -0,0 +1,284 @@
+/*
+ *  Copyright The Shufflecake Project Authors (2022)
+ *  Copyright The Shufflecake Project Contributors (2022)
+ *  Copyright Contributors to the The Shufflecake Project.
+ *
+ *  See the AUTHORS file at the top-level directory of this distribution and at
+ *  <https://www.shufflecake.net/permalinks/shufflecake-userland/AUTHORS>
+ *
+ *  This file is part of the program dm-sflc, which is part of the Shufflecake
+ *  Project. Shufflecake is a plausible deniability (hidden storage) layer for
+ *  Linux. See <https://www.shufflecake.net>.
+ *
+ *  This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version. This program is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ *  Public License for more details. You should have received a copy of the
+ *  GNU General Public License along with this program.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file only implements the discards (and the write-zeroes, which take
+ * the same path but only clear bits of the written-block map, see written.c).
+ * Discards never reach the underlying device (which slices are in use is
+ * exactly what must not show). Instead, each slice keeps track of its blocks
+ * discarded since it was mapped, and once none of its blocks is live, the
+ * slice is unmapped and its PSI goes back to the free pool (only once the
+ * header saying so is on disk). A write to a discarded block makes it live
+ * again.
+ *
+ * The discarded blocks of a slice are a bitmap (a bare count could not tell a
+ * block discarded twice), only allocated for the slices that have seen a
+ * discard, and only kept in memory: after a reopen, all the blocks of the
+ * mapped slices are live again.
+ */
+
+/*****************************************************
+ *                  INCLUDE SECTION                  *
+ *****************************************************/
+
+#include <linux/blkdev.h>
+
+#include "volume.h"
+#include "utils/pools.h"
+#include "utils/workqueues.h"
+#include "log/log.h"
+
+/*****************************************************
+ *           PRIVATE FUNCTIONS PROTOTYPES            *
+ *****************************************************/
+
+static void sflc_vol_doDiscard(struct work_struct * work);
+static void sflc_vol_discardBlocks(sflc_Volume * vol, u32 lsi, u32 first, u32 nr);
+static void sflc_vol_zeroBlocks(sflc_Volume * vol, u32 lsi, u32 first, u32 nr);
+static void sflc_vol_unmapSlice(sflc_Volume * vol, u32 lsi);
+
+/*****************************************************
+ *           PUBLIC FUNCTIONS DEFINITIONS            *
+ *****************************************************/
+
+/* Queues the discard (or write-zeroes) to the write workqueue (unmapping sleeps). The same blocks
+   are discarded in copy_vol (NULL if none): at the same LSIs, or at the replica LSIs if it's the volume itself */
+int sflc_vol_processDiscard(sflc_Volume * vol, sflc_Volume * copy_vol, struct bio * bio)
+{
+        sflc_vol_WriteWork * write_work;
+
+        write_work = mempool_alloc(sflc_pools_writeWorkPool, GFP_NOIO);
+        if (!write_work) {
+                pr_err("Failed allocation of work structure\n");
+                return -ENOMEM;
+        }
+
+        /* Set fields */
+        write_work->vol = vol;
+        write_work->orig_bio = bio;
+        write_work->mirror_vol = copy_vol;
+        write_work->nr_mirrors = 0;
+        INIT_WORK(&write_work->work, sflc_vol_doDiscard);
+
+        /* Enqueue */
+        queue_work(sflc_queues_writeQueue, &write_work->work);
+
+        return 0;
+}
+
+/* The blocks are being written: they are live again (if they were discarded) */
+void sflc_vol_reviveBlocks(sflc_Volume * vol, sector_t log_sector, u32 nr_sectors)
+{
+        u32 lsi = SFLC_VOL_SECTOR_TO_LSI(log_sector);
+        u32 first = (log_sector / SFLC_DEV_SECTOR_SCALE) % SFLC_VOL_LOG_SLICE_SIZE;
+        u32 nr = DIV_ROUND_UP(nr_sectors, SFLC_DEV_SECTOR_SCALE);
+        unsigned long * discarded;
+
+        /* Nothing discarded in the slice (a discard can only add the blocks it covers, not these) */
+        if (!xa_load(&vol->discarded, lsi)) {
+                return;
+        }
+
+        mutex_lock(&vol->discard_lock);
+        discarded = xa_load(&vol->discarded, lsi);
+        if (discarded) {
+                bitmap_clear(discarded, first, min_t(u32, nr, SFLC_VOL_LOG_SLICE_SIZE - first));
+                /* All live again */
+                if (bitmap_empty(discarded, SFLC_VOL_LOG_SLICE_SIZE)) {
+                        xa_erase(&vol->discarded, lsi);
+                        bitmap_free(discarded);
+                }
+        }
+        mutex_unlock(&vol->discard_lock);
+}
+
+/* Forgets all the discarded blocks (on volume teardown) */
+void sflc_vol_freeDiscarded(sflc_Volume * vol)
+{
+        unsigned long * discarded;
+        unsigned long lsi;
+
+        xa_for_each(&vol->discarded, lsi, discarded) {
+                bitmap_free(discarded);
+        }
+        xa_destroy(&vol->discarded);
+}
+
+/*****************************************************
+ *          PRIVATE FUNCTIONS DEFINITIONS            *
+ *****************************************************/
+
+/* Discards (or zeroes) the whole blocks covered by the bio, slice by slice, in the volume and its copies */
+static void sflc_vol_doDiscard(struct work_struct * work)
+{
+        sflc_vol_WriteWork * write_work = container_of(work, sflc_vol_WriteWork, work);
+        sflc_Volume * vol = write_work->vol;
+        sflc_Volume * copy_vol = write_work->mirror_vol;
+        struct bio * bio = write_work->orig_bio;
+        void (*handle)(sflc_Volume *, u32, u32, u32) = sflc_vol_discardBlocks;
+        /* Only whole blocks can be discarded */
+        u64 block = DIV_ROUND_UP(bio->bi_iter.bi_sector, SFLC_DEV_SECTOR_SCALE);
+        u64 end = bio_end_sector(bio) / SFLC_DEV_SECTOR_SCALE;
+
+        mempool_free(write_work, sflc_pools_writeWorkPool);
+
+        /* Write-zeroes are block-aligned (the logical block size is a block) */
+        if (bio_op(bio) == REQ_OP_WRITE_ZEROES) {
+                handle = sflc_vol_zeroBlocks;
+        }
+
+        while (block < end) {
+                u32 lsi = block / SFLC_VOL_LOG_SLICE_SIZE;
+                u32 first = block % SFLC_VOL_LOG_SLICE_SIZE;
+                u32 nr = min_t(u64, end - block, SFLC_VOL_LOG_SLICE_SIZE - first);
+
+                if (lsi >= vol->dev->tot_slices) {
+                        break;
+                }
+
+                handle(vol, lsi, first, nr);
+                if (copy_vol == vol) {
+                        u32 copies[SFLC_VOL_MAX_REPLICAS - 1];
+                        u32 nr_copies = sflc_vol_replicaLsis(vol, lsi, copies);
+                        u32 c;
+
+                        for (c = 0; c < nr_copies; c++) {
+                                handle(vol, copies[c], first, nr);
+                        }
+                } else if (copy_vol) {
+                        handle(copy_vol, lsi, first, nr);
+                }
+
+                block += nr;
+        }
+
+        /* Discards are only advisory: whatever could not be tracked stays allocated */
+        bio->bi_status = BLK_STS_OK;
+        bio_endio(bio);
+}
+
+/* Marks the blocks of the slice as discarded, and unmaps it if none is left live */
+static void sflc_vol_discardBlocks(sflc_Volume * vol, u32 lsi, u32 first, u32 nr)
+{
+        unsigned long * discarded;
+        int err;
+
+        if (lsi >= vol->dev->tot_slices) {
+                return;
+        }
+        /* A slice waiting for repair, or whose replica lags behind, is left alone */
+        if (sflc_dev_repairIsQueued(vol->dev, vol->vol_idx, lsi) || sflc_vol_replicaIsStale(vol, lsi)) {
+                return;
+        }
+
+        mutex_lock(&vol->discard_lock);
+
+        /* Nothing to discard in an unmapped slice */
+        if (READ_ONCE(vol->fmap[lsi]) == SFLC_VOL_FMAP_INVALID_PSI) {
+                goto out;
+        }
+
+        discarded = xa_load(&vol->discarded, lsi);
+        if (!discarded) {
+                discarded = bitmap_zalloc(SFLC_VOL_LOG_SLICE_SIZE, GFP_NOIO);
+                if (!discarded) {
+                        goto out;
+                }
+                err = xa_err(xa_store(&vol->discarded, lsi, discarded, GFP_NOIO));
+                if (err) {
+                        pr_warn_ratelimited("Could not track discarded blocks of slice %u; error %d\n", lsi, err);
+                        bitmap_free(discarded);
+                        goto out;
+                }
+        }
+        bitmap_set(discarded, first, nr);
+
+        /* Some block is still live */
+        if (!bitmap_full(discarded, SFLC_VOL_LOG_SLICE_SIZE)) {
+                goto out;
+        }
+        xa_erase(&vol->discarded, lsi);
+        bitmap_free(discarded);
+        sflc_vol_unmapSlice(vol, lsi);
+
+out:
+        mutex_unlock(&vol->discard_lock);
+}
+
+/* The blocks of the slice read as zeros from now on (they were never written, as far as reads go) */
+static void sflc_vol_zeroBlocks(sflc_Volume * vol, u32 lsi, u32 first, u32 nr)
+{
+        if (lsi >= vol->dev->tot_slices) {
+                return;
+        }
+
+        mutex_lock(&vol->fmap_lock);
+        sflc_vol_forgetWrittenLocked(vol, lsi, first, nr);
+        mutex_unlock(&vol->fmap_lock);
+}
+
+/* Gives the PSI of the slice back to the free pool. Caller holds discard_lock. */
+static void sflc_vol_unmapSlice(sflc_Volume * vol, u32 lsi)
+{
+        sflc_Device * dev = vol->dev;
+        u32 psi;
+        int err;
+
+        mutex_lock(&vol->fmap_lock);
+
+        psi = vol->fmap[lsi];
+        if (psi == SFLC_VOL_FMAP_INVALID_PSI) {
+                goto out;
+        }
+
+        /* Forget the mapping: concurrent lockless lookups will retry */
+        write_seqcount_begin(&vol->fmap_seqcount);
+        WRITE_ONCE(vol->fmap[lsi], SFLC_VOL_FMAP_INVALID_PSI);
+        write_seqcount_end(&vol->fmap_seqcount);
+        vol->mapped_slices -= 1;
+        set_bit(lsi / SFLC_VOL_HEADER_MAPPINGS_PER_BLOCK, vol->fmap_dirty);
+        /* Whatever slice gets the LSI next starts out unwritten */
+        sflc_vol_forgetWrittenLocked(vol, lsi, 0, SFLC_VOL_LOG_SLICE_SIZE);
+
+        /* The PSI can only go to another volume once the header on disk no longer claims it:
+           otherwise, after a crash, the conflict repair at open could overwrite its new data.
+           If the store fails, the PSI stays taken until the volume is closed */
+        err = sflc_vol_storeFmapLocked(vol);
+        if (err) {
+                pr_warn("Could not store fmap after discarding slice %u of volume %s; error %d. Its PSI stays taken\n",
+                        lsi, vol->vol_name, err);
+                goto out;
+        }
+
+        mutex_lock(&dev->rmap_lock);
+        /* A PSI also claimed by another volume stays with its owner */
+        if (psi < dev->tot_slices && dev->rmap[psi] == vol->vol_idx) {
+                /* The IVs are garbage now: drop them before anyone else can map the PSI */
+                sflc_dev_dropIvBlock(dev, psi);
+                sflc_dev_unsetRmap(dev, psi);
+        }
+        mutex_unlock(&dev->rmap_lock);
+
+out:
+        mutex_unlock(&vol->fmap_lock);
+}
@@ -29,20 +29,88 @@
  *                  INCLUDE SECTION                  *
  *****************************************************/
 
+#include <linux/blkdev.h>
+#include <linux/completion.h>
+
 #include "volume.h"
 #include "crypto/rand/rand.h"
 #include "utils/pools.h"
+#include "utils/workqueues.h"
 #include "log/log.h"
 
 /*****************************************************
  *                     CONSTANTS                     *
  *****************************************************/
 
+/*****************************************************
+ *                       TYPES                       *
+ *****************************************************/
+
+typedef struct sflc_vol_fmap_io_s sflc_vol_FmapIo;
+
+/* A header slice (IV block + up to 256 fmap or dirty-log blocks), loaded or stored as a unit */
+typedef struct sflc_vol_fmap_chunk_s
+{
+        sflc_Volume           * vol;
+        int                     rw;
+        sflc_vol_FmapIo       * io;
+
+        /* Index of the header slice, and how far its used blocks go */
+        u32                     idx;
+        u32                     nr_blocks;
+
+        /* The pages to be read/written (only the used blocks have one, and when storing only the dirty ones) */
+        struct page           * iv_page;
+        struct page           * data_pages[SFLC_DEV_SECTOR_TO_IV_RATIO];
+        u32                     nr_pages;
+
+        /* Bios still in flight */
+        atomic_t                bios_pending;
+
+        /* The crypto work, and on which CPU to run it */
+        int                     cpu;
+        struct work_struct      work;
+} sflc_vol_FmapChunk;
+
+/* A whole fmap load/store */
+struct sflc_vol_fmap_io_s
+{
+        /* Chunks not yet completed */
+        atomic_t                chunks_pending;
+        struct completion       done;
+        /* First error encountered */
+        int                     err;
+
+        u32                     nr_chunks;
+        sflc_vol_FmapChunk      chunks[];
+};
+
 /*****************************************************
  *           PRIVATE FUNCTIONS PROTOTYPES            *
  *****************************************************/
 
 //s32 sflc_vol_mapSlice(sflc_Volume * vol, u32 lsi, int op);
+static u32 sflc_vol_lookupSlice(sflc_Volume * vol, u32 lsi);
+static bool sflc_vol_headerBlockUsed(sflc_Volume * vol, u32 blk);
+
+static sflc_vol_FmapIo * sflc_vol_newFmapIo(sflc_Volume * vol, int rw);
+static void sflc_vol_freeFmapIo(sflc_vol_FmapIo * io);
+static int sflc_vol_allocFmapPages(sflc_vol_FmapIo * io, u32 first, u32 last, gfp_t gfp);
+static void sflc_vol_freeFmapPages(sflc_vol_FmapIo * io, u32 first, u32 last);
+static int sflc_vol_doFmapIo(sflc_vol_FmapIo * io);
+static int sflc_vol_runFmapIo(sflc_vol_FmapIo * io, u32 first, u32 last);
+static void sflc_vol_submitFmapChunk(sflc_vol_FmapChunk * chunk);
+static void sflc_vol_fmapChunkEndIo(struct bio * bio);
+static void sflc_vol_decryptFmapChunk(struct work_struct * work);
+static void sflc_vol_encryptFmapChunk(struct work_struct * work);
+static void sflc_vol_fmapChunkDone(sflc_vol_FmapChunk * chunk);
+
+/*****************************************************
+ *                PRIVATE VARIABLES                  *
+ *****************************************************/
+
+/* Taken by the loads/stores that have to wait for the page reserve: one at a time, one chunk at a time */
+static DEFINE_MUTEX(sflc_vol_fmapAllocLock);
 
 /*****************************************************
  *           PUBLIC FUNCTIONS DEFINITIONS            *
@@ -101,29 +169,10 @@ s64 sflc_vol_remapSector(sflc_Volume * vol, sector_t log_sector, int op, u32 * p
 int sflc_vol_loadFmap(sflc_Volume * vol)
 {
         sflc_Device * dev = vol->dev;
-        sector_t sector;
-        struct page * iv_page;
-        u8 * iv_ptr;
-        struct page * data_page;
-        u8 * data_ptr;
+        sflc_vol_FmapIo * io;
         u32 lsi;
         int err;
 
-        /* Allocate pages */
-        iv_page = mempool_alloc(sflc_pools_pagePool, GFP_NOIO);
-        if (!iv_page) {
-                pr_err("Could not allocate IV page\n");
-                return -ENOMEM;
-        }
-        data_page = mempool_alloc(sflc_pools_pagePool, GFP_NOIO);
-        if (!data_page) {
-                pr_err("Could not allocate data page\n");
-                return -ENOMEM;
-        }
-        /* Kmap them */
-        iv_ptr = kmap(iv_page);
-        data_ptr = kmap(data_page);
-
         /* Lock both the forward and the reverse position maps */
         if (mutex_lock_interruptible(&vol->fmap_lock)) {
                 pr_err("Interrupted while waiting to lock fmap\n");
@@ -135,195 +184,604 @@ int sflc_vol_loadFmap(sflc_Volume * vol)
                 return -EINTR;
         }
 
-        /* Starting sector of the volume header (first sector is reserved to userland tool) */
-        sector = (vol->vol_idx * SFLC_VOL_HEADER_SIZE) + 1;
-        /* Starting LSI in the fmap */
-        lsi = 0;
+        /* Allocate all the chunks */
+        io = sflc_vol_newFmapIo(vol, READ);
+        if (IS_ERR(io)) {
+                err = PTR_ERR(io);
+                pr_err("Could not allocate fmap I/O; error %d\n", err);
+                goto out;
+        }
 
-        /* Loop over the 4 IV-data slices */
-        int i;
-        for (i = 0; i < SFLC_VOL_HEADER_IV_BLOCKS && lsi < dev->tot_slices; i++) {
-                /* Load the IV block */
-                err = sflc_dev_rwSector(dev, iv_page, sector, READ);
-                if (err) {
-                        pr_err("Could not read IV block i=%d at sector %llu; error %d\n", i, sector, err);
-                        goto out;
-                }
-                sector += 1;
+        /* Read all the chunks at once: each is decrypted (into the fmap) as soon as it comes in */
+        err = sflc_vol_doFmapIo(io);
+        sflc_vol_freeFmapIo(io);
+        if (err) {
+                pr_err("Could not load fmap; error %d\n", err);
+                goto out;
+        }
+        /* The log from the last session (empty if there was none) */
+        if (vol->replica_stale) {
+                sflc_vol_dlogLoaded(vol);
+        }
+        /* And the written-block map (all of the mapped slices if there was none) */
+        sflc_vol_wmapLoaded(vol);
 
-                /* Loop over the 256 data blocks */
-                int j;
-                for (j = 0; j < SFLC_DEV_SECTOR_TO_IV_RATIO && lsi < dev->tot_slices; j++) {
-                        /* Load the data block */
-                        err = sflc_dev_rwSector(dev, data_page, sector, READ);
-                        if (err) {
-                                pr_err("Could not read data block i=%d, j=%d at sector %llu; error %d\n", i, j, sector, err);
-                                goto out;
-                        }
-                        sector += 1;
+        /* Add the mappings to the device's rmap and to the count */
+        for (lsi = 0; lsi < dev->tot_slices; lsi++) {
+                u32 psi = vol->fmap[lsi];
+
+                if (psi == SFLC_VOL_FMAP_INVALID_PSI) {
+                        continue;
+                }
 
-                        /* Decrypt it in place */
-                        err = sflc_sk_decrypt(vol->skctx, data_ptr, data_ptr, SFLC_DEV_SECTOR_SIZE, (iv_ptr + j*SFLC_SK_IV_LEN));
+                /* If another volume owns it already, just take note of the conflict */
+                if (psi < dev->tot_slices && dev->rmap[psi] != SFLC_DEV_RMAP_INVALID_VOL) {
+                        err = sflc_dev_addConflict(dev, psi, vol->vol_idx, lsi);
                         if (err) {
-                                pr_err("Could not decrypt data block i=%d, j=%d at sector %llu; error %d\n", i, j, sector, err);
+                                pr_err("Could not record slice conflict; error %d\n", err);
                                 goto out;
                         }
-
-                        /* Loop over the 1024 fmap entries in this data block */
-                        int k;
-                        for (k = 0; k < SFLC_VOL_HEADER_MAPPINGS_PER_BLOCK && lsi < dev->tot_slices; k++) {
-                                /* An entry is just a single big-endian PSI, the LSI
-                                   is implicitly the index of this entry */
-                                __be32 * be_psi = (void *) (data_ptr + (k * sizeof(__be32)));
-                                u32 psi = be32_to_cpu(*be_psi);
-
-                                /* Add mapping to the volume's fmap */
-                                vol->fmap[lsi] = psi;
-                                /* Also add it to the device's rmap and to the count, if LSI is actually mapped */
-                                if (psi != SFLC_VOL_FMAP_INVALID_PSI) {
-                                        sflc_dev_setRmap(dev, psi, vol->vol_idx);
-                                        vol->mapped_slices += 1;
-                                }
-
-                                /* Next iteration */
-                                lsi += 1;
-                        }
+                } else {
+                        sflc_dev_setRmap(dev, psi, vol->vol_idx);
                 }
+                vol->mapped_slices += 1;
         }
-        /* No error if we made it here */
-        err = 0;
 
 out:
         /* Unlock both maps */
         mutex_unlock(&dev->rmap_lock);
         mutex_unlock(&vol->fmap_lock);
-        /* Kunmap pages */
-        kunmap(iv_page);
-        kunmap(data_page);
-        /* Free them */
-        mempool_free(iv_page, sflc_pools_pagePool);
-        mempool_free(data_page, sflc_pools_pagePool);
 
         return err;
 }
 
-/* Stores (and encrypts) the position map to the volume's header */
+/* Stores (and encrypts) the dirty blocks of the position map to the volume's header */
 int sflc_vol_storeFmap(sflc_Volume * vol)
 {
-        sflc_Device * dev = vol->dev;
-        sector_t sector;
-        struct page * iv_page;
-        u8 * iv_ptr;
-        struct page * data_page;
-        u8 * data_ptr;
-        u32 lsi;
         int err;
 
-        /* Allocate pages */
-        iv_page = mempool_alloc(sflc_pools_pagePool, GFP_NOIO);
-        if (!iv_page) {
-                pr_err("Could not allocate IV page\n");
-                return -ENOMEM;
-        }
-        data_page = mempool_alloc(sflc_pools_pagePool, GFP_NOIO);
-        if (!data_page) {
-                pr_err("Could not allocate data page\n");
-                return -ENOMEM;
-        }
-        /* Kmap them */
-        iv_ptr = kmap(iv_page);
-        data_ptr = kmap(data_page);
-
-        /* Lock both the forward and the reverse position maps */
+        /* Lock the forward position map (no new slices get mapped meanwhile) */
         if (mutex_lock_interruptible(&vol->fmap_lock)) {
                 pr_err("Interrupted while waiting to lock fmap\n");
                 return -EINTR;
         }
-        if (mutex_lock_interruptible(&dev->rmap_lock)) {
-                pr_err("Interrupted while waiting to lock rmap\n");
-                mutex_unlock(&vol->fmap_lock);
-                return -EINTR;
+        err = sflc_vol_storeFmapLocked(vol);
+        mutex_unlock(&vol->fmap_lock);
+
+        return err;
+}
+
+/* Same, with the fmap_lock already held */
+int sflc_vol_storeFmapLocked(sflc_Volume * vol)
+{
+        sflc_vol_FmapIo * io;
+        bool dlog_dirty;
+        int err;
+
+        /* Nothing to do if nothing changed, or if the header must be left alone (whatever
+           changed in memory, e.g. a written-block map rebuilt at load time) */
+        if (vol->read_only || bitmap_empty(vol->fmap_dirty, SFLC_VOL_HEADER_DATA_BLOCKS)) {
+                return 0;
         }
 
-        /* Starting sector of the volume header */
-        sector = (vol->vol_idx * SFLC_VOL_HEADER_SIZE) + 1;
-        /* Starting LSI in the fmap */
-        lsi = 0;
+        /* Settle what goes in the dirty-replica log */
+        dlog_dirty = vol->replica_stale &&
+                     find_next_bit(vol->fmap_dirty, SFLC_VOL_HEADER_DATA_BLOCKS, SFLC_VOL_DLOG_FIRST_BLOCK) < SFLC_VOL_HEADER_DATA_BLOCKS;
+        if (dlog_dirty) {
+                sflc_vol_prepareDlog(vol);
+        }
+
+        /* Allocate the chunks (their pages come with the I/O) */
+        io = sflc_vol_newFmapIo(vol, WRITE);
+        if (IS_ERR(io)) {
+                err = PTR_ERR(io);
+                pr_err("Could not allocate fmap I/O; error %d\n", err);
+                return err;
+        }
+
+        /* Encrypt the chunks in parallel, each is written as soon as it's ready */
+        err = sflc_vol_doFmapIo(io);
+        sflc_vol_freeFmapIo(io);
+        if (err) {
+                /* Leave the blocks dirty, to be retried at the next store */
+                pr_err("Could not store fmap; error %d\n", err);
+                return err;
+        }
+
+        /* All clean */
+        bitmap_zero(vol->fmap_dirty, SFLC_VOL_HEADER_DATA_BLOCKS);
+        if (dlog_dirty) {
+                sflc_vol_dlogStored(vol);
+        }
+
+        return 0;
+}
+
+/*****************************************************
+ *          PRIVATE FUNCTIONS DEFINITIONS            *
+ *****************************************************/
 
-        /* Loop over the 4 IV-data slices */
+/* The fmap blocks come first, the dirty-replica log (if any) last, the written-block map (if any) right before it */
+static bool sflc_vol_headerBlockUsed(sflc_Volume * vol, u32 blk)
+{
+        return blk < SFLC_VOL_FMAP_BLOCKS(vol->dev->tot_slices) || sflc_vol_isDlogBlock(vol, blk) || sflc_vol_isWmapBlock(vol, blk);
+}
+
+/* Allocates the chunks needed to load/store the whole fmap (without their pages).
+   Returns an ERR_PTR() if unsuccessful. */
+static sflc_vol_FmapIo * sflc_vol_newFmapIo(sflc_Volume * vol, int rw)
+{
+        sflc_vol_FmapIo * io;
+        u32 nr_chunks;
+        int cpu;
         int i;
-        for (i = 0; i < SFLC_VOL_HEADER_IV_BLOCKS && lsi < dev->tot_slices; i++) {
-                /* Fill the IV block with random bytes */
-                err = sflc_rand_getBytes(iv_ptr, SFLC_DEV_SECTOR_SIZE);
-                if (err) {
-                        pr_err("Could not sample random IV for block i=%d at sector %llu; error %d\n", i, sector, err);
-                        goto out;
+
+        /* Every header slice may hold used blocks (the ones that don't are skipped) */
+        nr_chunks = SFLC_VOL_HEADER_IV_BLOCKS;
+
+        /* Allocate the structure */
+        io = kzalloc(struct_size(io, chunks, nr_chunks), GFP_NOIO);
+        if (!io) {
+                pr_err("Could not allocate FmapIo\n");
+                return ERR_PTR(-ENOMEM);
+        }
+        io->nr_chunks = nr_chunks;
+        init_completion(&io->done);
+        io->err = 0;
+
+        /* Init the chunks, spreading their crypto over the online CPUs */
+        cpu = cpumask_first(cpu_online_mask);
+        for (i = 0; i < nr_chunks; i++) {
+                sflc_vol_FmapChunk * chunk = &io->chunks[i];
+                int j;
+
+                chunk->vol = vol;
+                chunk->rw = rw;
+                chunk->io = io;
+                chunk->idx = i;
+                chunk->cpu = cpu;
+                INIT_WORK(&chunk->work, (rw == READ) ? sflc_vol_decryptFmapChunk : sflc_vol_encryptFmapChunk);
+
+                /* Up to the last used block */
+                for (j = SFLC_DEV_SECTOR_TO_IV_RATIO; j > 0; j--) {
+                        if (sflc_vol_headerBlockUsed(vol, i * SFLC_DEV_SECTOR_TO_IV_RATIO + j - 1)) {
+                                break;
+                        }
                 }
-                /* Store it on the disk (before it gets changed by the encryption) */
-                err = sflc_dev_rwSector(dev, iv_page, sector, WRITE);
-                if (err) {
-                        pr_err("Could not read IV block i=%d at sector %llu; error %d\n", i, sector, err);
-                        goto out;
+                chunk->nr_blocks = j;
+
+                /* Next CPU */
+                cpu = cpumask_next(cpu, cpu_online_mask);
+                if (cpu >= nr_cpu_ids) {
+                        cpu = cpumask_first(cpu_online_mask);
                 }
-                sector += 1;
+        }
+
+        return io;
+}
 
-                /* Loop over the 256 data blocks */
+/* Frees the chunks and their pages */
+static void sflc_vol_freeFmapIo(sflc_vol_FmapIo * io)
+{
+        sflc_vol_freeFmapPages(io, 0, io->nr_chunks);
+        kfree(io);
+}
+
+/* Allocates the pages of the chunks in [first, last): only the used blocks get one, and when storing
+   only the dirty ones. Returns -ENOMEM if the flags don't let it wait (the pages taken are left for
+   sflc_vol_freeFmapPages()). */
+static int sflc_vol_allocFmapPages(sflc_vol_FmapIo * io, u32 first, u32 last, gfp_t gfp)
+{
+        u32 i;
+
+        for (i = first; i < last; i++) {
+                sflc_vol_FmapChunk * chunk = &io->chunks[i];
+                sflc_Volume * vol = chunk->vol;
                 int j;
-                for (j = 0; j < SFLC_DEV_SECTOR_TO_IV_RATIO && lsi < dev->tot_slices; j++) {
-                        /* Loop over the 1024 fmap entries that fit in this data block */
-                        int k;
-                        for (k = 0; k < SFLC_VOL_HEADER_MAPPINGS_PER_BLOCK && lsi < dev->tot_slices; k++) {
-                                /* Get the PSI for the current LSI */
-                                u32 psi = vol->fmap[lsi];
-                                /* Write it into the block as big-endian */
-                                __be32 * be_psi = (void *) (data_ptr + (k * sizeof(__be32)));
-                                *be_psi = cpu_to_be32(psi);
-
-                                /* Next iteration */
-                                lsi += 1;
+
+                if (chunk->nr_blocks == 0) {
+                        continue;
+                }
+
+                chunk->iv_page = mempool_alloc(sflc_pools_metaPagePool, gfp);
+                if (!chunk->iv_page) {
+                        return -ENOMEM;
+                }
+                for (j = 0; j < chunk->nr_blocks; j++) {
+                        u32 blk = i * SFLC_DEV_SECTOR_TO_IV_RATIO + j;
+
+                        /* Unused blocks are left alone, and so are the clean ones when storing */
+                        if (!sflc_vol_headerBlockUsed(vol, blk) || (chunk->rw == WRITE && !test_bit(blk, vol->fmap_dirty))) {
+                                continue;
                         }
 
-                        /* Encrypt it in place */
-                        err = sflc_sk_encrypt(vol->skctx, data_ptr, data_ptr, SFLC_DEV_SECTOR_SIZE, (iv_ptr + j*SFLC_SK_IV_LEN));
-                        if (err) {
-                                pr_err("Could not encrypt data block i=%d, j=%d at sector %llu; error %d\n", i, j, sector, err);
-                                goto out;
+                        chunk->data_pages[j] = mempool_alloc(sflc_pools_metaPagePool, gfp);
+                        if (!chunk->data_pages[j]) {
+                                return -ENOMEM;
                         }
+                        chunk->nr_pages += 1;
+                }
+        }
 
-                        /* Store the data block */
-                        err = sflc_dev_rwSector(dev, data_page, sector, WRITE);
-                        if (err) {
-                                pr_err("Could not write data block i=%d, j=%d at sector %llu; error %d\n", i, j, sector, err);
-                                goto out;
+        return 0;
+}
+
+/* Gives the pages of the chunks in [first, last) back to the reserve */
+static void sflc_vol_freeFmapPages(sflc_vol_FmapIo * io, u32 first, u32 last)
+{
+        u32 i;
+
+        for (i = first; i < last; i++) {
+                sflc_vol_FmapChunk * chunk = &io->chunks[i];
+                int j;
+
+                if (chunk->iv_page) {
+                        mempool_free(chunk->iv_page, sflc_pools_metaPagePool);
+                        chunk->iv_page = NULL;
+                }
+                for (j = 0; j < chunk->nr_blocks; j++) {
+                        if (chunk->data_pages[j]) {
+                                mempool_free(chunk->data_pages[j], sflc_pools_metaPagePool);
+                                chunk->data_pages[j] = NULL;
                         }
-                        sector += 1;              
                 }
+                chunk->nr_pages = 0;
         }
-        /* No error if we made it here */
-        err = 0;
+}
 
-out:
-        /* Unlock both maps */
-        mutex_unlock(&dev->rmap_lock);
-        mutex_unlock(&vol->fmap_lock);
-        /* Kunmap pages */
-        kunmap(iv_page);
-        kunmap(data_page);
-        /* Free them */
-        mempool_free(iv_page, sflc_pools_pagePool);
-        mempool_free(data_page, sflc_pools_pagePool);
+/* Loads/stores the whole header, the way sflc_vol_allocWritePages() takes bounce pages: all the
+   chunks at once if their pages are there without waiting, otherwise one chunk at a time under a
+   mutex, waiting for the reserve (which covers a chunk) with no other page held. */
+static int sflc_vol_doFmapIo(sflc_vol_FmapIo * io)
+{
+        int err;
+        u32 i;
+
+        err = sflc_vol_allocFmapPages(io, 0, io->nr_chunks, GFP_NOWAIT | __GFP_NOWARN);
+        if (likely(!err)) {
+                err = sflc_vol_runFmapIo(io, 0, io->nr_chunks);
+                sflc_vol_freeFmapPages(io, 0, io->nr_chunks);
+                return err;
+        }
+        sflc_vol_freeFmapPages(io, 0, io->nr_chunks);
+
+        mutex_lock(&sflc_vol_fmapAllocLock);
+        for (i = 0; i < io->nr_chunks && !err; i++) {
+                /* Can't fail */
+                sflc_vol_allocFmapPages(io, i, i + 1, GFP_NOIO);
+                err = sflc_vol_runFmapIo(io, i, i + 1);
+                sflc_vol_freeFmapPages(io, i, i + 1);
+        }
+        mutex_unlock(&sflc_vol_fmapAllocLock);
 
         return err;
 }
 
-/*****************************************************
- *          PRIVATE FUNCTIONS DEFINITIONS            *
- *****************************************************/
+/* Starts the chunks in [first, last), and waits for them to complete */
+static int sflc_vol_runFmapIo(sflc_vol_FmapIo * io, u32 first, u32 last)
+{
+        struct blk_plug plug;
+        u32 i;
+
+        atomic_set(&io->chunks_pending, last - first);
+        reinit_completion(&io->done);
+
+        if (io->chunks[0].rw == READ) {
+                /* Submit all the reads in one go */
+                blk_start_plug(&plug);
+                for (i = first; i < last; i++) {
+                        /* Header slices with no used blocks aren't even read */
+                        if (io->chunks[i].nr_pages == 0) {
+                                sflc_vol_fmapChunkDone(&io->chunks[i]);
+                                continue;
+                        }
+                        sflc_vol_submitFmapChunk(&io->chunks[i]);
+                }
+                blk_finish_plug(&plug);
+        } else {
+                /* Encryption comes first, then each chunk submits its own writes */
+                for (i = first; i < last; i++) {
+                        /* Chunks with no dirty blocks are done already */
+                        if (io->chunks[i].nr_pages == 0) {
+                                sflc_vol_fmapChunkDone(&io->chunks[i]);
+                                continue;
+                        }
+                        queue_work_on(io->chunks[i].cpu, sflc_queues_decryptQueue, &io->chunks[i].work);
+                }
+        }
+
+        /* Wait for all of them */
+        wait_for_completion(&io->done);
+
+        return io->err;
+}
+
+/* Submits the bios of a chunk: the IV block, and one for each contiguous run of blocks
+   that have a page */
+static void sflc_vol_submitFmapChunk(sflc_vol_FmapChunk * chunk)
+{
+        sflc_Volume * vol = chunk->vol;
+        sector_t sector;
+        struct bio * bio;
+        int nr_runs;
+        int j;
+
+        /* Position of the chunk's IV block (first sector of the header is reserved to userland tool) */
+        sector = (vol->vol_idx * SFLC_VOL_HEADER_SIZE) + 1 + (chunk->idx * (1 + SFLC_DEV_SECTOR_TO_IV_RATIO));
+
+        /* Count the runs first, so that no completion comes before we're done */
+        nr_runs = 0;
+        for (j = 0; j < chunk->nr_blocks; j++) {
+                if (chunk->data_pages[j] && (j == 0 || !chunk->data_pages[j - 1])) {
+                        nr_runs += 1;
+                }
+        }
+        atomic_set(&chunk->bios_pending, 1 + nr_runs);
+
+        /* IV block */
+        bio = bio_alloc_bioset(GFP_NOIO, 1, &sflc_pools_bioset);
+        bio_set_dev(bio, vol->dev->real_dev->bdev);
+        bio->bi_iter.bi_sector = sector * SFLC_DEV_SECTOR_SCALE;
+        bio->bi_opf = (chunk->rw == READ) ? REQ_OP_READ : REQ_OP_WRITE;
+        bio_add_page(bio, chunk->iv_page, SFLC_DEV_SECTOR_SIZE, 0);
+        bio->bi_private = chunk;
+        bio->bi_end_io = sflc_vol_fmapChunkEndIo;
+        submit_bio(bio);
+
+        /* Data blocks */
+        j = 0;
+        while (j < chunk->nr_blocks) {
+                int run_len;
+
+                /* Find the next run */
+                if (!chunk->data_pages[j]) {
+                        j += 1;
+                        continue;
+                }
+                for (run_len = 1; j + run_len < chunk->nr_blocks && chunk->data_pages[j + run_len]; run_len++);
+
+                bio = bio_alloc_bioset(GFP_NOIO, run_len, &sflc_pools_bioset);
+                bio_set_dev(bio, vol->dev->real_dev->bdev);
+                bio->bi_iter.bi_sector = (sector + 1 + j) * SFLC_DEV_SECTOR_SCALE;
+                bio->bi_opf = (chunk->rw == READ) ? REQ_OP_READ : REQ_OP_WRITE;
+                for (; run_len > 0; run_len--, j++) {
+                        bio_add_page(bio, chunk->data_pages[j], SFLC_DEV_SECTOR_SIZE, 0);
+                }
+                bio->bi_private = chunk;
+                bio->bi_end_io = sflc_vol_fmapChunkEndIo;
+                submit_bio(bio);
+        }
+}
+
+/* Completion of either bio of a chunk */
+static void sflc_vol_fmapChunkEndIo(struct bio * bio)
+{
+        sflc_vol_FmapChunk * chunk = bio->bi_private;
+        int err = blk_status_to_errno(bio->bi_status);
+
+        if (err) {
+                pr_err("Could not %s fmap chunk %u; error %d\n", (chunk->rw == READ) ? "read" : "write", chunk->idx, err);
+                cmpxchg(&chunk->io->err, 0, err);
+        }
+        bio_put(bio);
+
+        /* Wait for the other bios */
+        if (!atomic_dec_and_test(&chunk->bios_pending)) {
+                return;
+        }
+
+        /* Reads still need decrypting (not in interrupt context), writes are done */
+        if (chunk->rw == READ) {
+                queue_work_on(chunk->cpu, sflc_queues_decryptQueue, &chunk->work);
+        } else {
+                sflc_vol_fmapChunkDone(chunk);
+        }
+}
+
+/* Decrypts a chunk that was just read, and fills its part of the fmap (or of the dirty-replica log) */
+static void sflc_vol_decryptFmapChunk(struct work_struct * work)
+{
+        sflc_vol_FmapChunk * chunk = container_of(work, sflc_vol_FmapChunk, work);
+        sflc_Volume * vol = chunk->vol;
+        u8 * iv_ptr = vol->fmap_ivs + (chunk->idx * SFLC_DEV_SECTOR_SIZE);
+        u8 iv[SFLC_SK_IV_LEN];
+        u32 lsi;
+        int err;
+        int j;
+
+        /* Don't bother if the I/O failed */
+        if (READ_ONCE(chunk->io->err)) {
+                goto out;
+        }
+
+        /* Keep the IVs, they are reused for the blocks that are not rewritten */
+        memcpy(iv_ptr, page_address(chunk->iv_page), SFLC_DEV_SECTOR_SIZE);
+
+        /* Loop over the data blocks */
+        for (j = 0; j < chunk->nr_blocks; j++) {
+                u32 blk = chunk->idx * SFLC_DEV_SECTOR_TO_IV_RATIO + j;
+                u8 * data_ptr;
+
+                /* Skip the unused ones */
+                if (!chunk->data_pages[j]) {
+                        continue;
+                }
+                data_ptr = page_address(chunk->data_pages[j]);
+
+                /* Decrypt it in place (on a copy of the IV, which gets changed by the decryption) */
+                memcpy(iv, iv_ptr + j*SFLC_SK_IV_LEN, SFLC_SK_IV_LEN);
+                err = sflc_sk_decrypt(vol->skctx, data_ptr, data_ptr, SFLC_DEV_SECTOR_SIZE, iv);
+                if (err) {
+                        pr_err("Could not decrypt data block i=%u, j=%d; error %d\n", chunk->idx, j, err);
+                        cmpxchg(&chunk->io->err, 0, err);
+                        goto out;
+                }
+
+                /* Not part of the fmap */
+                if (sflc_vol_isDlogBlock(vol, blk)) {
+                        sflc_vol_decodeDlogBlock(vol, blk, data_ptr);
+                        continue;
+                }
+                if (sflc_vol_isWmapBlock(vol, blk)) {
+                        sflc_vol_decodeWmapBlock(vol, blk, data_ptr);
+                        continue;
+                }
+
+                /* Starting LSI of this block */
+                lsi = blk * SFLC_VOL_HEADER_MAPPINGS_PER_BLOCK;
+
+                /* Loop over the 1024 fmap entries in this data block */
+                int k;
+                for (k = 0; k < SFLC_VOL_HEADER_MAPPINGS_PER_BLOCK && lsi < vol->dev->tot_slices; k++) {
+                        /* An entry is just a single big-endian PSI, the LSI
+                           is implicitly the index of this entry */
+                        __be32 * be_psi = (void *) (data_ptr + (k * sizeof(__be32)));
+
+                        /* Add mapping to the volume's fmap (chunks cover disjoint LSIs) */
+                        vol->fmap[lsi] = be32_to_cpu(*be_psi);
+
+                        /* Next iteration */
+                        lsi += 1;
+                }
+        }
+
+out:
+        sflc_vol_fmapChunkDone(chunk);
+}
+
+/* Fills the dirty blocks of a chunk from the fmap (or the dirty-replica log), encrypts them with fresh IVs,
+   and submits them */
+static void sflc_vol_encryptFmapChunk(struct work_struct * work)
+{
+        sflc_vol_FmapChunk * chunk = container_of(work, sflc_vol_FmapChunk, work);
+        sflc_Volume * vol = chunk->vol;
+        u8 * iv_ptr = vol->fmap_ivs + (chunk->idx * SFLC_DEV_SECTOR_SIZE);
+        u8 iv[SFLC_SK_IV_LEN];
+        u32 lsi;
+        int err;
+        int j;
+
+        /* Loop over the data blocks */
+        for (j = 0; j < chunk->nr_blocks; j++) {
+                u32 blk = chunk->idx * SFLC_DEV_SECTOR_TO_IV_RATIO + j;
+                u8 * data_ptr;
+
+                /* Skip the clean ones */
+                if (!chunk->data_pages[j]) {
+                        continue;
+                }
+                data_ptr = page_address(chunk->data_pages[j]);
+
+                /* Sample a fresh IV for this block */
+                err = sflc_rand_getBytes(iv_ptr + j*SFLC_SK_IV_LEN, SFLC_SK_IV_LEN);
+                if (err) {
+                        pr_err("Could not sample random IV for block i=%u, j=%d; error %d\n", chunk->idx, j, err);
+                        goto err_encrypt;
+                }
+
+                /* Not part of the fmap */
+                if (sflc_vol_isDlogBlock(vol, blk)) {
+                        sflc_vol_encodeDlogBlock(vol, blk, data_ptr);
+                        goto encrypt;
+                }
+                if (sflc_vol_isWmapBlock(vol, blk)) {
+                        sflc_vol_encodeWmapBlock(vol, blk, data_ptr);
+                        goto encrypt;
+                }
+
+                /* Starting LSI of this block */
+                lsi = blk * SFLC_VOL_HEADER_MAPPINGS_PER_BLOCK;
+
+                /* Loop over the 1024 fmap entries that fit in this data block (unused ones are invalid) */
+                int k;
+                for (k = 0; k < SFLC_VOL_HEADER_MAPPINGS_PER_BLOCK; k++) {
+                        /* Get the PSI for the current LSI */
+                        u32 psi = (lsi < vol->dev->tot_slices) ? vol->fmap[lsi] : SFLC_VOL_FMAP_INVALID_PSI;
+                        /* Write it into the block as big-endian */
+                        __be32 * be_psi = (void *) (data_ptr + (k * sizeof(__be32)));
+                        *be_psi = cpu_to_be32(psi);
+
+                        /* Next iteration */
+                        lsi += 1;
+                }
+
+encrypt:
+
+                /* Encrypt it in place (on a copy of the IV, which gets changed by the encryption) */
+                memcpy(iv, iv_ptr + j*SFLC_SK_IV_LEN, SFLC_SK_IV_LEN);
+                err = sflc_sk_encrypt(vol->skctx, data_ptr, data_ptr, SFLC_DEV_SECTOR_SIZE, iv);
+                if (err) {
+                        pr_err("Could not encrypt data block i=%u, j=%d; error %d\n", chunk->idx, j, err);
+                        goto err_encrypt;
+                }
+        }
+
+        /* The IV block is always rewritten as a whole */
+        memcpy(page_address(chunk->iv_page), iv_ptr, SFLC_DEV_SECTOR_SIZE);
+
+        /* Write it all */
+        sflc_vol_submitFmapChunk(chunk);
+        return;
+
+
+err_encrypt:
+        cmpxchg(&chunk->io->err, 0, err);
+        sflc_vol_fmapChunkDone(chunk);
+}
+
+/* Signals that a chunk is done, completing the whole operation if it was the last one */
+static void sflc_vol_fmapChunkDone(sflc_vol_FmapChunk * chunk)
+{
+        sflc_vol_FmapIo * io = chunk->io;
+
+        if (atomic_dec_and_test(&io->chunks_pending)) {
+                complete(&io->done);
+        }
+}
+
+/* Lockless lookup of the PSI an LSI is mapped to. Once mapped, an LSI only
+   changes PSI when the slice repair rewrites it, so a consistent snapshot
+   of the single entry is all we need. */
+static u32 sflc_vol_lookupSlice(sflc_Volume * vol, u32 lsi)
+{
+        unsigned seq;
+        u32 psi;
+
+        /* Frozen */
+        if (vol->read_only) {
+                return READ_ONCE(vol->fmap[lsi]);
+        }
+
+        do {
+                seq = read_seqcount_begin(&vol->fmap_seqcount);
+                psi = READ_ONCE(vol->fmap[lsi]);
+        } while (read_seqcount_retry(&vol->fmap_seqcount, seq));
+
+        return psi;
+}
 
 s32 sflc_vol_mapSlice(sflc_Volume * vol, u32 lsi, int op)
 {
         s32 psi;
         sflc_Device * dev = vol->dev;
+        int err;
+
+        /* Fast path: if slice is already mapped, just return the mapping without locking */
+        psi = sflc_vol_lookupSlice(vol, lsi);
+        if (psi != SFLC_VOL_FMAP_INVALID_PSI) {
+                return psi;
+        }
+
+        /* If slice is not mapped, but the operation is a READ, return -ENXIO */
+        if (op == READ) {
+                return -ENXIO;
+        }
+        /* No new mappings in a frozen fmap */
+        if (vol->read_only) {
+                return -EROFS;
+        }
+
+        /* Otherwise, create a new slice mapping */
 
         /* Lock the volume's forward map */
         if (mutex_lock_interruptible(&vol->fmap_lock)) {
@@ -331,20 +789,13 @@ s32 sflc_vol_mapSlice(sflc_Volume * vol, u32 lsi, int op)
                 return -EINTR;
         }
 
-        /* If slice is already mapped, just return the mapping */
+        /* Someone might have mapped it while we were waiting for the lock */
         if (vol->fmap[lsi] != SFLC_VOL_FMAP_INVALID_PSI) {
+                psi = vol->fmap[lsi];
                 mutex_unlock(&vol->fmap_lock);
-                return vol->fmap[lsi];
-        }
-
-        /* If slice is not mapped, but the operation is a READ, return -ENXIO */
-        if (op == READ) {
-                mutex_unlock(&vol->fmap_lock);
-                return -ENXIO;
+                return psi;
         }
 
-        /* Otherwise, create a new slice mapping */
-
         /* Also lock the device's reverse map */
         if (mutex_lock_interruptible(&dev->rmap_lock)) {
                 pr_err("Interrupted while waiting to lock the reverse position map\n");
@@ -361,15 +812,77 @@ s32 sflc_vol_mapSlice(sflc_Volume * vol, u32 lsi, int op)
                 return psi;
         }
 
+        /* Take it in the device's rmap */
+        err = sflc_dev_setRmap(dev, psi, vol->vol_idx);
+        if (err) {
+                pr_err("Could not take physical slice %d; error %d\n", psi, err);
+                mutex_unlock(&dev->rmap_lock);
+                mutex_unlock(&vol->fmap_lock);
+                return err;
+        }
+
         /* Insert the mapping into the volume's fmap */
-        vol->fmap[lsi] = psi;
+        write_seqcount_begin(&vol->fmap_seqcount);
+        WRITE_ONCE(vol->fmap[lsi], psi);
+        write_seqcount_end(&vol->fmap_seqcount);
         vol->mapped_slices += 1;
-        /* And in the device's rmap */
-        sflc_dev_setRmap(dev, psi, vol->vol_idx);
+        /* Its header block will have to be stored */
+        set_bit(lsi / SFLC_VOL_HEADER_MAPPINGS_PER_BLOCK, vol->fmap_dirty);
+
+        /* Unlock both maps */
+        mutex_unlock(&dev->rmap_lock);
+        mutex_unlock(&vol->fmap_lock);
+
+        return psi;
+}
+
+// sflc-raid START
+/* Maps the LSI to a fresh random PSI, forgetting the previous mapping (used by the slice repair) */
+s32 sflc_vol_reallocSlice(sflc_Volume * vol, u32 lsi)
+{
+        s32 psi;
+        sflc_Device * dev = vol->dev;
+        int err;
+
+        /* Lock both the forward and the reverse position maps */
+        if (mutex_lock_interruptible(&vol->fmap_lock)) {
+                pr_err("Interrupted while waiting to lock the forward position map\n");
+                return -EINTR;
+        }
+        if (mutex_lock_interruptible(&dev->rmap_lock)) {
+                pr_err("Interrupted while waiting to lock the reverse position map\n");
+                mutex_unlock(&vol->fmap_lock);
+                return -EINTR;
+        }
 
+        /* Get a free physical slice */
+        psi = sflc_dev_getRandomFreePsi(dev);
+        if (psi < 0) {
+                pr_err("Could not get a random free physical slice; error %d\n", psi);
+                goto out;
+        }
+        /* The old PSI stays owned by whoever owns it in the rmap */
+        err = sflc_dev_setRmap(dev, psi, vol->vol_idx);
+        if (err) {
+                pr_err("Could not take physical slice %d; error %d\n", psi, err);
+                psi = err;
+                goto out;
+        }
+
+        /* Replace the mapping: concurrent lockless lookups will retry */
+        if (vol->fmap[lsi] == SFLC_VOL_FMAP_INVALID_PSI) {
+                vol->mapped_slices += 1;
+        }
+        write_seqcount_begin(&vol->fmap_seqcount);
+        WRITE_ONCE(vol->fmap[lsi], psi);
+        write_seqcount_end(&vol->fmap_seqcount);
+        set_bit(lsi / SFLC_VOL_HEADER_MAPPINGS_PER_BLOCK, vol->fmap_dirty);
+
+out:
         /* Unlock both maps */
         mutex_unlock(&dev->rmap_lock);
         mutex_unlock(&vol->fmap_lock);
 
         return psi;
 }
+// sflc-raid END
@@ -42,6 +42,13 @@
  *           PRIVATE FUNCTIONS PROTOTYPES            *
  *****************************************************/
 
+static void sflc_vol_doFlush(struct work_struct *work);
+
+// sflc-raid START
+static int sflc_vol_processMirroredWrite(sflc_Volume *vol, struct bio *bio, sflc_Volume *mirror_vol, const sector_t *mirror_sectors, u32 nr_mirrors);
+static bool sflc_vol_bioIsMirrored(sflc_Volume *vol, struct bio *bio);
+// sflc-raid END
+
 /*****************************************************
  *           PUBLIC FUNCTIONS DEFINITIONS            *
  *****************************************************/
@@ -73,6 +80,12 @@ int sflc_vol_processBio(sflc_Volume *vol, struct bio *bio)
 {
         sflc_vol_WriteWork *write_work;
 
+        /* Discards only touch the slice mappings, write-zeroes the written-block map */
+        if (bio_op(bio) == REQ_OP_DISCARD || bio_op(bio) == REQ_OP_WRITE_ZEROES)
+        {
+                return sflc_vol_processDiscard(vol, NULL, bio);
+        }
+
         /* If it is a READ, no need to pass it through a workqueue */
         if (bio_data_dir(bio) == READ)
         {
@@ -91,29 +104,22 @@ int sflc_vol_processBio(sflc_Volume *vol, struct bio *bio)
         /* Set fields */
         write_work->vol = vol;
         write_work->orig_bio = bio;
+        write_work->mirror_vol = NULL;
+        write_work->nr_mirrors = 0;
         INIT_WORK(&write_work->work, sflc_vol_doWrite);
 
-        /* Enqueue */
-        queue_work(sflc_queues_writeQueue, &write_work->work);
+        /* Enqueue to the write engine (the work itself only runs if the repair daemon holds it back) */
+        sflc_dev_queueWrite(vol->dev, write_work);
 
         return 0;
 }
 
-// sflc-raid START
-int sflc_vol_processBioRedundantlyAmong(sflc_Volume *vol, sflc_Volume *copy_vol, struct bio *bio)
+/* Stores the dirty part of the fmap, then passes the (empty) flush bio down */
+int sflc_vol_processFlush(sflc_Volume *vol, struct bio *bio)
 {
         sflc_vol_WriteWork *write_work;
-        sflc_vol_WriteWork *red_write_work;
-        struct bio *red_bio;
-
-        /* If it is a READ, no need to pass it through a workqueue */
-        if (bio_data_dir(bio) == READ)
-        {
-                sflc_vol_doRead(vol, bio);
-                return 0;
-        }
 
-        /* Allocate writeWork structure */
+        /* Storing the fmap sleeps, do it in the write workqueue */
         write_work = mempool_alloc(sflc_pools_writeWorkPool, GFP_NOIO);
         if (!write_work)
         {
@@ -124,131 +130,273 @@ int sflc_vol_processBioRedundantlyAmong(sflc_Volume *vol, sflc_Volume *copy_vol,
         /* Set fields */
         write_work->vol = vol;
         write_work->orig_bio = bio;
-        INIT_WORK(&write_work->work, sflc_vol_doWrite);
+        write_work->mirror_vol = NULL;
+        write_work->nr_mirrors = 0;
+        INIT_WORK(&write_work->work, sflc_vol_doFlush);
 
-        /* Enqueue original bio */
+        /* Enqueue */
         queue_work(sflc_queues_writeQueue, &write_work->work);
 
-        // Dirty hack to not take superblocks in 1GB device
-        if (bio->bi_iter.bi_sector == 29560)
+        return 0;
+}
+
+// sflc-raid START
+/* Parses "all", "meta", or "ranges:<start>-<end>[,<start>-<end>...]". Returns < 0 if invalid. */
+int sflc_vol_parseMirrorPolicy(const char *spec, sflc_vol_MirrorPolicy *policy)
+{
+        char *buf;
+        char *cursor;
+        char *range;
+        int err = 0;
+
+        policy->nr_ranges = 0;
+        if (strcmp(spec, "all") == 0)
+        {
+                policy->type = SFLC_VOL_MIRROR_ALL;
+                return 0;
+        }
+        if (strcmp(spec, "meta") == 0)
         {
+                policy->type = SFLC_VOL_MIRROR_META;
                 return 0;
         }
+        if (strncmp(spec, "ranges:", strlen("ranges:")) != 0)
+        {
+                pr_err("Unknown mirror policy %s\n", spec);
+                return -EINVAL;
+        }
+        policy->type = SFLC_VOL_MIRROR_RANGES;
 
-        /* Allocate writeWork structure */
-        red_write_work = mempool_alloc(sflc_pools_writeWorkPool, GFP_NOIO);
-        if (!red_write_work)
+        /* strsep() cuts the string up */
+        buf = kstrdup(spec + strlen("ranges:"), GFP_KERNEL);
+        if (!buf)
         {
-                pr_err("Failed allocation of work structure\n");
                 return -ENOMEM;
         }
+        cursor = buf;
+        while ((range = strsep(&cursor, ",")))
+        {
+                char *end = strchr(range, '-');
+                unsigned long long start_sector;
+                unsigned long long end_sector;
+
+                if (policy->nr_ranges == SFLC_VOL_MAX_MIRROR_RANGES)
+                {
+                        pr_err("At most %d mirrored ranges\n", SFLC_VOL_MAX_MIRROR_RANGES);
+                        err = -EINVAL;
+                        break;
+                }
+                if (!end)
+                {
+                        pr_err("Invalid mirrored range %s\n", range);
+                        err = -EINVAL;
+                        break;
+                }
+                *end = '\0';
+                if (kstrtoull(range, 10, &start_sector) || kstrtoull(end + 1, 10, &end_sector) || start_sector >= end_sector)
+                {
+                        pr_err("Invalid mirrored range %s-%s\n", range, end + 1);
+                        err = -EINVAL;
+                        break;
+                }
+                policy->range_start[policy->nr_ranges] = start_sector;
+                policy->range_end[policy->nr_ranges] = end_sector;
+                policy->nr_ranges += 1;
+        }
+        kfree(buf);
 
-        bio_get(bio);
+        return err;
+}
 
-        /* Shallow copy bio (as it is already a cloned bio it is ok); a new bio will be allocated later*/
-        red_bio = bio_clone_fast(bio, GFP_NOIO, &sflc_pools_bioset);
-        if (!red_bio)
+/* The data also lives at the same logical sector of the paired volume: reads can be served by either
+   copy, writes go to both in the same work item */
+int sflc_vol_processBioRedundantlyAmong(sflc_Volume *vol, sflc_Volume *copy_vol, struct bio *bio)
+{
+        sector_t copy_sector = bio->bi_iter.bi_sector;
+
+        /* Discarded (or zeroed) data is gone from both copies, whatever the mirror policy */
+        if (bio_op(bio) == REQ_OP_DISCARD || bio_op(bio) == REQ_OP_WRITE_ZEROES)
         {
-                pr_err("Could not allocate bio\n");
-                return -ENOMEM;
+                return sflc_vol_processDiscard(vol, copy_vol, bio);
         }
 
-        /* Set sector */
-        red_bio->bi_iter.bi_sector = bio->bi_iter.bi_sector;
-        /* Set flags */
-        red_bio->bi_opf = bio->bi_opf;
-
-        /* Set fields */
-        red_write_work->vol = copy_vol;
-        red_write_work->orig_bio = red_bio;
-        INIT_WORK(&red_write_work->work, sflc_vol_doWrite);
+        /* Not covered by the mirror policy: only one copy to write, and to read from */
+        if (!sflc_vol_bioIsMirrored(vol, bio))
+        {
+                return sflc_vol_processBio(vol, bio);
+        }
 
-        /* Enqueue original bio */
-        queue_work(sflc_queues_writeQueue, &red_write_work->work);
+        /* If it is a READ, no need to pass it through a workqueue (either copy can serve it) */
+        if (bio_data_dir(bio) == READ)
+        {
+                sflc_vol_doMirroredRead(vol, bio, copy_vol, &copy_sector, 1);
+                return 0;
+        }
 
-        return 0;
+        return sflc_vol_processMirroredWrite(vol, bio, copy_vol, &copy_sector, 1);
 }
 
+/* The data also lives in other slices of the same volume: reads can be served by any copy,
+   writes go to all of them in the same work item */
 int sflc_vol_processBioRedundantlyWithin(sflc_Volume *vol, struct bio *bio)
 {
-        sflc_vol_WriteWork *write_work;
-        sflc_vol_WriteWork *red_write_work;
-        struct bio *red_bio;
+        sector_t slice_sectors = SFLC_VOL_LOG_SLICE_SIZE * SFLC_DEV_SECTOR_SCALE;
+        u32 red_lsis[SFLC_VOL_MAX_REPLICAS - 1];
+        sector_t red_sectors[SFLC_VOL_MAX_REPLICAS - 1];
+        u32 nr_copies;
+        u32 i;
+
+        /* Discarded (or zeroed) data is gone from all the copies, whatever the mirror policy */
+        if (bio_op(bio) == REQ_OP_DISCARD || bio_op(bio) == REQ_OP_WRITE_ZEROES)
+        {
+                return sflc_vol_processDiscard(vol, vol, bio);
+        }
 
-        /* If it is a READ, no need to pass it through a workqueue */
-        if (bio_data_dir(bio) == READ)
+        /* The copies are at the same offset in their slice */
+        nr_copies = sflc_vol_replicaLsis(vol, SFLC_VOL_SECTOR_TO_LSI(bio->bi_iter.bi_sector), red_lsis);
+        for (i = 0; i < nr_copies; i++)
         {
-                sflc_vol_doRead(vol, bio);
-                return 0;
+                red_sectors[i] = (sector_t)red_lsis[i] * slice_sectors + bio->bi_iter.bi_sector % slice_sectors;
         }
 
-        /* Allocate writeWork structure */
-        write_work = mempool_alloc(sflc_pools_writeWorkPool, GFP_NOIO);
-        if (!write_work)
+        /* No other copy, or not covered by the mirror policy: only one copy to write, and to read from */
+        if (nr_copies == 0 || !sflc_vol_bioIsMirrored(vol, bio))
         {
-                pr_err("Failed allocation of work structure\n");
-                return -ENOMEM;
+                return sflc_vol_processBio(vol, bio);
         }
 
-        /* Set fields */
-        write_work->vol = vol;
-        write_work->orig_bio = bio;
-        INIT_WORK(&write_work->work, sflc_vol_doWrite);
+        /* If it is a READ, no need to pass it through a workqueue (either copy can serve it) */
+        if (bio_data_dir(bio) == READ)
+        {
+                sflc_vol_doMirroredRead(vol, bio, vol, red_sectors, nr_copies);
+                return 0;
+        }
 
-        /* Enqueue original bio */
-        queue_work(sflc_queues_writeQueue, &write_work->work);
+        return sflc_vol_processMirroredWrite(vol, bio, vol, red_sectors, nr_copies);
+}
+
+/* The other LSIs holding a copy of the LSI within the volume: its even/odd pair, or the LSIs
+   replica_stride apart (wrapping around). Returns how many there are. */
+u32 sflc_vol_replicaLsis(sflc_Volume *vol, u32 lsi, u32 *lsis)
+{
+        u32 copies = vol->replica_factor;
+        u32 stride = vol->replica_stride;
+        u32 r;
 
-        // Dirty hack to not take superblocks in 1GB device
-        if (bio->bi_iter.bi_sector == 29560 || bio->bi_iter.bi_sector == 29520 || bio->bi_iter.bi_sector == 262144)
+        if (copies == 0)
+        {
+                lsis[0] = lsi ^ 1;
+                return 1;
+        }
+        /* Past the last whole set of copies (never exposed) */
+        if (lsi >= copies * stride)
         {
                 return 0;
         }
 
-        /* Allocate writeWork structure */
-        red_write_work = mempool_alloc(sflc_pools_writeWorkPool, GFP_NOIO);
-        if (!red_write_work)
+        for (r = 1; r < copies; r++)
         {
-                pr_err("Failed allocation of work structure\n");
-                return -ENOMEM;
+                lsis[r - 1] = (lsi + r * stride) % (copies * stride);
         }
 
-        bio_get(bio);
+        return copies - 1;
+}
+// sflc-raid END
+
+/*****************************************************
+ *          PRIVATE FUNCTIONS DEFINITIONS            *
+ *****************************************************/
+
+/* Checkpoints the fmap, then submits the flush to the underlying device, so that it covers the header too */
+static void sflc_vol_doFlush(struct work_struct *work)
+{
+        sflc_vol_WriteWork *write_work = container_of(work, sflc_vol_WriteWork, work);
+        sflc_Volume *vol = write_work->vol;
+        struct bio *bio = write_work->orig_bio;
+        int err;
+
+        mempool_free(write_work, sflc_pools_writeWorkPool);
 
-        /* Shallow copy bio (as it is already a cloned bio it is ok); a new bio will be allocated later*/
-        red_bio = bio_clone_fast(bio, GFP_NOIO, &sflc_pools_bioset);
-        if (!red_bio)
+        err = sflc_vol_storeFmap(vol);
+        if (err)
         {
-                pr_err("Could not allocate bio\n");
-                return -ENOMEM;
+                pr_err("Could not checkpoint the position map; error %d\n", err);
+                bio->bi_status = errno_to_blk_status(err);
+                bio_endio(bio);
+                return;
         }
 
-        sector_t red_sector;
-        if (bio->bi_iter.bi_sector / (SFLC_VOL_LOG_SLICE_SIZE * SFLC_DEV_SECTOR_SCALE) % 2 == 0)
+        /* The flush has no sector to remap */
+        bio_set_dev(bio, vol->dev->real_dev->bdev);
+        submit_bio_noacct(bio);
+}
+
+// sflc-raid START
+/* Submits the write, and its mirror copies at the given logical sectors of mirror_vol, as a single work item */
+static int sflc_vol_processMirroredWrite(sflc_Volume *vol, struct bio *bio, sflc_Volume *mirror_vol, const sector_t *mirror_sectors, u32 nr_mirrors)
+{
+        sflc_vol_WriteWork *write_work;
+        u32 i;
+
+        /* Allocate writeWork structure */
+        write_work = mempool_alloc(sflc_pools_writeWorkPool, GFP_NOIO);
+        if (!write_work)
         {
-                red_sector = bio->bi_iter.bi_sector + SFLC_VOL_LOG_SLICE_SIZE * SFLC_DEV_SECTOR_SCALE;
+                pr_err("Failed allocation of work structure\n");
+                return -ENOMEM;
         }
-        else
+
+        /* Set fields */
+        write_work->vol = vol;
+        write_work->orig_bio = bio;
+        write_work->mirror_vol = mirror_vol;
+        for (i = 0; i < nr_mirrors; i++)
         {
-                red_sector = bio->bi_iter.bi_sector - SFLC_VOL_LOG_SLICE_SIZE * SFLC_DEV_SECTOR_SCALE;
+                write_work->mirror_sector[i] = mirror_sectors[i];
         }
+        write_work->nr_mirrors = nr_mirrors;
+        INIT_WORK(&write_work->work, sflc_vol_doWrite);
 
-        /* Set sector */
-        red_bio->bi_iter.bi_sector = red_sector;
-        /* Set flags */
-        red_bio->bi_opf = bio->bi_opf;
+        /* Enqueue to the write engine (the work itself only runs if the repair daemon holds it back) */
+        sflc_dev_queueWrite(vol->dev, write_work);
 
-        /* Set fields */
-        red_write_work->vol = vol;
-        red_write_work->orig_bio = red_bio;
-        INIT_WORK(&red_write_work->work, sflc_vol_doWrite);
+        return 0;
+}
 
-        /* Enqueue original bio */
-        queue_work(sflc_queues_writeQueue, &red_write_work->work);
+/* Whether the bio goes through both copies, according to the volume's mirror policy.
+   A write is mirrored if it touches a mirrored range, a read only if it's all inside one
+   (the rest of the replica is stale). Metadata reads only trust the primary: the same
+   block may have been written without the flags. */
+static bool sflc_vol_bioIsMirrored(sflc_Volume *vol, struct bio *bio)
+{
+        sflc_vol_MirrorPolicy *policy = &vol->mirror_policy;
+        bool is_write = (bio_data_dir(bio) == WRITE);
+        u32 i;
 
-        return 0;
+        switch (policy->type)
+        {
+        case SFLC_VOL_MIRROR_ALL:
+                return true;
+
+        case SFLC_VOL_MIRROR_META:
+                return is_write && (bio->bi_opf & (REQ_META | REQ_PRIO));
+
+        case SFLC_VOL_MIRROR_RANGES:
+                for (i = 0; i < policy->nr_ranges; i++)
+                {
+                        if (is_write && bio->bi_iter.bi_sector < policy->range_end[i] && bio_end_sector(bio) > policy->range_start[i])
+                        {
+                                return true;
+                        }
+                        if (!is_write && bio->bi_iter.bi_sector >= policy->range_start[i] && bio_end_sector(bio) <= policy->range_end[i])
+                        {
+                                return true;
+                        }
+                }
+                return false;
+
+        default:
+                return true;
+        }
 }
 // sflc-raid END
-
-/*****************************************************
- *          PRIVATE FUNCTIONS DEFINITIONS            *
- *****************************************************/
@@ -0,0 +1,765 @@
+/*
+ *  Copyright The Shufflecake Project Authors (2022)
+ *  Copyright The Shufflecake Project Contributors (2022)
+ *  Copyright Contributors to the The Shufflecake Project.
+ *
+ *  See the AUTHORS file at the top-level directory of this distribution and at
+ *  <https://www.shufflecake.net/permalinks/shufflecake-userland/AUTHORS>
+ *
+ *  This file is part of the program dm-sflc, which is part of the Shufflecake
+ *  Project. Shufflecake is a plausible deniability (hidden storage) layer for
+ *  Linux. See <https://www.shufflecake.net>.
+ *
+ *  This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version. This program is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ *  Public License for more details. You should have received a copy of the
+ *  GNU General Public License along with this program.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file only implements the parity redundancy.
+ * The LSIs of the volume are grouped in stripes of K data slices followed
+ * by M parity slices, and only the data slices are exposed. The parity is
+ * computed over the plaintext of the data slices (an unmapped slice counts
+ * as zeros) and encrypted like any other slice: P is their XOR, and Q (if
+ * M = 2) their RAID-6 syndrome, both computed by the kernel's SIMD routines.
+ * A write reads the old data and parity, folds the change into the parity,
+ * and writes the new data and parity back, under the lock of the stripe.
+ * A slice is zeroed when it first gets mapped, so that the parity also holds
+ * for the blocks that were never written.
+ * A slice found corrupted when opening the volume is rebuilt from the rest
+ * of its stripe by the repair daemon.
+ * There is no journal: a crash in the middle of a write can leave the parity
+ * of the blocks it touched out of date.
+ */
+
+/*****************************************************
+ *                  INCLUDE SECTION                  *
+ *****************************************************/
+
+#include <linux/blkdev.h>
+#include <linux/completion.h>
+#include <linux/raid/pq.h>
+#include <linux/raid/xor.h>
+
+#include "volume.h"
+#include "crypto/rand/rand.h"
+#include "utils/pools.h"
+#include "utils/workqueues.h"
+#include "log/log.h"
+
+/*****************************************************
+ *                     CONSTANTS                     *
+ *****************************************************/
+
+#define SFLC_VOL_PARITY_MAX_WIDTH (SFLC_VOL_PARITY_MAX_DATA + SFLC_VOL_PARITY_MAX_PARITY)
+
+/*****************************************************
+ *                       TYPES                       *
+ *****************************************************/
+
+/* The bios of one step of a parity update or rebuild, submitted and waited for together */
+typedef struct sflc_vol_parity_io_s
+{
+        /* Bios in flight, plus one for the submitter until it waits */
+        atomic_t                pending;
+        blk_status_t            status;
+        struct completion       done;
+} sflc_vol_ParityIo;
+
+/*****************************************************
+ *           PRIVATE FUNCTIONS PROTOTYPES            *
+ *****************************************************/
+
+static void sflc_vol_doParityWrite(struct work_struct *work);
+static int sflc_vol_writeWithParity(sflc_Volume *vol, struct bio *bio, u32 lsi, struct page **pages);
+static s32 sflc_vol_mapMember(sflc_Volume *vol, u32 lsi, struct page **scratch);
+static int sflc_vol_zeroSlice(sflc_Volume *vol, u32 psi, struct page **scratch);
+static int sflc_vol_cryptBlocks(sflc_Volume *vol, u32 psi, u32 off_in_slice, u32 nr_blocks, struct page **pages, int rw);
+static void sflc_vol_foldParity(sflc_Volume *vol, u32 pos, void *old, void *new, void **parity);
+static void sflc_vol_recoverBlock(sflc_Volume *vol, const bool *lost, void **ptrs);
+static void sflc_vol_xorInto(void *dest, void **srcs, u32 count);
+static void sflc_vol_parityIoInit(sflc_vol_ParityIo *io);
+static void sflc_vol_parityIoAdd(sflc_vol_ParityIo *io, sflc_Device *dev, u32 psi, u32 off_in_slice, u32 nr_blocks, struct page **pages, int rw);
+static int sflc_vol_parityIoWait(sflc_vol_ParityIo *io);
+static void sflc_vol_parityIoEndIo(struct bio *bio);
+
+/* Number of LSIs in a stripe */
+static inline u32 sflc_vol_stripeWidth(sflc_Volume *vol)
+{
+        return vol->parity_data + vol->parity_nr;
+}
+
+/* The lock serialising the writes to the stripe starting at first_lsi */
+static inline struct mutex *sflc_vol_stripeLock(sflc_Volume *vol, u32 first_lsi)
+{
+        return &vol->parity_locks[(first_lsi / sflc_vol_stripeWidth(vol)) % SFLC_VOL_PARITY_LOCKS];
+}
+
+/*****************************************************
+ *           PUBLIC FUNCTIONS DEFINITIONS            *
+ *****************************************************/
+
+/* Parses "<K>+<M>". Returns < 0 if invalid. */
+int sflc_vol_parseParity(const char *spec, u32 *data_slices, u32 *parity_slices)
+{
+        if (sscanf(spec, "%u+%u", data_slices, parity_slices) != 2) {
+                pr_err("Invalid parity layout %s\n", spec);
+                return -EINVAL;
+        }
+        /* RAID-6 needs at least 4 members */
+        if (*data_slices < 2 || *data_slices > SFLC_VOL_PARITY_MAX_DATA ||
+            *parity_slices < 1 || *parity_slices > SFLC_VOL_PARITY_MAX_PARITY) {
+                pr_err("Parity layout %s out of range (2 to %d data slices, 1 to %d parity slices)\n",
+                       spec, SFLC_VOL_PARITY_MAX_DATA, SFLC_VOL_PARITY_MAX_PARITY);
+                return -EINVAL;
+        }
+
+        return 0;
+}
+
+/* Remaps the bio onto the data slices of the stripes. Reads then go on as usual, writes
+   go through the write workqueue to update the parity as well */
+int sflc_vol_processBioWithParity(sflc_Volume *vol, struct bio *bio)
+{
+        sector_t slice_sectors = SFLC_VOL_LOG_SLICE_SIZE * SFLC_DEV_SECTOR_SCALE;
+        u32 width = sflc_vol_stripeWidth(vol);
+        u32 log_lsi = SFLC_VOL_SECTOR_TO_LSI(bio->bi_iter.bi_sector);
+        u32 lsi;
+        sflc_vol_WriteWork *write_work;
+
+        /* Unmapping a data slice would leave its parity stale: discards are ignored */
+        if (bio_op(bio) == REQ_OP_DISCARD) {
+                bio_endio(bio);
+                return 0;
+        }
+        /* Same for write-zeroes, which only clear written bits: the block layer writes zeros instead */
+        if (bio_op(bio) == REQ_OP_WRITE_ZEROES) {
+                bio->bi_status = BLK_STS_NOTSUPP;
+                bio_endio(bio);
+                return 0;
+        }
+
+        /* Only whole stripes are exposed */
+        if (log_lsi >= vol->dev->tot_slices / width * vol->parity_data) {
+                pr_err("Bio past the last stripe of volume %s\n", vol->vol_name);
+                return -EIO;
+        }
+        /* The data slices come first in their stripe */
+        lsi = (log_lsi / vol->parity_data) * width + (log_lsi % vol->parity_data);
+        bio->bi_iter.bi_sector = ((sector_t)lsi * slice_sectors) + (bio->bi_iter.bi_sector % slice_sectors);
+
+        /* If it is a READ, no need to pass it through a workqueue */
+        if (bio_data_dir(bio) == READ) {
+                sflc_vol_doRead(vol, bio);
+                return 0;
+        }
+
+        /* Allocate writeWork structure */
+        write_work = mempool_alloc(sflc_pools_writeWorkPool, GFP_NOIO);
+        if (!write_work) {
+                pr_err("Failed allocation of work structure\n");
+                return -ENOMEM;
+        }
+
+        /* Set fields */
+        write_work->vol = vol;
+        write_work->orig_bio = bio;
+        write_work->mirror_vol = NULL;
+        write_work->nr_mirrors = 0;
+        INIT_WORK(&write_work->work, sflc_vol_doParityWrite);
+
+        /* Enqueue */
+        queue_work(sflc_queues_writeQueue, &write_work->work);
+
+        return 0;
+}
+
+/* Rebuilds the LSI from the rest of its stripe, onto its (fresh) PSI. The other members of the
+   stripe still waiting for repair are lost as well, at most M can be. Returns < 0 if error. */
+int sflc_vol_rebuildFromParity(sflc_Volume *vol, u32 lsi)
+{
+        sflc_Device *dev = vol->dev;
+        u32 width = sflc_vol_stripeWidth(vol);
+        u32 first_lsi;
+        u32 pos;
+        bool lost[SFLC_VOL_PARITY_MAX_WIDTH];
+        s32 psi[SFLC_VOL_PARITY_MAX_WIDTH];
+        void *ptrs[SFLC_VOL_PARITY_MAX_WIDTH];
+        struct page **pages;
+        struct mutex *lock;
+        sflc_vol_ParityIo io;
+        unsigned long batch_start;
+        u32 off_in_slice;
+        u32 batch;
+        u32 nr;
+        u32 throttled = 0;
+        u32 nr_lost = 0;
+        u32 p;
+        u32 i;
+        int err;
+
+        if (vol->parity_data == 0) {
+                return -EINVAL;
+        }
+        first_lsi = lsi - (lsi % width);
+        pos = lsi - first_lsi;
+        if (first_lsi + width > dev->tot_slices) {
+                return -EINVAL;
+        }
+
+        for (p = 0; p < width; p++) {
+                lost[p] = (p == pos) || sflc_dev_repairIsQueued(dev, vol->vol_idx, first_lsi + p);
+                nr_lost += lost[p];
+        }
+        if (nr_lost > vol->parity_nr) {
+                pr_err("%u slices lost in the stripe of slice %u of volume %s, more than its %u parity slices\n",
+                       nr_lost, lsi, vol->vol_name, vol->parity_nr);
+                return -EIO;
+        }
+
+        /* One batch of blocks for each member, in a single buffer from the reserve (a wide stripe
+           makes for smaller batches) */
+        batch = min_t(u32, SFLC_VOL_PARITY_BATCH, SFLC_POOLS_PARITY_BUF_PAGES / width);
+        pages = mempool_alloc(sflc_pools_parityBufPool, GFP_NOIO);
+        lock = sflc_vol_stripeLock(vol, first_lsi);
+
+        batch_start = jiffies;
+        for (off_in_slice = 0; off_in_slice < SFLC_VOL_LOG_SLICE_SIZE; off_in_slice += nr) {
+                nr = min_t(u32, batch, SFLC_VOL_LOG_SLICE_SIZE - off_in_slice);
+
+                /* The writes to the rest of the stripe go in between batches */
+                mutex_lock(lock);
+
+                /* Members may get mapped by those writes, so look them up every time */
+                for (p = 0; p < width; p++) {
+                        psi[p] = sflc_vol_mapSlice(vol, first_lsi + p, READ);
+                        if (psi[p] < 0 && (psi[p] != -ENXIO || p == pos)) {
+                                err = psi[p];
+                                pr_err("Could not look up slice %u; error %d\n", first_lsi + p, err);
+                                goto err_batch;
+                        }
+                }
+
+                /* Read what's left of the stripe (unmapped slices are zeros) */
+                sflc_vol_parityIoInit(&io);
+                for (p = 0; p < width; p++) {
+                        if (lost[p]) {
+                                continue;
+                        }
+                        if (psi[p] == -ENXIO) {
+                                for (i = 0; i < nr; i++) {
+                                        clear_page(page_address(pages[p * batch + i]));
+                                }
+                                continue;
+                        }
+                        sflc_vol_parityIoAdd(&io, dev, psi[p], off_in_slice, nr, pages + p * batch, READ);
+                }
+                err = sflc_vol_parityIoWait(&io);
+                if (err) {
+                        pr_err("Could not read the stripe at offset %u; error %d\n", off_in_slice, err);
+                        goto err_batch;
+                }
+                for (p = 0; p < width; p++) {
+                        if (lost[p] || psi[p] == -ENXIO) {
+                                continue;
+                        }
+                        err = sflc_vol_cryptBlocks(vol, psi[p], off_in_slice, nr, pages + p * batch, READ);
+                        if (err) {
+                                goto err_batch;
+                        }
+                }
+
+                /* Recompute the lost members */
+                for (i = 0; i < nr; i++) {
+                        for (p = 0; p < width; p++) {
+                                ptrs[p] = page_address(pages[p * batch + i]);
+                        }
+                        sflc_vol_recoverBlock(vol, lost, ptrs);
+                }
+
+                /* Only ours is written, the others have their own job */
+                err = sflc_vol_cryptBlocks(vol, psi[pos], off_in_slice, nr, pages + pos * batch, WRITE);
+                if (err) {
+                        goto err_batch;
+                }
+                sflc_vol_parityIoInit(&io);
+                sflc_vol_parityIoAdd(&io, dev, psi[pos], off_in_slice, nr, pages + pos * batch, WRITE);
+                err = sflc_vol_parityIoWait(&io);
+                if (err) {
+                        pr_err("Could not write rebuilt blocks at offset %u; error %d\n", off_in_slice, err);
+                        goto err_batch;
+                }
+
+                mutex_unlock(lock);
+
+                /* The bandwidth cap is reckoned in repair batches */
+                throttled += nr;
+                if (throttled >= SFLC_DEV_REPAIR_BATCH) {
+                        sflc_dev_throttleRepair(dev, batch_start);
+                        batch_start = jiffies;
+                        throttled = 0;
+                }
+        }
+
+        mempool_free(pages, sflc_pools_parityBufPool);
+        return 0;
+
+
+err_batch:
+        mutex_unlock(lock);
+        mempool_free(pages, sflc_pools_parityBufPool);
+        return err;
+}
+
+/*****************************************************
+ *          PRIVATE FUNCTIONS DEFINITIONS            *
+ *****************************************************/
+
+/* Executed in the write workqueue: the whole read-modify-write, synchronously */
+static void sflc_vol_doParityWrite(struct work_struct *work)
+{
+        sflc_vol_WriteWork *write_work = container_of(work, sflc_vol_WriteWork, work);
+        sflc_Volume *vol = write_work->vol;
+        struct bio *orig_bio = write_work->orig_bio;
+        u32 width = sflc_vol_stripeWidth(vol);
+        u32 lsi = SFLC_VOL_SECTOR_TO_LSI(orig_bio->bi_iter.bi_sector);
+        u32 first_lsi = lsi - (lsi % width);
+        struct page **pages;
+        struct mutex *lock;
+        u32 j;
+        int err;
+
+        /* The data slice, or a parity slice, waiting for repair would be overwritten by it:
+           the repair daemon requeues the work */
+        if (sflc_dev_deferWriteToRepair(vol->dev, vol->vol_idx, lsi, write_work)) {
+                return;
+        }
+        for (j = 0; j < vol->parity_nr; j++) {
+                if (sflc_dev_deferWriteToRepair(vol->dev, vol->vol_idx, first_lsi + vol->parity_data + j, write_work)) {
+                        return;
+                }
+        }
+
+        /* Old data, new data, and parity: from the reserve, so it can't fail (one buffer per
+           write, so it can't deadlock on it either) */
+        pages = mempool_alloc(sflc_pools_parityBufPool, GFP_NOIO);
+
+        /* Reads of these blocks now go to disk */
+        sflc_vol_markWritten(vol, orig_bio->bi_iter.bi_sector, bio_sectors(orig_bio));
+
+        lock = sflc_vol_stripeLock(vol, first_lsi);
+        mutex_lock(lock);
+        err = sflc_vol_writeWithParity(vol, orig_bio, lsi, pages);
+        mutex_unlock(lock);
+        if (err) {
+                pr_err("Could not write slice %u of volume %s with its parity; error %d\n", lsi, vol->vol_name, err);
+        }
+
+        /* The blocks were written without FUA: one flush covers them, and the written-block map */
+        if (!err && (orig_bio->bi_opf & REQ_FUA)) {
+                err = sflc_vol_syncWmap(vol);
+                if (!err && !vol->written) {
+                        err = blkdev_issue_flush(vol->dev->real_dev->bdev);
+                }
+                if (err) {
+                        pr_err("Could not flush FUA write to slice %u of volume %s; error %d\n", lsi, vol->vol_name, err);
+                }
+        }
+
+        mempool_free(pages, sflc_pools_parityBufPool);
+
+        mempool_free(write_work, sflc_pools_writeWorkPool);
+
+        orig_bio->bi_status = errno_to_blk_status(err);
+        bio_endio(orig_bio);
+
+        return;
+}
+
+/* Writes the bio onto the data slice, folding the change into the parity slices, one batch at
+   a time. The caller holds the stripe lock. Returns < 0 if error. */
+static int sflc_vol_writeWithParity(sflc_Volume *vol, struct bio *bio, u32 lsi, struct page **pages)
+{
+        u32 width = sflc_vol_stripeWidth(vol);
+        u32 first_lsi = lsi - (lsi % width);
+        u32 pos = lsi - first_lsi;
+        u32 off_in_slice = (bio->bi_iter.bi_sector / SFLC_DEV_SECTOR_SCALE) % SFLC_VOL_LOG_SLICE_SIZE;
+        u32 nr_blocks = bio->bi_iter.bi_size / SFLC_DEV_SECTOR_SIZE;
+        struct page **old_pages = pages;
+        struct page **new_pages = pages + SFLC_VOL_PARITY_BATCH;
+        struct page **parity_pages = pages + 2 * SFLC_VOL_PARITY_BATCH;
+        struct bvec_iter iter = bio->bi_iter;
+        s32 data_psi;
+        s32 parity_psi[SFLC_VOL_PARITY_MAX_PARITY];
+        void *parity[SFLC_VOL_PARITY_MAX_PARITY];
+        sflc_vol_ParityIo io;
+        u32 done;
+        u32 nr;
+        u32 i;
+        u32 j;
+        int err;
+
+        /* Map the slices first (the old pages serve to zero the new ones) */
+        data_psi = sflc_vol_mapMember(vol, lsi, old_pages);
+        if (data_psi < 0) {
+                return data_psi;
+        }
+        for (j = 0; j < vol->parity_nr; j++) {
+                parity_psi[j] = sflc_vol_mapMember(vol, first_lsi + vol->parity_data + j, old_pages);
+                if (parity_psi[j] < 0) {
+                        return parity_psi[j];
+                }
+        }
+
+        for (done = 0; done < nr_blocks; done += nr) {
+                nr = min_t(u32, nr_blocks - done, SFLC_VOL_PARITY_BATCH);
+
+                /* Read the old data and parity together */
+                sflc_vol_parityIoInit(&io);
+                sflc_vol_parityIoAdd(&io, vol->dev, data_psi, off_in_slice + done, nr, old_pages, READ);
+                for (j = 0; j < vol->parity_nr; j++) {
+                        sflc_vol_parityIoAdd(&io, vol->dev, parity_psi[j], off_in_slice + done, nr, parity_pages + j * SFLC_VOL_PARITY_BATCH, READ);
+                }
+                err = sflc_vol_parityIoWait(&io);
+                if (err) {
+                        pr_err("Could not read old data and parity; error %d\n", err);
+                        return err;
+                }
+                err = sflc_vol_cryptBlocks(vol, data_psi, off_in_slice + done, nr, old_pages, READ);
+                if (err) {
+                        return err;
+                }
+                for (j = 0; j < vol->parity_nr; j++) {
+                        err = sflc_vol_cryptBlocks(vol, parity_psi[j], off_in_slice + done, nr, parity_pages + j * SFLC_VOL_PARITY_BATCH, READ);
+                        if (err) {
+                                return err;
+                        }
+                }
+
+                /* Copy the new data in, and fold the change of every block into the parity */
+                for (i = 0; i < nr; i++) {
+                        struct bio_vec bvl = bio_iter_iovec(bio, iter);
+                        void *new = page_address(new_pages[i]);
+
+                        memcpy(new, kmap(bvl.bv_page) + bvl.bv_offset, SFLC_DEV_SECTOR_SIZE);
+                        kunmap(bvl.bv_page);
+                        bio_advance_iter(bio, &iter, SFLC_DEV_SECTOR_SIZE);
+
+                        for (j = 0; j < vol->parity_nr; j++) {
+                                parity[j] = page_address(parity_pages[j * SFLC_VOL_PARITY_BATCH + i]);
+                        }
+                        sflc_vol_foldParity(vol, pos, page_address(old_pages[i]), new, parity);
+                }
+
+                /* Write the new data and parity together, under fresh IVs */
+                err = sflc_vol_cryptBlocks(vol, data_psi, off_in_slice + done, nr, new_pages, WRITE);
+                if (err) {
+                        return err;
+                }
+                for (j = 0; j < vol->parity_nr; j++) {
+                        err = sflc_vol_cryptBlocks(vol, parity_psi[j], off_in_slice + done, nr, parity_pages + j * SFLC_VOL_PARITY_BATCH, WRITE);
+                        if (err) {
+                                return err;
+                        }
+                }
+                sflc_vol_parityIoInit(&io);
+                sflc_vol_parityIoAdd(&io, vol->dev, data_psi, off_in_slice + done, nr, new_pages, WRITE);
+                for (j = 0; j < vol->parity_nr; j++) {
+                        sflc_vol_parityIoAdd(&io, vol->dev, parity_psi[j], off_in_slice + done, nr, parity_pages + j * SFLC_VOL_PARITY_BATCH, WRITE);
+                }
+                err = sflc_vol_parityIoWait(&io);
+                if (err) {
+                        pr_err("Could not write new data and parity; error %d\n", err);
+                        return err;
+                }
+        }
+
+        return 0;
+}
+
+/* The PSI of a member of the stripe, mapping it (and zeroing it) if it wasn't. The caller holds
+   the stripe lock. Returns < 0 if error. */
+static s32 sflc_vol_mapMember(sflc_Volume *vol, u32 lsi, struct page **scratch)
+{
+        s32 psi;
+        int err;
+
+        psi = sflc_vol_mapSlice(vol, lsi, READ);
+        if (psi != -ENXIO) {
+                return psi;
+        }
+
+        /* Only the writers of the stripe map its slices, so nobody else can see it unzeroed */
+        psi = sflc_vol_mapSlice(vol, lsi, WRITE);
+        if (psi < 0) {
+                pr_err("Could not map slice %u; error %d\n", lsi, psi);
+                return psi;
+        }
+        err = sflc_vol_zeroSlice(vol, psi, scratch);
+        if (err) {
+                pr_err("Could not zero new slice %u; error %d\n", lsi, err);
+                return err;
+        }
+
+        return psi;
+}
+
+/* Fills a new slice with (encrypted) zeros, which is what the parity assumed it held. Returns < 0 if error. */
+static int sflc_vol_zeroSlice(sflc_Volume *vol, u32 psi, struct page **scratch)
+{
+        sflc_vol_ParityIo io;
+        u32 off_in_slice;
+        u32 i;
+        int err;
+
+        for (off_in_slice = 0; off_in_slice < SFLC_VOL_LOG_SLICE_SIZE; off_in_slice += SFLC_VOL_PARITY_BATCH) {
+                for (i = 0; i < SFLC_VOL_PARITY_BATCH; i++) {
+                        clear_page(page_address(scratch[i]));
+                }
+                err = sflc_vol_cryptBlocks(vol, psi, off_in_slice, SFLC_VOL_PARITY_BATCH, scratch, WRITE);
+                if (err) {
+                        return err;
+                }
+
+                sflc_vol_parityIoInit(&io);
+                sflc_vol_parityIoAdd(&io, vol->dev, psi, off_in_slice, SFLC_VOL_PARITY_BATCH, scratch, WRITE);
+                err = sflc_vol_parityIoWait(&io);
+                if (err) {
+                        return err;
+                }
+        }
+
+        return 0;
+}
+
+/* Decrypts (READ), or encrypts under fresh IVs (WRITE), consecutive blocks of a slice in place.
+   Returns < 0 if error. */
+static int sflc_vol_cryptBlocks(sflc_Volume *vol, u32 psi, u32 off_in_slice, u32 nr_blocks, struct page **pages, int rw)
+{
+        sflc_Device *dev = vol->dev;
+        u8 *iv_block;
+        u8 iv[SFLC_SK_IV_LEN];
+        u32 i;
+        int err = 0;
+
+        iv_block = sflc_dev_getIvBlockRef(dev, psi, rw);
+        if (IS_ERR(iv_block)) {
+                err = PTR_ERR(iv_block);
+                pr_err("Could not acquire reference to IV block; error %d\n", err);
+                return err;
+        }
+
+        if (rw == WRITE) {
+                err = sflc_rand_getBytes(iv_block + (off_in_slice * SFLC_SK_IV_LEN), nr_blocks * SFLC_SK_IV_LEN);
+                if (err) {
+                        pr_err("Could not sample IVs; error %d\n", err);
+                        goto out;
+                }
+        }
+
+        for (i = 0; i < nr_blocks; i++) {
+                u8 *block = page_address(pages[i]);
+
+                /* The crypto API updates the IV in place, so work on a copy */
+                memcpy(iv, iv_block + ((off_in_slice + i) * SFLC_SK_IV_LEN), SFLC_SK_IV_LEN);
+                if (rw == READ) {
+                        err = sflc_sk_decrypt(vol->skctx, block, block, SFLC_DEV_SECTOR_SIZE, iv);
+                } else {
+                        err = sflc_sk_encrypt(vol->skctx, block, block, SFLC_DEV_SECTOR_SIZE, iv);
+                }
+                if (err) {
+                        pr_err("Could not %s block at offset %u; error %d\n",
+                               (rw == READ) ? "decrypt" : "encrypt", off_in_slice + i, err);
+                        goto out;
+                }
+        }
+
+out:
+        sflc_dev_putIvBlockRef(dev, psi);
+        return err;
+}
+
+/* Folds the change of a data block into the parity blocks: P ^= old ^ new, and Q ^= g^pos * (old ^ new).
+   The old block is left holding the change. */
+static void sflc_vol_foldParity(sflc_Volume *vol, u32 pos, void *old, void *new, void **parity)
+{
+        u32 width = sflc_vol_stripeWidth(vol);
+        void *ptrs[SFLC_VOL_PARITY_MAX_WIDTH];
+        u8 *delta = old;
+        u8 *q;
+        u8 coef;
+        u32 b;
+
+        xor_blocks(1, SFLC_DEV_SECTOR_SIZE, old, &new);
+
+        if (vol->parity_nr == 1) {
+                xor_blocks(1, SFLC_DEV_SECTOR_SIZE, parity[0], &old);
+                return;
+        }
+
+        /* Only the data member at pos is looked at */
+        if (raid6_call.xor_syndrome) {
+                ptrs[pos] = old;
+                ptrs[width - 2] = parity[0];
+                ptrs[width - 1] = parity[1];
+                raid6_call.xor_syndrome(width, pos, pos, SFLC_DEV_SECTOR_SIZE, ptrs);
+                return;
+        }
+
+        /* Not every RAID-6 implementation has partial updates */
+        xor_blocks(1, SFLC_DEV_SECTOR_SIZE, parity[0], &old);
+        coef = raid6_gfexp[pos];
+        q = parity[1];
+        for (b = 0; b < SFLC_DEV_SECTOR_SIZE; b++) {
+                q[b] ^= raid6_gfmul[coef][delta[b]];
+        }
+
+        return;
+}
+
+/* Recomputes the lost members of the stripe (at most M), for one block. The data members come
+   first in ptrs, then P and Q. */
+static void sflc_vol_recoverBlock(sflc_Volume *vol, const bool *lost, void **ptrs)
+{
+        u32 k = vol->parity_data;
+        u32 width = sflc_vol_stripeWidth(vol);
+        void *srcs[SFLC_VOL_PARITY_MAX_WIDTH];
+        int faila = -1;
+        int failb = -1;
+        u32 target;
+        u32 nr_srcs = 0;
+        u32 p;
+
+        for (p = 0; p < k; p++) {
+                if (!lost[p]) {
+                        continue;
+                }
+                if (faila < 0) {
+                        faila = p;
+                } else {
+                        failb = p;
+                }
+        }
+
+        /* Two data members: from P and Q */
+        if (failb >= 0) {
+                raid6_2data_recov(width, SFLC_DEV_SECTOR_SIZE, faila, failb, ptrs);
+                return;
+        }
+        /* A data member and P: from Q (P comes back too) */
+        if (faila >= 0 && vol->parity_nr == 2 && lost[k]) {
+                raid6_datap_recov(width, SFLC_DEV_SECTOR_SIZE, faila, ptrs);
+                return;
+        }
+
+        /* A data member, or P with a single parity: the XOR of the other data members and P */
+        if (faila >= 0 || vol->parity_nr == 1) {
+                target = (faila >= 0) ? faila : k;
+                for (p = 0; p <= k; p++) {
+                        if (p != target) {
+                                srcs[nr_srcs++] = ptrs[p];
+                        }
+                }
+                sflc_vol_xorInto(ptrs[target], srcs, nr_srcs);
+        }
+
+        /* Whatever parity is left to recompute (P along with Q, since it's the same pass) */
+        if (vol->parity_nr == 2 && (faila < 0 || lost[k + 1])) {
+                raid6_call.gen_syndrome(width, SFLC_DEV_SECTOR_SIZE, ptrs);
+        }
+
+        return;
+}
+
+/* dest = XOR of the sources */
+static void sflc_vol_xorInto(void *dest, void **srcs, u32 count)
+{
+        u32 done;
+
+        memcpy(dest, srcs[0], SFLC_DEV_SECTOR_SIZE);
+        for (done = 1; done < count; done += MAX_XOR_BLOCKS) {
+                xor_blocks(min_t(u32, count - done, MAX_XOR_BLOCKS), SFLC_DEV_SECTOR_SIZE, dest, srcs + done);
+        }
+
+        return;
+}
+
+static void sflc_vol_parityIoInit(sflc_vol_ParityIo *io)
+{
+        atomic_set(&io->pending, 1);
+        io->status = BLK_STS_OK;
+        init_completion(&io->done);
+
+        return;
+}
+
+/* Submits the read/write of consecutive data blocks of a physical slice from/to the pages.
+   A failure to submit is reported by sflc_vol_parityIoWait(). */
+static void sflc_vol_parityIoAdd(sflc_vol_ParityIo *io, sflc_Device *dev, u32 psi, u32 off_in_slice, u32 nr_blocks, struct page **pages, int rw)
+{
+        struct bio *bio;
+        sector_t sector;
+        u32 i;
+
+        /* Allocate bio */
+        bio = bio_alloc_bioset(GFP_NOIO, nr_blocks, &sflc_pools_bioset);
+        if (!bio) {
+                pr_err("Could not allocate bio\n");
+                io->status = BLK_STS_RESOURCE;
+                return;
+        }
+
+        /* Skip the header, the previous slices, and the IV block */
+        sector = SFLC_DEV_HEADER_SIZE + ((sector_t)psi * SFLC_DEV_PHYS_SLICE_SIZE) + 1 + off_in_slice;
+
+        bio_set_dev(bio, dev->real_dev->bdev);
+        bio->bi_iter.bi_sector = sector * SFLC_DEV_SECTOR_SCALE;
+        bio->bi_opf = ((rw == READ) ? REQ_OP_READ : REQ_OP_WRITE);
+        for (i = 0; i < nr_blocks; i++) {
+                if (!bio_add_page(bio, pages[i], SFLC_DEV_SECTOR_SIZE, 0)) {
+                        pr_err("Catastrophe: could not add page to bio! WTF?\n");
+                        bio_put(bio);
+                        io->status = BLK_STS_IOERR;
+                        return;
+                }
+        }
+        bio->bi_end_io = sflc_vol_parityIoEndIo;
+        bio->bi_private = io;
+
+        atomic_inc(&io->pending);
+        submit_bio(bio);
+
+        return;
+}
+
+/* Waits for all the bios added. Returns < 0 if any failed. */
+static int sflc_vol_parityIoWait(sflc_vol_ParityIo *io)
+{
+        if (!atomic_dec_and_test(&io->pending)) {
+                wait_for_completion_io(&io->done);
+        }
+
+        return blk_status_to_errno(io->status);
+}
+
+static void sflc_vol_parityIoEndIo(struct bio *bio)
+{
+        sflc_vol_ParityIo *io = bio->bi_private;
+
+        if (unlikely(bio->bi_status)) {
+                io->status = bio->bi_status;
+        }
+        bio_put(bio);
+
+        if (atomic_dec_and_test(&io->pending)) {
+                complete(&io->done);
+        }
+
+        return;
+}
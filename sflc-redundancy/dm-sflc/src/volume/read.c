@@ -26,6 +26,17 @@
  * of the original bio) and remapping the sector. The clone is 
  * submitted to the underlying device. Its bi_endio function decrypts 
  * the pages in place, and marks the original bio as complete.
+ * When the data has a replica (redundant volumes), the copy whose physical
+ * region has fewer reads in flight is read, and the other one is tried
+ * if that fails.
+ * Sequential reads are spotted as they come (a few streams per volume, each
+ * expecting the sector where its last read ended): once a stream is
+ * established, the IV block of the slice after the one it is in is read
+ * ahead into the IV cache, so that a cold scan doesn't stall on an IV miss
+ * at every slice boundary. Data read-ahead is left to the page cache above.
+ * The streams are matched locklessly: a read moves its stream on with a
+ * cmpxchg, and two racing reads only cost the stream a hit. Reads in the
+ * last slice of the volume are not tracked, having nothing to read ahead.
  */
 
 /*****************************************************
@@ -34,7 +45,6 @@
 
 #include "volume.h"
 #include "utils/pools.h"
-#include "utils/workqueues.h"
 #include "log/log.h"
 
 /*****************************************************
@@ -46,10 +56,15 @@
  *****************************************************/
 
 static void sflc_vol_fillBioWithZeros(struct bio * orig_bio);
+static bool sflc_vol_trackReadStream(sflc_Volume * vol, sector_t log_sector, u32 nr_sectors, u32 * ahead_lsi_out);
+static void sflc_vol_readAheadIvBlock(sflc_Volume * vol, u32 lsi);
+static s32 sflc_vol_pickReplica(sflc_vol_DecryptWork * dec_work, u32 psi, u32 * psi_out, u32 * off_in_slice_out, s64 * phys_sector_out);
+static int sflc_vol_submitReadCopy(sflc_vol_DecryptWork * dec_work, s64 phys_sector);
+static atomic_t * sflc_vol_readRegion(sflc_Device * dev, u32 psi);
 static void sflc_vol_readEndIo(struct bio * phys_bio);
-static void sflc_vol_readEndIoBottomHalf(struct work_struct * work);
-static int sflc_vol_decryptBio(sflc_Volume * vol, struct bio * orig_bio, u32 psi, u32 off_in_slice);
-static int sflc_vol_fetchIv(sflc_Volume * vol, u8 * iv, u32 psi, u32 off_in_slice);
+static void sflc_vol_decryptBio(sflc_vol_DecryptWork * dec_work);
+static void sflc_vol_decryptDone(sflc_sk_Batch * batch, int err);
+static void sflc_vol_endRead(sflc_vol_DecryptWork * dec_work, blk_status_t status);
 
 /*****************************************************
  *           PUBLIC FUNCTIONS DEFINITIONS            *
@@ -57,13 +72,55 @@ static int sflc_vol_fetchIv(sflc_Volume * vol, u8 * iv, u32 psi, u32 off_in_slic
 
 /* Executed in context from sflc_tgt_map() */
 void sflc_vol_doRead(sflc_Volume * vol, struct bio * bio)
+{
+        sflc_vol_doMirroredRead(vol, bio, NULL, NULL, 0);
+}
+
+/* Executed in context from sflc_tgt_map(). The replicas are at the given logical sectors of mirror_vol */
+void sflc_vol_doMirroredRead(sflc_Volume * vol, struct bio * bio, sflc_Volume * mirror_vol, const sector_t * mirror_sectors, u32 nr_mirrors)
 {
         sflc_Device * dev = vol->dev;
         struct bio * orig_bio = bio;
-        struct bio * phys_bio;
+        sector_t log_sector = orig_bio->bi_iter.bi_sector;
         s64 phys_sector;
         sflc_vol_DecryptWork * dec_work;
+        u32 psi;
+        u32 off_in_slice;
         blk_status_t status;
+        u32 ahead_lsi;
+        u32 i;
+        int err;
+
+        /* A slice waiting for repair can't be read yet: the repair daemon resubmits the bio */
+        if (sflc_dev_deferReadToRepair(dev, vol->vol_idx, SFLC_VOL_SECTOR_TO_LSI(log_sector), orig_bio)) {
+                return;
+        }
+
+        /* Part of a sequential stream: get the IV block of its next slice on the way */
+        if (sflc_vol_trackReadStream(vol, log_sector, bio_sectors(orig_bio), &ahead_lsi)) {
+                sflc_vol_readAheadIvBlock(vol, ahead_lsi);
+        }
+
+        /* With lazy replicas (pairs only), only one copy may be up to date */
+        if (!mirror_vol) {
+                nr_mirrors = 0;
+        } else if (nr_mirrors == 1) {
+                if (sflc_vol_replicaIsStale(vol, SFLC_VOL_SECTOR_TO_LSI(log_sector))) {
+                        nr_mirrors = 0;
+                } else if (sflc_vol_replicaIsStale(mirror_vol, SFLC_VOL_SECTOR_TO_LSI(mirror_sectors[0]))) {
+                        vol = mirror_vol;
+                        log_sector = mirror_sectors[0];
+                        nr_mirrors = 0;
+                }
+        }
+
+        /* Never written since the slice was mapped (or zeroed since): no need to go to disk */
+        if (sflc_vol_rangeIsUnwritten(vol, log_sector, bio_sectors(orig_bio))) {
+                sflc_vol_fillBioWithZeros(orig_bio);
+                orig_bio->bi_status = BLK_STS_OK;
+                bio_endio(orig_bio);
+                return;
+        }
 
         /* Allocate decryptWork structure */
         dec_work = mempool_alloc(sflc_pools_decryptWorkPool, GFP_NOIO);
@@ -76,22 +133,8 @@ void sflc_vol_doRead(sflc_Volume * vol, struct bio * bio)
         /* Get an extra reference to the original bio */
         bio_get(orig_bio);
 
-        /* Shallow-copy the bio and submit it (change the bi_endio).
-           We can shallow-copy because we don't need to own the pages,
-           we can decrypt in place. */
-
-        /* Shallow copy */
-        phys_bio = bio_clone_fast(orig_bio, GFP_NOIO, &sflc_pools_bioset);
-        if (!phys_bio) {
-                pr_err("Could not clone original bio\n");
-                status = BLK_STS_IOERR;
-                goto err_clone_orig_bio;
-        }
-
-        /* Set real backing device */
-	bio_set_dev(phys_bio, dev->real_dev->bdev);
         /* Remap sector */
-	phys_sector = sflc_vol_remapSector(vol, orig_bio->bi_iter.bi_sector, READ, &dec_work->psi, &dec_work->off_in_slice);
+	phys_sector = sflc_vol_remapSector(vol, log_sector, READ, &psi, &off_in_slice);
 	/* If -ENXIO, special case: stupid READ */
 	if (phys_sector == -ENXIO) {
 		pr_warn("Stupid READ. Returning all zeros\n");
@@ -105,27 +148,52 @@ void sflc_vol_doRead(sflc_Volume * vol, struct bio * bio)
                 status = BLK_STS_IOERR;
                 goto err_remap_sector;
         }
-        /* No errors */
-        phys_bio->bi_iter.bi_sector = phys_sector;
 
-        /* Set field in dec_work */
+        /* Set fields in dec_work: the primary copy, and the replicas to fall back on */
         dec_work->vol = vol;
         dec_work->orig_bio = orig_bio;
-        dec_work->phys_bio = phys_bio;
-        /* Set fields for the endio */
-        phys_bio->bi_end_io = sflc_vol_readEndIo;
-	phys_bio->bi_private = dec_work;
+        dec_work->lsi = SFLC_VOL_SECTOR_TO_LSI(log_sector);
+        dec_work->psi = psi;
+        dec_work->off_in_slice = off_in_slice;
+        dec_work->alt_vol = mirror_vol;
+        for (i = 0; i < nr_mirrors; i++) {
+                dec_work->alt_sector[i] = mirror_sectors[i];
+        }
+        dec_work->nr_alts = nr_mirrors;
+
+        /* Possibly read a replica instead (the primary takes its place among the fallbacks) */
+        if (nr_mirrors) {
+                u32 mirror_psi;
+                u32 mirror_off_in_slice;
+                s64 mirror_phys_sector;
+                s32 best;
+
+                best = sflc_vol_pickReplica(dec_work, psi, &mirror_psi, &mirror_off_in_slice, &mirror_phys_sector);
+                if (best >= 0) {
+                        dec_work->vol = mirror_vol;
+                        dec_work->lsi = SFLC_VOL_SECTOR_TO_LSI(dec_work->alt_sector[best]);
+                        dec_work->psi = mirror_psi;
+                        dec_work->off_in_slice = mirror_off_in_slice;
+                        dec_work->alt_vol = vol;
+                        dec_work->alt_sector[best] = log_sector;
+                        phys_sector = mirror_phys_sector;
+                }
+        }
 
         /* Only submit the physical bio */
-        submit_bio(phys_bio);
+        err = sflc_vol_submitReadCopy(dec_work, phys_sector);
+        if (err) {
+                pr_err("Could not submit physical bio; error %d\n", err);
+                status = BLK_STS_IOERR;
+                goto err_submit;
+        }
 
         return;
 
 
+err_submit:
 err_remap_sector:
 err_stupid_read:
-        bio_put(phys_bio);
-err_clone_orig_bio:
         bio_put(orig_bio);
         mempool_free(dec_work, sflc_pools_decryptWorkPool);
 err_alloc_dec_work:
@@ -135,122 +203,355 @@ err_alloc_dec_work:
         return;
 }
 
+/* Bottom half of a read, on the CPU that submitted it (see device/decrypt.c) */
+void sflc_vol_readDone(sflc_vol_DecryptWork * dec_work)
+{
+        sflc_Volume * vol = dec_work->vol;
+        struct bio * phys_bio = dec_work->phys_bio;
+        blk_status_t status = phys_bio->bi_status;
+
+        /* One less read in flight in the region */
+        atomic_dec(sflc_vol_readRegion(vol->dev, dec_work->psi));
+
+        /* On error, the IV block read along is no use (the decryption won't ask for it) */
+        if (unlikely(status)) {
+                sflc_dev_dropIvPrefetch(vol->dev, dec_work->psi);
+        }
+
+        /* On error, try the other copies (each once), until one can be submitted */
+        if (unlikely(status) && dec_work->nr_alts) {
+                pr_warn_ratelimited("Read error %d on volume %s, retrying from another copy\n",
+                                    blk_status_to_errno(status), vol->vol_name);
+        }
+        while (unlikely(status) && dec_work->nr_alts) {
+                sflc_Volume * alt_vol = dec_work->alt_vol;
+                u32 alt_lsi;
+                s64 phys_sector;
+
+                dec_work->nr_alts -= 1;
+                /* A copy waiting to be repaired (say, after a failed write) holds old data */
+                alt_lsi = SFLC_VOL_SECTOR_TO_LSI(dec_work->alt_sector[dec_work->nr_alts]);
+                if (sflc_dev_repairIsQueued(alt_vol->dev, alt_vol->vol_idx, alt_lsi)) {
+                        continue;
+                }
+                phys_sector = sflc_vol_remapSector(alt_vol, dec_work->alt_sector[dec_work->nr_alts], READ, &dec_work->psi, &dec_work->off_in_slice);
+                if (phys_sector < 0) {
+                        continue;
+                }
+
+                bio_put(phys_bio);
+                dec_work->vol = alt_vol;
+                dec_work->lsi = alt_lsi;
+                if (!sflc_vol_submitReadCopy(dec_work, phys_sector)) {
+                        return;
+                }
+                /* Could not even try */
+                dec_work->phys_bio = NULL;
+                break;
+        }
+
+        /* Decrypt the physical bio: the original bio completes with the last sector */
+        if (likely(!status)) {
+                sflc_vol_decryptBio(dec_work);
+                return;
+        }
+
+        sflc_vol_endRead(dec_work, status);
+
+	return;
+}
+
 /*****************************************************
  *          PRIVATE FUNCTIONS DEFINITIONS            *
  *****************************************************/
 
 static void sflc_vol_fillBioWithZeros(struct bio * orig_bio)
 {
-	struct bio_vec bvl = bio_iovec(orig_bio);
-        void * sector_ptr = kmap(bvl.bv_page) + bvl.bv_offset;
+        /* Zero, and advance through, all the sectors of the bio */
+        while (orig_bio->bi_iter.bi_size) {
+                struct bio_vec bvl = bio_iovec(orig_bio);
+                void * sector_ptr = kmap(bvl.bv_page) + bvl.bv_offset;
 
-        memset(sector_ptr, 0, SFLC_DEV_SECTOR_SIZE);
-        bio_advance(orig_bio, SFLC_DEV_SECTOR_SIZE);
+                memset(sector_ptr, 0, SFLC_DEV_SECTOR_SIZE);
+                bio_advance(orig_bio, SFLC_DEV_SECTOR_SIZE);
+
+                kunmap(bvl.bv_page);
+        }
 
-        kunmap(bvl.bv_page);
         return;
 }
 
-/* Pushes all the decryption work to a workqueue bottom half */
-static void sflc_vol_readEndIo(struct bio * phys_bio)
+/* Matches the read against the volume's streams (a miss recycles one), locklessly. Returns true, with
+   the LSI whose IV block should be read ahead, the first time an established stream gets into a slice. */
+static bool sflc_vol_trackReadStream(sflc_Volume * vol, sector_t log_sector, u32 nr_sectors, u32 * ahead_lsi_out)
 {
-        sflc_vol_DecryptWork * dec_work = phys_bio->bi_private;
+        sflc_vol_ReadStream * stream = NULL;
+        sector_t next_sector = log_sector + nr_sectors;
+        u32 ahead_lsi = SFLC_VOL_SECTOR_TO_LSI(next_sector - 1) + 1;
+        u32 hits;
+        u32 i;
+
+        /* No slice after this one: the stream would have nothing to read ahead */
+        if (ahead_lsi >= vol->dev->tot_slices) {
+                return false;
+        }
 
-        /* Init work structure */
-        INIT_WORK(&dec_work->work, sflc_vol_readEndIoBottomHalf);
-        /* Enqueue it */
-        queue_work(sflc_queues_decryptQueue, &dec_work->work);
+        /* The one read that moves next_sector on gets the hit */
+        for (i = 0; i < SFLC_VOL_READ_STREAMS; i++) {
+                if (READ_ONCE(vol->streams[i].next_sector) == log_sector &&
+                    cmpxchg64(&vol->streams[i].next_sector, log_sector, next_sector) == log_sector) {
+                        stream = &vol->streams[i];
+                        break;
+                }
+        }
 
-        return;
+        /* A new stream might be starting here (it has no hits yet) */
+        if (!stream) {
+                stream = &vol->streams[(u32) atomic_inc_return(&vol->streams_victim) % SFLC_VOL_READ_STREAMS];
+                WRITE_ONCE(stream->hits, 0);
+                WRITE_ONCE(stream->ahead_lsi, SFLC_VOL_FMAP_INVALID_PSI);
+                WRITE_ONCE(stream->next_sector, next_sector);
+                return false;
+        }
+
+        hits = READ_ONCE(stream->hits);
+        if (hits < SFLC_VOL_READ_STREAM_MIN_HITS) {
+                hits += 1;
+                WRITE_ONCE(stream->hits, hits);
+        }
+        if (hits < SFLC_VOL_READ_STREAM_MIN_HITS) {
+                return false;
+        }
+
+        /* Once per slice */
+        if (xchg(&stream->ahead_lsi, ahead_lsi) == ahead_lsi) {
+                return false;
+        }
+
+        *ahead_lsi_out = ahead_lsi;
+        return true;
 }
 
-static void sflc_vol_readEndIoBottomHalf(struct work_struct * work)
+/* Starts reading the IV block of the LSI into the IV cache, if it's worth it */
+static void sflc_vol_readAheadIvBlock(sflc_Volume * vol, u32 lsi)
 {
-	sflc_vol_DecryptWork * dec_work = container_of(work, sflc_vol_DecryptWork, work);
-        sflc_Volume * vol = dec_work->vol;
-        struct bio * orig_bio = dec_work->orig_bio;
-        struct bio * phys_bio = dec_work->phys_bio;
-        blk_status_t status = phys_bio->bi_status;
-        int err;
+        s32 psi;
 
-        /* Decrypt the physical bio and advance the original bio */
-        err = sflc_vol_decryptBio(vol, orig_bio, dec_work->psi, dec_work->off_in_slice);
-        if (err) {
-                pr_err("Could not decrypt bio; error %d\n", err);
-                status = BLK_STS_IOERR;
+        /* Past the end of the volume */
+        if (lsi >= vol->dev->tot_slices) {
+                return;
+        }
+        /* Nothing to decrypt there */
+        if (sflc_vol_rangeIsUnwritten(vol, (sector_t) lsi * SFLC_VOL_LOG_SLICE_SIZE * SFLC_DEV_SECTOR_SCALE,
+                                      SFLC_VOL_LOG_SLICE_SIZE * SFLC_DEV_SECTOR_SCALE)) {
+                return;
+        }
+        /* Unmapped (lockless lookup) */
+        psi = sflc_vol_mapSlice(vol, lsi, READ);
+        if (psi < 0) {
+                return;
         }
 
-        /* Release the extra reference to the original bio */
-        bio_put(orig_bio);
-        /* End I/O on the original bio */
-        orig_bio->bi_status = status;
-        bio_endio(orig_bio);
+        sflc_dev_prefetchIvBlock(vol->dev, psi);
+}
 
-        /* Free the physical bio */
-	bio_put(phys_bio);
-        /* Free the work item */
-        mempool_free(dec_work, sflc_pools_decryptWorkPool);
+/* Pushes all the decryption work to the bottom half, on the submitting CPU */
+static void sflc_vol_readEndIo(struct bio * phys_bio)
+{
+        sflc_vol_DecryptWork * dec_work = phys_bio->bi_private;
 
-	return;
+        sflc_dev_queueReadDone(dec_work->vol->dev, dec_work);
+
+        return;
 }
 
-/* Decrypts the content of the physical bio, and at the same time it advances the original bio */
-static int sflc_vol_decryptBio(sflc_Volume * vol, struct bio * orig_bio, u32 psi, u32 off_in_slice)
+/* Decides whether to read a replica rather than the primary copy (at psi): the one with fewest reads
+   in flight in its physical region wins, the primary on ties. Returns the index of the replica picked
+   (among the alternatives of dec_work), or -1 to stay on the primary. */
+static s32 sflc_vol_pickReplica(sflc_vol_DecryptWork * dec_work, u32 psi, u32 * psi_out, u32 * off_in_slice_out, s64 * phys_sector_out)
 {
-        u8 iv[SFLC_SK_IV_LEN];
-        int err;
+        sflc_Volume * mirror_vol = dec_work->alt_vol;
+        sflc_Device * dev = mirror_vol->dev;
+        int least = atomic_read(sflc_vol_readRegion(dev, psi));
+        s32 best = -1;
+        u32 i;
+
+        /* While slices are being rebuilt the replicas may be stale */
+        if (READ_ONCE(dev->repair_pending)) {
+                return -1;
+        }
 
-        /* Fetch IV */
-        err = sflc_vol_fetchIv(vol, iv, psi, off_in_slice);
-        if (err) {
-                pr_err("Could not fetch IV; error %d\n", err);
-                return err;
+        for (i = 0; i < dec_work->nr_alts; i++) {
+                u32 alt_psi;
+                u32 alt_off_in_slice;
+                s64 phys_sector;
+                int load;
+
+                /* The replica might not be mapped */
+                phys_sector = sflc_vol_remapSector(mirror_vol, dec_work->alt_sector[i], READ, &alt_psi, &alt_off_in_slice);
+                if (phys_sector < 0) {
+                        continue;
+                }
+
+                load = atomic_read(sflc_vol_readRegion(dev, alt_psi));
+                if (load < least) {
+                        least = load;
+                        best = i;
+                        *psi_out = alt_psi;
+                        *off_in_slice_out = alt_off_in_slice;
+                        *phys_sector_out = phys_sector;
+                }
         }
 
-        /* Decrypt sector in place */
-        struct bio_vec bvl = bio_iovec(orig_bio);
-        void * sector_ptr = kmap(bvl.bv_page) + bvl.bv_offset;
-        err = sflc_sk_decrypt(vol->skctx, sector_ptr, sector_ptr, SFLC_DEV_SECTOR_SIZE, iv);
-        kunmap(bvl.bv_page);
-        if (err) {
-                pr_err("Error while decrypting sector: %d\n", err);
-                return err;
+        return best;
+}
+
+/* Shallow-clones the original bio onto the copy described by dec_work, and submits it. Returns < 0 if error. */
+static int sflc_vol_submitReadCopy(sflc_vol_DecryptWork * dec_work, s64 phys_sector)
+{
+        sflc_Device * dev = dec_work->vol->dev;
+        struct bio * phys_bio;
+        struct blk_plug plug;
+
+        /* Shallow-copy the bio and submit it (change the bi_endio).
+           We can shallow-copy because we don't need to own the pages,
+           we can decrypt in place. */
+        phys_bio = bio_clone_fast(dec_work->orig_bio, GFP_NOIO, &sflc_pools_bioset);
+        if (!phys_bio) {
+                pr_err("Could not clone original bio\n");
+                return -ENOMEM;
         }
 
-        /* Advance original bio by one sector */
-        bio_advance(orig_bio, SFLC_DEV_SECTOR_SIZE);
+        /* Set real backing device */
+	bio_set_dev(phys_bio, dev->real_dev->bdev);
+        /* Remapped sector */
+        phys_bio->bi_iter.bi_sector = phys_sector;
+
+        /* Set fields for the endio */
+        dec_work->phys_bio = phys_bio;
+        phys_bio->bi_end_io = sflc_vol_readEndIo;
+	phys_bio->bi_private = dec_work;
+        /* The completion is decrypted here */
+        dec_work->cpu = raw_smp_processor_id();
+
+        /* One more read in flight in the region */
+        atomic_inc(sflc_vol_readRegion(dev, dec_work->psi));
+
+        /* On an IV cache miss, the IV block is read along with the data (rather than after it, by the
+           decryption). It sits right before the first block of the slice: the two bios merge then. */
+        blk_start_plug(&plug);
+        sflc_dev_prefetchIvBlock(dev, dec_work->psi);
+        submit_bio(phys_bio);
+        blk_finish_plug(&plug);
 
         return 0;
 }
 
-static int sflc_vol_fetchIv(sflc_Volume * vol, u8 * iv, u32 psi, u32 off_in_slice)
+/* The counter of reads in flight in the physical region the PSI belongs to */
+static atomic_t * sflc_vol_readRegion(sflc_Device * dev, u32 psi)
 {
+        /* tot_slices can shrink (even slice count in 'w' mode), clamp the last PSI */
+        return &dev->read_inflight[min_t(u32, ((u64) psi * SFLC_DEV_READ_REGIONS) / dev->tot_slices, SFLC_DEV_READ_REGIONS - 1)];
+}
+
+/* Queues the decryption of all the sectors of the original bio (in place), as one batch of
+   asynchronous requests: the last one to complete ends the read (see sflc_vol_decryptDone()).
+   The blocks of the LSI never written read as zeros. */
+static void sflc_vol_decryptBio(sflc_vol_DecryptWork * dec_work)
+{
+        sflc_Volume * vol = dec_work->vol;
         sflc_Device * dev = vol->dev;
-        u8 * iv_block;
+        struct bio * orig_bio = dec_work->orig_bio;
+        struct bvec_iter iter = orig_bio->bi_iter;
+        u32 off_in_slice = dec_work->off_in_slice;
+        u32 nr_blocks = iter.bi_size / SFLC_DEV_SECTOR_SIZE;
+        u8 * ivs;
+        u32 ivs_first;
+        bool lockless;
         int err;
 
-        /* Acquire a reference to the whole relevant IV block */
-        iv_block = sflc_dev_getIvBlockRef(dev, psi, READ);
-        if (IS_ERR(iv_block)) {
-                err = PTR_ERR(iv_block);
-                pr_err("Could not acquire reference to IV block; error %ld\n", PTR_ERR(iv_block));
-                goto err_get_iv_block_ref;
+        /* A read-only volume's IVs never change: copy them out of the cache, without locking it */
+        lockless = vol->read_only && nr_blocks <= SFLC_VOL_LOCKLESS_READ_BLOCKS &&
+                   !sflc_dev_copyIvsLockless(dev, dec_work->psi, off_in_slice, nr_blocks, dec_work->ivs);
+        if (lockless) {
+                ivs = dec_work->ivs;
+                ivs_first = off_in_slice;
+        } else {
+                /* Acquire a reference to the whole relevant IV block, once for all the sectors */
+                ivs = sflc_dev_getIvBlockRef(dev, dec_work->psi, READ);
+                ivs_first = 0;
+                if (IS_ERR(ivs)) {
+                        pr_err("Could not acquire reference to IV block; error %d\n", (int) PTR_ERR(ivs));
+                        sflc_vol_endRead(dec_work, BLK_STS_IOERR);
+                        return;
+                }
         }
 
-        /* Copy the relevant portion */
-        memcpy(iv, iv_block + (off_in_slice * SFLC_SK_IV_LEN), SFLC_SK_IV_LEN);
+        /* Queue all the sectors (the bio never crosses a slice boundary). The requests copy their IV */
+        sflc_sk_initBatch(&dec_work->crypt, sflc_vol_decryptDone, dec_work);
+        while (iter.bi_size) {
+                struct bio_vec bvl = bio_iter_iovec(orig_bio, iter);
+
+                if (sflc_vol_blockIsWritten(vol, dec_work->lsi, off_in_slice)) {
+                        err = sflc_sk_queueDecrypt(vol->skctx, &dec_work->crypt, bvl.bv_page, bvl.bv_offset,
+                                                   bvl.bv_page, bvl.bv_offset, SFLC_DEV_SECTOR_SIZE,
+                                                   ivs + ((off_in_slice - ivs_first) * SFLC_SK_IV_LEN));
+                        if (err) {
+                                pr_err("Error while decrypting sector: %d\n", err);
+                                break;
+                        }
+                } else {
+                        memzero_page(bvl.bv_page, bvl.bv_offset, SFLC_DEV_SECTOR_SIZE);
+                }
+
+                bio_advance_iter(orig_bio, &iter, SFLC_DEV_SECTOR_SIZE);
+                off_in_slice += 1;
+        }
 
         /* Release reference to the IV block */
-        err = sflc_dev_putIvBlockRef(dev, psi);
+        if (!lockless && sflc_dev_putIvBlockRef(dev, dec_work->psi)) {
+                pr_err("Could not release reference to IV block\n");
+                sflc_sk_failBatch(&dec_work->crypt, -EIO);
+        }
+
+        /* Go, the last request to complete (maybe this very call) ends the read */
+        sflc_sk_closeBatch(&dec_work->crypt);
+
+        return;
+}
+
+/* All the sectors are decrypted (possibly in softirq context) */
+static void sflc_vol_decryptDone(sflc_sk_Batch * batch, int err)
+{
+        sflc_vol_DecryptWork * dec_work = batch->private;
+
         if (err) {
-                pr_err("Could not release reference to IV block; error %d\n", err);
-                goto err_put_iv_block_ref;
+                pr_err("Could not decrypt bio; error %d\n", err);
         }
 
-        return 0;
+        sflc_vol_endRead(dec_work, err ? BLK_STS_IOERR : BLK_STS_OK);
+}
+
+/* Completes the original bio, and frees the rest */
+static void sflc_vol_endRead(sflc_vol_DecryptWork * dec_work, blk_status_t status)
+{
+        struct bio * orig_bio = dec_work->orig_bio;
+
+        /* All of it has been processed */
+        bio_advance(orig_bio, orig_bio->bi_iter.bi_size);
+
+        /* Release the extra reference to the original bio */
+        bio_put(orig_bio);
+        /* End I/O on the original bio */
+        orig_bio->bi_status = status;
+        bio_endio(orig_bio);
 
+        /* Free the physical bio */
+        if (dec_work->phys_bio) {
+                bio_put(dec_work->phys_bio);
+        }
+        /* Free the work item */
+        mempool_free(dec_work, sflc_pools_decryptWorkPool);
 
-err_put_iv_block_ref:
-err_get_iv_block_ref:
-        return err;
+        return;
 }
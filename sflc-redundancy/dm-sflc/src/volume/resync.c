@@ -0,0 +1,402 @@
+/*
+ *  Copyright The Shufflecake Project Authors (2022)
+ *  Copyright The Shufflecake Project Contributors (2022)
+ *  Copyright Contributors to the The Shufflecake Project.
+ *
+ *  See the AUTHORS file at the top-level directory of this distribution and at
+ *  <https://www.shufflecake.net/permalinks/shufflecake-userland/AUTHORS>
+ *
+ *  This file is part of the program dm-sflc, which is part of the Shufflecake
+ *  Project. Shufflecake is a plausible deniability (hidden storage) layer for
+ *  Linux. See <https://www.shufflecake.net>.
+ *
+ *  This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version. This program is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ *  Public License for more details. You should have received a copy of the
+ *  GNU General Public License along with this program.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file only implements the lazy replicas.
+ * A lazy write only goes to the primary copy, and the upper bio completes
+ * with it. The slice is first set in the dirty-replica log, which lives in
+ * the header (encrypted like the fmap, and stored along with it), so that
+ * after a crash we still know which replicas lag behind. The stale slices
+ * are then copied onto their replica by the repair daemon, a while later
+ * (so that a burst of writes to a slice costs a single copy), and at the
+ * next opening for those left over.
+ *
+ * A bit can only be cleared in the log on disk when no lazy write is in
+ * flight: a write counts itself in flight before checking that its bit
+ * is in the log, and a store announces itself before checking the count.
+ */
+
+/*****************************************************
+ *                  INCLUDE SECTION                  *
+ *****************************************************/
+
+#include "volume.h"
+#include "utils/workqueues.h"
+#include "log/log.h"
+
+/*****************************************************
+ *                     CONSTANTS                     *
+ *****************************************************/
+
+/*****************************************************
+ *           PRIVATE FUNCTIONS PROTOTYPES            *
+ *****************************************************/
+
+/* The header block holding the bit of the LSI */
+static inline u32 sflc_vol_dlogBlockOf(u32 lsi)
+{
+        return SFLC_VOL_DLOG_FIRST_BLOCK + 1 + (lsi / SFLC_VOL_DLOG_LSIS_PER_BLOCK);
+}
+
+/*****************************************************
+ *           PUBLIC FUNCTIONS DEFINITIONS            *
+ *****************************************************/
+
+/* Allocates the dirty-replica log, if there is room for it in the header. Returns < 0 if error. */
+int sflc_vol_allocDlog(sflc_Volume * vol)
+{
+        u32 nbits = vol->dev->tot_slices;
+
+        vol->mirror_vol = NULL;
+        vol->lazy_replicas = false;
+        vol->dlog_valid = false;
+        vol->dlog_unsynced = false;
+        atomic_set(&vol->lazy_inflight, 0);
+        INIT_DELAYED_WORK(&vol->resync_work, sflc_vol_resyncWorkFn);
+
+        /* No room: the replicas are always written eagerly */
+        if (!SFLC_VOL_HAS_DLOG(nbits)) {
+                pr_notice("No room for the dirty-replica log of volume %s: no lazy replicas\n", vol->vol_name);
+                return 0;
+        }
+
+        vol->dlog_nbits = nbits;
+        vol->replica_stale = bitmap_zalloc(nbits, GFP_KERNEL);
+        vol->replica_resyncing = bitmap_zalloc(nbits, GFP_KERNEL);
+        vol->replica_logged = bitmap_zalloc(nbits, GFP_KERNEL);
+        if (!vol->replica_stale || !vol->replica_resyncing || !vol->replica_logged) {
+                pr_err("Could not allocate dirty-replica log\n");
+                sflc_vol_freeDlog(vol);
+                return -ENOMEM;
+        }
+
+        return 0;
+}
+
+/* Frees the dirty-replica log */
+void sflc_vol_freeDlog(sflc_Volume * vol)
+{
+        bitmap_free(vol->replica_logged);
+        bitmap_free(vol->replica_resyncing);
+        bitmap_free(vol->replica_stale);
+        vol->replica_logged = NULL;
+        vol->replica_resyncing = NULL;
+        vol->replica_stale = NULL;
+}
+
+/* Switches the lazy replicas on or off. Returns < 0 if error. */
+int sflc_vol_setLazyReplicas(sflc_Volume * vol, bool enable)
+{
+        int err = 0;
+
+        /* The stale replicas are still resynced */
+        if (!enable) {
+                WRITE_ONCE(vol->lazy_replicas, false);
+                return 0;
+        }
+        /* Only a pair of copies can tell which one is stale */
+        if (!vol->replica_stale || vol->replica_factor > 2) {
+                return -EOPNOTSUPP;
+        }
+
+        if (mutex_lock_interruptible(&vol->fmap_lock)) {
+                pr_err("Interrupted while waiting to lock fmap\n");
+                return -EINTR;
+        }
+        /* What's in the header was never a log: write an empty one before the first lazy write */
+        if (!vol->dlog_valid) {
+                bitmap_set(vol->fmap_dirty, SFLC_VOL_DLOG_FIRST_BLOCK, SFLC_VOL_DLOG_BLOCKS);
+                err = sflc_vol_storeFmapLocked(vol);
+                if (err) {
+                        pr_err("Could not initialise dirty-replica log; error %d\n", err);
+                        goto out;
+                }
+                vol->dlog_valid = true;
+        }
+        WRITE_ONCE(vol->lazy_replicas, true);
+
+out:
+        mutex_unlock(&vol->fmap_lock);
+        return err;
+}
+
+/* The replica of the LSI lags behind the volume's copy */
+bool sflc_vol_replicaIsStale(sflc_Volume * vol, u32 lsi)
+{
+        if (!vol->replica_stale || lsi >= vol->dlog_nbits) {
+                return false;
+        }
+
+        return test_bit(lsi, vol->replica_stale) || test_bit(lsi, vol->replica_resyncing);
+}
+
+/* Makes sure the LSI is in the log on disk, before its replica goes stale. Returns < 0 if error.
+   On success, the write counts as in flight until sflc_vol_markReplicaStale(). */
+int sflc_vol_logStaleReplica(sflc_Volume * vol, u32 lsi)
+{
+        int err = 0;
+
+        if (!vol->replica_stale || lsi >= vol->dlog_nbits) {
+                return -EINVAL;
+        }
+
+        /* In flight first: from now on, no store clears the bit */
+        atomic_inc(&vol->lazy_inflight);
+        smp_mb__after_atomic();
+
+        /* Fast path: the bit is in the log, and no store is changing it */
+        if (test_bit(lsi, vol->replica_logged) && !READ_ONCE(vol->dlog_unsynced)) {
+                return 0;
+        }
+
+        /* Otherwise set it, and store the log (along with the dirty fmap blocks) */
+        mutex_lock(&vol->fmap_lock);
+        if (!test_bit(lsi, vol->replica_logged) || vol->dlog_unsynced) {
+                set_bit(lsi, vol->replica_stale);
+                set_bit(sflc_vol_dlogBlockOf(lsi), vol->fmap_dirty);
+                err = sflc_vol_storeFmapLocked(vol);
+        }
+        mutex_unlock(&vol->fmap_lock);
+
+        if (err) {
+                pr_err("Could not log stale replica of slice %u; error %d\n", lsi, err);
+                smp_mb__before_atomic();
+                atomic_dec(&vol->lazy_inflight);
+        }
+
+        return err;
+}
+
+/* The primary of a lazy write landed: the replica now lags behind (callable from endio) */
+void sflc_vol_markReplicaStale(sflc_Volume * vol, u32 lsi)
+{
+        set_bit(lsi, vol->replica_stale);
+        /* Before it stops counting as in flight */
+        smp_mb__before_atomic();
+        atomic_dec(&vol->lazy_inflight);
+
+        sflc_vol_scheduleResync(vol, msecs_to_jiffies(SFLC_VOL_RESYNC_DELAY_MS));
+}
+
+/* Queues the stale replicas for resync, after a while (callable from endio) */
+void sflc_vol_scheduleResync(sflc_Volume * vol, unsigned long delay)
+{
+        /* A read-only volume keeps its stale replicas (the reads go to the fresh copy) */
+        if (!vol->replica_stale || vol->read_only) {
+                return;
+        }
+
+        /* No-op if it's already pending: the first write of a burst sets the deadline */
+        queue_delayed_work(sflc_queues_writeQueue, &vol->resync_work, delay);
+}
+
+/* Hands the stale slices over to the repair daemon (their replica gets mapped if it isn't) */
+void sflc_vol_resyncWorkFn(struct work_struct * work)
+{
+        sflc_Volume * vol = container_of(to_delayed_work(work), sflc_Volume, resync_work);
+        sflc_Device * dev = vol->dev;
+        sflc_Volume * mirror_vol = READ_ONCE(vol->mirror_vol);
+        unsigned long lsi;
+        u32 queued = 0;
+        int err;
+
+        /* The replicas wait for the other volume to be opened */
+        if (!mirror_vol) {
+                return;
+        }
+
+        for_each_set_bit(lsi, vol->replica_stale, vol->dlog_nbits) {
+                u32 mirror_lsi = lsi;
+                s32 psi;
+
+                /* Within a volume, the replica is in another slice (if any) */
+                if (mirror_vol == vol && !sflc_vol_replicaLsis(vol, lsi, &mirror_lsi)) {
+                        continue;
+                }
+                if (mirror_lsi >= dev->tot_slices) {
+                        continue;
+                }
+                /* The replica might have never been written */
+                psi = sflc_vol_mapSlice(mirror_vol, mirror_lsi, WRITE);
+                if (psi < 0) {
+                        pr_err("Could not map replica of slice %lu of volume %s; error %d\n", lsi, vol->vol_name, psi);
+                        continue;
+                }
+
+                err = sflc_dev_queueResync(dev, vol->vol_idx, lsi, mirror_vol->vol_idx, mirror_lsi);
+                if (err) {
+                        pr_err("Could not queue resync of slice %lu of volume %s; error %d\n", lsi, vol->vol_name, err);
+                        break;
+                }
+                queued += 1;
+        }
+        if (!queued) {
+                return;
+        }
+
+        /* The daemon is started under the device lock: if it's taken, a volume is coming or
+           going, try again later */
+        if (down_trylock(&sflc_dev_mutex)) {
+                sflc_vol_scheduleResync(vol, msecs_to_jiffies(SFLC_VOL_RESYNC_DELAY_MS));
+                return;
+        }
+        err = sflc_dev_startRepair(dev);
+        up(&sflc_dev_mutex);
+        if (err) {
+                pr_err("Could not start the resync of volume %s; error %d\n", vol->vol_name, err);
+        }
+}
+
+/* Called by the repair daemon before reading the primary: writes landing from now on
+   will have to be copied again */
+void sflc_vol_beginResync(sflc_Volume * vol, u32 lsi)
+{
+        set_bit(lsi, vol->replica_resyncing);
+        smp_mb__before_atomic();
+        clear_bit(lsi, vol->replica_stale);
+}
+
+/* Called by the repair daemon once the replica is written (or failed to) */
+void sflc_vol_endResync(sflc_Volume * vol, u32 lsi, int err)
+{
+        /* Try again later */
+        if (err) {
+                set_bit(lsi, vol->replica_stale);
+        }
+        smp_mb__before_atomic();
+        clear_bit(lsi, vol->replica_resyncing);
+
+        /* Cleared from the log at the next store (the dirty bits are only touched under the lock,
+           a store in progress zeroes them) */
+        mutex_lock(&vol->fmap_lock);
+        set_bit(sflc_vol_dlogBlockOf(lsi), vol->fmap_dirty);
+        mutex_unlock(&vol->fmap_lock);
+
+        if (err) {
+                sflc_vol_scheduleResync(vol, msecs_to_jiffies(SFLC_VOL_RESYNC_DELAY_MS));
+        }
+}
+
+/* Whether the header data block is part of the dirty-replica log */
+bool sflc_vol_isDlogBlock(sflc_Volume * vol, u32 blk)
+{
+        return vol->replica_stale && blk >= SFLC_VOL_DLOG_FIRST_BLOCK && blk < SFLC_VOL_HEADER_DATA_BLOCKS;
+}
+
+/* Settles the content of the log about to be stored (under fmap_lock) */
+void sflc_vol_prepareDlog(sflc_Volume * vol)
+{
+        u32 nbits = vol->dlog_nbits;
+
+        /* Writers take the slow path (and wait for the lock) until it's on disk */
+        WRITE_ONCE(vol->dlog_unsynced, true);
+        smp_mb();
+
+        /* Bits are only cleared if no lazy write is in flight: it might rely on them */
+        if (atomic_read(&vol->lazy_inflight) == 0) {
+                bitmap_or(vol->replica_logged, vol->replica_stale, vol->replica_resyncing, nbits);
+        } else {
+                bitmap_or(vol->replica_logged, vol->replica_logged, vol->replica_stale, nbits);
+                bitmap_or(vol->replica_logged, vol->replica_logged, vol->replica_resyncing, nbits);
+        }
+}
+
+/* Fills a block of the log (in little-endian 32-bit words) */
+void sflc_vol_encodeDlogBlock(sflc_Volume * vol, u32 blk, u8 * data)
+{
+        u32 idx = blk - SFLC_VOL_DLOG_FIRST_BLOCK;
+        u32 * words = (u32 *) data;
+        u32 start;
+        u32 nbits;
+        u32 i;
+
+        memset(data, 0, SFLC_DEV_SECTOR_SIZE);
+
+        /* The descriptor */
+        if (idx == 0) {
+                memcpy(data, SFLC_VOL_DLOG_MAGIC, sizeof(SFLC_VOL_DLOG_MAGIC) - 1);
+                return;
+        }
+
+        /* The bitmap (block boundaries fall on word boundaries) */
+        start = (idx - 1) * SFLC_VOL_DLOG_LSIS_PER_BLOCK;
+        if (start >= vol->dlog_nbits) {
+                return;
+        }
+        nbits = min_t(u32, vol->dlog_nbits - start, SFLC_VOL_DLOG_LSIS_PER_BLOCK);
+        bitmap_to_arr32(words, vol->replica_logged + BIT_WORD(start), nbits);
+        for (i = 0; i < DIV_ROUND_UP(nbits, 32); i++) {
+                cpu_to_le32s(&words[i]);
+        }
+}
+
+/* Reads a block of the log back (into replica_logged, it is validated once all are in) */
+void sflc_vol_decodeDlogBlock(sflc_Volume * vol, u32 blk, u8 * data)
+{
+        u32 idx = blk - SFLC_VOL_DLOG_FIRST_BLOCK;
+        u32 * words = (u32 *) data;
+        u32 start;
+        u32 nbits;
+        u32 i;
+
+        /* The descriptor */
+        if (idx == 0) {
+                vol->dlog_valid = !memcmp(data, SFLC_VOL_DLOG_MAGIC, sizeof(SFLC_VOL_DLOG_MAGIC) - 1);
+                return;
+        }
+
+        /* The bitmap */
+        start = (idx - 1) * SFLC_VOL_DLOG_LSIS_PER_BLOCK;
+        if (start >= vol->dlog_nbits) {
+                return;
+        }
+        nbits = min_t(u32, vol->dlog_nbits - start, SFLC_VOL_DLOG_LSIS_PER_BLOCK);
+        for (i = 0; i < DIV_ROUND_UP(nbits, 32); i++) {
+                le32_to_cpus(&words[i]);
+        }
+        bitmap_from_arr32(vol->replica_logged + BIT_WORD(start), words, nbits);
+}
+
+/* The log was loaded with the fmap: its stale slices are resynced once the replicas are there */
+void sflc_vol_dlogLoaded(sflc_Volume * vol)
+{
+        u32 nr_stale;
+
+        /* Random bytes, not a log */
+        if (!vol->dlog_valid) {
+                bitmap_zero(vol->replica_logged, vol->dlog_nbits);
+        }
+        bitmap_copy(vol->replica_stale, vol->replica_logged, vol->dlog_nbits);
+
+        nr_stale = bitmap_weight(vol->replica_stale, vol->dlog_nbits);
+        if (nr_stale) {
+                pr_notice("Volume %s has %u slices with a stale replica: they will be resynced\n", vol->vol_name, nr_stale);
+        }
+}
+
+/* The log made it to disk: the writers can trust replica_logged again */
+void sflc_vol_dlogStored(sflc_Volume * vol)
+{
+        smp_wmb();
+        WRITE_ONCE(vol->dlog_unsynced, false);
+}
@@ -30,6 +30,7 @@
  *****************************************************/
 
 #include "volume.h"
+#include "crypto/rand/rand.h"
 #include "log/log.h"
 
 /*****************************************************
@@ -46,6 +47,8 @@ sflc_Volume * sflc_vol_getVolume(struct dm_target * ti, char * vol_name, sflc_De
 {
 	sflc_Volume * vol;
 	int err;
+	int lock;
+	int stream;
 
 	pr_debug("Called to create sflc_Volume named \"%s\"\n", vol_name);
 
@@ -91,8 +94,13 @@ sflc_Volume * sflc_vol_getVolume(struct dm_target * ti, char * vol_name, sflc_De
 		goto err_create_skctx;
 	}
 
-	/* Initialise fmap_lock */
+	/* Initialise fmap_lock, and the seqcount for lockless lookups */
 	mutex_init(&vol->fmap_lock);
+	seqcount_mutex_init(&vol->fmap_seqcount, &vol->fmap_lock);
+	/* And the parity stripe locks (whether or not there is parity) */
+	for (lock = 0; lock < SFLC_VOL_PARITY_LOCKS; lock++) {
+		mutex_init(&vol->parity_locks[lock]);
+	}
 	/* Allocate forward map */
 	vol->fmap = vmalloc(dev->tot_slices * sizeof(u32));
 	if (!vol->fmap) {
@@ -102,6 +110,49 @@ sflc_Volume * sflc_vol_getVolume(struct dm_target * ti, char * vol_name, sflc_De
 	}
 	/* And init the stats */
 	vol->mapped_slices = 0;
+	/* Allocate dirty bitmap and header IVs */
+	vol->fmap_dirty = bitmap_zalloc(SFLC_VOL_HEADER_DATA_BLOCKS, GFP_KERNEL);
+	if (!vol->fmap_dirty) {
+		pr_err("Could not allocate fmap dirty bitmap\n");
+		err = -ENOMEM;
+		goto err_alloc_fmap_dirty;
+	}
+	vol->fmap_ivs = kmalloc(SFLC_VOL_HEADER_IV_BLOCKS * SFLC_DEV_SECTOR_SIZE, GFP_KERNEL);
+	if (!vol->fmap_ivs) {
+		pr_err("Could not allocate fmap IVs\n");
+		err = -ENOMEM;
+		goto err_alloc_fmap_ivs;
+	}
+	/* An IV block is always written whole: the slots of the blocks that were never sampled
+	   nor loaded must look as random as the rest of the header */
+	err = sflc_rand_getBytes(vol->fmap_ivs, SFLC_VOL_HEADER_IV_BLOCKS * SFLC_DEV_SECTOR_SIZE);
+	if (err) {
+		pr_err("Could not sample fmap IVs; error %d\n", err);
+		goto err_sample_fmap_ivs;
+	}
+	vol->checkpoint_on_flush = false;
+	/* No block discarded yet */
+	mutex_init(&vol->discard_lock);
+	xa_init(&vol->discarded);
+	/* No read stream yet */
+	for (stream = 0; stream < SFLC_VOL_READ_STREAMS; stream++) {
+		vol->streams[stream].next_sector = 0;
+		vol->streams[stream].hits = 0;
+		vol->streams[stream].ahead_lsi = SFLC_VOL_FMAP_INVALID_PSI;
+	}
+	atomic_set(&vol->streams_victim, 0);
+	/* Dirty-replica log (if it fits) */
+	err = sflc_vol_allocDlog(vol);
+	if (err) {
+		pr_err("Could not allocate dirty-replica log; error %d\n", err);
+		goto err_alloc_dlog;
+	}
+	/* Written-block map (if it fits too) */
+	err = sflc_vol_allocWmap(vol);
+	if (err) {
+		pr_err("Could not allocate written-block map; error %d\n", err);
+		goto err_alloc_wmap;
+	}
 
 	/* Initialise fmap */
 	if (vol_creation) {
@@ -110,6 +161,14 @@ sflc_Volume * sflc_vol_getVolume(struct dm_target * ti, char * vol_name, sflc_De
 		for (i = 0; i < dev->tot_slices; i++) {
 			vol->fmap[i] = SFLC_VOL_FMAP_INVALID_PSI;
 		}
+		/* Nothing valid on disk yet: the whole header has to be written (with an empty log) */
+		bitmap_set(vol->fmap_dirty, 0, SFLC_VOL_FMAP_BLOCKS(dev->tot_slices));
+		if (vol->replica_stale) {
+			bitmap_set(vol->fmap_dirty, SFLC_VOL_DLOG_FIRST_BLOCK, SFLC_VOL_DLOG_BLOCKS);
+			vol->dlog_valid = true;
+		}
+		/* Nothing written yet */
+		sflc_vol_wmapCreated(vol);
 	} else {
 		pr_notice("Volume opening for volume %s: loading fmap from header\n", vol->vol_name);
 		err = sflc_vol_loadFmap(vol);
@@ -124,6 +183,15 @@ sflc_Volume * sflc_vol_getVolume(struct dm_target * ti, char * vol_name, sflc_De
 
 
 err_load_fmap:
+	sflc_vol_freeWmap(vol);
+err_alloc_wmap:
+	sflc_vol_freeDlog(vol);
+err_alloc_dlog:
+err_sample_fmap_ivs:
+	kfree(vol->fmap_ivs);
+err_alloc_fmap_ivs:
+	bitmap_free(vol->fmap_dirty);
+err_alloc_fmap_dirty:
 	vfree(vol->fmap);
 err_alloc_fmap:
 	sflc_sk_destroyContext(vol->skctx);
@@ -144,6 +212,9 @@ void sflc_vol_putVolume(struct dm_target * ti, sflc_Volume * vol)
 {
 	int err;
 
+	/* No more resyncs (the stale replicas are in the log) */
+	cancel_delayed_work_sync(&vol->resync_work);
+
 	/* Store fmap */
 	pr_notice("Going to store position map of volume %s\n", vol->vol_name);
 	err = sflc_vol_storeFmap(vol);
@@ -152,6 +223,11 @@ void sflc_vol_putVolume(struct dm_target * ti, sflc_Volume * vol)
 	}
 	pr_debug("Successfully stored position map of volume %s\n", vol->vol_name);
 	/* Free it */
+	sflc_vol_freeDiscarded(vol);
+	sflc_vol_freeWmap(vol);
+	sflc_vol_freeDlog(vol);
+	kfree_sensitive(vol->fmap_ivs);
+	bitmap_free(vol->fmap_dirty);
 	vfree(vol->fmap);
 
 	/* Skctx */
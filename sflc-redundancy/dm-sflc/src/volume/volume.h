@@ -37,6 +37,8 @@
 
 typedef struct sflc_vol_write_work_s sflc_vol_WriteWork;
 typedef struct sflc_vol_decrypt_work_s sflc_vol_DecryptWork;
+typedef struct sflc_vol_write_ctx_s sflc_vol_WriteCtx;
+typedef struct sflc_vol_read_stream_s sflc_vol_ReadStream;
 typedef struct sflc_volume_s sflc_Volume;
 
 /*****************************************************
@@ -44,6 +46,7 @@ typedef struct sflc_volume_s sflc_Volume;
  *****************************************************/
 
 #include <linux/blk_types.h>
+#include <linux/xarray.h>
 
 #include "device/device.h"
 #include "crypto/symkey/symkey.h"
@@ -60,9 +63,65 @@ typedef struct sflc_volume_s sflc_Volume;
 
 /* A single header data block contains 1024 fmap mappings */
 #define SFLC_VOL_HEADER_MAPPINGS_PER_BLOCK (SFLC_DEV_SECTOR_SIZE / sizeof(u32))
+/* Number of header data blocks actually used by the fmap */
+#define SFLC_VOL_FMAP_BLOCKS(tot_slices) DIV_ROUND_UP((tot_slices), SFLC_VOL_HEADER_MAPPINGS_PER_BLOCK)
 
 /* We split the volume's logical addressing space into 1 MB slices */
 #define SFLC_VOL_LOG_SLICE_SIZE 256	// In 4096-byte sectors
+/* The LSI a logical 512-byte sector falls in */
+#define SFLC_VOL_SECTOR_TO_LSI(log_sector) ((u32) ((log_sector) / (SFLC_VOL_LOG_SLICE_SIZE * SFLC_DEV_SECTOR_SCALE)))
+
+/* The dirty-replica log: a descriptor block, then a bitmap with one bit per LSI. It sits
+   at the end of the header data blocks, in the part the fmap doesn't use (unless the device
+   is close to the maximum size, in which case there are no lazy replicas) */
+#define SFLC_VOL_DLOG_LSIS_PER_BLOCK (SFLC_DEV_SECTOR_SIZE * BITS_PER_BYTE)
+#define SFLC_VOL_DLOG_BLOCKS (1 + DIV_ROUND_UP(SFLC_DEV_MAX_SLICES, SFLC_VOL_DLOG_LSIS_PER_BLOCK))
+#define SFLC_VOL_DLOG_FIRST_BLOCK (SFLC_VOL_HEADER_DATA_BLOCKS - SFLC_VOL_DLOG_BLOCKS)
+#define SFLC_VOL_HAS_DLOG(tot_slices) (SFLC_VOL_FMAP_BLOCKS(tot_slices) <= SFLC_VOL_DLOG_FIRST_BLOCK)
+/* Tells a valid descriptor block from the random bytes of a header that never had a log */
+#define SFLC_VOL_DLOG_MAGIC "SFLCDLOG"
+/* How long the replicas are let lag behind before the resync kicks in */
+#define SFLC_VOL_RESYNC_DELAY_MS 1000
+
+/* The written-block map: one bit per block of every LSI. It sits right below the dirty-replica
+   log, a descriptor block first, then the bitmap blocks going down (as long as they stay clear
+   of the fmap) */
+#define SFLC_VOL_WMAP_LSIS_PER_BLOCK (SFLC_DEV_SECTOR_SIZE * BITS_PER_BYTE / SFLC_VOL_LOG_SLICE_SIZE)
+#define SFLC_VOL_WMAP_DESC_BLOCK (SFLC_VOL_DLOG_FIRST_BLOCK - 1)
+#define SFLC_VOL_WMAP_BLOCKS(tot_slices) (1 + DIV_ROUND_UP((tot_slices), SFLC_VOL_WMAP_LSIS_PER_BLOCK))
+#define SFLC_VOL_WMAP_FIRST_BLOCK(tot_slices) (SFLC_VOL_DLOG_FIRST_BLOCK - SFLC_VOL_WMAP_BLOCKS(tot_slices))
+#define SFLC_VOL_HAS_WMAP(tot_slices) (SFLC_VOL_FMAP_BLOCKS(tot_slices) <= SFLC_VOL_WMAP_FIRST_BLOCK(tot_slices))
+/* Tells a valid descriptor block from the random bytes of a header that never had a map */
+#define SFLC_VOL_WMAP_MAGIC "SFLCWMAP"
+
+/* Within a volume, a slice has up to this many copies (the first one included), spread across
+   the logical space: copy r of LSI l is LSI l + r * (tot_slices / R), and only the first
+   tot_slices / R LSIs are exposed. Without a factor, slices are paired even/odd instead */
+#define SFLC_VOL_MAX_REPLICAS 4
+
+/* Which I/O of a redundant volume goes to both copies: everything, only the filesystem
+   metadata (bios flagged REQ_META or REQ_PRIO), or only some ranges of sectors */
+#define SFLC_VOL_MIRROR_ALL 'a'
+#define SFLC_VOL_MIRROR_META 'm'
+#define SFLC_VOL_MIRROR_RANGES 'r'
+#define SFLC_VOL_MAX_MIRROR_RANGES 16
+
+/* Parity redundancy: every stripe of K + M consecutive LSIs holds K data slices followed by
+   M parity slices (P, and Q for M = 2, as in RAID-6). Only the data slices are visible */
+#define SFLC_VOL_PARITY_MAX_DATA 16
+#define SFLC_VOL_PARITY_MAX_PARITY 2
+/* Writes to a stripe are serialised by one of these locks (picked by stripe number) */
+#define SFLC_VOL_PARITY_LOCKS 64
+/* Parity updates and rebuilds go by this many blocks at a time */
+#define SFLC_VOL_PARITY_BATCH 64
+
+/* Sequential reads are tracked in this many streams per volume */
+#define SFLC_VOL_READ_STREAMS 4
+/* A stream gets the IV block of its next slice read ahead once this many reads followed on */
+#define SFLC_VOL_READ_STREAM_MIN_HITS 2
+
+/* Reads of read-only volumes copy the IVs of up to this many blocks out of the IV cache locklessly */
+#define SFLC_VOL_LOCKLESS_READ_BLOCKS 32
 
 /* Value marking an LSI as unassigned */
 #define SFLC_VOL_FMAP_INVALID_PSI 0xFFFFFFFFU
@@ -71,14 +130,45 @@ typedef struct sflc_volume_s sflc_Volume;
  *                       TYPES                       *
  *****************************************************/
 
+/* Set at open time, from the table line */
+typedef struct sflc_vol_mirror_policy_s
+{
+	char			type;
+	/* For SFLC_VOL_MIRROR_RANGES, in 512-byte logical sectors (end excluded) */
+	u32			nr_ranges;
+	sector_t		range_start[SFLC_VOL_MAX_MIRROR_RANGES];
+	sector_t		range_end[SFLC_VOL_MAX_MIRROR_RANGES];
+} sflc_vol_MirrorPolicy;
+
 struct sflc_vol_write_work_s
 {
 	/* Essential information */
         sflc_Volume            * vol;
         struct bio            * orig_bio;
 
-	/* Write requests need to allocate own page */
-	struct page	      * page;
+	/* Where the mirror copies go: at each mirror_sector of mirror_vol (NULL if the write is not mirrored) */
+	sflc_Volume	      * mirror_vol;
+	sector_t		mirror_sector[SFLC_VOL_MAX_REPLICAS - 1];
+	u32			nr_mirrors;
+
+	/* Physical bios in flight: the original bio completes when they all have */
+	atomic_t		pending;
+	blk_status_t		status;
+	struct bio	      * primary_bio;
+	/* The mirrors that could not be written (bit i for mirror_sector[i]): they get repaired */
+	unsigned long		mirrors_failed;
+
+	/* Only the primary is written: the replica is resynced in the background */
+	bool			lazy;
+
+	/* Position in the list of writes held back by the repair daemon */
+	struct list_head	held_node;
+	/* Position in the write engine's queue, then batch */
+	struct list_head	queue_node;
+
+	/* The encryption of each copy (the primary first), and what the batch it's part of shares */
+	sflc_sk_Batch		crypt[SFLC_VOL_MAX_REPLICAS];
+	sflc_vol_WriteCtx     * write_ctx;
 
 	/* Will be submitted to workqueue */
         struct work_struct      work;
@@ -91,12 +181,35 @@ struct sflc_vol_decrypt_work_s
         struct bio            * orig_bio;
 	struct bio	      * phys_bio;
 
-	/* IV retrieval information */
+	/* IV retrieval information (and the LSI, for the written-block map) */
 	u32 			psi;
 	u32			off_in_slice;
+	u32			lsi;
 
-	/* Will be submitted to workqueue */
-        struct work_struct      work;
+	/* The other copies, to fall back on if this one fails (tried from the last one) */
+	sflc_Volume	      * alt_vol;
+	sector_t		alt_sector[SFLC_VOL_MAX_REPLICAS - 1];
+	u32			nr_alts;
+
+	/* The decryption requests in flight: the last one ends the read */
+	sflc_sk_Batch		crypt;
+	/* The IVs, copied out of the IV cache (read-only volumes) */
+	u8			ivs[SFLC_VOL_LOCKLESS_READ_BLOCKS * SFLC_SK_IV_LEN];
+
+	/* The CPU the read was submitted from, and position in its list of completed reads */
+	int			cpu;
+	struct llist_node	done_node;
+};
+
+/* A sequential read stream, detected by reads starting where the previous one ended */
+struct sflc_vol_read_stream_s
+{
+	/* Where the next read of the stream is expected to start (moved on with cmpxchg) */
+	sector_t		next_sector;
+	/* How many reads followed on so far */
+	u32			hits;
+	/* The last LSI whose IV block was read ahead (SFLC_VOL_FMAP_INVALID_PSI if none) */
+	u32			ahead_lsi;
 };
 
 struct sflc_volume_s
@@ -108,12 +221,69 @@ struct sflc_volume_s
 	sflc_Device    		      * dev;
 	/* Index of this volume within the device's volume array */
 	int				vol_idx;
+	/* Opened read-only (set before any I/O): writes are rejected, the fmap is frozen (never
+	   stored either), and reads look up the fmap and the IV cache without any lock */
+	bool				read_only;
 
-	/* Forward position map */
+	/* Forward position map. Lookups of mapped LSIs are lockless (seqcount-protected),
+	   the mutex is only taken to modify it */
 	struct mutex			fmap_lock;
+	seqcount_mutex_t		fmap_seqcount;
 	u32	        	      *	fmap;
 	/* Stats on the fmap */
 	u32				mapped_slices;
+	/* Header data blocks changed since the last store (under fmap_lock), and
+	   the header IV blocks as last stored, so that only those get rewritten */
+	unsigned long		      * fmap_dirty;
+	u8			      * fmap_ivs;
+	/* Store the dirty part of the fmap before passing a flush down (always done with a written-block map) */
+	bool				checkpoint_on_flush;
+	/* Written-block map (NULL if it doesn't fit in the header), stored with the fmap.
+	   Bits are indexed by LSI and block, and only change under fmap_lock */
+	unsigned long		      * written;
+	u32				wmap_lsis;
+	/* The descriptor block is valid on disk */
+	bool				wmap_valid;
+
+	/* Blocks discarded since their slice was mapped: a bitmap per LSI (only for the slices
+	   that have some), under discard_lock. Not persisted */
+	struct mutex			discard_lock;
+	struct xarray			discarded;
+
+	/* Sequential read streams (see read.c), lockless, and the next slot to recycle */
+	sflc_vol_ReadStream		streams[SFLC_VOL_READ_STREAMS];
+	atomic_t			streams_victim;
+
+	/* Which I/O is mirrored, if the volume is redundant */
+	sflc_vol_MirrorPolicy		mirror_policy;
+	/* Copies of every slice within the volume, and how many LSIs apart (0 if paired even/odd) */
+	u32				replica_factor;
+	u32				replica_stride;
+
+	/* Parity layout (K data and M parity slices per stripe; 0 if no parity), and the
+	   stripe locks */
+	u32				parity_data;
+	u32				parity_nr;
+	struct mutex			parity_locks[SFLC_VOL_PARITY_LOCKS];
+
+	/* Lazy replicas: writes complete with the primary copy, and the slices whose replica
+	   lags behind are copied over by the repair daemon. The dirty-replica log (NULL bitmaps
+	   if it doesn't fit in the header) persists them with the fmap: a slice is set in it on
+	   disk before its replica can go stale. Bitmaps are indexed by LSI, the log is written
+	   under fmap_lock */
+	sflc_Volume		      * mirror_vol;
+	bool				lazy_replicas;
+	u32				dlog_nbits;
+	unsigned long		      * replica_stale;
+	unsigned long		      * replica_resyncing;
+	unsigned long		      * replica_logged;
+	/* The descriptor block is valid on disk */
+	bool				dlog_valid;
+	/* A log store is under way (or failed): replica_logged can't be trusted */
+	bool				dlog_unsynced;
+	/* Lazy writes whose primary is in flight */
+	atomic_t			lazy_inflight;
+	struct delayed_work		resync_work;
 
 	/* Sysfs stuff */
 	sflc_sysfs_VolumeDevice	      * kdev;
@@ -140,24 +310,99 @@ void sflc_vol_putVolume(struct dm_target * ti, sflc_Volume * vol);
 int sflc_vol_remapBioFast(sflc_Volume * vol, struct bio * bio);
 /* Processes the bio in the normal indirection+crypto way */
 int sflc_vol_processBio(sflc_Volume * vol, struct bio * bio);
+/* Stores the dirty part of the fmap, then passes the (empty) flush bio down */
+int sflc_vol_processFlush(sflc_Volume * vol, struct bio * bio);
 
 /* Executed in top half */
 void sflc_vol_doRead(sflc_Volume * vol, struct bio * bio);
-/* Executed in bottom half */
+/* Same, but the data also lives at the mirror_sectors of mirror_vol: any copy may be read */
+void sflc_vol_doMirroredRead(sflc_Volume * vol, struct bio * bio, sflc_Volume * mirror_vol, const sector_t * mirror_sectors, u32 nr_mirrors);
+/* Bottom half of a read, on the CPU that submitted it (see device/decrypt.c) */
+void sflc_vol_readDone(sflc_vol_DecryptWork * dec_work);
+/* Executed in bottom half. Both copies of a mirrored write are handled by the same work item */
 void sflc_vol_doWrite(struct work_struct * work);
+/* Same, for a batch of write works taken off the write engine's queue, all under one plug */
+void sflc_vol_writeBatch(struct list_head * batch);
 
 /* Maps a logical 512-byte sector to a physical 512-byte sector. Returns < 0 if error.
  * Specifically, if op == READ, and the logical slice is unmapped, -ENXIO is returned. */
 s64 sflc_vol_remapSector(sflc_Volume * vol, sector_t log_sector, int op, u32 * psi_out, u32 * off_in_slice_out);
 /* Loads (and decrypts) the position map from the volume's header */
 int sflc_vol_loadFmap(sflc_Volume * vol);
-/* Stores (and encrypts) the position map to the volume's header */
+/* Stores (and encrypts) the dirty blocks of the position map to the volume's header */
 int sflc_vol_storeFmap(sflc_Volume * vol);
+/* Same, with the fmap_lock already held */
+int sflc_vol_storeFmapLocked(sflc_Volume * vol);
 
 // sflc-raid START
 s32 sflc_vol_mapSlice(sflc_Volume * vol, u32 lsi, int op); // From private to public
+/* Maps the LSI to a fresh random PSI, forgetting the previous mapping (used by the slice repair) */
+s32 sflc_vol_reallocSlice(sflc_Volume * vol, u32 lsi);
+/* Parses "all", "meta", or "ranges:<start>-<end>[,<start>-<end>...]". Returns < 0 if invalid. */
+int sflc_vol_parseMirrorPolicy(const char * spec, sflc_vol_MirrorPolicy * policy);
 int sflc_vol_processBioRedundantlyAmong(sflc_Volume * vol, sflc_Volume * copy_vol, struct bio * bio);
 int sflc_vol_processBioRedundantlyWithin(sflc_Volume * vol, struct bio * bio);
+/* The other LSIs holding a copy of the LSI within the volume. Returns how many there are. */
+u32 sflc_vol_replicaLsis(sflc_Volume * vol, u32 lsi, u32 * lsis);
+
+/* Lazy replicas (see resync.c) */
+int sflc_vol_allocDlog(sflc_Volume * vol);
+void sflc_vol_freeDlog(sflc_Volume * vol);
+int sflc_vol_setLazyReplicas(sflc_Volume * vol, bool enable);
+/* The replica of the LSI lags behind the volume's copy */
+bool sflc_vol_replicaIsStale(sflc_Volume * vol, u32 lsi);
+/* Makes sure the LSI is in the log on disk, before its replica goes stale. Returns < 0 if error. */
+int sflc_vol_logStaleReplica(sflc_Volume * vol, u32 lsi);
+/* The primary of a lazy write landed: the replica now lags behind (callable from endio) */
+void sflc_vol_markReplicaStale(sflc_Volume * vol, u32 lsi);
+/* Queues the stale replicas for resync, after a while (callable from endio) */
+void sflc_vol_scheduleResync(sflc_Volume * vol, unsigned long delay);
+void sflc_vol_resyncWorkFn(struct work_struct * work);
+/* Called by the repair daemon around the copy of a stale replica */
+void sflc_vol_beginResync(sflc_Volume * vol, u32 lsi);
+void sflc_vol_endResync(sflc_Volume * vol, u32 lsi, int err);
+/* Header blocks of the log, and what goes in them (under fmap_lock) */
+bool sflc_vol_isDlogBlock(sflc_Volume * vol, u32 blk);
+void sflc_vol_prepareDlog(sflc_Volume * vol);
+void sflc_vol_encodeDlogBlock(sflc_Volume * vol, u32 blk, u8 * data);
+void sflc_vol_decodeDlogBlock(sflc_Volume * vol, u32 blk, u8 * data);
+void sflc_vol_dlogLoaded(sflc_Volume * vol);
+void sflc_vol_dlogStored(sflc_Volume * vol);
+
+/* Discards and write-zeroes (see discard.c) */
+int sflc_vol_processDiscard(sflc_Volume * vol, sflc_Volume * copy_vol, struct bio * bio);
+/* The blocks are being written: they are live again (if they were discarded) */
+void sflc_vol_reviveBlocks(sflc_Volume * vol, sector_t log_sector, u32 nr_sectors);
+void sflc_vol_freeDiscarded(sflc_Volume * vol);
+
+/* Written-block map (see written.c) */
+int sflc_vol_allocWmap(sflc_Volume * vol);
+void sflc_vol_freeWmap(sflc_Volume * vol);
+/* Whether the block was ever written (lockless) */
+bool sflc_vol_blockIsWritten(sflc_Volume * vol, u32 lsi, u32 off_in_slice);
+/* Whether none of the blocks covered by the sectors (within a slice) was ever written (lockless) */
+bool sflc_vol_rangeIsUnwritten(sflc_Volume * vol, sector_t log_sector, u32 nr_sectors);
+/* The blocks covered by the sectors (within a slice) are being written */
+void sflc_vol_markWritten(sflc_Volume * vol, sector_t log_sector, u32 nr_sectors);
+/* Makes the map durable, for a FUA write. Returns < 0 if error. */
+int sflc_vol_syncWmap(sflc_Volume * vol);
+/* The blocks of the slice read as zeros from now on. Caller holds fmap_lock. */
+void sflc_vol_forgetWrittenLocked(sflc_Volume * vol, u32 lsi, u32 first, u32 nr);
+/* The receiver slice is now a copy of the donor slice (called by the repair daemon) */
+void sflc_vol_copyWritten(sflc_Volume * donor, u32 donor_lsi, sflc_Volume * receiver, u32 receiver_lsi);
+/* Header blocks of the map, and what goes in them (under fmap_lock) */
+bool sflc_vol_isWmapBlock(sflc_Volume * vol, u32 blk);
+void sflc_vol_encodeWmapBlock(sflc_Volume * vol, u32 blk, u8 * data);
+void sflc_vol_decodeWmapBlock(sflc_Volume * vol, u32 blk, u8 * data);
+void sflc_vol_wmapLoaded(sflc_Volume * vol);
+void sflc_vol_wmapCreated(sflc_Volume * vol);
+
+/* Parity redundancy (see parity.c) */
+/* Parses "<K>+<M>". Returns < 0 if invalid. */
+int sflc_vol_parseParity(const char * spec, u32 * data_slices, u32 * parity_slices);
+int sflc_vol_processBioWithParity(sflc_Volume * vol, struct bio * bio);
+/* Rebuilds the LSI from the rest of its stripe (called by the repair daemon). Returns < 0 if error. */
+int sflc_vol_rebuildFromParity(sflc_Volume * vol, u32 lsi);
 // sflc-raid END
 
 
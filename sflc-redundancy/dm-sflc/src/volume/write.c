@@ -26,12 +26,22 @@
  * the sector, and encrypting the data. The cloned bio is the one that's
  * submitted to the underlying device. Its bi_endio function marks the
  * original bio as complete.
+ * The writes come in batches from the device's write engine: they are
+ * handled in slice order, keeping the IV blocks of the slices referenced
+ * from one write to the next. The encryptions of the whole batch are
+ * queued as asynchronous requests, and waited for once: then all the
+ * physical bios are submitted under the same plug.
+ * A batch holds its bounce pages until it's submitted, so it's submitted
+ * early once it holds SFLC_VOL_WRITE_CTX_MAX_PAGES of them, or before its
+ * writer waits on the reserve (which the pages held would never refill).
  */
 
 /*****************************************************
  *                  INCLUDE SECTION                  *
  *****************************************************/
 
+#include <linux/list_sort.h>
+
 #include "volume.h"
 #include "crypto/rand/rand.h"
 #include "utils/pools.h"
@@ -41,57 +51,401 @@
  *                     CONSTANTS                     *
  *****************************************************/
 
+/* Bounce pages a batch may hold before its writes are submitted (a quarter of the reserve) */
+#define SFLC_VOL_WRITE_CTX_MAX_PAGES 256
+
+/*****************************************************
+ *                       TYPES                       *
+ *****************************************************/
+
+/* What a batch of writes (or a lone one) shares, from encryption to submission */
+struct sflc_vol_write_ctx_s
+{
+        /* The IV blocks kept referenced from one write to the next, one per copy (the primary first) */
+        struct
+        {
+                sflc_Device *dev;
+                u32 psi;
+                u8 *iv_block;
+        } pinned[SFLC_VOL_MAX_REPLICAS];
+
+        /* Physical bios still being encrypted (plus the submitter's reference) */
+        atomic_t crypt_pending;
+        struct completion crypt_done;
+        /* The physical bios, to be submitted once all are encrypted, and their bounce pages */
+        struct bio_list bios;
+        u32 nr_pages;
+};
+
 /*****************************************************
  *           PRIVATE FUNCTIONS PROTOTYPES            *
  *****************************************************/
 
-static int sflc_vol_encryptOrigBio(sflc_Volume *vol, struct bio *orig_bio, struct bio *phys_bio, u32 psi, u32 off_in_slice);
-static int sflc_vol_sampleAndWriteIv(sflc_Volume *vol, u8 *iv, u32 psi, u32 off_in_slice);
+static void sflc_vol_initWriteCtx(sflc_vol_WriteCtx *ctx);
+static void sflc_vol_submitWrites(sflc_vol_WriteCtx *ctx);
+static void sflc_vol_flushWrites(sflc_vol_WriteCtx *ctx);
+static void sflc_vol_writeOne(sflc_vol_WriteWork *write_work, sflc_vol_WriteCtx *ctx);
+static int sflc_vol_cmpWrites(void *priv, const struct list_head *a, const struct list_head *b);
+static u8 *sflc_vol_pinIvBlock(sflc_vol_WriteCtx *ctx, u32 copy, sflc_Device *dev, u32 psi);
+static void sflc_vol_unpinIvBlocks(sflc_vol_WriteCtx *ctx);
+static struct bio *sflc_vol_buildWriteBio(sflc_Volume *vol, struct bio *orig_bio, sector_t log_sector, sflc_vol_WriteWork *write_work,
+                                          sflc_vol_WriteCtx *ctx, u32 copy, u32 *off_in_slice_out);
+static void sflc_vol_allocWritePages(sflc_vol_WriteCtx *ctx, struct bio **phys_bios, u32 nr_bios, unsigned nr_sectors);
+static void sflc_vol_encryptOrigBio(sflc_Volume *vol, struct bio *orig_bio, struct bio *phys_bio, u32 off_in_slice, u8 *iv_block, sflc_sk_Batch *crypt);
+static void sflc_vol_encryptDone(sflc_sk_Batch *batch, int err);
+static void sflc_vol_freeBioPages(struct bio *phys_bio);
 static void sflc_vol_writeEndIo(struct bio *phys_bio);
+static void sflc_vol_finishWrite(struct work_struct *work);
+static void sflc_vol_repairMirrors(sflc_vol_WriteWork *write_work);
+static void sflc_vol_endWrite(sflc_vol_WriteWork *write_work);
 
 /*****************************************************
  *                PRIVATE VARIABLES                  *
  *****************************************************/
 
+/* Taken by the writers that have to wait for the bounce page reserve: one at a time */
+static DEFINE_MUTEX(sflc_vol_bounceAllocLock);
+
 /*****************************************************
  *           PUBLIC FUNCTIONS DEFINITIONS            *
  *****************************************************/
 
-/* Executed in workqueue bottom half */
+/* Executed in workqueue bottom half (only for the writes held back by the repair daemon) */
 void sflc_vol_doWrite(struct work_struct *work)
 {
         sflc_vol_WriteWork *write_work = container_of(work, sflc_vol_WriteWork, work);
+        sflc_vol_WriteCtx ctx;
+
+        sflc_vol_initWriteCtx(&ctx);
+        sflc_vol_writeOne(write_work, &ctx);
+        sflc_vol_submitWrites(&ctx);
+        sflc_vol_unpinIvBlocks(&ctx);
+}
+
+/* Called by the write engine. The writes are sorted by volume and sector, so that those to the
+   same slices come in a row and only look up their IV blocks once, and are all submitted under
+   one plug, so that the block layer can merge the adjacent ones */
+void sflc_vol_writeBatch(struct list_head *batch)
+{
+        sflc_vol_WriteCtx ctx;
+        sflc_vol_WriteWork *write_work;
+        sflc_vol_WriteWork *tmp;
+
+        /* Stable: writes to the same sector keep their order */
+        list_sort(NULL, batch, sflc_vol_cmpWrites);
+
+        sflc_vol_initWriteCtx(&ctx);
+        list_for_each_entry_safe(write_work, tmp, batch, queue_node)
+        {
+                list_del_init(&write_work->queue_node);
+                sflc_vol_writeOne(write_work, &ctx);
+        }
+        sflc_vol_submitWrites(&ctx);
+        sflc_vol_unpinIvBlocks(&ctx);
+
+        return;
+}
+
+/*****************************************************
+ *          PRIVATE FUNCTIONS DEFINITIONS            *
+ *****************************************************/
+
+static void sflc_vol_initWriteCtx(sflc_vol_WriteCtx *ctx)
+{
+        memset(ctx->pinned, 0, sizeof(ctx->pinned));
+        atomic_set(&ctx->crypt_pending, 1);
+        init_completion(&ctx->crypt_done);
+        bio_list_init(&ctx->bios);
+        ctx->nr_pages = 0;
+}
+
+/* Waits for all the encryptions in flight, then submits all the physical bios under one plug.
+   Those that could not be encrypted complete right away, with their error. */
+static void sflc_vol_submitWrites(sflc_vol_WriteCtx *ctx)
+{
+        struct blk_plug plug;
+        struct bio *phys_bio;
+
+        /* Drop the submitter's reference */
+        if (!atomic_dec_and_test(&ctx->crypt_pending))
+        {
+                wait_for_completion(&ctx->crypt_done);
+        }
+
+        blk_start_plug(&plug);
+        while ((phys_bio = bio_list_pop(&ctx->bios)))
+        {
+                if (unlikely(phys_bio->bi_status))
+                {
+                        bio_endio(phys_bio);
+                }
+                else
+                {
+                        submit_bio(phys_bio);
+                }
+        }
+        blk_finish_plug(&plug);
+
+        return;
+}
+
+/* Submits the writes built so far, and gets ctx ready for more (the IV blocks stay pinned) */
+static void sflc_vol_flushWrites(sflc_vol_WriteCtx *ctx)
+{
+        sflc_vol_submitWrites(ctx);
+
+        atomic_set(&ctx->crypt_pending, 1);
+        reinit_completion(&ctx->crypt_done);
+        ctx->nr_pages = 0;
+
+        return;
+}
+
+/* A mirrored write is encrypted once per copy (under each copy's key and IVs), all the physical
+   bios are submitted together, and the original bio only completes when all have.
+   Only the primary copy determines the outcome: if a mirror can't be set up, or fails, the
+   write goes on degraded (and says so), and the mirror is repaired from the primary before
+   the original bio completes.
+   With lazy replicas (pairs only), only the primary is written, and the slice is left to the resync.
+   The physical bios are left in ctx, encrypting. */
+static void sflc_vol_writeOne(sflc_vol_WriteWork *write_work, sflc_vol_WriteCtx *ctx)
+{
         sflc_Volume *vol = write_work->vol;
-        sflc_Device *dev = vol->dev;
+        sflc_Volume *mirror_vol = write_work->mirror_vol;
         struct bio *orig_bio = write_work->orig_bio;
         struct bio *phys_bio;
-        s64 phys_sector;
-        u32 psi;
-        u32 off_in_slice;
+        /* The copies built, their slot in write_work->crypt, and their offset in the slice */
+        struct bio *phys_bios[SFLC_VOL_MAX_REPLICAS];
+        u32 copies[SFLC_VOL_MAX_REPLICAS];
+        u32 offs_in_slice[SFLC_VOL_MAX_REPLICAS];
+        u32 nr_phys_bios = 0;
+        u32 i;
+        int err;
+
+        /* A slice waiting for repair would be overwritten by it: the repair daemon requeues the work */
+        if (sflc_dev_deferWriteToRepair(vol->dev, vol->vol_idx, SFLC_VOL_SECTOR_TO_LSI(orig_bio->bi_iter.bi_sector), write_work))
+        {
+                return;
+        }
+        for (i = 0; mirror_vol && i < write_work->nr_mirrors; i++)
+        {
+                if (sflc_dev_deferWriteToRepair(mirror_vol->dev, mirror_vol->vol_idx, SFLC_VOL_SECTOR_TO_LSI(write_work->mirror_sector[i]), write_work))
+                {
+                        return;
+                }
+        }
+
+        /* Lazy replicas: the slice goes in the log first, and the mirror is skipped */
+        write_work->lazy = false;
+        if (mirror_vol && write_work->nr_mirrors == 1 && READ_ONCE(vol->lazy_replicas))
+        {
+                err = sflc_vol_logStaleReplica(vol, SFLC_VOL_SECTOR_TO_LSI(orig_bio->bi_iter.bi_sector));
+                if (err)
+                {
+                        pr_warn_ratelimited("Could not log stale replica; error %d. Writing both copies\n", err);
+                }
+                else
+                {
+                        write_work->lazy = true;
+                        mirror_vol = NULL;
+                }
+        }
 
         /* Get an extra reference to the original bio */
         bio_get(orig_bio);
 
+        /* Discarded blocks come back to life (before their slice gets looked up), and the blocks
+           are read from disk from now on, in the replicas too even if they are left to the resync */
+        sflc_vol_reviveBlocks(vol, orig_bio->bi_iter.bi_sector, bio_sectors(orig_bio));
+        sflc_vol_markWritten(vol, orig_bio->bi_iter.bi_sector, bio_sectors(orig_bio));
+        for (i = 0; write_work->mirror_vol && i < write_work->nr_mirrors; i++)
+        {
+                sflc_vol_reviveBlocks(write_work->mirror_vol, write_work->mirror_sector[i], bio_sectors(orig_bio));
+                sflc_vol_markWritten(write_work->mirror_vol, write_work->mirror_sector[i], bio_sectors(orig_bio));
+        }
+
+        /* Completion accounting (before any physical bio can complete) */
+        write_work->status = BLK_STS_OK;
+        write_work->mirrors_failed = 0;
+        write_work->write_ctx = ctx;
+
+        /* The primary copy */
+        phys_bio = sflc_vol_buildWriteBio(vol, orig_bio, orig_bio->bi_iter.bi_sector, write_work, ctx, 0, &offs_in_slice[0]);
+        if (IS_ERR(phys_bio))
+        {
+                err = PTR_ERR(phys_bio);
+                pr_err("Could not build physical bio; error %d\n", err);
+                goto err_build_phys_bio;
+        }
+        phys_bios[0] = phys_bio;
+        copies[0] = 0;
+        nr_phys_bios = 1;
+
+        /* The mirror copies, if any */
+        for (i = 0; mirror_vol && i < write_work->nr_mirrors; i++)
+        {
+                struct bio *mirror_bio = sflc_vol_buildWriteBio(mirror_vol, orig_bio, write_work->mirror_sector[i], write_work, ctx, 1 + i,
+                                                                &offs_in_slice[nr_phys_bios]);
+
+                if (IS_ERR(mirror_bio))
+                {
+                        pr_warn_ratelimited("Could not build mirror bio for volume %s; error %d. Writing degraded\n",
+                                            mirror_vol->vol_name, (int)PTR_ERR(mirror_bio));
+                        __set_bit(i, &write_work->mirrors_failed);
+                        /* So that no physical bio is taken for this copy */
+                        write_work->crypt[1 + i].private = NULL;
+                        continue;
+                }
+                phys_bios[nr_phys_bios] = mirror_bio;
+                copies[nr_phys_bios] = 1 + i;
+                nr_phys_bios += 1;
+        }
+
+        write_work->primary_bio = phys_bio;
+        atomic_set(&write_work->pending, nr_phys_bios);
+
+        /* The bounce pages of all the copies at once, then the encryption of each copy into them,
+           the last request to complete tells ctx. Submitted together, once encrypted (the writes
+           before go first if the batch would hold too many pages) */
+        if (ctx->nr_pages && ctx->nr_pages + nr_phys_bios * (orig_bio->bi_iter.bi_size / SFLC_DEV_SECTOR_SIZE) > SFLC_VOL_WRITE_CTX_MAX_PAGES)
+        {
+                sflc_vol_flushWrites(ctx);
+        }
+        sflc_vol_allocWritePages(ctx, phys_bios, nr_phys_bios, orig_bio->bi_iter.bi_size / SFLC_DEV_SECTOR_SIZE);
+        for (i = 0; i < nr_phys_bios; i++)
+        {
+                u32 copy = copies[i];
+                sflc_sk_Batch *crypt = &write_work->crypt[copy];
+
+                sflc_sk_initBatch(crypt, sflc_vol_encryptDone, phys_bios[i]);
+                atomic_inc(&ctx->crypt_pending);
+                sflc_vol_encryptOrigBio(copy ? mirror_vol : vol, orig_bio, phys_bios[i], offs_in_slice[i], ctx->pinned[copy].iv_block, crypt);
+                sflc_sk_closeBatch(crypt);
+
+                bio_list_add(&ctx->bios, phys_bios[i]);
+        }
+
+        return;
+
+err_build_phys_bio:
+        bio_put(orig_bio);
+        /* Nothing was written, but it no longer counts as in flight */
+        if (write_work->lazy)
+        {
+                sflc_vol_markReplicaStale(vol, SFLC_VOL_SECTOR_TO_LSI(orig_bio->bi_iter.bi_sector));
+        }
+
+        orig_bio->bi_status = BLK_STS_IOERR;
+        bio_endio(orig_bio);
+        mempool_free(write_work, sflc_pools_writeWorkPool);
+        return;
+}
+
+/* Orders the writes of a batch by volume, then sector */
+static int sflc_vol_cmpWrites(void *priv, const struct list_head *a, const struct list_head *b)
+{
+        sflc_vol_WriteWork *wa = list_entry(a, sflc_vol_WriteWork, queue_node);
+        sflc_vol_WriteWork *wb = list_entry(b, sflc_vol_WriteWork, queue_node);
+
+        if (wa->vol != wb->vol)
+        {
+                return wa->vol->vol_idx < wb->vol->vol_idx ? -1 : 1;
+        }
+        if (wa->orig_bio->bi_iter.bi_sector != wb->orig_bio->bi_iter.bi_sector)
+        {
+                return wa->orig_bio->bi_iter.bi_sector < wb->orig_bio->bi_iter.bi_sector ? -1 : 1;
+        }
+
+        return 0;
+}
+
+/* Returns the IV block of the PSI, referenced (for writing) in the given slot of ctx: only
+   looked up if the slot held another one. Returns an ERR_PTR() if error. */
+static u8 *sflc_vol_pinIvBlock(sflc_vol_WriteCtx *ctx, u32 copy, sflc_Device *dev, u32 psi)
+{
+        u8 *iv_block;
+
+        if (ctx->pinned[copy].iv_block)
+        {
+                if (ctx->pinned[copy].dev == dev && ctx->pinned[copy].psi == psi)
+                {
+                        return ctx->pinned[copy].iv_block;
+                }
+                sflc_dev_putIvBlockRef(ctx->pinned[copy].dev, ctx->pinned[copy].psi);
+                ctx->pinned[copy].iv_block = NULL;
+        }
+
+        iv_block = sflc_dev_getIvBlockRef(dev, psi, WRITE);
+        if (IS_ERR(iv_block))
+        {
+                return iv_block;
+        }
+        ctx->pinned[copy].dev = dev;
+        ctx->pinned[copy].psi = psi;
+        ctx->pinned[copy].iv_block = iv_block;
+
+        return iv_block;
+}
+
+/* Releases all the IV blocks referenced in ctx */
+static void sflc_vol_unpinIvBlocks(sflc_vol_WriteCtx *ctx)
+{
+        u32 i;
+
+        for (i = 0; i < SFLC_VOL_MAX_REPLICAS; i++)
+        {
+                if (ctx->pinned[i].iv_block)
+                {
+                        if (sflc_dev_putIvBlockRef(ctx->pinned[i].dev, ctx->pinned[i].psi))
+                        {
+                                pr_err("Could not release reference to IV block\n");
+                        }
+                        ctx->pinned[i].iv_block = NULL;
+                }
+        }
+
+        return;
+}
+
+/* Allocates the physical bio writing the original bio's data at the given logical sector of the volume,
+   remaps it, and samples its IVs (in the IV block pinned in the given slot of ctx). The bio has no pages
+   yet. Returns an ERR_PTR() if error. */
+static struct bio *sflc_vol_buildWriteBio(sflc_Volume *vol, struct bio *orig_bio, sector_t log_sector, sflc_vol_WriteWork *write_work,
+                                          sflc_vol_WriteCtx *ctx, u32 copy, u32 *off_in_slice_out)
+{
+        sflc_Device *dev = vol->dev;
+        struct bio *phys_bio;
+        s64 phys_sector;
+        u32 psi;
+        u32 off_in_slice;
+        unsigned nr_sectors;
+        u8 *iv_block;
+        int err;
+
         /* Deep-copy the bio and encrypt the data.
            We need to deep-copy because I'm not sure
            we can encrypt in place and change the data in
            non-owned bio's. So we need our own. */
 
-        /* Allocate an empty bio */
-        phys_bio = bio_alloc_bioset(GFP_NOIO, bio_segments(orig_bio), &sflc_pools_bioset);
+        /* The bio never crosses a slice boundary, so it is at most one slice long */
+        nr_sectors = orig_bio->bi_iter.bi_size / SFLC_DEV_SECTOR_SIZE;
+
+        /* Allocate an empty bio, with room for one page per SFLC sector */
+        phys_bio = bio_alloc_bioset(GFP_NOIO, nr_sectors, &sflc_pools_bioset);
         if (!phys_bio)
         {
                 pr_err("Could not allocate bio\n");
-                goto err_alloc_phys_bio;
+                return ERR_PTR(-ENOMEM);
         }
 
         /* Set real backing device */
         bio_set_dev(phys_bio, dev->real_dev->bdev);
-        /* Remap sector */
-        phys_sector = sflc_vol_remapSector(vol, orig_bio->bi_iter.bi_sector, WRITE, &psi, &off_in_slice);
+        /* Remap sector (the physical sectors of a slice are contiguous) */
+        phys_sector = sflc_vol_remapSector(vol, log_sector, WRITE, &psi, &off_in_slice);
         if (phys_sector < 0)
         {
-                pr_err("Could not remap sector for physical bio; error %d\n", (int)phys_sector);
+                err = (int)phys_sector;
+                pr_err("Could not remap sector for physical bio; error %d\n", err);
                 goto err_remap_sector;
         }
         phys_bio->bi_iter.bi_sector = phys_sector;
@@ -102,161 +456,298 @@ void sflc_vol_doWrite(struct work_struct *work)
         phys_bio->bi_end_io = sflc_vol_writeEndIo;
         phys_bio->bi_private = write_work;
 
-        /* Encrypt the original bio into the physical bio (newly-allocated pages) */
-        int err = sflc_vol_encryptOrigBio(vol, orig_bio, phys_bio, psi, off_in_slice);
-        if (err)
+        /* The IV block, kept from the previous write to the slice if possible */
+        iv_block = sflc_vol_pinIvBlock(ctx, copy, dev, psi);
+        if (IS_ERR(iv_block))
         {
-                pr_err("Could not encrypt original bio; error %d\n", err);
-                goto err_encrypt_orig_bio;
+                err = PTR_ERR(iv_block);
+                pr_err("Could not acquire reference to IV block; error %d\n", err);
+                goto err_pin_iv_block;
         }
 
-        /* Only submit the physical bio */
-        submit_bio(phys_bio);
+        /* Sample fresh IVs for all the sectors, straight into the relevant portion of the block */
+        err = sflc_rand_getBytes(iv_block + (off_in_slice * SFLC_SK_IV_LEN), nr_sectors * SFLC_SK_IV_LEN);
+        if (err)
+        {
+                pr_err("Could not sample IVs; error %d\n", err);
+                err = -EIO;
+                goto err_sample_ivs;
+        }
 
-        return;
+        *off_in_slice_out = off_in_slice;
+        return phys_bio;
 
-err_encrypt_orig_bio:
+err_sample_ivs:
+err_pin_iv_block:
 err_remap_sector:
         bio_put(phys_bio);
-err_alloc_phys_bio:
-        bio_put(orig_bio);
+        return ERR_PTR(err);
+}
 
-        orig_bio->bi_status = BLK_STS_IOERR;
-        bio_endio(orig_bio);
+/* Fills the physical bios of a write with all their bounce pages (one per SFLC sector), the way dm-crypt
+   does: first without waiting, and if the pages aren't there, giving back those taken, submitting the
+   writes of ctx built so far, and trying again under a mutex, waiting for the reserve. Then only one
+   writer at a time waits on the reserve, and holding no part of it: as the reserve covers the largest
+   write, it eventually gets all it needs.
+   Can't fail. */
+static void sflc_vol_allocWritePages(sflc_vol_WriteCtx *ctx, struct bio **phys_bios, u32 nr_bios, unsigned nr_sectors)
+{
+        gfp_t gfp = GFP_NOWAIT | __GFP_NOWARN;
+        struct page *page;
+        unsigned i;
+        u32 b;
+
+retry:
+        for (b = 0; b < nr_bios; b++)
+        {
+                for (i = 0; i < nr_sectors; i++)
+                {
+                        page = sflc_pools_allocBouncePage(gfp);
+                        if (unlikely(!page))
+                        {
+                                goto err_alloc_page;
+                        }
+                        /* There's room for one page per sector */
+                        __bio_add_page(phys_bios[b], page, SFLC_DEV_SECTOR_SIZE, 0);
+                }
+        }
+
+        if (gfp & __GFP_DIRECT_RECLAIM)
+        {
+                mutex_unlock(&sflc_vol_bounceAllocLock);
+        }
+        ctx->nr_pages += nr_bios * nr_sectors;
         return;
+
+
+err_alloc_page:
+        /* Give them all back (only GFP_NOWAIT allocations fail) */
+        for (b = 0; b < nr_bios; b++)
+        {
+                sflc_vol_freeBioPages(phys_bios[b]);
+                phys_bios[b]->bi_vcnt = 0;
+                phys_bios[b]->bi_iter.bi_size = 0;
+        }
+
+        /* The pages of the writes built so far only come back once they're submitted */
+        if (ctx->nr_pages)
+        {
+                sflc_vol_flushWrites(ctx);
+        }
+
+        mutex_lock(&sflc_vol_bounceAllocLock);
+        gfp = GFP_NOIO;
+        goto retry;
 }
 
-/*****************************************************
- *          PRIVATE FUNCTIONS DEFINITIONS            *
- *****************************************************/
+/* Queues the encryption of the contents of the original bio into the bounce pages of the physical bio.
+   The original bio is not advanced: its iterator is only walked through a copy. Errors are recorded in crypt. */
+static void sflc_vol_encryptOrigBio(sflc_Volume *vol, struct bio *orig_bio, struct bio *phys_bio, u32 off_in_slice, u8 *iv_block, sflc_sk_Batch *crypt)
+{
+        struct bvec_iter iter = orig_bio->bi_iter;
+        unsigned nr_sectors = orig_bio->bi_iter.bi_size / SFLC_DEV_SECTOR_SIZE;
+        unsigned i;
+        int err;
+
+        for (i = 0; i < nr_sectors; i++)
+        {
+                struct bio_vec bvl = bio_iter_iovec(orig_bio, iter);
+                struct page *page = phys_bio->bi_io_vec[i].bv_page;
+
+                /* Encrypt sector out of place (the request takes a copy of the IV) */
+                err = sflc_sk_queueEncrypt(vol->skctx, crypt, bvl.bv_page, bvl.bv_offset, page, 0,
+                                           SFLC_DEV_SECTOR_SIZE, iv_block + ((off_in_slice + i) * SFLC_SK_IV_LEN));
+                if (err)
+                {
+                        pr_err("Error while encrypting sector: %d\n", err);
+                        return;
+                }
+
+                /* Next sector */
+                bio_advance_iter(orig_bio, &iter, SFLC_DEV_SECTOR_SIZE);
+        }
 
-/* Encrypts the contents of the original bio into newly-allocated pages for the physical bio */
-static int sflc_vol_encryptOrigBio(sflc_Volume *vol, struct bio *orig_bio, struct bio *phys_bio, u32 psi, u32 off_in_slice)
+        return;
+}
+
+/* All the sectors of a physical bio are encrypted (possibly in softirq context): a failed one
+   is completed with its error instead of being submitted */
+static void sflc_vol_encryptDone(sflc_sk_Batch *batch, int err)
 {
+        struct bio *phys_bio = batch->private;
         sflc_vol_WriteWork *write_work = phys_bio->bi_private;
-        u8 iv[SFLC_SK_IV_LEN];
-        int err;
+        sflc_vol_WriteCtx *ctx = write_work->write_ctx;
+
+        if (err)
+        {
+                pr_err("Could not encrypt original bio; error %d\n", err);
+                phys_bio->bi_status = BLK_STS_IOERR;
+        }
 
-        /* Allocate new page for the physical bio */
-        write_work->page = mempool_alloc(sflc_pools_pagePool, GFP_NOIO);
-        if (!write_work->page)
+        if (atomic_dec_and_test(&ctx->crypt_pending))
         {
-                pr_err("Could not allocate page\n");
-                err = -ENOMEM;
-                goto err_alloc_page;
+                complete(&ctx->crypt_done);
         }
+}
+
+/* Frees all the pages of a physical write bio (they are bounce pages) */
+static void sflc_vol_freeBioPages(struct bio *phys_bio)
+{
+        struct bio_vec *bvec;
+        struct bvec_iter_all iter_all;
 
-        /* Add it to physical bio */
-        if (!bio_add_page(phys_bio, write_work->page, SFLC_DEV_SECTOR_SIZE, 0))
+        bio_for_each_segment_all(bvec, phys_bio, iter_all)
         {
-                pr_err("Catastrophe. Could not add page to copy bio. WTF?\n");
-                err = -EIO;
-                goto err_bio_add_page;
+                if (unlikely(page_ref_count(bvec->bv_page) != 1))
+                {
+                        pr_err("WTF: page_ref_count = %d\n", page_ref_count(bvec->bv_page));
+                }
+                sflc_pools_freeBouncePage(bvec->bv_page);
         }
 
-        /* Sample a random IV and write it in the IV block */
-        err = sflc_vol_sampleAndWriteIv(vol, iv, psi, off_in_slice);
-        if (err)
+        return;
+}
+
+/* Called for each physical bio of the write: the last one completes the original bio */
+static void sflc_vol_writeEndIo(struct bio *phys_bio)
+{
+        sflc_vol_WriteWork *write_work = phys_bio->bi_private;
+
+        /* A failed mirror leaves the write degraded (until repaired), a failed primary fails it */
+        if (unlikely(phys_bio->bi_status))
         {
-                pr_err("Could not sample and write IV; error %d\n", err);
-                err = -EIO;
-                goto err_sample_and_write_iv;
+                if (phys_bio != write_work->primary_bio)
+                {
+                        u32 i;
+
+                        pr_warn_ratelimited("Mirror write to volume %s failed; error %d. Written degraded\n",
+                                            write_work->mirror_vol->vol_name, blk_status_to_errno(phys_bio->bi_status));
+                        for (i = 0; i < write_work->nr_mirrors; i++)
+                        {
+                                if (write_work->crypt[1 + i].private == phys_bio)
+                                {
+                                        set_bit(i, &write_work->mirrors_failed);
+                                }
+                        }
+                }
+                else
+                {
+                        write_work->status = phys_bio->bi_status;
+                }
         }
 
-        /* Encrypt sector out of place */
-        struct bio_vec bvl = bio_iovec(orig_bio);
-        void *enc_sector_ptr = kmap(write_work->page);
-        void *plain_sector_ptr = kmap(bvl.bv_page) + bvl.bv_offset;
-        err = sflc_sk_encrypt(vol->skctx, plain_sector_ptr, enc_sector_ptr, SFLC_DEV_SECTOR_SIZE, iv);
-        kunmap(bvl.bv_page);
-        kunmap(write_work->page);
-        if (err)
+        /* Free the pages and the physical bio */
+        sflc_vol_freeBioPages(phys_bio);
+        bio_put(phys_bio);
+
+        /* Wait for the other copies */
+        if (!atomic_dec_and_test(&write_work->pending))
         {
-                pr_err("Error while encrypting sector: %d\n", err);
-                goto err_encrypt;
+                return;
         }
 
-        return 0;
+        /* Some things can't be done from here, and must be before the original bio completes:
+           queueing the repair of the failed mirrors (they hold old data, no read must be served
+           from them), and making a FUA write's marks in the written-block map durable */
+        if (unlikely(write_work->mirrors_failed || (write_work->orig_bio->bi_opf & REQ_FUA)) && write_work->status == BLK_STS_OK)
+        {
+                INIT_WORK(&write_work->work, sflc_vol_finishWrite);
+                queue_work(sflc_queues_writeQueue, &write_work->work);
+                return;
+        }
 
-err_encrypt:
-err_sample_and_write_iv:
-err_bio_add_page:
-        mempool_free(write_work->page, sflc_pools_pagePool);
-err_alloc_page:
-        return err;
+        sflc_vol_endWrite(write_work);
+
+        return;
 }
 
-/* Allocates the io_work's IV (will need to be freed afterwards), fills it with random
-   bytes, and writes it into the IV block pointed by the io_work's PSI and off_in_slice. */
-static int sflc_vol_sampleAndWriteIv(sflc_Volume *vol, u8 *iv, u32 psi, u32 off_in_slice)
+/* Executed in the write workqueue: what a write must do, after its copies, before it completes */
+static void sflc_vol_finishWrite(struct work_struct *work)
 {
-        sflc_Device *dev = vol->dev;
-        u8 *iv_block;
+        sflc_vol_WriteWork *write_work = container_of(work, sflc_vol_WriteWork, work);
         int err;
 
-        /* Sample IV */
-        err = sflc_rand_getBytes(iv, SFLC_SK_IV_LEN);
-        if (err)
+        if (write_work->mirrors_failed)
         {
-                pr_err("Could not sample IV; error %d\n", err);
-                err = -EIO;
-                goto err_sample_iv;
+                sflc_vol_repairMirrors(write_work);
         }
 
-        /* Acquire a reference to the whole relevant IV block */
-        iv_block = sflc_dev_getIvBlockRef(dev, psi, WRITE);
-        if (IS_ERR(iv_block))
+        if (write_work->orig_bio->bi_opf & REQ_FUA)
         {
-                err = PTR_ERR(iv_block);
-                pr_err("Could not acquire reference to IV block; error %d\n", err);
-                goto err_get_iv_block_ref;
+                err = sflc_vol_syncWmap(write_work->vol);
+                if (!err && write_work->mirror_vol && write_work->mirror_vol != write_work->vol)
+                {
+                        err = sflc_vol_syncWmap(write_work->mirror_vol);
+                }
+                if (err)
+                {
+                        pr_err("Could not store the written-block map for a FUA write; error %d\n", err);
+                        write_work->status = errno_to_blk_status(err);
+                }
         }
 
-        /* Copy it into the relevant portion of the block */
-        memcpy(iv_block + (off_in_slice * SFLC_SK_IV_LEN), iv, SFLC_SK_IV_LEN);
+        sflc_vol_endWrite(write_work);
 
-        /* Release reference to the IV block */
-        err = sflc_dev_putIvBlockRef(dev, psi);
-        if (err)
+        return;
+}
+
+/* Queues the repair of the mirrors of a write that failed, from its primary copy */
+static void sflc_vol_repairMirrors(sflc_vol_WriteWork *write_work)
+{
+        sflc_Volume *vol = write_work->vol;
+        sflc_Volume *mirror_vol = write_work->mirror_vol;
+        u32 lsi = SFLC_VOL_SECTOR_TO_LSI(write_work->orig_bio->bi_iter.bi_sector);
+        u32 queued = 0;
+        unsigned long i;
+        int err;
+
+        for_each_set_bit(i, &write_work->mirrors_failed, write_work->nr_mirrors)
         {
-                pr_err("Could not release reference to IV block; error %d\n", err);
-                goto err_put_iv_block_ref;
+                u32 mirror_lsi = SFLC_VOL_SECTOR_TO_LSI(write_work->mirror_sector[i]);
+                s32 psi;
+
+                /* The mirror might not have been mapped */
+                psi = sflc_vol_mapSlice(mirror_vol, mirror_lsi, WRITE);
+                if (psi < 0)
+                {
+                        pr_err("Could not map mirror slice %u of volume %s; error %d. Left degraded\n", mirror_lsi, mirror_vol->vol_name, psi);
+                        continue;
+                }
+
+                err = sflc_dev_queueRepair(vol->dev, vol->vol_idx, lsi, mirror_vol->vol_idx, mirror_lsi);
+                if (err)
+                {
+                        pr_err("Could not queue repair of mirror slice %u of volume %s; error %d. Left degraded\n", mirror_lsi, mirror_vol->vol_name, err);
+                        continue;
+                }
+                queued += 1;
+        }
+        if (queued)
+        {
+                sflc_dev_kickRepair(vol->dev);
         }
 
-        return 0;
-
-err_put_iv_block_ref:
-err_get_iv_block_ref:
-err_sample_iv:
-        return err;
+        return;
 }
 
-static void sflc_vol_writeEndIo(struct bio *phys_bio)
+/* Completes the original bio of a write, once all its copies are done */
+static void sflc_vol_endWrite(sflc_vol_WriteWork *write_work)
 {
-        sflc_vol_WriteWork *write_work = phys_bio->bi_private;
         struct bio *orig_bio = write_work->orig_bio;
-        unsigned completed_bytes;
+
+        /* The replica lags behind from here on (before anyone can read the new data) */
+        if (write_work->lazy)
+        {
+                sflc_vol_markReplicaStale(write_work->vol, SFLC_VOL_SECTOR_TO_LSI(orig_bio->bi_iter.bi_sector));
+        }
 
         /* Release the extra reference to the original bio */
         bio_put(orig_bio);
         /* End I/O on the original bio */
-        completed_bytes = orig_bio->bi_iter.bi_size - phys_bio->bi_iter.bi_size;
-        bio_advance(orig_bio, completed_bytes);
-        if (unlikely(orig_bio->bi_iter.bi_size))
-        {
-                pr_err("Incomplete orig_bio: %u\n", orig_bio->bi_iter.bi_size);
-        }
-        orig_bio->bi_status = phys_bio->bi_status;
+        orig_bio->bi_status = write_work->status;
         bio_endio(orig_bio);
 
-        /* Free the physical bio */
-        bio_put(phys_bio);
-        /* Free the page, and the work item */
-        if (unlikely(page_ref_count(write_work->page) != 1))
-        {
-                pr_err("WTF: page_ref_count = %d\n", page_ref_count(write_work->page));
-        }
-        mempool_free(write_work->page, sflc_pools_pagePool);
+        /* Free the work item */
         mempool_free(write_work, sflc_pools_writeWorkPool);
 
         return;
@@ -0,0 +1,280 @@
+/*
+ *  Copyright The Shufflecake Project Authors (2022)
+ *  Copyright The Shufflecake Project Contributors (2022)
+ *  Copyright Contributors to the The Shufflecake Project.
+ *
+ *  See the AUTHORS file at the top-level directory of this distribution and at
+ *  <https://www.shufflecake.net/permalinks/shufflecake-userland/AUTHORS>
+ *
+ *  This file is part of the program dm-sflc, which is part of the Shufflecake
+ *  Project. Shufflecake is a plausible deniability (hidden storage) layer for
+ *  Linux. See <https://www.shufflecake.net>.
+ *
+ *  This program is free software: you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation, either version 3 of the License, or (at your option)
+ *  any later version. This program is distributed in the hope that it will be
+ *  useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+ *  Public License for more details. You should have received a copy of the
+ *  GNU General Public License along with this program.
+ *  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file only implements the written-block map.
+ * Every block of every LSI has a bit, set once the block has been written:
+ * the other ones read as zeros, without any I/O (their content on disk is
+ * just the random fill, or whatever was there before the slice was last
+ * unmapped), and a write-zeroes only has to clear bits.
+ * The map lives in the header (encrypted like the fmap, and stored along
+ * with it), right below the dirty-replica log: a descriptor block, then one
+ * block for every 128 LSIs, going down. Bits only change under fmap_lock,
+ * so that a store never misses one.
+ * Since an unwritten block reads as zeros, the map must be on disk before a
+ * flush or a FUA write completes: flushes store the dirty header first, and
+ * FUA writes store it and flush the device before they complete.
+ * A header that never had a map (or no room for one) has all the blocks of
+ * the mapped slices written.
+ */
+
+/*****************************************************
+ *                  INCLUDE SECTION                  *
+ *****************************************************/
+
+#include <linux/blkdev.h>
+
+#include "volume.h"
+#include "log/log.h"
+
+/*****************************************************
+ *           PRIVATE FUNCTIONS PROTOTYPES            *
+ *****************************************************/
+
+/* The header block holding the bits of the LSI */
+static inline u32 sflc_vol_wmapBlockOf(u32 lsi)
+{
+        return SFLC_VOL_WMAP_DESC_BLOCK - 1 - (lsi / SFLC_VOL_WMAP_LSIS_PER_BLOCK);
+}
+
+/* The first bit of the LSI */
+static inline unsigned long sflc_vol_wmapBit(u32 lsi, u32 off_in_slice)
+{
+        return (unsigned long) lsi * SFLC_VOL_LOG_SLICE_SIZE + off_in_slice;
+}
+
+/*****************************************************
+ *           PUBLIC FUNCTIONS DEFINITIONS            *
+ *****************************************************/
+
+/* Allocates the written-block map, if there is room for it in the header. Returns < 0 if error. */
+int sflc_vol_allocWmap(sflc_Volume * vol)
+{
+        u32 tot_slices = vol->dev->tot_slices;
+
+        vol->wmap_valid = false;
+
+        /* No room: every block of a mapped slice counts as written */
+        if (!SFLC_VOL_HAS_WMAP(tot_slices)) {
+                pr_notice("No room for the written-block map of volume %s\n", vol->vol_name);
+                return 0;
+        }
+
+        vol->wmap_lsis = tot_slices;
+        vol->written = bitmap_zalloc(sflc_vol_wmapBit(tot_slices, 0), GFP_KERNEL);
+        if (!vol->written) {
+                pr_err("Could not allocate written-block map\n");
+                return -ENOMEM;
+        }
+
+        return 0;
+}
+
+/* Frees the written-block map */
+void sflc_vol_freeWmap(sflc_Volume * vol)
+{
+        bitmap_free(vol->written);
+        vol->written = NULL;
+}
+
+/* Whether the block was ever written (lockless) */
+bool sflc_vol_blockIsWritten(sflc_Volume * vol, u32 lsi, u32 off_in_slice)
+{
+        if (!vol->written || lsi >= vol->wmap_lsis) {
+                return true;
+        }
+
+        return test_bit(sflc_vol_wmapBit(lsi, off_in_slice), vol->written);
+}
+
+/* Whether none of the blocks covered by the sectors (within a slice) was ever written (lockless) */
+bool sflc_vol_rangeIsUnwritten(sflc_Volume * vol, sector_t log_sector, u32 nr_sectors)
+{
+        u32 lsi = SFLC_VOL_SECTOR_TO_LSI(log_sector);
+        u32 first = (log_sector / SFLC_DEV_SECTOR_SCALE) % SFLC_VOL_LOG_SLICE_SIZE;
+        u32 nr = DIV_ROUND_UP(nr_sectors, SFLC_DEV_SECTOR_SCALE);
+        unsigned long start = sflc_vol_wmapBit(lsi, first);
+
+        if (!vol->written || lsi >= vol->wmap_lsis) {
+                return false;
+        }
+
+        return find_next_bit(vol->written, start + nr, start) >= start + nr;
+}
+
+/* The blocks covered by the sectors (within a slice) are being written */
+void sflc_vol_markWritten(sflc_Volume * vol, sector_t log_sector, u32 nr_sectors)
+{
+        u32 lsi = SFLC_VOL_SECTOR_TO_LSI(log_sector);
+        u32 first = (log_sector / SFLC_DEV_SECTOR_SCALE) % SFLC_VOL_LOG_SLICE_SIZE;
+        u32 nr = min_t(u32, DIV_ROUND_UP(nr_sectors, SFLC_DEV_SECTOR_SCALE), SFLC_VOL_LOG_SLICE_SIZE - first);
+        unsigned long start = sflc_vol_wmapBit(lsi, first);
+
+        if (!vol->written || lsi >= vol->wmap_lsis) {
+                return;
+        }
+        /* Fast path: already written (the bits are only cleared by write-zeroes and unmaps,
+           which don't race with writes to the same blocks) */
+        if (find_next_zero_bit(vol->written, start + nr, start) >= start + nr) {
+                return;
+        }
+
+        mutex_lock(&vol->fmap_lock);
+        bitmap_set(vol->written, start, nr);
+        set_bit(sflc_vol_wmapBlockOf(lsi), vol->fmap_dirty);
+        mutex_unlock(&vol->fmap_lock);
+}
+
+/* Makes the map durable (along with the rest of the dirty header), for a FUA write whose
+   blocks it marked. Returns < 0 if error. */
+int sflc_vol_syncWmap(sflc_Volume * vol)
+{
+        int err;
+
+        if (!vol->written) {
+                return 0;
+        }
+
+        /* Also waits for a store in progress, which may hold our bits */
+        err = sflc_vol_storeFmap(vol);
+        if (err) {
+                return err;
+        }
+
+        /* The header is written without FUA */
+        return blkdev_issue_flush(vol->dev->real_dev->bdev);
+}
+
+/* The blocks of the slice read as zeros from now on. Caller holds fmap_lock. */
+void sflc_vol_forgetWrittenLocked(sflc_Volume * vol, u32 lsi, u32 first, u32 nr)
+{
+        if (!vol->written || lsi >= vol->wmap_lsis) {
+                return;
+        }
+
+        bitmap_clear(vol->written, sflc_vol_wmapBit(lsi, first), nr);
+        set_bit(sflc_vol_wmapBlockOf(lsi), vol->fmap_dirty);
+}
+
+/* The receiver slice is now a copy of the donor slice (called by the repair daemon) */
+void sflc_vol_copyWritten(sflc_Volume * donor, u32 donor_lsi, sflc_Volume * receiver, u32 receiver_lsi)
+{
+        u32 off_in_slice;
+
+        if (!receiver->written || receiver_lsi >= receiver->wmap_lsis) {
+                return;
+        }
+
+        mutex_lock(&receiver->fmap_lock);
+        for (off_in_slice = 0; off_in_slice < SFLC_VOL_LOG_SLICE_SIZE; off_in_slice++) {
+                assign_bit(sflc_vol_wmapBit(receiver_lsi, off_in_slice), receiver->written,
+                           sflc_vol_blockIsWritten(donor, donor_lsi, off_in_slice));
+        }
+        set_bit(sflc_vol_wmapBlockOf(receiver_lsi), receiver->fmap_dirty);
+        mutex_unlock(&receiver->fmap_lock);
+}
+
+/* Whether the header data block is part of the written-block map */
+bool sflc_vol_isWmapBlock(sflc_Volume * vol, u32 blk)
+{
+        return vol->written && blk <= SFLC_VOL_WMAP_DESC_BLOCK && blk >= SFLC_VOL_WMAP_FIRST_BLOCK(vol->wmap_lsis);
+}
+
+/* Fills a block of the map (in little-endian 32-bit words) */
+void sflc_vol_encodeWmapBlock(sflc_Volume * vol, u32 blk, u8 * data)
+{
+        u32 * words = (u32 *) data;
+        unsigned long start;
+        u32 nbits;
+        u32 i;
+
+        memset(data, 0, SFLC_DEV_SECTOR_SIZE);
+
+        /* The descriptor */
+        if (blk == SFLC_VOL_WMAP_DESC_BLOCK) {
+                memcpy(data, SFLC_VOL_WMAP_MAGIC, sizeof(SFLC_VOL_WMAP_MAGIC) - 1);
+                return;
+        }
+
+        /* The bitmap (block boundaries fall on word boundaries) */
+        start = sflc_vol_wmapBit((SFLC_VOL_WMAP_DESC_BLOCK - 1 - blk) * SFLC_VOL_WMAP_LSIS_PER_BLOCK, 0);
+        nbits = min_t(unsigned long, sflc_vol_wmapBit(vol->wmap_lsis, 0) - start, SFLC_DEV_SECTOR_SIZE * BITS_PER_BYTE);
+        bitmap_to_arr32(words, vol->written + BIT_WORD(start), nbits);
+        for (i = 0; i < DIV_ROUND_UP(nbits, 32); i++) {
+                cpu_to_le32s(&words[i]);
+        }
+}
+
+/* Reads a block of the map back (it is validated once all are in) */
+void sflc_vol_decodeWmapBlock(sflc_Volume * vol, u32 blk, u8 * data)
+{
+        u32 * words = (u32 *) data;
+        unsigned long start;
+        u32 nbits;
+        u32 i;
+
+        /* The descriptor */
+        if (blk == SFLC_VOL_WMAP_DESC_BLOCK) {
+                vol->wmap_valid = !memcmp(data, SFLC_VOL_WMAP_MAGIC, sizeof(SFLC_VOL_WMAP_MAGIC) - 1);
+                return;
+        }
+
+        /* The bitmap */
+        start = sflc_vol_wmapBit((SFLC_VOL_WMAP_DESC_BLOCK - 1 - blk) * SFLC_VOL_WMAP_LSIS_PER_BLOCK, 0);
+        nbits = min_t(unsigned long, sflc_vol_wmapBit(vol->wmap_lsis, 0) - start, SFLC_DEV_SECTOR_SIZE * BITS_PER_BYTE);
+        for (i = 0; i < DIV_ROUND_UP(nbits, 32); i++) {
+                le32_to_cpus(&words[i]);
+        }
+        bitmap_from_arr32(vol->written + BIT_WORD(start), words, nbits);
+}
+
+/* The map was loaded with the fmap (under fmap_lock). Without a valid one, all the mapped
+   slices count as written, and the map is stored as such at the next store */
+void sflc_vol_wmapLoaded(sflc_Volume * vol)
+{
+        u32 lsi;
+
+        if (!vol->written || vol->wmap_valid) {
+                return;
+        }
+
+        /* Random bytes, not a map */
+        bitmap_zero(vol->written, sflc_vol_wmapBit(vol->wmap_lsis, 0));
+        for (lsi = 0; lsi < vol->wmap_lsis; lsi++) {
+                if (vol->fmap[lsi] != SFLC_VOL_FMAP_INVALID_PSI) {
+                        bitmap_set(vol->written, sflc_vol_wmapBit(lsi, 0), SFLC_VOL_LOG_SLICE_SIZE);
+                }
+        }
+        sflc_vol_wmapCreated(vol);
+}
+
+/* The whole map (and its descriptor) goes in the next store (under fmap_lock) */
+void sflc_vol_wmapCreated(sflc_Volume * vol)
+{
+        if (!vol->written) {
+                return;
+        }
+
+        bitmap_set(vol->fmap_dirty, SFLC_VOL_WMAP_FIRST_BLOCK(vol->wmap_lsis), SFLC_VOL_WMAP_BLOCKS(vol->wmap_lsis));
+        vol->wmap_valid = true;
+}
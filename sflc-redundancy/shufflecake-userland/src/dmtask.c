@@ -38,7 +38,7 @@
  *           PUBLIC FUNCTIONS DEFINITIONS            *
  *****************************************************/
 
-int sflc_dmt_create(char * virt_dev_name, uint64_t num_sectors, char * param)
+int sflc_dmt_create(char * virt_dev_name, uint64_t num_sectors, char * param, bool read_only)
 {
     struct dm_task *dmt;
     uint32_t cookie = 0;
@@ -63,6 +63,12 @@ int sflc_dmt_create(char * virt_dev_name, uint64_t num_sectors, char * param)
         goto out;
     }
 
+    /* The table gets loaded without FMODE_WRITE, and the disk is read-only */
+    if (read_only && !dm_task_set_ro(dmt)) {
+        print_red("DEBUG: Cannot set read-only\n");
+        goto out;
+    }
+
     if (!dm_task_set_add_node(dmt, DM_ADD_NODE_ON_CREATE)) {
         print_red("DEBUG: Cannot add node\n");
         goto out;
@@ -32,13 +32,14 @@
  *                  INCLUDE SECTION                  *
  *****************************************************/
 
+#include <stdbool.h>
 #include <libdevmapper.h>
 
 /*****************************************************
  *            PUBLIC FUNCTIONS PROTOTYPES            *
  *****************************************************/
 
-int sflc_dmt_create(char * virt_dev_name, uint64_t num_sectors, char * param);
+int sflc_dmt_create(char * virt_dev_name, uint64_t num_sectors, char * param, bool read_only);
 int sflc_dmt_destroy(char * virt_dev_name);
 
 
@@ -71,8 +71,8 @@
  *            PUBLIC FUNCTIONS PROTOTYPES            *
  *****************************************************/
 
-void sflc_create_vols(bool no_randfill, char * real_dev_path, char ** pwd, int nr_pwd, bool redundant_among, bool redundant_within);
-void sflc_open_vols(char * real_dev_path, char ** vol_names, int nr_vols, char * last_pwd, bool vol_creation, bool redundant_among, bool redundant_within);
+void sflc_create_vols(bool no_randfill, char * real_dev_path, char ** pwd, int nr_pwd, bool redundant_among, bool redundant_within, int replicas, char * parity, char * mirror_policy);
+void sflc_open_vols(char * real_dev_path, char ** vol_names, int nr_vols, char * last_pwd, bool vol_creation, bool read_only, bool redundant_among, bool redundant_within, int replicas, char * parity, char * mirror_policy);
 void sflc_close_vols(char * real_dev_path);
 
 #endif /* _SFLC_H_ */
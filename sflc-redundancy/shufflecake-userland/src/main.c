@@ -53,6 +53,10 @@
 #define OPTION_CREATE_NO_RANDFILL "--no-randfill"
 #define OPTION_REDUNDANT_AMONG "--redundant-among"
 #define OPTION_REDUNDANT_WITHIN "--redundant-within"
+#define OPTION_REDUNDANT_WITHIN_COPIES "--redundant-within="
+#define OPTION_REDUNDANT_PARITY "--redundant-parity="
+#define OPTION_MIRROR_POLICY "--mirror="
+#define OPTION_READ_ONLY "--read-only"
 
 /* Space for extra arguments to create command */
 #define CMD_CREATE_EXTRA_ARGS_MAX_LEN 200
@@ -76,6 +80,9 @@ struct sflc_create_vols_args
     bool		no_randfill;
     bool        redundant_among;
     bool        redundant_within;
+    int         replicas;
+    char      * parity;
+    char      * mirror_policy;
     char      * real_dev_path;
     char     ** pwd;
     int         nr_pwd;
@@ -83,8 +90,12 @@ struct sflc_create_vols_args
 
 struct sflc_open_vols_args
 {
+    bool        read_only;
     bool        redundant_among;
     bool        redundant_within;
+    int         replicas;
+    char      * parity;
+    char      * mirror_policy;
     char      * real_dev_path;
     char     ** vol_names;
     int         nr_vols;
@@ -143,15 +154,17 @@ int main(int argc, char ** argv)
                         args.create_vols.nr_pwd, args.create_vols.real_dev_path);
         sflc_create_vols(args.create_vols.no_randfill, args.create_vols.real_dev_path,
         					args.create_vols.pwd, args.create_vols.nr_pwd,
-                            args.create_vols.redundant_among, args.create_vols.redundant_within);
+                            args.create_vols.redundant_among, args.create_vols.redundant_within,
+                            args.create_vols.replicas, args.create_vols.parity, args.create_vols.mirror_policy);
         break;
     
     case SFLC_CMD_OPEN_VOLS:
         print_green("Opening %d volumes from real device %s, last password %s\n", 
                         args.open_vols.nr_vols, args.open_vols.real_dev_path, args.open_vols.last_pwd);
         sflc_open_vols(args.open_vols.real_dev_path, args.open_vols.vol_names,
-        				args.open_vols.nr_vols, args.open_vols.last_pwd, false,
-                        args.open_vols.redundant_among, args.open_vols.redundant_within);
+        				args.open_vols.nr_vols, args.open_vols.last_pwd, false, args.open_vols.read_only,
+                        args.open_vols.redundant_among, args.open_vols.redundant_within,
+                        args.open_vols.replicas, args.open_vols.parity, args.open_vols.mirror_policy);
         break;
     // sflc-raid END
 
@@ -235,19 +248,56 @@ static int parse_create_vols_args(int argc, char **argv, struct sflc_create_vols
 		// Save it in the struct, and advance the args
 		args->redundant_among = true;
         args->redundant_within = false;
+        args->parity = NULL;
+        args->replicas = 0;
 		argv += 1;
 		argc -= 1;
 	} else if (strcmp(argv[0], OPTION_REDUNDANT_WITHIN) == 0) {
         // Save it in the struct, and advance the args
         args->redundant_among = false;
 		args->redundant_within = true;
+        args->parity = NULL;
+        args->replicas = 0;
 		argv += 1;
 		argc -= 1;
+    } else if (strncmp(argv[0], OPTION_REDUNDANT_WITHIN_COPIES, strlen(OPTION_REDUNDANT_WITHIN_COPIES)) == 0) {
+        // Save it in the struct, and advance the args
+        args->redundant_among = false;
+        args->redundant_within = true;
+        args->parity = NULL;
+        args->replicas = atoi(argv[0] + strlen(OPTION_REDUNDANT_WITHIN_COPIES));
+        if (args->replicas <= 0) {
+            print_red("ERR: Invalid replication factor %s\n", argv[0] + strlen(OPTION_REDUNDANT_WITHIN_COPIES));
+            return EINVAL;
+        }
+        argv += 1;
+        argc -= 1;
+    } else if (strncmp(argv[0], OPTION_REDUNDANT_PARITY, strlen(OPTION_REDUNDANT_PARITY)) == 0) {
+        // Save it in the struct, and advance the args
+        args->redundant_among = false;
+        args->redundant_within = false;
+        args->parity = argv[0] + strlen(OPTION_REDUNDANT_PARITY);
+        args->replicas = 0;
+        argv += 1;
+        argc -= 1;
     }
 	else {
 		args->redundant_among = false;
         args->redundant_within = false;
+        args->parity = NULL;
+        args->replicas = 0;
 	}
+
+    /* Check if argument is --mirror= option */
+    if (argc > 0 && strncmp(argv[0], OPTION_MIRROR_POLICY, strlen(OPTION_MIRROR_POLICY)) == 0) {
+        // Save it in the struct, and advance the args
+        args->mirror_policy = argv[0] + strlen(OPTION_MIRROR_POLICY);
+        argv += 1;
+        argc -= 1;
+    }
+    else {
+        args->mirror_policy = NULL;
+    }
     // sflc-raid END
 
     /* Check that there are at least 2 remaining arguments (device and at least one password) */
@@ -269,25 +319,72 @@ static int parse_create_vols_args(int argc, char **argv, struct sflc_create_vols
 
 static int parse_open_vols_args(int argc, char **argv, struct sflc_open_vols_args * args)
 {
+    /* Check if first argument is --read-only option */
+    if (argc > 0 && strcmp(argv[0], OPTION_READ_ONLY) == 0) {
+        // Save it in the struct, and advance the args
+        args->read_only = true;
+        argv += 1;
+        argc -= 1;
+    } else {
+        args->read_only = false;
+    }
+
     // sflc-raid START
     /* Check if first argument is --redundant-* option */
-	if (strcmp(argv[0], OPTION_REDUNDANT_AMONG) == 0) {
+	if (argc > 0 && strcmp(argv[0], OPTION_REDUNDANT_AMONG) == 0) {
 		// Save it in the struct, and advance the args
 		args->redundant_among = true;
         args->redundant_within = false;
+        args->parity = NULL;
+        args->replicas = 0;
 		argv += 1;
 		argc -= 1;
-	} else if (strcmp(argv[0], OPTION_REDUNDANT_WITHIN) == 0) {
+	} else if (argc > 0 && strcmp(argv[0], OPTION_REDUNDANT_WITHIN) == 0) {
         // Save it in the struct, and advance the args
         args->redundant_among = false;
 		args->redundant_within = true;
+        args->parity = NULL;
+        args->replicas = 0;
 		argv += 1;
 		argc -= 1;
+    } else if (argc > 0 && strncmp(argv[0], OPTION_REDUNDANT_WITHIN_COPIES, strlen(OPTION_REDUNDANT_WITHIN_COPIES)) == 0) {
+        // Save it in the struct, and advance the args
+        args->redundant_among = false;
+        args->redundant_within = true;
+        args->parity = NULL;
+        args->replicas = atoi(argv[0] + strlen(OPTION_REDUNDANT_WITHIN_COPIES));
+        if (args->replicas <= 0) {
+            print_red("ERR: Invalid replication factor %s\n", argv[0] + strlen(OPTION_REDUNDANT_WITHIN_COPIES));
+            return EINVAL;
+        }
+        argv += 1;
+        argc -= 1;
+    } else if (argc > 0 && strncmp(argv[0], OPTION_REDUNDANT_PARITY, strlen(OPTION_REDUNDANT_PARITY)) == 0) {
+        // Save it in the struct, and advance the args
+        args->redundant_among = false;
+        args->redundant_within = false;
+        args->parity = argv[0] + strlen(OPTION_REDUNDANT_PARITY);
+        args->replicas = 0;
+        argv += 1;
+        argc -= 1;
     }
 	else {
 		args->redundant_among = false;
         args->redundant_within = false;
+        args->parity = NULL;
+        args->replicas = 0;
 	}
+
+    /* Check if argument is --mirror= option */
+    if (argc > 0 && strncmp(argv[0], OPTION_MIRROR_POLICY, strlen(OPTION_MIRROR_POLICY)) == 0) {
+        // Save it in the struct, and advance the args
+        args->mirror_policy = argv[0] + strlen(OPTION_MIRROR_POLICY);
+        argv += 1;
+        argc -= 1;
+    }
+    else {
+        args->mirror_policy = NULL;
+    }
     // sflc-raid END
 
     /* Check that there are at least 3 arguments */
@@ -328,12 +425,17 @@ static void show_help(char * bin_name)
 {
     printf("Usage:\n\n");
 
-    printf("\t%s %s [--no-randfill] [--redundand-among|redundant-within] <device>  [<pwd1>, ... <pwdN>]\n", bin_name, COMMAND_CREATE_VOLS_STR);
+    printf("\t%s %s [--no-randfill] [--redundand-among|redundant-within[=<R>]|redundant-parity=<K>+<M>] [--mirror=<policy>] <device>  [<pwd1>, ... <pwdN>]\n", bin_name, COMMAND_CREATE_VOLS_STR);
     printf("\t\tCreates N volumes with the given passwords on the given device. Erases pre-existing ones.\n\n");
     
-    printf("\t%s %s [--redundand-among|redundant-within] <device> [<volname1>, ... <volnameN>] <last_pwd>\n", bin_name, COMMAND_OPEN_VOLS_STR);
+    printf("\t%s %s [--read-only] [--redundand-among|redundant-within[=<R>]|redundant-parity=<K>+<M>] [--mirror=<policy>] <device> [<volname1>, ... <volnameN>] <last_pwd>\n", bin_name, COMMAND_OPEN_VOLS_STR);
     printf("\t\tOpens N volumes with the given names from the given device, using the provided password for the last volume.\n");
-    printf("\t\tNames can't be numbers (reserved)\n\n");
+    printf("\t\tWith --read-only, nothing is written to the device (not even the position maps)\n");
+    printf("\t\tNames can't be numbers (reserved)\n");
+    printf("\t\tThe policy of redundant volumes is all (default), meta (filesystem metadata only), or\n");
+    printf("\t\tranges:<start>-<end>,... (512-byte sectors, end excluded)\n");
+    printf("\t\tWithin a volume, every slice is kept in R copies (R = 1..4; default: even/odd pairs)\n");
+    printf("\t\tWith parity, every K data slices of a volume are protected by M parity slices (K = 2..16, M = 1 or 2)\n\n");
     
     printf("\t%s %s <device>\n", bin_name, COMMAND_CLOSE_VOLS_STR);
     printf("\t\tCloses all volumes on a device.\n\n");
@@ -32,6 +32,7 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "sflc.h"
 #include "dmtask.h"
@@ -72,7 +73,7 @@ static char ** readDeviceVolumes(char * real_dev_path);
    First fill all the userland blocks (from first to last), 
    then fill disk with random data, 
    then open all the volumes for creation, then close them */
-void sflc_create_vols(bool no_randfill, char * real_dev_path, char ** pwd, int nr_pwd, bool redundant_among, bool redundant_within)
+void sflc_create_vols(bool no_randfill, char * real_dev_path, char ** pwd, int nr_pwd, bool redundant_among, bool redundant_within, int replicas, char * parity, char * mirror_policy)
 {
     char block[SFLC_SECTOR_SIZE];
     char vek[SFLC_USR_KEY_LEN];   // Volume encryption key
@@ -174,7 +175,7 @@ void sflc_create_vols(bool no_randfill, char * real_dev_path, char ** pwd, int n
 
     // sflc-raid START
     /* Open volumes */
-    sflc_open_vols(real_dev_path, vol_names, nr_pwd, pwd[nr_pwd - 1], true, redundant_among, redundant_within);
+    sflc_open_vols(real_dev_path, vol_names, nr_pwd, pwd[nr_pwd - 1], true, false, redundant_among, redundant_within, replicas, parity, mirror_policy);
     // sflc-raid END
 
     /* Close volumes */
@@ -184,7 +185,7 @@ void sflc_create_vols(bool no_randfill, char * real_dev_path, char ** pwd, int n
 }
 
 /* Open the last volume, then call recursively */
-void sflc_open_vols(char * real_dev_path, char ** vol_names, int nr_vols, char * last_pwd, bool vol_creation, bool redundant_among, bool redundant_within)
+void sflc_open_vols(char * real_dev_path, char ** vol_names, int nr_vols, char * last_pwd, bool vol_creation, bool read_only, bool redundant_among, bool redundant_within, int replicas, char * parity, char * mirror_policy)
 {
     char block[SFLC_SECTOR_SIZE];
     char vek[SFLC_USR_KEY_LEN];   // Volume encryption key
@@ -192,6 +193,7 @@ void sflc_open_vols(char * real_dev_path, char ** vol_names, int nr_vols, char *
     char * vek_hex;
     char virt_dev_name[64];
     uint64_t tot_slices;
+    uint64_t vol_slices;
     char param[512];
     int err;
 
@@ -232,15 +234,48 @@ void sflc_open_vols(char * real_dev_path, char ** vol_names, int nr_vols, char *
     sprintf(virt_dev_name, "sflc-%s", handle);
 
     /* Construct parameter list to pass to dm-sflc kernel module */
-    char creation_flag = vol_creation ? 'c' : 'o';
+    char creation_flag = vol_creation ? 'c' : (read_only ? 'r' : 'o');
     // sflc-raid START
-    char redundant = 'n';
-    redundant = redundant_among ? 'a' : redundant;
-    redundant = redundant_within ? 'w' : redundant;
-    sprintf(param, "%s %s %d %c %llu %s %c", real_dev_path, handle, vol_idx, creation_flag, tot_slices, vek_hex, redundant);
+    char redundant[16] = "n";
+    vol_slices = tot_slices;
+    if (redundant_among) {
+        strcpy(redundant, "a");
+    }
+    if (redundant_within && replicas == 0) {
+        strcpy(redundant, "w");
+    }
+    if (redundant_within && replicas != 0) {
+        if (replicas < 1 || replicas > 4) {
+            die("ERR: Invalid replication factor %d (expected 1..4)", replicas);
+        }
+        snprintf(redundant, sizeof(redundant), "w%d", replicas);
+        /* Only the first copy of each slice is visible (the first volume has no copies) */
+        if (vol_idx != 0) {
+            vol_slices = tot_slices / replicas;
+        }
+    }
+    if (parity != NULL) {
+        unsigned data_slices;
+        unsigned parity_slices;
+
+        if (sscanf(parity, "%u+%u", &data_slices, &parity_slices) != 2 || data_slices < 2 || data_slices > 16 ||
+                parity_slices < 1 || parity_slices > 2) {
+            die("ERR: Invalid parity layout %s (expected <K>+<M>, K = 2..16, M = 1 or 2)", parity);
+        }
+        snprintf(redundant, sizeof(redundant), "p%u+%u", data_slices, parity_slices);
+        /* Only the data slices of the stripes are visible (the first volume has no parity) */
+        if (vol_idx != 0) {
+            vol_slices = tot_slices / (data_slices + parity_slices) * data_slices;
+        }
+    }
+    /* What gets mirrored (everything, unless told otherwise) */
+    if (mirror_policy == NULL) {
+        mirror_policy = "all";
+    }
+    snprintf(param, sizeof(param), "%s %s %d %c %llu %s %s %s", real_dev_path, handle, vol_idx, creation_flag, tot_slices, vek_hex, redundant, mirror_policy);
     // sflc-raid END
 
-    if (!sflc_dmt_create(virt_dev_name, tot_slices * SFLC_LOG_SLICE_SIZE * SFLC_SECTOR_SCALE, param)){
+    if (!sflc_dmt_create(virt_dev_name, vol_slices * SFLC_LOG_SLICE_SIZE * SFLC_SECTOR_SCALE, param, read_only)){
         die("ERR: Error in dmt_create");
     }
 
@@ -248,7 +283,7 @@ void sflc_open_vols(char * real_dev_path, char ** vol_names, int nr_vols, char *
 
     /* Only if there are more volumes to open */
     if (nr_vols > 1) {
-        sflc_open_vols(real_dev_path, vol_names, nr_vols - 1, previous_pwd, vol_creation, redundant_among, redundant_within);
+        sflc_open_vols(real_dev_path, vol_names, nr_vols - 1, previous_pwd, vol_creation, read_only, redundant_among, redundant_within, replicas, parity, mirror_policy);
     }
 
     return;